@@ -25,6 +25,8 @@ import sys
 import re
 import cgi
 import socket
+import struct
+import mmap
 
 #
 # need json
@@ -36,14 +38,62 @@ class Rpc:
         # idsデーモンの接続先にあわせる
         self.address = "127.0.0.1"
         self.port = 18000
+        # rpc_unix_pathを設定した場合はそのパスにする
+        self.unix_path = None
     def send(self, command):
-        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        sock.connect((self.address, self.port))
+        if self.unix_path:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(self.unix_path)
+        else:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.connect((self.address, self.port))
         sock.send(command + "\r\n")
         res = sock.recv(1024)
         sock.close()
         return res
 
+class StatusPage:
+    # idsのstatus_page_nameにあわせる (空ならRPCを使う)
+    # 共有メモリは /dev/shm/<名前> に見える
+    MAGIC = 0x49445331
+    VERSION = 1
+    HEADER = "=IIIIQ"
+    SNAPSHOT = "=11Q"
+    def __init__(self):
+        self.name = ""
+    def read(self):
+        if not self.name:
+            return None
+        try:
+            f = open("/dev/shm/" + self.name.lstrip("/"), "rb")
+            m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            f.close()
+        except (IOError, OSError, ValueError):
+            return None
+        hsize = struct.calcsize(self.HEADER)
+        ssize = struct.calcsize(self.SNAPSHOT)
+        magic, version, size, reserved, seq = struct.unpack_from(self.HEADER, m, 0)
+        if magic != self.MAGIC or version != self.VERSION or size != ssize:
+            return None
+        # seqlock: 前後でsequenceが同じで偶数なら一貫している
+        for i in range(1000):
+            seq = struct.unpack_from("=Q", m, hsize - 8)[0]
+            if seq & 1:
+                continue
+            snapshot = struct.unpack_from(self.SNAPSHOT, m, hsize)
+            if struct.unpack_from("=Q", m, hsize - 8)[0] == seq:
+                return snapshot
+        return None
+    def send(self, command):
+        snapshot = self.read()
+        if snapshot is None:
+            return None
+        if command == "GET_ALERT_STATUS":
+            return ["GOOD\r\n", "FIRST ALERT\r\n", "SECOND ALERT\r\n"][snapshot[1]]
+        if command == "GET_MONITOR_STATUS":
+            return ["STOPPING\r\n", "RUNNING\r\n"][snapshot[2] != 0]
+        return None
+
 class Json:
     def __init__(self):
         pass
@@ -71,6 +121,7 @@ class Request:
         return self.fs.getfirst("Command", "")
 
 rpc = Rpc()
+status_page = StatusPage()
 output = Output()
 req = Request()
 cmd = req.get_command()
@@ -85,7 +136,7 @@ if cmd == "STOP_MONITOR" or \
     else:
         output.message("RPC ERROR")
 elif cmd == "GET_ALERT_STATUS":
-    res = rpc.send(cmd)
+    res = status_page.send(cmd) or rpc.send(cmd)
     if res == "GOOD\r\n":
         output.message("GOOD")
     elif res == "FIRST ALERT\r\n":
@@ -95,7 +146,7 @@ elif cmd == "GET_ALERT_STATUS":
     else:
         output.message("RPC ERROR")
 elif cmd == "GET_MONITOR_STATUS":
-    res = rpc.send(cmd)
+    res = status_page.send(cmd) or rpc.send(cmd)
     if res == "RUNNING\r\n":
         output.message("RUNNING")
     elif res == "STOPPING\r\n":
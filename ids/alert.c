@@ -23,22 +23,35 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <event.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/queue.h>
 
 #include "macro.h"
+#include "token_bucket.h"
 #include "tcpsock.h"
 #include "alert.h"
+#include "logger.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "priority.h"
 
 static int
-alert_execute(char *cmd) {
+alert_execute(const char *cmd) {
 	int st;
+	uint64_t start;
+
+	start = stats_now();
 	switch (fork()) {
 	case -1:
-		fprintf(stderr, "failed in fork.");
-                break;
+		logger_write(LOGGER_ERROR, "alert_spawn", "errno=%d error=\"failed in fork\"", errno);
+		stats_add(STATS_ALERT_SPAWN_ERRORS, 1);
+		return 1;
         case 0:
                 /* 子側 */
 		/* 子プロセスの管理はinitへ作戦 */
@@ -68,9 +81,36 @@ alert_execute(char *cmd) {
 		wait(&st);
                 break;
         }
+	stats_record(STATS_ALERT_SPAWN, stats_now() - start);
 	return 0;
 }
 
+/* statusの警報のactionを順に実行する */
+static void
+alert_execute_actions(struct alert *alert, int status) {
+	int i;
+
+	for (i = 0; i < alert->action_count; i++) {
+		if (alert->actions[i].status == status) {
+			alert_execute(alert->actions[i].script);
+		}
+	}
+}
+
+/* ステータスを更新し、変化していれば通知する */
+static void
+alert_set_status(struct alert *alert, int status) {
+	int i;
+
+	if (alert->alert_status == status) {
+		return;
+	}
+	alert->alert_status = status;
+	for (i = 0; i < alert->listener_count; i++) {
+		alert->listeners[i].status_cb(status, alert->listeners[i].args);
+	}
+}
+
 static void
 alert_start_second(int fd, short event, void *args) {
 	struct alert *alert = args;
@@ -80,9 +120,13 @@ alert_start_second(int fd, short event, void *args) {
 		/* NOT REACHED */
 	}
 	/* 2次警報処理の開始 */
-	alert->alert_status = ALERT_STATUS_SECOND_ALERT;
+	watchdog_enter("alert_start_second");
+	alert_set_status(alert, ALERT_STATUS_SECOND_ALERT);
+	stats_add(STATS_SECOND_ALERTS, 1);
 	alert_execute(alert->second_alert_script);
+	alert_execute_actions(alert, ALERT_STATUS_SECOND_ALERT);
 	alert->alert_processing = 0;
+	watchdog_leave();
 }
 
 int
@@ -131,26 +175,36 @@ fail:
 	return 1;
 }
 
+/* waitマイクロ秒後に2次警報処理を開始するイベントを登録 */
+static void
+alert_second_schedule(struct alert *alert, uint64_t wait) {
+	struct timeval wait_time;
+
+	alert->second_alert_at = stats_now() + wait;
+	wait_time.tv_sec = wait / 1000000;
+	wait_time.tv_usec = wait % 1000000;
+     	evtimer_set(&alert->second_alert_event, alert_start_second, alert);
+     	event_base_set(alert->event_base, &alert->second_alert_event);
+	event_priority_set(&alert->second_alert_event, EVENT_PRIORITY_HIGH);
+     	evtimer_add(&alert->second_alert_event, &wait_time);
+}
+
 /* 1次警報処理の開始 */
 int
 alert_start_first(struct alert *alert) {
-	struct timeval wait_time;
-	
-	alert->alert_status = ALERT_STATUS_FIRST_ALERT;
+	alert_set_status(alert, ALERT_STATUS_FIRST_ALERT);
 	if (alert->alert_processing) {
 		return 0;
 	}
 	alert->alert_processing = 1;
 
 	/* 1次警報処理スクリプトの実行 */
+	stats_add(STATS_FIRST_ALERTS, 1);
 	alert_execute(alert->first_alert_script);
+	alert_execute_actions(alert, ALERT_STATUS_FIRST_ALERT);
 
 	/* 2時警報処理イベントを登録 */
-	wait_time.tv_sec = alert->cancel_wait_time;
-	wait_time.tv_usec = 0;
-     	evtimer_set(&alert->second_alert_event, alert_start_second, alert);
-     	event_base_set(alert->event_base, &alert->second_alert_event);
-     	evtimer_add(&alert->second_alert_event, &wait_time);
+	alert_second_schedule(alert, (uint64_t)alert->cancel_wait_time * 1000000);
 
 	return 0;
 }
@@ -161,7 +215,14 @@ alert_cancel(struct alert *alert) {
         /* 登録してあるイベントを削除 */
 	evtimer_del(&alert->second_alert_event);
 	alert->alert_processing = 0;
-	alert->alert_status = ALERT_STATUS_NO_ALERT;
+	alert_set_status(alert, ALERT_STATUS_NO_ALERT);
+}
+
+void
+alert_finish(struct alert *alert) {
+	if (alert->alert_processing) {
+		evtimer_del(&alert->second_alert_event);
+	}
 }
 
 void
@@ -169,16 +230,146 @@ alert_destroy(struct alert *alert) {
 	if (alert) {
 		free(alert->first_alert_script);
 		free(alert->second_alert_script);
+		free(alert->actions);
 		free(alert);
 	}
 }
 
 void
 alert_clear_status(struct alert *alert) {
-	alert->alert_status = ALERT_STATUS_NO_ALERT;
+	alert_set_status(alert, ALERT_STATUS_NO_ALERT);
 }
 
 int
 alert_get_status(struct alert *alert) {
 	return alert->alert_status;
 }
+
+int
+alert_set_scripts(
+    struct alert *alert,
+    const char *first_alert_script,
+    const char *second_alert_script)
+{
+	char *nscript;
+	char *ascript;
+
+	nscript = strdup(first_alert_script);
+	ascript = strdup(second_alert_script);
+	if (nscript == NULL || ascript == NULL) {
+		free(nscript);
+		free(ascript);
+		return 1;
+	}
+	free(alert->first_alert_script);
+	free(alert->second_alert_script);
+	alert->first_alert_script = nscript;
+	alert->second_alert_script = ascript;
+
+	return 0;
+}
+
+int
+alert_set_actions(
+    struct alert *alert,
+    const struct alert_action *actions,
+    int action_count)
+{
+	struct alert_action *new_actions = NULL;
+	size_t size;
+	size_t len;
+	char *p;
+	int i;
+
+	if (action_count > 0) {
+		/* 配列の後ろにスクリプトを詰めて1回で確保する */
+		size = sizeof(struct alert_action) * action_count;
+		for (i = 0; i < action_count; i++) {
+			size += strlen(actions[i].script) + 1;
+		}
+		new_actions = malloc(size);
+		if (new_actions == NULL) {
+			return 1;
+		}
+		p = (char *)&new_actions[action_count];
+		for (i = 0; i < action_count; i++) {
+			len = strlen(actions[i].script) + 1;
+			memcpy(p, actions[i].script, len);
+			new_actions[i].status = actions[i].status;
+			new_actions[i].script = p;
+			p += len;
+		}
+	}
+	free(alert->actions);
+	alert->actions = new_actions;
+	alert->action_count = action_count;
+
+	return 0;
+}
+
+void
+alert_set_cancel_wait_time(struct alert *alert, int cancel_wait_time) {
+	alert->cancel_wait_time = cancel_wait_time;
+}
+
+void
+alert_get_state(struct alert *alert, struct alert_state *state) {
+	memset(state, 0, sizeof(*state));
+	state->status = alert->alert_status;
+	state->processing = alert->alert_processing;
+	state->second_alert_at = alert->alert_processing ? alert->second_alert_at : 0;
+}
+
+void
+alert_set_state(struct alert *alert, const struct alert_state *state) {
+	uint64_t now;
+
+	if (alert->alert_processing) {
+		evtimer_del(&alert->second_alert_event);
+		alert->alert_processing = 0;
+	}
+	alert_set_status(alert, state->status);
+	if (!state->processing) {
+		return;
+	}
+	alert->alert_processing = 1;
+	now = stats_now();
+	alert_second_schedule(alert,
+	    state->second_alert_at > now ? state->second_alert_at - now : 0);
+}
+
+int
+alert_add_listener(
+    struct alert *alert,
+    void (*status_cb)(int status, void *args),
+    void *args)
+{
+	if (alert->listener_count >= ALERT_LISTENER_LIMIT) {
+		return 1;
+	}
+	alert->listeners[alert->listener_count].status_cb = status_cb;
+	alert->listeners[alert->listener_count].args = args;
+	alert->listener_count++;
+
+	return 0;
+}
+
+void
+alert_remove_listener(
+    struct alert *alert,
+    void (*status_cb)(int status, void *args),
+    void *args)
+{
+	int i;
+
+	for (i = 0; i < alert->listener_count; i++) {
+		if (alert->listeners[i].status_cb == status_cb &&
+		    alert->listeners[i].args == args) {
+			/* 通知の順番を変えないように詰める */
+			memmove(&alert->listeners[i], &alert->listeners[i + 1],
+			    sizeof(alert->listeners[0]) * (alert->listener_count - i - 1));
+			alert->listener_count--;
+			return;
+		}
+	}
+}
@@ -29,14 +29,40 @@
 #define ALERT_STATUS_FIRST_ALERT  1
 #define ALERT_STATUS_SECOND_ALERT 2
 
+#define ALERT_LISTENER_LIMIT      4
+
+/* alertステータスの変化を通知する先 */
+struct alert_listener {
+	void (*status_cb)(int status, void *args);  /* 変化後のステータスを渡す */
+	void *args;
+};
+
+/* 警報スクリプトの後に続けて実行するスクリプト */
+struct alert_action {
+	int status;     /* 実行する警報 (ALERT_STATUS_FIRST_ALERT, ALERT_STATUS_SECOND_ALERT) */
+	const char *script;
+};
+
+/* 別のプロセスに引き継ぐalertの状態 */
+struct alert_state {
+	int status;                      /* アラートの状態 */
+	int processing;                  /* アラート処理中フラグ */
+	uint64_t second_alert_at;        /* 2次警報の予定時刻 (stats_now()の値) */
+};
+
 struct alert {
 	struct event_base *event_base;
 	char *first_alert_script;        /* 1次警報のスクリプトファイルパス */
 	char *second_alert_script;       /* 2次警報のスクリプトファイルパス */
+	struct alert_action *actions;    /* 続けて実行するスクリプト (scriptも同じ領域に置く) */
+	int action_count;
 	struct event second_alert_event; /* ２次警報のイベント */
 	int cancel_wait_time;            /* cancel待ちの猶予時間 */
 	int alert_processing;            /* アラート処理中フラグ */
+	uint64_t second_alert_at;        /* 2次警報の予定時刻 (stats_now()の値) */
 	int alert_status;                /* アラートの状態 */
+	struct alert_listener listeners[ALERT_LISTENER_LIMIT]; /* ステータス変化の通知先 */
+	int listener_count;
 };
 
 /* alertのインスタンスを生成 */
@@ -52,6 +78,12 @@ int alert_start_first(
 /* alert処理をキャンセルする*/
 void alert_cancel(
     struct alert *alert);
+/*
+ * 2次警報の予定を止める
+ * alert_cancelと違ってステータスは変えず、通知もしない
+ */
+void alert_finish(
+    struct alert *alert);
 /* alertのインスタンスを削除する */
 void alert_destroy(
     struct alert *alert);
@@ -61,5 +93,51 @@ void alert_clear_status(
 /* alertステータスを取得する */
 int alert_get_status(
     struct alert *alert);
+/*
+ * 警報スクリプトを差し替える
+ * 失敗した場合は前のスクリプトのまま1を返す
+ */
+int alert_set_scripts(
+    struct alert *alert,
+    const char *first_alert_script,
+    const char *second_alert_script);
+/*
+ * 警報スクリプトの後に続けて実行するスクリプトを差し替える
+ * actionsは複製するので呼び出し側で捨ててよい
+ * 失敗した場合は前のままで1を返す
+ */
+int alert_set_actions(
+    struct alert *alert,
+    const struct alert_action *actions,
+    int action_count);
+/*
+ * cancel待ちの猶予時間を変える
+ * 次の1次警報から使う (待っている2次警報の予定は変えない)
+ */
+void alert_set_cancel_wait_time(
+    struct alert *alert,
+    int cancel_wait_time);
+/* 別のプロセスに引き継ぐ状態を取得する */
+void alert_get_state(
+    struct alert *alert,
+    struct alert_state *state);
+/*
+ * 引き継いだ状態に戻す
+ * 2次警報を待っていた場合は残りの時間で登録し直す (過ぎていればすぐ実行する)
+ * スクリプトは実行しない
+ */
+void alert_set_state(
+    struct alert *alert,
+    const struct alert_state *state);
+/* alertステータスが変化した時の通知先を登録する */
+int alert_add_listener(
+    struct alert *alert,
+    void (*status_cb)(int status, void *args),
+    void *args);
+/* alert_add_listenerで登録した通知先を外す (登録されていなければ何もしない) */
+void alert_remove_listener(
+    struct alert *alert,
+    void (*status_cb)(int status, void *args),
+    void *args);
 
 #endif
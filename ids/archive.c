@@ -0,0 +1,483 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/*
+ * アーカイブはデーモンとidsarchiveの両方で使うので、
+ * ここではログに書かずに結果を返すだけにする
+ */
+
+#define ARCHIVE_USEC UINT64_C(1000000)
+
+/* blockのヘッダの後ろ全体のチェックサム (FNV-1aを8バイト単位にしたもの) */
+static uint32_t
+archive_checksum(const unsigned char *payload) {
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= ARCHIVE_BLOCK_PAYLOAD; i += sizeof(word)) {
+		memcpy(&word, &payload[i], sizeof(word));
+		hash ^= le64toh(word);
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static unsigned char *
+archive_put_varint(unsigned char *p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char)value;
+
+	return p;
+}
+
+/* 読めなければNULLを返す */
+static const unsigned char *
+archive_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value) {
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && p < end; shift += 7) {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*value = v;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/* 書いているblockを空にする */
+static void
+archive_block_reset(struct archive *archive) {
+	memset(archive->block, 0, sizeof(archive->block));
+	archive->length = 0;
+	archive->run_count = 0;
+	archive->first_time = 0;
+	archive->last_time = 0;
+	archive->prev_start = 0;
+}
+
+/* 書いているblockをその位置に書く */
+static int
+archive_block_write(struct archive *archive) {
+	struct archive_block_header header;
+	unsigned char *payload = &archive->block[sizeof(header)];
+	off_t offset;
+
+	header.magic = htole32(ARCHIVE_BLOCK_MAGIC);
+	header.length = htole32(archive->length);
+	header.run_count = htole32(archive->run_count);
+	header.checksum = htole32(archive_checksum(payload));
+	header.first_time = htole64(archive->first_time);
+	header.last_time = htole64(archive->last_time);
+	memcpy(archive->block, &header, sizeof(header));
+	offset = (off_t)((archive->block_index + 1) * ARCHIVE_BLOCK_SIZE);
+	if (pwrite(archive->fd, archive->block, ARCHIVE_BLOCK_SIZE, offset) != ARCHIVE_BLOCK_SIZE) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/* ファイルを開いて、最後のblockの次から書くようにする */
+static int
+archive_open(struct archive *archive) {
+	struct archive_header header;
+	struct stat st;
+	int fd;
+
+	fd = open(archive->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return 1;
+	}
+	if (fstat(fd, &st) < 0) {
+		goto fail;
+	}
+	if (st.st_size == 0) {
+		/* 新しいファイルならヘッダを書く */
+		memset(archive->block, 0, sizeof(archive->block));
+		header.magic = htole32(ARCHIVE_MAGIC);
+		header.version = htole32(ARCHIVE_VERSION);
+		header.block_size = htole32(ARCHIVE_BLOCK_SIZE);
+		header.reserved = 0;
+		memcpy(archive->block, &header, sizeof(header));
+		if (pwrite(fd, archive->block, ARCHIVE_BLOCK_SIZE, 0) != ARCHIVE_BLOCK_SIZE) {
+			goto fail;
+		}
+		st.st_size = ARCHIVE_BLOCK_SIZE;
+	} else {
+		/* 別の形式のファイルは上書きしない */
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		    le32toh(header.magic) != ARCHIVE_MAGIC ||
+		    le32toh(header.version) != ARCHIVE_VERSION ||
+		    le32toh(header.block_size) != ARCHIVE_BLOCK_SIZE) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+	/* 途中で切れたblockがあればその後ろから書く */
+	archive->block_index = ((uint64_t)st.st_size - 1) / ARCHIVE_BLOCK_SIZE;
+	archive->fd = fd;
+	archive_block_reset(archive);
+
+	return 0;
+
+fail:
+	close(fd);
+
+	return 1;
+}
+
+/* 書き込みに失敗したらblockを捨ててファイルを閉じる */
+static void
+archive_abort(struct archive *archive, uint64_t now) {
+	int saved_errno = errno;
+
+	close(archive->fd);
+	errno = saved_errno;
+	archive->fd = -1;
+	archive->run_open = 0;
+	archive->retry = now + ARCHIVE_FLUSH_INTERVAL * ARCHIVE_USEC;
+	archive_block_reset(archive);
+}
+
+/* runをblockに足す、blockが一杯なら書き出して次のblockに移る */
+static int
+archive_put_run(struct archive *archive, const struct archive_run *run) {
+	unsigned char *p;
+	int64_t delta;
+
+	if (archive->run_count > 0 &&
+	    archive->length + ARCHIVE_RUN_MAX > ARCHIVE_BLOCK_PAYLOAD) {
+		if (archive_block_write(archive)) {
+			return 1;
+		}
+		archive->block_index++;
+		archive_block_reset(archive);
+	}
+	if (archive->run_count == 0) {
+		archive->first_time = run->start;
+		archive->prev_start = run->start;
+	}
+	p = &archive->block[sizeof(struct archive_block_header) + archive->length];
+	*p++ = run->value;
+	delta = (int64_t)(run->start - archive->prev_start);
+	p = archive_put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	p = archive_put_varint(p, run->count);
+	p = archive_put_varint(p, run->span);
+	archive->length = (uint32_t)(p - &archive->block[sizeof(struct archive_block_header)]);
+	archive->run_count++;
+	archive->prev_start = run->start;
+	archive->last_time = run->start + run->span;
+
+	return 0;
+}
+
+int
+archive_create(struct archive **archive, const char *path) {
+	struct archive *inst;
+
+	*archive = NULL;
+	inst = malloc(sizeof(struct archive));
+	if (inst == NULL) {
+		return 1;
+	}
+	memset(inst, 0, sizeof(struct archive));
+	inst->fd = -1;
+	inst->path = strdup(path);
+	if (inst->path == NULL) {
+		free(inst);
+		return 1;
+	}
+	*archive = inst;
+
+	return 0;
+}
+
+void
+archive_destroy(struct archive *archive) {
+	if (archive == NULL) {
+		return;
+	}
+	archive_close(archive);
+	free(archive->path);
+	free(archive);
+}
+
+int
+archive_add(struct archive *archive, uint64_t sample_time, uint8_t value, int interval) {
+	struct archive_run *run = &archive->run;
+	uint64_t last;
+
+	if (archive->fd < 0) {
+		if (sample_time < archive->retry) {
+			return 0;
+		}
+		if (archive_open(archive)) {
+			archive->retry = sample_time + ARCHIVE_FLUSH_INTERVAL * ARCHIVE_USEC;
+			return 1;
+		}
+		archive->flushed = sample_time;
+	}
+	if (archive->run_open) {
+		last = run->start + run->span;
+		/* 値が同じで間が空いていなければrunを伸ばす */
+		if (run->value == value && sample_time >= last &&
+		    sample_time - last <= (uint64_t)interval * ARCHIVE_GAP_FACTOR) {
+			run->count++;
+			run->span = sample_time - run->start;
+		} else {
+			archive->run_open = 0;
+			if (archive_put_run(archive, run)) {
+				goto fail;
+			}
+		}
+	}
+	if (!archive->run_open) {
+		run->start = sample_time;
+		run->span = 0;
+		run->count = 1;
+		run->value = value;
+		archive->run_open = 1;
+	}
+	/* 落ちたときに失う分を抑えるため、runを切って書いている途中のblockを書き直す */
+	if (sample_time < archive->flushed ||
+	    sample_time - archive->flushed >= ARCHIVE_FLUSH_INTERVAL * ARCHIVE_USEC) {
+		archive->run_open = 0;
+		if (archive_put_run(archive, run) ||
+		    archive_block_write(archive)) {
+			goto fail;
+		}
+		archive->flushed = sample_time;
+	}
+
+	return 0;
+
+fail:
+	archive_abort(archive, sample_time);
+
+	return 1;
+}
+
+int
+archive_close(struct archive *archive) {
+	int saved_errno;
+	int error = 0;
+
+	if (archive->fd < 0) {
+		return 0;
+	}
+	if (archive->run_open) {
+		archive->run_open = 0;
+		if (archive_put_run(archive, &archive->run)) {
+			error = 1;
+		}
+	}
+	if (!error && archive->run_count > 0) {
+		if (archive_block_write(archive)) {
+			error = 1;
+		}
+	}
+	saved_errno = errno;
+	close(archive->fd);
+	errno = saved_errno;
+	archive->fd = -1;
+	archive->retry = 0;
+	archive_block_reset(archive);
+
+	return error;
+}
+
+int
+archive_reader_open(struct archive_reader **reader, const char *path) {
+	struct archive_reader *inst;
+	struct archive_header header;
+	struct stat st;
+	int fd = -1;
+
+	*reader = NULL;
+	inst = malloc(sizeof(struct archive_reader));
+	if (inst == NULL) {
+		return 1;
+	}
+	memset(inst, 0, sizeof(struct archive_reader));
+	inst->addr = MAP_FAILED;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed in open archive file (%s: %s).\n", path, strerror(errno));
+		goto fail;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "failed in stat archive file (%s).\n", path);
+		goto fail;
+	}
+	if (st.st_size < ARCHIVE_BLOCK_SIZE) {
+		fprintf(stderr, "archive file (%s) is too short.\n", path);
+		goto fail;
+	}
+	inst->size = (size_t)st.st_size;
+	inst->addr = mmap(NULL, inst->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (inst->addr == MAP_FAILED) {
+		fprintf(stderr, "failed in map archive file (%s).\n", path);
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+	/* 前から順に読むことが多いので先読みさせる */
+	madvise(inst->addr, inst->size, MADV_SEQUENTIAL);
+	memcpy(&header, inst->addr, sizeof(header));
+	if (le32toh(header.magic) != ARCHIVE_MAGIC ||
+	    le32toh(header.version) != ARCHIVE_VERSION ||
+	    le32toh(header.block_size) != ARCHIVE_BLOCK_SIZE) {
+		fprintf(stderr, "archive file (%s) has another layout.\n", path);
+		goto fail;
+	}
+	inst->block_count = inst->size / ARCHIVE_BLOCK_SIZE - 1;
+	*reader = inst;
+
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (inst->addr != MAP_FAILED) {
+		munmap(inst->addr, inst->size);
+	}
+	free(inst);
+
+	return 1;
+}
+
+void
+archive_reader_close(struct archive_reader *reader) {
+	if (reader == NULL) {
+		return;
+	}
+	munmap(reader->addr, reader->size);
+	free(reader);
+}
+
+static const unsigned char *
+archive_reader_block(struct archive_reader *reader, uint64_t index) {
+	return (const unsigned char *)reader->addr + (index + 1) * ARCHIVE_BLOCK_SIZE;
+}
+
+void
+archive_reader_seek(struct archive_reader *reader, uint64_t seek_time) {
+	struct archive_block_header header;
+	uint64_t low = 0;
+	uint64_t high = reader->block_count;
+	uint64_t middle;
+
+	/* last_timeがseek_time以上になる最初のblock */
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		memcpy(&header, archive_reader_block(reader, middle), sizeof(header));
+		if (le64toh(header.last_time) < seek_time) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	reader->block_index = low;
+	reader->run_left = 0;
+}
+
+/* 次の読めるblockに移る、無ければ1を返す */
+static int
+archive_reader_load(struct archive_reader *reader) {
+	struct archive_block_header header;
+	const unsigned char *block;
+	uint32_t length;
+
+	while (reader->block_index < reader->block_count) {
+		block = archive_reader_block(reader, reader->block_index++);
+		memcpy(&header, block, sizeof(header));
+		if (header.magic == 0) {
+			/* 書く前に落ちたblock */
+			continue;
+		}
+		length = le32toh(header.length);
+		if (le32toh(header.magic) != ARCHIVE_BLOCK_MAGIC ||
+		    length > ARCHIVE_BLOCK_PAYLOAD ||
+		    le32toh(header.checksum) != archive_checksum(&block[sizeof(header)])) {
+			reader->bad_blocks++;
+			continue;
+		}
+		reader->pos = &block[sizeof(header)];
+		reader->end = reader->pos + length;
+		reader->run_left = le32toh(header.run_count);
+		reader->prev_start = le64toh(header.first_time);
+		if (reader->run_left > 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+archive_reader_next(struct archive_reader *reader, struct archive_run *run) {
+	const unsigned char *p;
+	uint64_t delta;
+
+	for (;;) {
+		if (reader->run_left == 0 && archive_reader_load(reader)) {
+			return 1;
+		}
+		p = reader->pos;
+		if (p < reader->end) {
+			run->value = *p++;
+			if ((p = archive_get_varint(p, reader->end, &delta)) != NULL &&
+			    (p = archive_get_varint(p, reader->end, &run->count)) != NULL &&
+			    (p = archive_get_varint(p, reader->end, &run->span)) != NULL) {
+				run->start = reader->prev_start + (uint64_t)((int64_t)(delta >> 1) ^ -(int64_t)(delta & 1));
+				reader->prev_start = run->start;
+				reader->pos = p;
+				reader->run_left--;
+				return 0;
+			}
+		}
+		/* runの数と中身が合わないblockは残りを捨てる */
+		reader->bad_blocks++;
+		reader->run_left = 0;
+	}
+}
@@ -0,0 +1,157 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/*
+ * サンプルのアーカイブ
+ *
+ * センサーの値 (rdata[4]) が同じで間隔が空いていないサンプルの並びを1つのrunにまとめ、
+ * runごとに次の4つを書く。
+ *   値             1バイト
+ *   開始時刻       前のrunの開始時刻との差 (usec、zigzagした可変長整数)
+ *   サンプル数     可変長整数
+ *   長さ           最後のサンプルの時刻 - 開始時刻 (usec、可変長整数)
+ * run内の各サンプルの時刻は開始時刻から長さを等分したものとして戻す
+ * (runの境目の時刻は正確に残る)。
+ *
+ * ファイルはARCHIVE_BLOCK_SIZEのヘッダに固定長のblockを並べたもの。
+ * blockの先頭には最初のrunの開始時刻 (絶対値) と最後のサンプルの時刻があり、
+ * blockごとに単独で読める。blockの位置は番号から決まるので、
+ * 時刻での位置合わせはblockのヘッダを二分探索するだけで済む。
+ * 書いている途中のblockは一杯になるか、ARCHIVE_FLUSH_INTERVALごとに同じ位置に書き直す
+ * (その時点で続いているrunはそこで切る)。落ちても失うのは書き直す前の分だけで、
+ * 壊れたblockはチェックサムで読み飛ばす。
+ * 値はリトルエンディアンで書く。
+ *
+ * 書く側はファイルを最初のサンプルで開き、archive_closeで閉じる。
+ * 開くたびに新しいblockから書くので、プロセスを入れ替えても同じファイルに続けて書ける。
+ * 使う側は stdint.h をincludeしてからこのファイルをincludeする。
+ */
+
+#define ARCHIVE_MAGIC          0x41534449   /* "IDSA" */
+#define ARCHIVE_BLOCK_MAGIC    0x42534449   /* "IDSB" */
+#define ARCHIVE_VERSION        1
+#define ARCHIVE_BLOCK_SIZE     4096         /* ファイルのヘッダとblockの大きさ */
+#define ARCHIVE_FLUSH_INTERVAL 60           /* 書いている途中のblockを書き直す間隔 (秒) */
+#define ARCHIVE_GAP_FACTOR     3            /* ポーリング間隔のこの倍より空いたらrunを切る */
+#define ARCHIVE_RUN_MAX        31           /* 1つのrunを書くのに必要な最大のバイト数 */
+
+/* ファイルの先頭 */
+struct archive_header {
+	uint32_t magic;                /* ARCHIVE_MAGIC */
+	uint32_t version;              /* ARCHIVE_VERSION */
+	uint32_t block_size;           /* ARCHIVE_BLOCK_SIZE */
+	uint32_t reserved;
+};
+
+/* blockの先頭 */
+struct archive_block_header {
+	uint32_t magic;                /* ARCHIVE_BLOCK_MAGIC */
+	uint32_t length;               /* ヘッダの後ろに書いたバイト数 */
+	uint32_t run_count;            /* runの数 */
+	uint32_t checksum;             /* ヘッダの後ろ全体のチェックサム (8バイト単位のFNV-1a) */
+	uint64_t first_time;           /* 最初のrunの開始時刻 (エポックからのusec) */
+	uint64_t last_time;            /* 最後のサンプルの時刻 (エポックからのusec) */
+};
+
+#define ARCHIVE_BLOCK_PAYLOAD  (ARCHIVE_BLOCK_SIZE - sizeof(struct archive_block_header))
+
+/* 同じ値のサンプルの並び */
+struct archive_run {
+	uint64_t start;                /* 最初のサンプルの時刻 (エポックからのusec) */
+	uint64_t span;                 /* 最後のサンプルの時刻 - start */
+	uint64_t count;                /* サンプル数 */
+	uint8_t value;                 /* センサーの値 (0xffなら人がいる) */
+};
+
+struct archive {
+	char *path;                    /* ファイルのパス */
+	int fd;                        /* 開いていなければ-1 */
+	uint64_t block_index;          /* 書いているblockの番号 (0から) */
+	unsigned char block[ARCHIVE_BLOCK_SIZE]; /* 書いているblock (ヘッダは書き出すときに埋める) */
+	uint32_t length;               /* blockのヘッダの後ろに書いたバイト数 */
+	uint32_t run_count;            /* blockに書いたrunの数 */
+	uint64_t first_time;           /* blockの最初のrunの開始時刻 */
+	uint64_t last_time;            /* blockの最後のサンプルの時刻 */
+	uint64_t prev_start;           /* blockに書いた最後のrunの開始時刻 */
+	uint64_t retry;                /* 開けなかったときに次に開き直す時刻 (usec) */
+	uint64_t flushed;              /* 最後にblockを書いた時刻 (usec) */
+	int run_open;                  /* runが続いているか */
+	struct archive_run run;        /* 続いているrun */
+};
+
+struct archive_reader {
+	void *addr;                    /* mmapしたファイル */
+	size_t size;
+	uint64_t block_count;          /* blockの数 */
+	uint64_t block_index;          /* 読んでいるblockの番号 */
+	const unsigned char *pos;      /* 読んでいるblockの次のrun */
+	const unsigned char *end;      /* 読んでいるblockの終わり */
+	uint32_t run_left;             /* 読んでいるblockに残っているrunの数 */
+	uint64_t prev_start;           /* 読んだ最後のrunの開始時刻 */
+	uint64_t bad_blocks;           /* 読み飛ばした壊れたblockの数 */
+};
+
+/* インスタンス生成 (ファイルは最初のサンプルで開く) */
+int archive_create(
+    struct archive **archive,
+    const char *path);
+/* 続いているrunとblockを書いてからインスタンスを削除 */
+void archive_destroy(
+    struct archive *archive);
+/*
+ * 時刻 (エポックからのusec) に読んだ値を足す
+ * intervalはポーリング間隔 (usec)、これのARCHIVE_GAP_FACTOR倍より空いたらrunを切る
+ * 開けないか書き込みに失敗したら1を返す
+ * (書いていたblockは捨ててファイルを閉じ、ARCHIVE_FLUSH_INTERVAL後に開き直す)
+ */
+int archive_add(
+    struct archive *archive,
+    uint64_t sample_time,
+    uint8_t value,
+    int interval);
+/*
+ * 続いているrunとblockを書いてファイルを閉じる
+ * 次のarchive_addで新しいblockから書き始める
+ */
+int archive_close(
+    struct archive *archive);
+
+/* アーカイブのファイルを読むために開く */
+int archive_reader_open(
+    struct archive_reader **reader,
+    const char *path);
+void archive_reader_close(
+    struct archive_reader *reader);
+/*
+ * seek_timeのサンプルを含むblock (無ければその後のblock) から読むようにする
+ * blockは時刻の順に並んでいるものとして二分探索する
+ */
+void archive_reader_seek(
+    struct archive_reader *reader,
+    uint64_t seek_time);
+/* 次のrunを読む、終わりなら1を返す */
+int archive_reader_next(
+    struct archive_reader *reader,
+    struct archive_run *run);
+
+#endif
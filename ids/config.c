@@ -24,10 +24,46 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "macro.h"
 #include "string_util.h"
 #include "config.h"
+#include "config_key_hash.h"
+#include "config_section_key_hash.h"
+
+#define CONFIG_STRINGS_SIZE 256 /* 文字列テーブルの最初の大きさ */
+#define CONFIG_KEY_SIZE     64  /* 項目名の最大長 */
+
+/* config_section_updateの結果 */
+#define CONFIG_UPDATE_OK       0
+#define CONFIG_UPDATE_UNKNOWN  1  /* そのセクションに無い項目 */
+#define CONFIG_UPDATE_INVALID  2  /* 値が範囲外 */
+#define CONFIG_UPDATE_ERROR    3  /* メモリが足りない */
+
+/* 数値の値を読む、範囲外なら1を返す */
+static int
+config_parse_int(const char *value, long min, long max, int *result) {
+	char *endptr;
+	long val;
+
+	errno = 0;
+	val = strtol(value, &endptr, 10);
+	if (endptr == value || *endptr != '\0') {
+		return 1;
+	}
+	if ((val == LONG_MIN || val == LONG_MAX) && errno == ERANGE) {
+		return 1;
+	}
+	if (val < min || val > max) {
+		return 1;
+	}
+	*result = (int)val;
+
+	return 0;
+}
 
 /*
  * 更新関数雛型
@@ -37,8 +73,8 @@
 static int								\
 config_update_##name(							\
     struct config *config,						\
-    struct string_kv *kv) {						\
-	char *tmp = strdup(kv->value);					\
+    const char *value) {						\
+	char *tmp = strdup(value);					\
 	if (tmp == NULL) {						\
 		return 1;						\
 	}								\
@@ -51,99 +87,567 @@ config_update_##name(							\
 static int								\
 config_update_##name(							\
     struct config *config,						\
-    struct string_kv *kv) {						\
-        char *endptr;							\
-        long val;							\
-									\
-        val = strtol(kv->value, &endptr, 10);				\
-        if (*endptr != '\0') {						\
-                return 1;						\
-        }								\
-        if ((val == LONG_MIN || val == LONG_MAX) &&			\
-	    errno == ERANGE) {						\
-                return 1;						\
-        }								\
-        if (val == 0 && errno == EINVAL) {				\
-                return 1;						\
-        }								\
-	if (val < (min) || val > (max)) {				\
-		return 1;						\
-	}								\
-	config->name = (int)val;					\
-									\
-	return 0;							\
+    const char *value) {						\
+	return config_parse_int(value, min, max, &config->name);	\
 }
 
 /* 更新関数定義 */
-CONFIG_UPDATE_STRING(first_alert_script)
-CONFIG_UPDATE_STRING(second_alert_script)
-CONFIG_UPDATE_STRING(rpc_port)
-CONFIG_UPDATE_STRING(pid_file_path)
-CONFIG_UPDATE_INT(cancel_wait_time, 5, 86400)
-CONFIG_UPDATE_INT(poll_interval, 1000, 255000)
-CONFIG_UPDATE_INT(alert_threshold, 1, 65535)
-CONFIG_UPDATE_INT(rpc_timeout, 5, 3600)
-
-/* keyと処理関数の定義 */
+#define CONFIG_STRING(upper, name) CONFIG_UPDATE_STRING(name)
+#define CONFIG_INT(upper, name, min, max) CONFIG_UPDATE_INT(name, min, max)
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+
+/* keyと処理関数の定義 (enum config_keyの順) */
 struct config_key_map {
 	const char *key;
-	int (*update_func)(struct config *config, struct string_kv *kv);
+	int (*update_func)(struct config *config, const char *value);
+	long min;                       /* 数値の項目の範囲 (セクションでも使う) */
+	long max;
 };
 struct config_key_map config_key_map[] = {
-	{ "first_alert_script", config_update_first_alert_script },
-	{ "second_alert_script", config_update_second_alert_script },
-	{ "rpc_port", config_update_rpc_port },
-	{ "pid_file_path", config_update_pid_file_path },
-	{ "cancel_wait_time", config_update_cancel_wait_time },
-	{ "poll_interval", config_update_poll_interval },
-	{ "alert_threshold", config_update_alert_threshold },
-	{ "rpc_timeout", config_update_rpc_timeout },
-	{ NULL, NULL},
+#define CONFIG_STRING(upper, name) { #name, config_update_##name, 0, 0 },
+#define CONFIG_INT(upper, name, min, max) { #name, config_update_##name, min, max },
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	{ NULL, NULL, 0, 0 },
 };
 
-/* コンフィグ更新処理 */
+/* セクションの項目の定義 (enum config_section_keyの順) */
+struct config_section_key_map {
+	const char *key;
+	int sections;                   /* 書けるセクション (CONFIG_SECTION_MASK_*) */
+};
+static const struct config_section_key_map config_section_key_map[] = {
+#define CONFIG_SECTION_KEY(upper, name, sections) { #name, sections },
+#include "config_section.def"
+#undef CONFIG_SECTION_KEY
+};
+
+/* config_key_hash.h, config_section_key_hash.hが古い場合はコンパイルエラーにする */
+typedef char config_key_hash_check[
+    (CONFIG_KEY_COUNT == CONFIG_KEY_HASH_COUNT) ? 1 : -1];
+typedef char config_section_key_hash_check[
+    (CONFIG_SECTION_KEY_COUNT == CONFIG_SECTION_KEY_HASH_COUNT) ? 1 : -1];
+
+/*
+ * 項目名を大文字にしてupperに入れ、その長さを返す
+ * 空か長すぎる場合は0を返す
+ */
+static size_t
+config_key_upper(char *upper, size_t size, const char *name) {
+	size_t len;
+
+	for (len = 0; name[len] != '\0'; len++) {
+		if (len + 1 >= size) {
+			return 0;
+		}
+		upper[len] = toupper((unsigned char)name[len]);
+	}
+	upper[len] = '\0';
+
+	return len;
+}
+
+/* セクションの項目を引く、無ければ-1を返す */
+static int
+config_section_key_lookup(const char *name) {
+	char upper[CONFIG_KEY_SIZE];
+	unsigned int idx;
+	size_t len;
+
+	len = config_key_upper(upper, sizeof(upper), name);
+	if (len == 0) {
+		return -1;
+	}
+	idx = config_section_key_hash_slot[config_section_key_hash(upper, len)];
+	if (idx == 0 ||
+	    strcasecmp(config_section_key_map[idx - 1].key, name) != 0) {
+		return -1;
+	}
+
+	return idx - 1;
+}
+
+/* 全体の設定の更新処理 */
+static void
+config_update(struct config *config, struct string_kv *kv, int linecnt) {
+	int key;
+
+	key = config_key_lookup(kv->key);
+	if (key < 0) {
+		fprintf(stderr, "unknown key (%d: %s)\n", linecnt, kv->key);
+		return;
+	}
+	if (config_key_map[key].update_func(config, kv->value)) {
+		fprintf(stderr, "invalid value (%d: %s = %s)\n",
+		    linecnt, kv->key, kv->value);
+	}
+}
+
+/*
+ * stringsに文字列を足して、その位置をoffsetに入れる
+ * 空文字列は足さずに位置0にする
+ */
+static int
+config_strings_add(struct config *config, const char *str, unsigned int *offset) {
+	size_t len = strlen(str) + 1;
+	size_t size;
+	char *strings;
+
+	if (len == 1) {
+		*offset = 0;
+		return 0;
+	}
+	if (config->strings_len + len > config->strings_size) {
+		size = config->strings_size ? config->strings_size : CONFIG_STRINGS_SIZE;
+		while (size < config->strings_len + len + 1) {
+			size *= 2;
+		}
+		if (size > UINT_MAX) {
+			return 1;
+		}
+		strings = realloc(config->strings, size);
+		if (strings == NULL) {
+			return 1;
+		}
+		if (config->strings_len == 0) {
+			/* 位置0は空文字列 */
+			strings[0] = '\0';
+			config->strings_len = 1;
+		}
+		config->strings = strings;
+		config->strings_size = size;
+	}
+	memcpy(&config->strings[config->strings_len], str, len);
+	*offset = (unsigned int)config->strings_len;
+	config->strings_len += len;
+
+	return 0;
+}
+
+/*
+ * 配列にcount個目を足せるようにする
+ * 大きさはcountが2のべき乗になるたびに倍にする
+ */
 static int
-config_update(struct config *config, struct string_kv *kv) {
+config_array_grow(void *array, int count, size_t size) {
+	void **p = array;
+	void *tmp;
+
+	if (count != 0 && (count & (count - 1)) != 0) {
+		return 0;
+	}
+	tmp = realloc(*p, (count ? (size_t)count * 2 : 1) * size);
+	if (tmp == NULL) {
+		return 1;
+	}
+	*p = tmp;
+
+	return 0;
+}
+
+/* 次の空白でない文字 */
+static char *
+config_skip_space(char *p) {
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+/*
+ * [<種類> "<名前>"] の行を分ける
+ * 名前の後ろの'"'を'\0'にして、typeに種類 (長さはtype_len)、nameに名前を入れる
+ */
+static int
+config_section_header(char *line, char **type, size_t *type_len, char **name) {
+	char *p;
+
+	*type = config_skip_space(line + 1);
+	for (p = *type; *p != '\0' && *p != ' ' && *p != '\t' && *p != '"'; p++);
+	*type_len = p - *type;
+	p = config_skip_space(p);
+	if (*p != '"' || p[1] == '"' || strchr(p + 1, '"') == NULL) {
+		return 1;
+	}
+	*name = p + 1;
+	p = strchr(*name, '"');
+	*p = '\0';
+	p = config_skip_space(p + 1);
+	if (*p != ']' || *config_skip_space(p + 1) != '\0') {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * [<種類> "<名前>"] の行を読んで、その種類の配列にセクションを足す
+ * 足したセクションの種類をsectionに入れる
+ */
+static int
+config_section_add(struct config *config, char *line, int linecnt, int *section) {
+	struct config_sensor *sensor;
+	struct config_zone *zone;
+	struct config_action *action;
+	unsigned int name;
+	char *type, *name_str;
+	size_t type_len;
+
+	if (config_section_header(line, &type, &type_len, &name_str)) {
+		goto syntax;
+	}
+	if (config_strings_add(config, name_str, &name)) {
+		return 1;
+	}
+	if (type_len == sizeof("sensor") - 1 && strncasecmp(type, "sensor", type_len) == 0) {
+		if (config_array_grow(&config->sensors,
+		    config->sensor_count, sizeof(struct config_sensor))) {
+			return 1;
+		}
+		sensor = &config->sensors[config->sensor_count++];
+		sensor->name = name;
+		sensor->zone_name = 0;
+		sensor->zone = -1;
+		sensor->poll_interval = -1;
+		sensor->alert_threshold = -1;
+		*section = CONFIG_SECTION_SENSOR;
+	} else if (type_len == sizeof("zone") - 1 && strncasecmp(type, "zone", type_len) == 0) {
+		if (config_array_grow(&config->zones,
+		    config->zone_count, sizeof(struct config_zone))) {
+			return 1;
+		}
+		zone = &config->zones[config->zone_count++];
+		zone->name = name;
+		zone->cancel_wait_time = -1;
+		*section = CONFIG_SECTION_ZONE;
+	} else if (type_len == sizeof("action") - 1 && strncasecmp(type, "action", type_len) == 0) {
+		if (config_array_grow(&config->actions,
+		    config->action_count, sizeof(struct config_action))) {
+			return 1;
+		}
+		action = &config->actions[config->action_count++];
+		action->name = name;
+		action->zone_name = 0;
+		action->zone = -1;
+		action->level = 0;
+		action->script = 0;
+		*section = CONFIG_SECTION_ACTION;
+	} else {
+		fprintf(stderr, "unknown section (%d: %.*s)\n", linecnt, (int)type_len, type);
+		return 1;
+	}
+
+	return 0;
+
+syntax:
+	fprintf(stderr, "section syntax error (%d)\n", linecnt);
+	return 1;
+}
+
+/* 今のセクション (最後に足したもの) の項目を更新する */
+static int
+config_section_update(struct config *config, int section, struct string_kv *kv) {
+	struct config_sensor *sensor;
+	struct config_action *action;
+	int *val;
+	int key;
+	long min, max;
+
+	key = config_section_key_lookup(kv->key);
+	if (key < 0 || !(config_section_key_map[key].sections & (1 << section))) {
+		return CONFIG_UPDATE_UNKNOWN;
+	}
+	switch (key) {
+	case CONFIG_SECTION_KEY_ZONE:
+		if (section == CONFIG_SECTION_SENSOR) {
+			sensor = &config->sensors[config->sensor_count - 1];
+			if (config_strings_add(config, kv->value, &sensor->zone_name)) {
+				return CONFIG_UPDATE_ERROR;
+			}
+		} else {
+			action = &config->actions[config->action_count - 1];
+			if (config_strings_add(config, kv->value, &action->zone_name)) {
+				return CONFIG_UPDATE_ERROR;
+			}
+		}
+		return CONFIG_UPDATE_OK;
+	case CONFIG_SECTION_KEY_LEVEL:
+		action = &config->actions[config->action_count - 1];
+		if (strcasecmp(kv->value, "first") == 0) {
+			action->level = CONFIG_ACTION_FIRST;
+		} else if (strcasecmp(kv->value, "second") == 0) {
+			action->level = CONFIG_ACTION_SECOND;
+		} else {
+			return CONFIG_UPDATE_INVALID;
+		}
+		return CONFIG_UPDATE_OK;
+	case CONFIG_SECTION_KEY_SCRIPT:
+		action = &config->actions[config->action_count - 1];
+		if (config_strings_add(config, kv->value, &action->script)) {
+			return CONFIG_UPDATE_ERROR;
+		}
+		return CONFIG_UPDATE_OK;
+	case CONFIG_SECTION_KEY_POLL_INTERVAL:
+		val = &config->sensors[config->sensor_count - 1].poll_interval;
+		min = config_key_map[CONFIG_KEY_POLL_INTERVAL].min;
+		max = config_key_map[CONFIG_KEY_POLL_INTERVAL].max;
+		break;
+	case CONFIG_SECTION_KEY_ALERT_THRESHOLD:
+		val = &config->sensors[config->sensor_count - 1].alert_threshold;
+		min = config_key_map[CONFIG_KEY_ALERT_THRESHOLD].min;
+		max = config_key_map[CONFIG_KEY_ALERT_THRESHOLD].max;
+		break;
+	case CONFIG_SECTION_KEY_CANCEL_WAIT_TIME:
+		val = &config->zones[config->zone_count - 1].cancel_wait_time;
+		min = config_key_map[CONFIG_KEY_CANCEL_WAIT_TIME].min;
+		max = config_key_map[CONFIG_KEY_CANCEL_WAIT_TIME].max;
+		break;
+	default:
+		ABORT();
+		/* NOT REACHED */
+		return CONFIG_UPDATE_UNKNOWN;
+	}
+	if (config_parse_int(kv->value, min, max, val)) {
+		return CONFIG_UPDATE_INVALID;
+	}
+
+	return CONFIG_UPDATE_OK;
+}
+
+/*
+ * セクションの名前の索引
+ * 名前の重複を調べたり、zoneの名前から番号を引くのに使う
+ */
+struct config_name_index {
+	int *slots;                     /* 配列の番号 + 1、0は空き */
+	unsigned int mask;
+};
+
+static unsigned int
+config_name_hash(const char *name) {
+	unsigned int h = 2166136261u;
+
+	while (*name != '\0') {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * names (stringsの中の位置、strideバイトごと) の索引を作る
+ * 名前が重複していたら1を返す
+ */
+static int
+config_name_index_create(
+    struct config_name_index *index,
+    struct config *config,
+    const void *names,
+    size_t stride,
+    int count,
+    const char *type)
+{
+	const char *name;
+	unsigned int size = 1;
+	unsigned int slot;
+	unsigned int offset;
+	int i;
+
+	while (size < (unsigned int)count * 2) {
+		size *= 2;
+	}
+	index->slots = calloc(size, sizeof(int));
+	if (index->slots == NULL) {
+		return 1;
+	}
+	index->mask = size - 1;
+	for (i = 0; i < count; i++) {
+		memcpy(&offset, (const char *)names + i * stride, sizeof(offset));
+		name = config_string(config, offset);
+		for (slot = config_name_hash(name) & index->mask;
+		    index->slots[slot] != 0;
+		    slot = (slot + 1) & index->mask) {
+			memcpy(&offset, (const char *)names
+			    + (index->slots[slot] - 1) * stride, sizeof(offset));
+			if (strcmp(config_string(config, offset), name) == 0) {
+				fprintf(stderr, "duplicate [%s \"%s\"]\n", type, name);
+				free(index->slots);
+				index->slots = NULL;
+				return 1;
+			}
+		}
+		index->slots[slot] = i + 1;
+	}
+
+	return 0;
+}
+
+/* 索引から名前の番号を引く、無ければ-1を返す */
+static int
+config_name_index_find(struct config_name_index *index, struct config *config, const char *name) {
+	unsigned int slot;
+	int i;
+
+	for (slot = config_name_hash(name) & index->mask;
+	    index->slots[slot] != 0;
+	    slot = (slot + 1) & index->mask) {
+		i = index->slots[slot] - 1;
+		if (strcmp(config_string(config, config->zones[i].name), name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * 全部読んだ後に、セクションの名前の重複とzoneの参照を調べる
+ * 最初の[sensor]とそのzoneに書いた値を全体の設定の値にする
+ */
+static int
+config_resolve(struct config *config) {
+	struct config_name_index index;
+	struct config_sensor *sensor;
+	struct config_action *action;
+	struct config_zone *zone;
 	int i;
 
-	for (i = 0; config_key_map[i].key != NULL; i++) {
-		if (strncasecmp(
-		    config_key_map[i].key,
-		    kv->key,
-		    strlen(config_key_map[i].key)) == 0) {
-			config_key_map[i].update_func(config, kv);
+	if (config_name_index_create(&index, config,
+	    config->sensors ? &config->sensors->name : NULL,
+	    sizeof(struct config_sensor), config->sensor_count, "sensor")) {
+		return 1;
+	}
+	free(index.slots);
+	if (config_name_index_create(&index, config,
+	    config->actions ? &config->actions->name : NULL,
+	    sizeof(struct config_action), config->action_count, "action")) {
+		return 1;
+	}
+	free(index.slots);
+	if (config_name_index_create(&index, config,
+	    config->zones ? &config->zones->name : NULL,
+	    sizeof(struct config_zone), config->zone_count, "zone")) {
+		return 1;
+	}
+	for (i = 0; i < config->sensor_count; i++) {
+		sensor = &config->sensors[i];
+		if (sensor->zone_name == 0) {
+			continue;
+		}
+		sensor->zone = config_name_index_find(&index, config,
+		    config_string(config, sensor->zone_name));
+		if (sensor->zone < 0) {
+			fprintf(stderr, "unknown zone \"%s\" in [sensor \"%s\"]\n",
+			    config_string(config, sensor->zone_name),
+			    config_string(config, sensor->name));
+			goto fail;
+		}
+	}
+	for (i = 0; i < config->action_count; i++) {
+		action = &config->actions[i];
+		if (action->level == 0 || action->script == 0) {
+			fprintf(stderr, "level and script are required in [action \"%s\"]\n",
+			    config_string(config, action->name));
+			goto fail;
+		}
+		if (action->zone_name == 0) {
+			continue;
+		}
+		action->zone = config_name_index_find(&index, config,
+		    config_string(config, action->zone_name));
+		if (action->zone < 0) {
+			fprintf(stderr, "unknown zone \"%s\" in [action \"%s\"]\n",
+			    config_string(config, action->zone_name),
+			    config_string(config, action->name));
+			goto fail;
+		}
+	}
+	free(index.slots);
+	if (config->sensor_count == 0) {
+		return 0;
+	}
+	sensor = &config->sensors[0];
+	if (sensor->poll_interval >= 0) {
+		config->poll_interval = sensor->poll_interval;
+	}
+	if (sensor->alert_threshold >= 0) {
+		config->alert_threshold = sensor->alert_threshold;
+	}
+	if (sensor->zone >= 0) {
+		zone = &config->zones[sensor->zone];
+		if (zone->cancel_wait_time >= 0) {
+			config->cancel_wait_time = zone->cancel_wait_time;
 		}
 	}
 
 	return 0;
+
+fail:
+	free(index.slots);
+	return 1;
 }
 
 /* コンフィグのパース */
 static int
 config_parse(struct config *config, FILE *fp) {
-	char line[256];
+	char *line = NULL;
+	size_t line_size = 0;
 	struct string_kv kv;
 	int linecnt = 0;
+	int section = CONFIG_SECTION_NONE;
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
+	/* 長い行 (コメントなど) も1行として読む */
+	while (getline(&line, &line_size, fp) >= 0) {
 		linecnt++;
 		if (string_rstrip(line, "\r\n")) {
 			fprintf(stderr, "reverse strip error (%d: %s)\n", linecnt, line);
-			return 1;
+			goto fail;
 		}
 		if (line[0] == '\0' || line[0] == '#') {
 			continue;
 		}
-		if (string_kv_split(&kv, line, "=")) {
+		if (line[0] == '[') {
+			if (config_section_add(config, line, linecnt, &section)) {
+				goto fail;
+			}
+			continue;
+		}
+		if (strchr(line, '=') == NULL ||
+		    string_kv_split(&kv, line, "=")) {
 			fprintf(stderr, "sprint error (%d: %s)\n", linecnt, line);
-			return 1;
+			goto fail;
 		}
-		if (config_update(config, &kv)) {
-			fprintf(stderr, "update error (%d: %s)\n", linecnt, line);
-			return 1;
+		if (section == CONFIG_SECTION_NONE) {
+			config_update(config, &kv, linecnt);
+			continue;
+		}
+		switch (config_section_update(config, section, &kv)) {
+		case CONFIG_UPDATE_OK:
+			break;
+		case CONFIG_UPDATE_UNKNOWN:
+			fprintf(stderr, "unknown key (%d: %s)\n", linecnt, kv.key);
+			break;
+		case CONFIG_UPDATE_INVALID:
+			fprintf(stderr, "invalid value (%d: %s = %s)\n",
+			    linecnt, kv.key, kv.value);
+			break;
+		default:
+			fprintf(stderr, "update error (%d: %s)\n", linecnt, kv.key);
+			goto fail;
 		}
 	}
-	return 0;
+
+	free(line);
+
+	return config_resolve(config);
+
+fail:
+	free(line);
+	return 1;
 }
 
 int
@@ -163,8 +667,20 @@ config_create(
 	char *sascript = NULL;
 	char *rport = NULL;
 	char *pfpath = NULL;
+	char *hport = NULL;
+	char *hroot = NULL;
+	char *upath = NULL;
+	char *auids = NULL;
+	char *spname = NULL;
+	char *usbpath = NULL;
+	char *lpath = NULL;
+	char *hpath = NULL;
+	char *apath = NULL;
 
 	inst = malloc(sizeof(struct config));
+	if (inst == NULL) {
+		return 1;
+	}
 	memset(inst, 0, sizeof(struct config));
 	fascript = strdup(first_alert_script);
 	if (fascript == NULL) {
@@ -182,14 +698,69 @@ config_create(
 	if (pfpath== NULL) {
 		goto fail;
 	}
+	hport = strdup(DEFAULT_HTTP_PORT);
+	if (hport == NULL) {
+		goto fail;
+	}
+	hroot = strdup(DEFAULT_HTTP_DOCUMENT_ROOT);
+	if (hroot == NULL) {
+		goto fail;
+	}
+	upath = strdup(DEFAULT_RPC_UNIX_PATH);
+	if (upath == NULL) {
+		goto fail;
+	}
+	auids = strdup(DEFAULT_RPC_ALLOW_UIDS);
+	if (auids == NULL) {
+		goto fail;
+	}
+	spname = strdup(DEFAULT_STATUS_PAGE_NAME);
+	if (spname == NULL) {
+		goto fail;
+	}
+	usbpath = strdup(DEFAULT_USB_PATH);
+	if (usbpath == NULL) {
+		goto fail;
+	}
+	lpath = strdup(DEFAULT_LOG_PATH);
+	if (lpath == NULL) {
+		goto fail;
+	}
+	hpath = strdup(DEFAULT_HISTORY_PATH);
+	if (hpath == NULL) {
+		goto fail;
+	}
+	apath = strdup(DEFAULT_ARCHIVE_PATH);
+	if (apath == NULL) {
+		goto fail;
+	}
 	inst->first_alert_script = fascript;
 	inst->second_alert_script = sascript;
 	inst->rpc_port = rport;
 	inst->pid_file_path = pfpath;
+	inst->http_port = hport;
+	inst->http_document_root = hroot;
+	inst->rpc_unix_path = upath;
+	inst->rpc_allow_uids = auids;
+	inst->status_page_name = spname;
+	inst->usb_path = usbpath;
+	inst->log_path = lpath;
+	inst->history_path = hpath;
+	inst->archive_path = apath;
 	inst->cancel_wait_time = cancel_wait_time;
 	inst->poll_interval = poll_interval;
 	inst->alert_threshold = alert_threshold;
 	inst->rpc_timeout = rpc_timeout;
+	inst->log_level = DEFAULT_LOG_LEVEL;
+	inst->callback_budget = DEFAULT_CALLBACK_BUDGET;
+	inst->rpc_connect_rate = DEFAULT_RPC_CONNECT_RATE;
+	inst->rpc_connect_burst = DEFAULT_RPC_CONNECT_BURST;
+	inst->rpc_command_rate = DEFAULT_RPC_COMMAND_RATE;
+	inst->rpc_command_burst = DEFAULT_RPC_COMMAND_BURST;
+	inst->rpc_io_uring = DEFAULT_RPC_IO_URING;
+	inst->rpc_defer_accept = DEFAULT_RPC_DEFER_ACCEPT;
+	inst->rpc_fast_open = DEFAULT_RPC_FAST_OPEN;
+	inst->rpc_tcp_mutate = DEFAULT_RPC_TCP_MUTATE;
 	*config = inst;
 
 	return 0;
@@ -199,6 +770,15 @@ fail:
 	free(sascript);
 	free(rport);
 	free(pfpath);
+	free(hport);
+	free(hroot);
+	free(upath);
+	free(auids);
+	free(spname);
+	free(usbpath);
+	free(lpath);
+	free(hpath);
+	free(apath);
 	free(inst);
 
 	return 1;
@@ -207,7 +787,7 @@ fail:
 int
 config_load(struct config *config, const char *config_path) {
 	FILE *fp;
-	fp = fopen(config_path, "r");
+	fp = fopen(config_path, "re");
 	if (fp == NULL) {
 		return 1;
 	}
@@ -222,21 +802,446 @@ config_load(struct config *config, const char *config_path) {
 
 void
 config_print(struct config *config) {
-	printf("first_alert_script = %s\n", config->first_alert_script);
-	printf("second_alert_script = %s\n", config->second_alert_script);
-	printf("rpc_port = %s\n", config->rpc_port);
-	printf("pid_file_path = %s\n", config->pid_file_path);
-	printf("cancel_wait_time = %d\n", config->cancel_wait_time);
-	printf("poll_interval = %d\n", config->poll_interval);
-	printf("alert_threshold = %d\n", config->alert_threshold);
-	printf("rpc_timeout = %d\n", config->rpc_timeout);
+	struct config_sensor *sensor;
+	struct config_zone *zone;
+	struct config_action *action;
+	int i;
+
+#define CONFIG_STRING(upper, name) printf(#name " = %s\n", config->name);
+#define CONFIG_INT(upper, name, min, max) printf(#name " = %d\n", config->name);
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	for (i = 0; i < config->sensor_count; i++) {
+		sensor = &config->sensors[i];
+		printf("[sensor \"%s\"] zone = %s, poll_interval = %d, alert_threshold = %d\n",
+		    config_string(config, sensor->name),
+		    config_string(config, sensor->zone_name),
+		    sensor->poll_interval, sensor->alert_threshold);
+	}
+	for (i = 0; i < config->zone_count; i++) {
+		zone = &config->zones[i];
+		printf("[zone \"%s\"] cancel_wait_time = %d\n",
+		    config_string(config, zone->name), zone->cancel_wait_time);
+	}
+	for (i = 0; i < config->action_count; i++) {
+		action = &config->actions[i];
+		printf("[action \"%s\"] zone = %s, level = %s, script = %s\n",
+		    config_string(config, action->name),
+		    config_string(config, action->zone_name),
+		    action->level == CONFIG_ACTION_FIRST ? "first" : "second",
+		    config_string(config, action->script));
+	}
+}
+
+/* new_configのkeyの値をold_configの値に戻す */
+static int
+config_revert(struct config *old_config, struct config *new_config, int key) {
+	char *tmp;
+
+	switch (key) {
+#define CONFIG_STRING(upper, name)					\
+	case CONFIG_KEY_##upper:					\
+		tmp = strdup(old_config->name);				\
+		if (tmp == NULL) {					\
+			return 1;					\
+		}							\
+		free(new_config->name);					\
+		new_config->name = tmp;					\
+		break;
+#define CONFIG_INT(upper, name, min, max)				\
+	case CONFIG_KEY_##upper:					\
+		new_config->name = old_config->name;			\
+		break;
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	default:
+		ABORT();
+		/* NOT REACHED */
+	}
+
+	return 0;
+}
+
+int
+config_diff(
+    struct config *old_config,
+    struct config *new_config,
+    int (*changed_cb)(int key, struct config *old_config, struct config *new_config, void *args),
+    void *args)
+{
+	int reverted = 0;
+
+#define CONFIG_STRING(upper, name)					\
+	if (strcmp(old_config->name, new_config->name) != 0 &&		\
+	    changed_cb(CONFIG_KEY_##upper, old_config, new_config, args)) { \
+		if (config_revert(old_config, new_config, CONFIG_KEY_##upper)) { \
+			return -1;					\
+		}							\
+		reverted++;						\
+	}
+#define CONFIG_INT(upper, name, min, max)				\
+	if (old_config->name != new_config->name &&			\
+	    changed_cb(CONFIG_KEY_##upper, old_config, new_config, args)) { \
+		if (config_revert(old_config, new_config, CONFIG_KEY_##upper)) { \
+			return -1;					\
+		}							\
+		reverted++;						\
+	}
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+
+	return reverted;
+}
+
+const char *
+config_key_name(int key) {
+	if (key < 0 || key >= CONFIG_KEY_COUNT) {
+		return NULL;
+	}
+	return config_key_map[key].key;
+}
+
+int
+config_key_lookup(const char *name) {
+	char upper[CONFIG_KEY_SIZE];
+	unsigned int idx;
+	size_t len;
+
+	/* 完全ハッシュでslotを決めて、名前が完全一致したものだけを返す */
+	len = config_key_upper(upper, sizeof(upper), name);
+	if (len == 0) {
+		return -1;
+	}
+	idx = config_key_hash_slot[config_key_hash(upper, len)];
+	if (idx == 0 || strcasecmp(config_key_map[idx - 1].key, name) != 0) {
+		return -1;
+	}
+
+	return idx - 1;
+}
+
+int
+config_set(struct config *config, int key, const char *value) {
+	if (key < 0 || key >= CONFIG_KEY_COUNT) {
+		return 1;
+	}
+
+	return config_key_map[key].update_func(config, value);
+}
+
+int
+config_format(struct config *config, int key, char *buf, size_t size) {
+	int len;
+
+	switch (key) {
+#define CONFIG_STRING(upper, name)					\
+	case CONFIG_KEY_##upper:					\
+		len = snprintf(buf, size, "%s", config->name);		\
+		break;
+#define CONFIG_INT(upper, name, min, max)				\
+	case CONFIG_KEY_##upper:					\
+		len = snprintf(buf, size, "%d", config->name);		\
+		break;
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	default:
+		return -1;
+	}
+	if (len < 0 || (size_t)len >= size) {
+		return -1;
+	}
+
+	return len;
+}
+
+const char *
+config_string(struct config *config, unsigned int offset) {
+	if (offset == 0 || offset >= config->strings_len) {
+		return "";
+	}
+	return &config->strings[offset];
+}
+
+int
+config_sections_equal(struct config *config1, struct config *config2) {
+	if (config1->sensor_count != config2->sensor_count ||
+	    config1->zone_count != config2->zone_count ||
+	    config1->action_count != config2->action_count ||
+	    config1->strings_len != config2->strings_len) {
+		return 0;
+	}
+	/* 同じ内容を読めば同じ並びになるので、配列をそのまま比べる */
+	if (config1->sensor_count > 0 && memcmp(config1->sensors, config2->sensors,
+	    sizeof(struct config_sensor) * config1->sensor_count) != 0) {
+		return 0;
+	}
+	if (config1->zone_count > 0 && memcmp(config1->zones, config2->zones,
+	    sizeof(struct config_zone) * config1->zone_count) != 0) {
+		return 0;
+	}
+	if (config1->action_count > 0 && memcmp(config1->actions, config2->actions,
+	    sizeof(struct config_action) * config1->action_count) != 0) {
+		return 0;
+	}
+	if (config1->strings_len > 0 &&
+	    memcmp(config1->strings, config2->strings, config1->strings_len) != 0) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* 配列をconfig_array_growで足していける大きさで複製する */
+static int
+config_array_dup(void *array, const void *src, int count, size_t size) {
+	void **p = array;
+	size_t capacity = 1;
+
+	*p = NULL;
+	if (count == 0) {
+		return 0;
+	}
+	while (capacity < (size_t)count) {
+		capacity *= 2;
+	}
+	*p = malloc(capacity * size);
+	if (*p == NULL) {
+		return 1;
+	}
+	memcpy(*p, src, size * count);
+
+	return 0;
+}
+
+int
+config_copy(struct config **config, struct config *src_config) {
+	struct config *inst;
+
+	inst = malloc(sizeof(struct config));
+	if (inst == NULL) {
+		return 1;
+	}
+	memset(inst, 0, sizeof(struct config));
+#define CONFIG_STRING(upper, name)					\
+	inst->name = strdup(src_config->name);				\
+	if (inst->name == NULL) {					\
+		goto fail;						\
+	}
+#define CONFIG_INT(upper, name, min, max) inst->name = src_config->name;
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	if (config_array_dup(&inst->sensors, src_config->sensors,
+	    src_config->sensor_count, sizeof(struct config_sensor)) ||
+	    config_array_dup(&inst->zones, src_config->zones,
+	    src_config->zone_count, sizeof(struct config_zone)) ||
+	    config_array_dup(&inst->actions, src_config->actions,
+	    src_config->action_count, sizeof(struct config_action))) {
+		goto fail;
+	}
+	inst->sensor_count = src_config->sensor_count;
+	inst->zone_count = src_config->zone_count;
+	inst->action_count = src_config->action_count;
+	if (src_config->strings_len > 0) {
+		inst->strings = malloc(src_config->strings_len);
+		if (inst->strings == NULL) {
+			goto fail;
+		}
+		memcpy(inst->strings, src_config->strings, src_config->strings_len);
+		inst->strings_len = src_config->strings_len;
+		inst->strings_size = src_config->strings_len;
+	}
+	*config = inst;
+
+	return 0;
+
+fail:
+	config_destroy(inst);
+
+	return 1;
+}
+
+/*
+ * 全体の設定より優先されるセクションに書いてある項目なら、そのセクションを返す
+ * (最初の[sensor]のpoll_interval, alert_thresholdと、そのzoneのcancel_wait_time)
+ * 書いてある値をvalueのポインタに入れる。無ければ全体の設定に書くので0を返す
+ */
+static int
+config_save_section(struct config *config, int key, const char **type, const char **name, int **value) {
+	struct config_sensor *sensor;
+	struct config_zone *zone;
+
+	if (config->sensor_count == 0) {
+		return 0;
+	}
+	sensor = &config->sensors[0];
+	*type = "sensor";
+	*name = config_string(config, sensor->name);
+	switch (key) {
+	case CONFIG_KEY_POLL_INTERVAL:
+		*value = &sensor->poll_interval;
+		break;
+	case CONFIG_KEY_ALERT_THRESHOLD:
+		*value = &sensor->alert_threshold;
+		break;
+	case CONFIG_KEY_CANCEL_WAIT_TIME:
+		if (sensor->zone < 0) {
+			return 0;
+		}
+		zone = &config->zones[sensor->zone];
+		*type = "zone";
+		*name = config_string(config, zone->name);
+		*value = &zone->cancel_wait_time;
+		break;
+	default:
+		return 0;
+	}
+
+	return **value >= 0;
+}
+
+int
+config_save(struct config *config, const char *config_path, int key, const char *value) {
+	FILE *in = NULL;
+	FILE *out = NULL;
+	char tmp_path[PATH_MAX];
+	char *line = NULL;
+	char *work = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	struct string_kv kv;
+	struct stat st;
+	const char *name;
+	const char *section_type = NULL;
+	const char *section_name = NULL;
+	int *section_value = NULL;
+	char *type, *header_name;
+	size_t type_len;
+	size_t len;
+	int in_section = 0;
+	int target = 0;
+	int found = 0;
+	int newline = 1;
+
+	name = config_key_name(key);
+	if (name == NULL) {
+		return 1;
+	}
+	/* 全体の設定に書いても負けるならそのセクションに書く */
+	target = config_save_section(config, key, &section_type, &section_name, &section_value);
+	len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", config_path);
+	if (len >= sizeof(tmp_path)) {
+		return 1;
+	}
+	in = fopen(config_path, "re");
+	if (in == NULL) {
+		return 1;
+	}
+	out = fopen(tmp_path, "we");
+	if (out == NULL) {
+		goto fail;
+	}
+	/* 元のファイルのパーミッションを引き継ぐ */
+	if (fstat(fileno(in), &st) == 0) {
+		fchmod(fileno(out), st.st_mode & 07777);
+	}
+	/* 長い行も分けずにそのまま写す */
+	while ((line_len = getline(&line, &line_size, in)) >= 0) {
+		len = (size_t)line_len;
+		newline = (len > 0 && line[len - 1] == '\n');
+		free(work);
+		work = strdup(line);
+		if (work == NULL) {
+			goto fail;
+		}
+		if (line[0] == '[') {
+			if (!found && (!target || in_section)) {
+				/* 全体の設定はセクションより前に、セクションの項目はその終わりに書く */
+				fprintf(out, "%s = %s\n", name, value);
+				found = 1;
+			}
+			in_section = (target &&
+			    string_rstrip(work, "\r\n") == 0 &&
+			    config_section_header(work, &type, &type_len, &header_name) == 0 &&
+			    type_len == strlen(section_type) &&
+			    strncasecmp(type, section_type, type_len) == 0 &&
+			    strcmp(header_name, section_name) == 0);
+			fputs(line, out);
+			continue;
+		}
+		if (!found &&
+		    (!target || in_section) &&
+		    work[0] != '#' &&
+		    strchr(work, '=') != NULL &&
+		    string_rstrip(work, "\r\n") == 0 &&
+		    string_kv_split(&kv, work, "=") == 0 &&
+		    strcasecmp(kv.key, name) == 0) {
+			fprintf(out, "%s = %s\n", name, value);
+			found = 1;
+			continue;
+		}
+		fputs(line, out);
+	}
+	if (ferror(in)) {
+		goto fail;
+	}
+	if (!found) {
+		if (target && !in_section) {
+			/* セクションが無くなっている */
+			goto fail;
+		}
+		fprintf(out, "%s%s = %s\n", newline ? "" : "\n", name, value);
+	}
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+		goto fail;
+	}
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto fail;
+	}
+	out = NULL;
+	if (rename(tmp_path, config_path)) {
+		goto fail;
+	}
+	fclose(in);
+	free(line);
+	free(work);
+	if (target) {
+		/* 読み直した時と同じになるように、セクションの値も書いた値にする */
+		*section_value = atoi(value);
+	}
+
+	return 0;
+
+fail:
+	if (out) {
+		fclose(out);
+	}
+	unlink(tmp_path);
+	fclose(in);
+	free(line);
+	free(work);
+
+	return 1;
 }
 
 void
 config_destroy(struct config *config) {
-	free(config->first_alert_script);
-	free(config->second_alert_script);
-	free(config->rpc_port);
-	free(config->pid_file_path);
+	if (config == NULL) {
+		return;
+	}
+#define CONFIG_STRING(upper, name) free(config->name);
+#define CONFIG_INT(upper, name, min, max)
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	free(config->sensors);
+	free(config->zones);
+	free(config->actions);
+	free(config->strings);
 	free(config);
 }
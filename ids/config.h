@@ -22,15 +22,105 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-struct config {
-	char *first_alert_script;
-	char *second_alert_script;
-	int cancel_wait_time;
+/* config_createの引数にない項目のデフォルト値 */
+#define DEFAULT_HTTP_PORT           ""   /* 空ならHTTPを使わない */
+#define DEFAULT_HTTP_DOCUMENT_ROOT  ""   /* 空なら静的ファイルを返さない */
+#define DEFAULT_RPC_UNIX_PATH       ""   /* 空ならunix domain socketは使わない */
+#define DEFAULT_RPC_ALLOW_UIDS      ""   /* 空ならrootだけ */
+#define DEFAULT_STATUS_PAGE_NAME    ""   /* 空なら共有メモリに状態を置かない */
+#define DEFAULT_USB_PATH            ""   /* 空ならベンダーIDとプロダクトIDでセンサーを探す */
+#define DEFAULT_LOG_PATH            ""   /* 空ならstderr、syslogならsyslogに送る */
+#define DEFAULT_LOG_LEVEL           2    /* 0: error, 1: warn, 2: info, 3: debug */
+#define DEFAULT_HISTORY_PATH        ""   /* 空なら在室率の履歴を残さない */
+#define DEFAULT_ARCHIVE_PATH        ""   /* 空ならサンプルのアーカイブを残さない */
+#define DEFAULT_CALLBACK_BUDGET     100  /* コールバックの予算 (msec)、0なら監視しない */
+#define DEFAULT_RPC_CONNECT_RATE    50   /* 接続元ごとの1秒あたりのRPCの接続数、0なら制限しない */
+#define DEFAULT_RPC_CONNECT_BURST   100  /* 接続元ごとにまとめてできるRPCの接続数 */
+#define DEFAULT_RPC_COMMAND_RATE    500  /* バイナリの接続ごとの1秒あたりのコマンド数、0なら制限しない */
+#define DEFAULT_RPC_COMMAND_BURST   1000 /* バイナリの接続ごとにまとめて実行できるコマンド数 */
+#define DEFAULT_RPC_IO_URING        0    /* 1ならRPCの接続をio_uringで扱う */
+#define DEFAULT_RPC_DEFER_ACCEPT    0    /* RPCのTCP_DEFER_ACCEPTの秒数、0なら使わない */
+#define DEFAULT_RPC_FAST_OPEN       0    /* RPCのTCP_FASTOPENのキューの長さ、0なら使わない */
+#define DEFAULT_RPC_TCP_MUTATE      2    /* TCPとHTTPからはループバックアドレスからだけ状態を変更するコマンドを受け付ける */
+
+/* 設定項目の番号 (CONFIG_KEY_<大文字の名前>) */
+enum config_key {
+#define CONFIG_STRING(upper, name) CONFIG_KEY_##upper,
+#define CONFIG_INT(upper, name, min, max) CONFIG_KEY_##upper,
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	CONFIG_KEY_COUNT
+};
+
+/*
+ * セクション
+ *   [sensor "<名前>"]
+ *   [zone "<名前>"]
+ *   [action "<名前>"]
+ * 最初のセクションより前の項目は全体の設定
+ */
+#define CONFIG_SECTION_NONE         0
+#define CONFIG_SECTION_SENSOR       1
+#define CONFIG_SECTION_ZONE         2
+#define CONFIG_SECTION_ACTION       3
+
+#define CONFIG_SECTION_MASK_SENSOR  (1 << CONFIG_SECTION_SENSOR)
+#define CONFIG_SECTION_MASK_ZONE    (1 << CONFIG_SECTION_ZONE)
+#define CONFIG_SECTION_MASK_ACTION  (1 << CONFIG_SECTION_ACTION)
+
+/* セクションの項目の番号 (CONFIG_SECTION_KEY_<大文字の名前>) */
+enum config_section_key {
+#define CONFIG_SECTION_KEY(upper, name, sections) CONFIG_SECTION_KEY_##upper,
+#include "config_section.def"
+#undef CONFIG_SECTION_KEY
+	CONFIG_SECTION_KEY_COUNT
+};
+
+/* actionのlevel */
+#define CONFIG_ACTION_FIRST         1  /* 一次警報で実行する */
+#define CONFIG_ACTION_SECOND        2  /* 二次警報で実行する */
+
+/*
+ * セクションは読んだ順に種類ごとの配列に詰める
+ * 名前や文字列の値はconfig->stringsにまとめて置き、その中の位置で持つ
+ * (位置0は空文字列)
+ * 数値が-1の項目は書かれていないもので、全体の設定を使う
+ */
+struct config_sensor {
+	unsigned int name;          /* 名前 */
+	unsigned int zone_name;     /* zoneの名前 */
+	int zone;                   /* zonesの番号、-1ならzone無し */
 	int poll_interval;
 	int alert_threshold;
-	char *rpc_port;
-	int rpc_timeout;
-	char *pid_file_path;
+};
+struct config_zone {
+	unsigned int name;          /* 名前 */
+	int cancel_wait_time;
+};
+struct config_action {
+	unsigned int name;          /* 名前 */
+	unsigned int zone_name;     /* zoneの名前 */
+	int zone;                   /* zonesの番号、-1なら全zone */
+	int level;                  /* CONFIG_ACTION_FIRST, CONFIG_ACTION_SECOND */
+	unsigned int script;        /* 実行するスクリプト */
+};
+
+struct config {
+#define CONFIG_STRING(upper, name) char *name;
+#define CONFIG_INT(upper, name, min, max) int name;
+#include "config.def"
+#undef CONFIG_STRING
+#undef CONFIG_INT
+	struct config_sensor *sensors;  /* [sensor] */
+	int sensor_count;
+	struct config_zone *zones;      /* [zone] */
+	int zone_count;
+	struct config_action *actions;  /* [action] */
+	int action_count;
+	char *strings;                  /* セクションの名前と文字列の値 */
+	size_t strings_len;
+	size_t strings_size;
 };
 
 /* configの生成 */
@@ -44,13 +134,73 @@ int config_create(
     const char *rpc_port,
     int rpc_timeout,
     const char *pid_file_path);
-/* コンフィグファイルの読み込み */
+/*
+ * コンフィグファイルの読み込み
+ * idsが扱うセンサーは1つなので、最初の[sensor]とそのzoneに書いた値を
+ * 全体の設定の値にする
+ */
 int config_load(
     struct config *config,
     const char *config_path);
 /* コンフィグ情報を出力する */
 void config_print(
     struct config *config);
+/*
+ * 2つのconfigを比べて、値が違う項目ごとにchanged_cbを呼ぶ
+ * changed_cbが0以外を返した項目は、適用しなかったものとして
+ * new_configの値をold_configの値に戻す
+ * 戻した項目の数を返す。戻せなかった場合は-1を返す
+ */
+int config_diff(
+    struct config *old_config,
+    struct config *new_config,
+    int (*changed_cb)(int key, struct config *old_config, struct config *new_config, void *args),
+    void *args);
+/* 項目の名前 */
+const char *config_key_name(
+    int key);
+/* 名前から項目の番号を引く、無ければ-1を返す */
+int config_key_lookup(
+    const char *name);
+/*
+ * 1項目の値を文字列から設定する
+ * コンフィグファイルと同じ範囲のチェックをして、範囲外なら1を返す
+ */
+int config_set(
+    struct config *config,
+    int key,
+    const char *value);
+/* 1項目の値を文字列にしてbufに書き、その長さを返す */
+int config_format(
+    struct config *config,
+    int key,
+    char *buf,
+    size_t size);
+/* セクションの文字列 */
+const char *config_string(
+    struct config *config,
+    unsigned int offset);
+/* 2つのconfigのセクションが同じかどうか */
+int config_sections_equal(
+    struct config *config1,
+    struct config *config2);
+/* configの複製 */
+int config_copy(
+    struct config **config,
+    struct config *src_config);
+/*
+ * コンフィグファイルの1項目だけを書き換える
+ * 最初の[sensor]やそのzoneに書いてある値が全体の設定より優先される項目は、
+ * そのセクションの中を書き換えて、configのセクションの値も合わせる
+ * 他の行はそのまま残し、keyの行が無ければ全体の設定は最初のセクションの前 (無ければ最後) に、
+ * セクションの項目はそのセクションの最後に足す
+ * 一時ファイルに書いてからrenameするので、途中で失敗しても元のファイルは壊れない
+ */
+int config_save(
+    struct config *config,
+    const char *config_path,
+    int key,
+    const char *value);
 /* configの削除 */
 void config_destroy(
     struct config *config);
@@ -0,0 +1,35 @@
+/* このファイルは gen_hash.py が config.def から生成したもの。直接編集しないこと */
+#ifndef CONFIG_KEY_HASH_H
+#define CONFIG_KEY_HASH_H
+
+#define CONFIG_KEY_HASH_COUNT 27
+#define CONFIG_KEY_HASH_SIZE  128
+#define CONFIG_KEY_HASH_SEED  2u
+
+/* FNV-1a (seed付き) */
+static inline unsigned int
+config_key_hash(const char *str, size_t len) {
+	unsigned int h = 2166136261u ^ CONFIG_KEY_HASH_SEED;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+
+	return h & (CONFIG_KEY_HASH_SIZE - 1);
+}
+
+/* slot -> 定義順の番号 + 1 (0は空き) */
+static const unsigned char config_key_hash_slot[CONFIG_KEY_HASH_SIZE] = {
+	0, 0, 21, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	15, 0, 17, 0, 0, 0, 0, 0, 3, 0, 6, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 19, 10, 0,
+	0, 0, 0, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 13, 0, 24,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 4, 0, 0, 0, 7,
+	1, 26, 0, 0, 0, 0, 0, 0, 0, 5, 0, 18, 0, 0, 25, 23,
+	0, 11, 8, 0, 0, 0, 0, 0, 0, 20, 0, 0, 0, 0, 0, 0,
+	0, 14, 0, 9, 0, 0, 0, 0, 0, 0, 22, 0, 0, 0, 0, 27,
+};
+
+#endif
@@ -0,0 +1,28 @@
+/* このファイルは gen_hash.py が config_section.def から生成したもの。直接編集しないこと */
+#ifndef CONFIG_SECTION_KEY_HASH_H
+#define CONFIG_SECTION_KEY_HASH_H
+
+#define CONFIG_SECTION_KEY_HASH_COUNT 6
+#define CONFIG_SECTION_KEY_HASH_SIZE  16
+#define CONFIG_SECTION_KEY_HASH_SEED  2u
+
+/* FNV-1a (seed付き) */
+static inline unsigned int
+config_section_key_hash(const char *str, size_t len) {
+	unsigned int h = 2166136261u ^ CONFIG_SECTION_KEY_HASH_SEED;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+
+	return h & (CONFIG_SECTION_KEY_HASH_SIZE - 1);
+}
+
+/* slot -> 定義順の番号 + 1 (0は空き) */
+static const unsigned char config_section_key_hash_slot[CONFIG_SECTION_KEY_HASH_SIZE] = {
+	6, 0, 0, 0, 0, 1, 0, 5, 0, 4, 2, 0, 0, 0, 0, 3,
+};
+
+#endif
@@ -0,0 +1,65 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+/*
+ * 検出の判定
+ * 人がいるサンプルが続いた数 (連続検出回数) がthresholdを超えたら警報を出して0に戻し、
+ * 人がいないサンプルで0に戻す。
+ * sensor_pollingは1サンプルずつ、idssweepは同じ値が続く区間ごとに呼ぶ
+ * (区間をどう分けて入れても結果は同じになる)。
+ */
+
+/*
+ * 同じ値のサンプルをn個続けて入れ、出した警報の数を返す
+ * countは連続検出回数、警報を出したらfirstに最初の警報を出したサンプルの位置 (0から) を入れる
+ */
+static inline unsigned long
+detector_feed(
+    unsigned long *count,
+    unsigned long threshold,
+    int presence,
+    unsigned long n,
+    unsigned long *first)
+{
+	unsigned long total;
+
+	if (!presence) {
+		*count = 0;
+		return 0;
+	}
+	/* thresholdを下げた直後は次の1サンプルで警報を出す */
+	if (*count > threshold) {
+		*count = threshold;
+	}
+	total = *count + n;
+	if (total <= threshold) {
+		*count = total;
+		return 0;
+	}
+	*first = threshold - *count;
+	*count = total % (threshold + 1);
+
+	return total / (threshold + 1);
+}
+
+#endif
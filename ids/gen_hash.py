@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# Copyright (c) 2010 Hiroyuki Kakine
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+#
+# *.defファイルに並んだ名前から完全ハッシュのテーブルを生成する
+#
+#   ./gen_hash.py <prefix> <macro> <def file> > <prefix>_hash.h
+#
+# <def file>の中の "<macro>(NAME, ..." の NAME を定義順に拾い、
+# 衝突しないseedを探してslot -> (定義順の番号 + 1) の表を出力する。
+# 0は空きslot。
+# <macro>はカンマで区切って複数書ける (CONFIG_STRING,CONFIG_INT など)。
+#
+
+import re
+import sys
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+
+def fnv1a(name, seed):
+    h = (FNV_OFFSET ^ seed) & 0xffffffff
+    for c in bytearray(name.encode("ascii")):
+        h ^= c
+        h = (h * FNV_PRIME) & 0xffffffff
+    return h
+
+def load_names(macro, path):
+    names = []
+    macros = "|".join(re.escape(m) for m in macro.split(","))
+    pattern = re.compile(r"^\s*(?:" + macros + r")\(\s*([A-Za-z0-9_]+)")
+    for line in open(path):
+        m = pattern.match(line)
+        if m:
+            names.append(m.group(1))
+    return names
+
+def search(names):
+    size = 1
+    while size < len(names) * 2:
+        size *= 2
+    while True:
+        for seed in range(0, 1 << 16):
+            slots = [0] * size
+            for i, name in enumerate(names):
+                slot = fnv1a(name, seed) & (size - 1)
+                if slots[slot]:
+                    break
+                slots[slot] = i + 1
+            else:
+                return size, seed, slots
+        size *= 2
+
+def main():
+    if len(sys.argv) != 4:
+        sys.stderr.write("usage: %s <prefix> <macro> <def file>\n" % sys.argv[0])
+        return 1
+    prefix, macro, path = sys.argv[1:]
+    names = load_names(macro, path)
+    if not names:
+        sys.stderr.write("no entry in %s\n" % path)
+        return 1
+    if len(names) != len(set(names)):
+        sys.stderr.write("duplicate entry in %s\n" % path)
+        return 1
+    size, seed, slots = search(names)
+    upper = prefix.upper()
+    out = sys.stdout
+    out.write("/* このファイルは gen_hash.py が %s から生成したもの。直接編集しないこと */\n" % path)
+    out.write("#ifndef %s_HASH_H\n" % upper)
+    out.write("#define %s_HASH_H\n\n" % upper)
+    out.write("#define %s_HASH_COUNT %d\n" % (upper, len(names)))
+    out.write("#define %s_HASH_SIZE  %d\n" % (upper, size))
+    out.write("#define %s_HASH_SEED  %du\n\n" % (upper, seed))
+    out.write("/* FNV-1a (seed付き) */\n")
+    out.write("static inline unsigned int\n")
+    out.write("%s_hash(const char *str, size_t len) {\n" % prefix)
+    out.write("\tunsigned int h = %uu ^ %s_HASH_SEED;\n" % (FNV_OFFSET, upper))
+    out.write("\tsize_t i;\n\n")
+    out.write("\tfor (i = 0; i < len; i++) {\n")
+    out.write("\t\th ^= (unsigned char)str[i];\n")
+    out.write("\t\th *= %uu;\n" % FNV_PRIME)
+    out.write("\t}\n\n")
+    out.write("\treturn h & (%s_HASH_SIZE - 1);\n" % upper)
+    out.write("}\n\n")
+    out.write("/* slot -> 定義順の番号 + 1 (0は空き) */\n")
+    out.write("static const unsigned char %s_hash_slot[%s_HASH_SIZE] = {\n" % (prefix, upper))
+    for i in range(0, size, 16):
+        out.write("\t" + ", ".join(str(s) for s in slots[i:i + 16]) + ",\n")
+    out.write("};\n\n")
+    out.write("#endif\n")
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,265 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "history.h"
+
+/* 解像度ごとの区間の秒数 */
+static const uint32_t history_seconds[HISTORY_RESOLUTION_MAX] = {
+	1,
+	60,
+	60 * 60,
+};
+
+/* 解像度ごとのslot数 */
+static const uint32_t history_slots[HISTORY_RESOLUTION_MAX] = {
+	HISTORY_SECOND_SLOTS,
+	HISTORY_MINUTE_SLOTS,
+	HISTORY_HOUR_SLOTS,
+};
+
+/* ファイル全体の大きさ */
+static size_t
+history_file_size(void) {
+	size_t size = HISTORY_HEADER_SIZE;
+	int i;
+
+	for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+		size += sizeof(struct history_slot) * history_slots[i];
+	}
+
+	return size;
+}
+
+/* ヘッダがこのバージョンのものか */
+static int
+history_header_valid(const struct history_header *header) {
+	int i;
+
+	if (header->magic != HISTORY_MAGIC ||
+	    header->version != HISTORY_VERSION ||
+	    header->slot_size != sizeof(struct history_slot)) {
+		return 0;
+	}
+	for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+		if (header->slots[i] != history_slots[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+history_create(struct history **history, const char *path, const char *name) {
+	struct history *inst;
+	struct history_header *header;
+	struct stat st;
+	size_t size = history_file_size();
+	char *p;
+	int fd = -1;
+	int i;
+
+	*history = NULL;
+	inst = malloc(sizeof(struct history));
+	if (inst == NULL) {
+		return 1;
+	}
+	memset(inst, 0, sizeof(struct history));
+	inst->addr = MAP_FAILED;
+	inst->path = strdup(path);
+	inst->name = strdup(name);
+	if (inst->path == NULL || inst->name == NULL) {
+		goto fail;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed in open history file (%s: %s).\n", path, strerror(errno));
+		goto fail;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "failed in stat history file (%s).\n", path);
+		goto fail;
+	}
+	/* 大きさが違えば作り直す (ftruncateで縮めてから伸ばすとslotは0になる) */
+	if ((size_t)st.st_size != size) {
+		if (st.st_size > 0) {
+			fprintf(stderr, "history file (%s) has another layout, clear it.\n", path);
+		}
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0) {
+			fprintf(stderr, "failed in truncate history file (%s).\n", path);
+			goto fail;
+		}
+	}
+	inst->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (inst->addr == MAP_FAILED) {
+		fprintf(stderr, "failed in map history file (%s).\n", path);
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+	inst->size = size;
+	header = inst->addr;
+	if (!history_header_valid(header)) {
+		if (header->magic != 0) {
+			fprintf(stderr, "history file (%s) has another layout, clear it.\n", path);
+		}
+		memset(inst->addr, 0, size);
+		header->version = HISTORY_VERSION;
+		header->slot_size = sizeof(struct history_slot);
+		for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+			header->slots[i] = history_slots[i];
+		}
+		header->magic = HISTORY_MAGIC;
+	}
+	p = (char *)inst->addr + HISTORY_HEADER_SIZE;
+	for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+		inst->rings[i] = (struct history_slot *)p;
+		p += sizeof(struct history_slot) * history_slots[i];
+	}
+	*history = inst;
+
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (inst->addr != MAP_FAILED) {
+		munmap(inst->addr, size);
+	}
+	free(inst->path);
+	free(inst->name);
+	free(inst);
+
+	return 1;
+}
+
+void
+history_destroy(struct history *history) {
+	if (history == NULL) {
+		return;
+	}
+	munmap(history->addr, history->size);
+	free(history->path);
+	free(history->name);
+	free(history);
+}
+
+int
+history_resolution(unsigned long seconds) {
+	int i;
+
+	for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+		if (history_seconds[i] == seconds) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void
+history_add(struct history *history, time_t sample_time, int presence) {
+	struct history_slot *slot;
+	uint32_t index;
+	int i;
+
+	if (sample_time < 0) {
+		return;
+	}
+	for (i = 0; i < HISTORY_RESOLUTION_MAX; i++) {
+		index = (uint32_t)((uint64_t)sample_time / history_seconds[i]);
+		slot = &history->rings[i][index % history_slots[i]];
+		/* 前の周回の区間が残っていたら空にしてから使う */
+		if (slot->index != index) {
+			slot->index = index;
+			slot->samples = 0;
+			slot->present = 0;
+		}
+		slot->samples++;
+		if (presence) {
+			slot->present++;
+		}
+	}
+}
+
+int
+history_format(
+    struct history *history,
+    int resolution,
+    time_t from,
+    time_t to,
+    char *buffer,
+    size_t size)
+{
+	const struct history_slot *ring;
+	const struct history_slot *slot;
+	uint32_t seconds;
+	uint64_t first, last, index;
+	unsigned long count;
+	size_t len;
+	int n;
+
+	if (resolution < 0 || resolution >= HISTORY_RESOLUTION_MAX ||
+	    from < 0 || to <= from) {
+		return -1;
+	}
+	ring = history->rings[resolution];
+	seconds = history_seconds[resolution];
+	first = (uint64_t)from / seconds;
+	last = ((uint64_t)to - 1) / seconds;
+	count = (unsigned long)(last - first + 1);
+	if (count > HISTORY_QUERY_LIMIT) {
+		count = HISTORY_QUERY_LIMIT;
+	}
+	n = snprintf(buffer, size, "%lu %lu %lu",
+	    (unsigned long)(first * seconds), (unsigned long)seconds, count);
+	if (n < 0 || (size_t)n >= size) {
+		return -1;
+	}
+	len = (size_t)n;
+	for (index = first; index < first + count; index++) {
+		slot = &ring[index % history_slots[resolution]];
+		if (slot->index != (uint32_t)index || slot->samples == 0) {
+			n = snprintf(&buffer[len], size - len, " -");
+		} else {
+			n = snprintf(&buffer[len], size - len, " %lu",
+			    (unsigned long)slot->present * 1000 / slot->samples);
+		}
+		if (n < 0 || (size_t)n >= size - len) {
+			return -1;
+		}
+		len += (size_t)n;
+	}
+
+	return (int)len;
+}
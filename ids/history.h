@@ -0,0 +1,112 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+/*
+ * 在室率の履歴
+ *
+ * 秒、分、時の解像度ごとに固定長のリングをファイルに置いてmmapする。
+ * リングのslotは (時刻 / 解像度) で決まり、サンプルが来るたびに3つの解像度の
+ * slotのサンプル数と人がいた数を足すだけで集計する (後から集計し直さない)。
+ * slotには何番目の区間かを書いておき、違う区間のものが残っていたら空として扱う。
+ * 範囲の問い合わせも時刻から計算したslotを順に読むだけ。
+ *
+ * ファイルはプロセスを再起動しても入れ替えても同じものを使い続ける。
+ * 使う側は stdint.h, sys/types.h をincludeしてからこのファイルをincludeする。
+ */
+
+#define HISTORY_MAGIC          0x49445348   /* "IDSH" */
+#define HISTORY_VERSION        1
+#define HISTORY_HEADER_SIZE    4096         /* slotの前に置くヘッダの大きさ */
+#define HISTORY_QUERY_LIMIT    360          /* 1回の問い合わせで返す区間の数 */
+
+/* 解像度 */
+enum history_resolution {
+	HISTORY_SECOND = 0,
+	HISTORY_MINUTE,
+	HISTORY_HOUR,
+	HISTORY_RESOLUTION_MAX
+};
+
+/* 解像度ごとの区間の秒数とリングのslot数 */
+#define HISTORY_SECOND_SLOTS   (60 * 60 * 24)       /* 1日 */
+#define HISTORY_MINUTE_SLOTS   (60 * 24 * 31)       /* 31日 */
+#define HISTORY_HOUR_SLOTS     (24 * 366 * 2)       /* 2年 */
+
+/* 1区間の集計 */
+struct history_slot {
+	uint32_t index;                /* 何番目の区間か (時刻 / 区間の秒数) */
+	uint32_t samples;              /* サンプル数 */
+	uint32_t present;              /* 人がいたサンプル数 */
+};
+
+/* ファイルの先頭 */
+struct history_header {
+	uint32_t magic;                /* 初期化が終わったらHISTORY_MAGIC */
+	uint32_t version;              /* HISTORY_VERSION */
+	uint32_t slot_size;            /* sizeof(struct history_slot) */
+	uint32_t slots[HISTORY_RESOLUTION_MAX]; /* 解像度ごとのslot数 */
+};
+
+struct history {
+	char *path;                    /* ファイルのパス */
+	char *name;                    /* センサーの名前 (問い合わせで使う) */
+	void *addr;                    /* mmapしたファイル */
+	size_t size;
+	struct history_slot *rings[HISTORY_RESOLUTION_MAX]; /* 解像度ごとのリング */
+};
+
+/*
+ * 履歴のファイルを開いてmmapする
+ * 無いか形式が違えば作り直す
+ */
+int history_create(
+    struct history **history,
+    const char *path,
+    const char *name);
+/* インスタンス削除 */
+void history_destroy(
+    struct history *history);
+/* 区間の秒数から解像度を返す、無ければ-1 */
+int history_resolution(
+    unsigned long seconds);
+/* 時刻 (エポック秒) のサンプルを足す */
+void history_add(
+    struct history *history,
+    time_t sample_time,
+    int presence);
+/*
+ * [from, to) の在室率を "<最初の区間の時刻> <区間の秒数> <区間の数> <在室率> ..." の
+ * 1行にしてbufferに書き、その長さを返す
+ * 在室率は1000分率、サンプルが無い区間は "-"
+ * 区間がHISTORY_QUERY_LIMITを超える場合は前から返す
+ * 書けなければ-1を返す
+ */
+int history_format(
+    struct history *history,
+    int resolution,
+    time_t from,
+    time_t to,
+    char *buffer,
+    size_t size);
+
+#endif
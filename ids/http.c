@@ -0,0 +1,1262 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <event.h>
+
+#include "macro.h"
+#include "string_util.h"
+#include "token_bucket.h"
+#include "tcpsock.h"
+#include "alert.h"
+#include "sensor.h"
+#include "rpc.h"
+#include "http.h"
+#include "logger.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "priority.h"
+
+#define HTTP_API_PATH           "/api"
+#define HTTP_EVENTS_PATH        "/events"
+#define HTTP_METRICS_PATH       "/metrics"
+#define HTTP_METRICS_TYPE       "text/plain; version=0.0.4"
+#define HTTP_API_PARAM          "Command="
+#define HTTP_INDEX_FILE         "index.html"
+
+/* http_request_processの戻り値 */
+#define HTTP_PROCESS_NEED_MORE  0   /* リクエストがまだ揃っていない */
+#define HTTP_PROCESS_KEEP       1   /* 処理した、接続は維持する */
+#define HTTP_PROCESS_CLOSE      2   /* 処理した、接続を閉じる */
+#define HTTP_PROCESS_STREAM     3   /* /eventsのストリームになった */
+
+/*
+ * 接続ごとのコンテキスト
+ * ソケットはノンブロッキングで、送り切れなかったレスポンスはoutに溜めて
+ * 書き込み可能になってから送る。送り切るまで次のリクエストは処理しない
+ */
+struct http_connection {
+	size_t len;
+	char buffer[HTTP_REQUEST_SIZE + 1];
+	char *out;                  /* 送信バッファ (HTTP_OUTPUT_SIZE)、使うまでNULL */
+	size_t out_len;
+	int file_fd;                /* 送っている途中の静的ファイル、無ければ-1 */
+	off_t file_left;            /* file_fdの残りのバイト数 */
+	int close_after;            /* 送り切ったら閉じる */
+	int stream;                 /* /eventsのストリーム */
+	struct event write_event;   /* /eventsで送信できるようになるのを待つイベント */
+	int write_pending;          /* 書き込み可能になるのを待っているかどうか */
+	struct token_bucket bucket; /* /apiのコマンド数の制限 (rpc_command_rate) */
+};
+
+/* パース済みのリクエスト */
+struct http_request {
+	char *method;
+	char *path;
+	char *query;           /* '?'以降、無ければNULL */
+	char *body;
+	size_t body_len;
+	int keep_alive;
+	char *host;            /* Hostヘッダ、無ければNULL */
+	char *origin;          /* Originヘッダ、無ければNULL */
+};
+
+/* 拡張子とContent-Typeの対応 */
+struct http_content_type {
+	const char *suffix;
+	const char *type;
+};
+static const struct http_content_type http_content_type[] = {
+	{ ".html", "text/html; charset=utf-8" },
+	{ ".css", "text/css" },
+	{ ".js", "application/javascript" },
+	{ ".png", "image/png" },
+	{ ".jpg", "image/jpeg" },
+	{ ".gif", "image/gif" },
+	{ NULL, "application/octet-stream" },
+};
+
+/* 送信バッファを確保する */
+static int
+http_output_alloc(struct http_connection *conn) {
+	if (conn->out == NULL) {
+		conn->out = malloc(HTTP_OUTPUT_SIZE);
+		if (conn->out == NULL) {
+			return 1;
+		}
+		conn->out_len = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * ブロックせずに書けるだけ書く
+ * 書けなかった分は送信バッファに入れる (送るのはhttp_connection_flush)
+ */
+static int
+http_writev(tcp_accept_info_t *acceptinfo, struct iovec *iov, int iovcnt) {
+	struct http_connection *conn = acceptinfo->ctx;
+	ssize_t n = 0;
+	size_t len;
+	int i;
+
+	if (conn->out_len == 0 && conn->file_fd < 0) {
+		do {
+			n = writev(acceptinfo->accept_sd, iov, iovcnt);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return 1;
+			}
+			n = 0;
+		}
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if ((size_t)n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			continue;
+		}
+		len = iov[i].iov_len - n;
+		if (http_output_alloc(conn) || conn->out_len + len > HTTP_OUTPUT_SIZE) {
+			return 1;
+		}
+		memcpy(&conn->out[conn->out_len], (char *)iov[i].iov_base + n, len);
+		conn->out_len += len;
+		n = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * ヘッダとボディを返す
+ * 小さいレスポンスが分割されないように1回のwritevで出す
+ */
+static int
+http_response(
+    tcp_accept_info_t *acceptinfo,
+    const char *status,
+    const char *content_type,
+    size_t content_length,
+    const char *body,
+    size_t body_len,
+    int keep_alive)
+{
+	char header[HTTP_HEADER_SIZE];
+	struct iovec iov[2];
+	int len;
+
+	len = snprintf(header, sizeof(header),
+	    "HTTP/1.1 %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %lu\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "Connection: %s\r\n"
+	    "\r\n",
+	    status, content_type, (unsigned long)content_length,
+	    keep_alive ? "keep-alive" : "close");
+	if (len < 0 || (size_t)len >= sizeof(header)) {
+		return 1;
+	}
+	iov[0].iov_base = header;
+	iov[0].iov_len = len;
+	iov[1].iov_base = (void *)(uintptr_t)body;
+	iov[1].iov_len = body_len;
+
+	return http_writev(acceptinfo, iov, (body_len > 0) ? 2 : 1);
+}
+
+/* エラーを返す */
+static int
+http_response_error(tcp_accept_info_t *acceptinfo, const char *status, int keep_alive) {
+	return http_response(acceptinfo, status, "text/plain",
+	    strlen(status), status, strlen(status), keep_alive);
+}
+
+/*
+ * /metrics (Prometheusのtext exposition format)
+ * 現在の状態のgaugeと統計をmetrics_bufferに作って返す
+ * スクレイプごとに確保しないようにバッファは使い回す
+ */
+static int
+http_metrics(struct http *http, tcp_accept_info_t *acceptinfo, struct http_request *request) {
+	char *buffer = http->metrics_buffer;
+	int len, n;
+
+	len = snprintf(buffer, HTTP_METRICS_SIZE,
+	    "# HELP ids_alert_status Alert status (0: none, 1: first alert, 2: second alert).\n"
+	    "# TYPE ids_alert_status gauge\n"
+	    "ids_alert_status %d\n"
+	    "# HELP ids_monitor_running Whether alerts are enabled.\n"
+	    "# TYPE ids_monitor_running gauge\n"
+	    "ids_monitor_running %d\n"
+	    "# HELP ids_presence Whether the last sample detected presence.\n"
+	    "# TYPE ids_presence gauge\n"
+	    "ids_presence %d\n"
+	    "# HELP ids_detect_count Consecutive samples with presence.\n"
+	    "# TYPE ids_detect_count gauge\n"
+	    "ids_detect_count %lu\n"
+	    "# HELP ids_event_streams Connected /events clients.\n"
+	    "# TYPE ids_event_streams gauge\n"
+	    "ids_event_streams %d\n",
+	    alert_get_status(http->alert),
+	    sensor_get_monitor_status(http->sensor) ? 1 : 0,
+	    sensor_get_presence(http->sensor) ? 1 : 0,
+	    sensor_get_detect_count(http->sensor),
+	    http->stream_count);
+	if (len < 0 || len >= HTTP_METRICS_SIZE) {
+		return http_response_error(acceptinfo, "500 Internal Server Error", request->keep_alive);
+	}
+	n = stats_format_prometheus(&buffer[len], HTTP_METRICS_SIZE - len);
+	if (n < 0) {
+		logger_write(LOGGER_ERROR, "http_metrics", "error=\"metrics buffer is too small\"");
+		return http_response_error(acceptinfo, "500 Internal Server Error", request->keep_alive);
+	}
+	len += n;
+
+	return http_response(acceptinfo, "200 OK", HTTP_METRICS_TYPE,
+	    len, buffer, len, request->keep_alive);
+}
+
+/* %XXと'+'をデコードする (その場で書き換える) */
+static void
+http_url_decode(char *str) {
+	char *src = str, *dst = str;
+	char hex[3] = "";
+
+	while (*src != '\0') {
+		if (*src == '+') {
+			*dst++ = ' ';
+			src++;
+		} else if (src[0] == '%' && src[1] != '\0' && src[2] != '\0') {
+			hex[0] = src[1];
+			hex[1] = src[2];
+			*dst++ = (char)strtol(hex, NULL, 16);
+			src += 3;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	*dst = '\0';
+}
+
+/* "a=b&Command=X" からCommandの値を探す (その場で書き換える) */
+static char *
+http_form_command(char *form) {
+	char *param;
+
+	while ((param = strsep(&form, "&")) != NULL) {
+		if (strncmp(param, HTTP_API_PARAM, sizeof(HTTP_API_PARAM) - 1) == 0) {
+			param += sizeof(HTTP_API_PARAM) - 1;
+			http_url_decode(param);
+			return param;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * rpcのコマンドを実行して、末尾の改行を落としたレスポンスを得る
+ * 複数行のレスポンス (GET_STATSなど) は途中の改行をそのまま残す
+ */
+static int
+http_command_result(struct http *http, const char *command, int read_only, int loopback, char *out, size_t size) {
+	char line[RPC_RESULT_SIZE];
+
+	if (strlen(command) >= sizeof(line)) {
+		return 1;
+	}
+	strcpy(line, command);
+	if (rpc_execute(http->rpc, line, read_only, loopback, out, size) < 0) {
+		return 1;
+	}
+	string_rstrip(out, "\r\n");
+
+	return 0;
+}
+
+/*
+ * 別のサイトのページから送られたリクエストでないか
+ * Originが無い (ブラウザ以外) か、Originのホスト部分がHostと同じならよい
+ */
+static int
+http_same_origin(struct http_request *request) {
+	const char *host;
+
+	if (request->origin == NULL) {
+		return 1;
+	}
+	if (request->host == NULL) {
+		return 0;
+	}
+	if (strncmp(request->origin, "http://", 7) == 0) {
+		host = &request->origin[7];
+	} else if (strncmp(request->origin, "https://", 8) == 0) {
+		host = &request->origin[8];
+	} else {
+		return 0;
+	}
+
+	return strcasecmp(host, request->host) == 0;
+}
+
+/*
+ * コマンドを実行して結果をJSONで返す
+ *   GET  /api/<COMMAND>
+ *   GET  /api?Command=<COMMAND>
+ *   POST /api (Command=<COMMAND>)
+ * 状態を変更するコマンドは、同じオリジンからのPOSTでだけ実行する
+ * (リンクや別のサイトのページから実行されないように)
+ * レスポンスはids.cgiと同じ {"Result": "<rpcのレスポンス>"}
+ */
+static int
+http_api(struct http *http, tcp_accept_info_t *acceptinfo, struct http_request *request) {
+	struct http_connection *conn = acceptinfo->ctx;
+	char *command = NULL;
+	char result[RPC_RESULT_SIZE];
+	char json[RPC_RESULT_SIZE * 6 + 32];
+	char form[HTTP_REQUEST_SIZE + 1];
+	char *src, *dst;
+	int read_only = 1;
+	int len;
+
+	if (request->path[sizeof(HTTP_API_PATH) - 1] == '/') {
+		command = &request->path[sizeof(HTTP_API_PATH)];
+		http_url_decode(command);
+	} else if (request->path[sizeof(HTTP_API_PATH) - 1] != '\0') {
+		return http_response_error(acceptinfo, "404 Not Found", request->keep_alive);
+	} else if (strcmp(request->method, "POST") == 0) {
+		/* 後ろに次のリクエストが続いていることがあるのでコピーする */
+		memcpy(form, request->body, request->body_len);
+		form[request->body_len] = '\0';
+		command = http_form_command(form);
+		read_only = !http_same_origin(request);
+	} else if (request->query) {
+		command = http_form_command(request->query);
+	}
+	if (command == NULL || *command == '\0') {
+		return http_response_error(acceptinfo, "400 Bad Request", request->keep_alive);
+	}
+	/* keep-aliveで続けて送られてもバイナリのRPCと同じだけしか実行しない */
+	if (http->rpc->command_rate > 0 &&
+	    token_bucket_take(&conn->bucket,
+	    http->rpc->command_rate, http->rpc->command_burst, 1, stats_now())) {
+		stats_add(STATS_RPC_THROTTLES, 1);
+		return http_response_error(acceptinfo, "429 Too Many Requests", request->keep_alive);
+	}
+	if (http_command_result(http, command, read_only,
+	    tcp_server_accept_loopback(acceptinfo), result, sizeof(result))) {
+		return http_response_error(acceptinfo, "500 Internal Server Error", request->keep_alive);
+	}
+	/* JSONの文字列にする (制御文字は\uXXXXにする) */
+	len = snprintf(json, sizeof(json), "{\"Result\": \"");
+	dst = &json[len];
+	for (src = result; *src != '\0'; src++) {
+		if (*src == '"' || *src == '\\') {
+			*dst++ = '\\';
+			*dst++ = *src;
+		} else if ((unsigned char)*src < 0x20) {
+			dst += sprintf(dst, "\\u%04x", (unsigned char)*src);
+		} else {
+			*dst++ = *src;
+		}
+	}
+	memcpy(dst, "\"}", 3);
+	dst += 2;
+
+	return http_response(acceptinfo, "200 OK", "application/json",
+	    dst - json, json, dst - json, request->keep_alive);
+}
+
+/*
+ * document_root以下のファイルを返す
+ * 先頭のチャンクだけここで送り、残りはhttp_connection_flushで送れるだけ送る
+ */
+static int
+http_static(struct http *http, tcp_accept_info_t *acceptinfo, struct http_request *request) {
+	struct http_connection *conn = acceptinfo->ctx;
+	char path[PATH_MAX];
+	char buffer[8192];
+	const struct http_content_type *ct;
+	struct stat st;
+	size_t path_len;
+	ssize_t n;
+	int fd;
+	int len;
+
+	http_url_decode(request->path);
+	if (request->path[0] != '/' || strstr(request->path, "..") != NULL) {
+		return http_response_error(acceptinfo, "400 Bad Request", request->keep_alive);
+	}
+	len = snprintf(path, sizeof(path), "%s%s%s",
+	    http->document_root, request->path,
+	    request->path[strlen(request->path) - 1] == '/' ? HTTP_INDEX_FILE : "");
+	if (len < 0 || (size_t)len >= sizeof(path)) {
+		return http_response_error(acceptinfo, "404 Not Found", request->keep_alive);
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return http_response_error(acceptinfo, "404 Not Found", request->keep_alive);
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size > HTTP_FILE_SIZE_LIMIT) {
+		close(fd);
+		return http_response_error(acceptinfo, "404 Not Found", request->keep_alive);
+	}
+	path_len = strlen(path);
+	for (ct = http_content_type; ct->suffix != NULL; ct++) {
+		if (path_len >= strlen(ct->suffix) &&
+		    strcasecmp(&path[path_len - strlen(ct->suffix)], ct->suffix) == 0) {
+			break;
+		}
+	}
+	/* 先頭のチャンクはヘッダと一緒に送る */
+	n = read(fd, buffer, sizeof(buffer));
+	if (n < 0 ||
+	    http_response(acceptinfo, "200 OK", ct->type, st.st_size,
+	    buffer, n, request->keep_alive)) {
+		close(fd);
+		return 1;
+	}
+	if (n == st.st_size) {
+		close(fd);
+		return 0;
+	}
+	if (http_output_alloc(conn)) {
+		close(fd);
+		return 1;
+	}
+	conn->file_fd = fd;
+	conn->file_left = st.st_size - n;
+
+	return 0;
+}
+
+/* /eventsの接続を一覧から外す */
+static void
+http_stream_remove(struct http *http, tcp_accept_info_t *acceptinfo) {
+	int i;
+
+	for (i = 0; i < http->stream_count; i++) {
+		if (http->streams[i] == acceptinfo) {
+			http->stream_count--;
+			http->streams[i] = http->streams[http->stream_count];
+			http->streams[http->stream_count] = NULL;
+			return;
+		}
+	}
+}
+
+/* 接続のコンテキストを開放する */
+static void
+http_connection_free(struct http *http, tcp_accept_info_t *acceptinfo) {
+	struct http_connection *conn = acceptinfo->ctx;
+
+	if (conn == NULL) {
+		return;
+	}
+	if (conn->stream) {
+		http_stream_remove(http, acceptinfo);
+		if (conn->write_pending) {
+			event_del(&conn->write_event);
+		}
+	}
+	if (conn->file_fd >= 0) {
+		close(conn->file_fd);
+	}
+	free(conn->out);
+	free(conn);
+	acceptinfo->ctx = NULL;
+}
+
+/* 接続を閉じる */
+static void
+http_connection_close(struct http *http, tcp_accept_info_t *acceptinfo) {
+	http_connection_free(http, acceptinfo);
+	tcp_server_accept_clear(acceptinfo);
+}
+
+static void http_stream_writable(int sd, short event, void *info);
+
+/*
+ * 送信バッファと送っている途中のファイルを送れるだけ送る
+ * 送りきれなければ書き込み可能になるのを待つ
+ * (/eventsはwrite_eventで、それ以外は読み込みの代わりにEV_WRITEを待つ)
+ * ソケットはノンブロッキングなのでイベントループは止まらない
+ */
+static int
+http_connection_flush(struct http *http, tcp_accept_info_t *acceptinfo) {
+	struct http_connection *conn = acceptinfo->ctx;
+	ssize_t n;
+
+	for (;;) {
+		if (conn->out_len == 0) {
+			if (conn->file_fd < 0) {
+				return 0;
+			}
+			n = read(conn->file_fd, conn->out,
+			    (conn->file_left < HTTP_OUTPUT_SIZE) ? (size_t)conn->file_left : HTTP_OUTPUT_SIZE);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				/* Content-Lengthより短くなった */
+				return 1;
+			}
+			conn->out_len = n;
+			conn->file_left -= n;
+			if (conn->file_left == 0) {
+				close(conn->file_fd);
+				conn->file_fd = -1;
+			}
+		}
+		n = send(acceptinfo->accept_sd, conn->out, conn->out_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return 1;
+			}
+			break;
+		}
+		memmove(conn->out, &conn->out[n], conn->out_len - n);
+		conn->out_len -= n;
+	}
+	if (conn->write_pending) {
+		return 0;
+	}
+	if (conn->stream) {
+		event_set(&conn->write_event, acceptinfo->accept_sd, EV_WRITE,
+		    http_stream_writable, acceptinfo);
+		event_base_set(http->event_base, &conn->write_event);
+		event_priority_set(&conn->write_event, EVENT_PRIORITY_LOW);
+		if (event_add(&conn->write_event, NULL) < 0) {
+			return 1;
+		}
+	} else if (tcp_server_accept_wait_write(acceptinfo) < 0) {
+		return 1;
+	}
+	conn->write_pending = 1;
+
+	return 0;
+}
+
+/* 書き込み可能になった */
+static void
+http_stream_writable(int sd, short event, void *info) {
+	tcp_accept_info_t *acceptinfo = info;
+	struct http *http = acceptinfo->args;
+	struct http_connection *conn = acceptinfo->ctx;
+
+	watchdog_enter("http_stream_writable");
+	conn->write_pending = 0;
+	if (http_connection_flush(http, acceptinfo)) {
+		http_connection_close(http, acceptinfo);
+	}
+	watchdog_leave();
+}
+
+/*
+ * 送信バッファに積んで送る
+ * バッファに入りきらない場合は1を返す (呼び出し側で切断する)
+ */
+static int
+http_stream_push(struct http *http, tcp_accept_info_t *acceptinfo, const char *data, size_t len) {
+	struct http_connection *conn = acceptinfo->ctx;
+
+	if (conn->out_len + len > HTTP_STREAM_BUFFER) {
+		logger_write(LOGGER_WARN, "http_events", "error=\"event stream is too slow, disconnect\"");
+		return 1;
+	}
+	memcpy(&conn->out[conn->out_len], data, len);
+	conn->out_len += len;
+	if (conn->write_pending) {
+		/* 書き込み可能になったら送られる */
+		return 0;
+	}
+
+	return http_connection_flush(http, acceptinfo);
+}
+
+/*
+ * イベントを1つ作ってevent_bufferに入れる
+ * 複数行のdataは1行ずつdata:の行にする
+ */
+static int
+http_event_format(struct http *http, const char *name, const char *data) {
+	size_t size = sizeof(http->event_buffer);
+	size_t line_len;
+	int len, n;
+
+	if (name) {
+		len = snprintf(http->event_buffer, size, "event: %s\n", name);
+		do {
+			if (len < 0 || (size_t)len >= size) {
+				return -1;
+			}
+			line_len = strcspn(data, "\r\n");
+			n = snprintf(&http->event_buffer[len], size - len,
+			    "data: %.*s\n", (int)line_len, data);
+			len = (n < 0) ? -1 : len + n;
+			data += line_len;
+			if (*data == '\r') {
+				data++;
+			}
+			if (*data == '\n') {
+				data++;
+			}
+		} while (*data != '\0');
+		/* 空行でイベントを終える */
+		if (len < 0 || (size_t)len + 1 >= size) {
+			return -1;
+		}
+		http->event_buffer[len++] = '\n';
+		http->event_buffer[len] = '\0';
+	} else {
+		/* コメント行 (生存確認用) */
+		len = snprintf(http->event_buffer, sizeof(http->event_buffer),
+		    ": %s\n\n", data);
+	}
+	if (len < 0 || (size_t)len >= sizeof(http->event_buffer)) {
+		return -1;
+	}
+
+	return len;
+}
+
+/*
+ * 全ての/events接続にイベントを送る
+ * イベントは一度だけ作って全接続で共有する
+ */
+static void
+http_broadcast(struct http *http, const char *name, const char *data) {
+	tcp_accept_info_t *acceptinfo;
+	int len;
+	int i;
+
+	if (http->stream_count == 0) {
+		return;
+	}
+	len = http_event_format(http, name, data);
+	if (len < 0) {
+		return;
+	}
+	i = 0;
+	while (i < http->stream_count) {
+		acceptinfo = http->streams[i];
+		if (http_stream_push(http, acceptinfo, http->event_buffer, len)) {
+			/* 一覧から外れるので i は進めない */
+			http_connection_close(http, acceptinfo);
+			continue;
+		}
+		i++;
+	}
+}
+
+/* コマンドの結果をイベントとして送る */
+static void
+http_broadcast_command(struct http *http, const char *name, const char *command) {
+	char result[RPC_RESULT_SIZE];
+
+	if (http->stream_count == 0) {
+		return;
+	}
+	if (http_command_result(http, command, 1, 0, result, sizeof(result))) {
+		return;
+	}
+	http_broadcast(http, name, result);
+}
+
+/* alertステータスの変化通知 */
+static void
+http_alert_status_changed(int status, void *args) {
+	http_broadcast_command(args, "alert", "GET_ALERT_STATUS");
+}
+
+/* sensorの状態変化通知 */
+static void
+http_sensor_event(int event, void *args) {
+	struct http *http = args;
+
+	switch (event) {
+	case SENSOR_EVENT_MONITOR:
+		http_broadcast_command(http, "monitor", "GET_MONITOR_STATUS");
+		break;
+	case SENSOR_EVENT_PRESENCE:
+		http_broadcast(http, "occupancy",
+		    sensor_get_presence(http->sensor) ? "1" : "0");
+		break;
+	default:
+		break;
+	}
+}
+
+/* 生存確認を送る、送れない接続はここで切断される */
+static void
+http_heartbeat(int fd, short event, void *args) {
+	watchdog_enter("http_heartbeat");
+	http_broadcast(args, NULL, "ping");
+	watchdog_leave();
+}
+
+/*
+ * GET /events
+ * Server-Sent Eventsで状態の変化を送り続ける
+ *   event: alert      data: <GET_ALERT_STATUSのレスポンス>
+ *   event: monitor    data: <GET_MONITOR_STATUSのレスポンス>
+ *   event: occupancy  data: 1 (人がいる) / 0 (人がいない)
+ */
+static int
+http_events(struct http *http, tcp_accept_info_t *acceptinfo, struct http_request *request) {
+	static const char header[] =
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: text/event-stream\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "Connection: keep-alive\r\n"
+	    "\r\n"
+	    "retry: 3000\n\n";
+	struct http_connection *conn = acceptinfo->ctx;
+	char result[RPC_RESULT_SIZE];
+	int len;
+
+	if (http->stream_count >= HTTP_STREAM_LIMIT) {
+		http_response_error(acceptinfo, "503 Service Unavailable", 0);
+		return HTTP_PROCESS_CLOSE;
+	}
+	if (http_output_alloc(conn)) {
+		http_response_error(acceptinfo, "500 Internal Server Error", 0);
+		return HTTP_PROCESS_CLOSE;
+	}
+	conn->stream = 1;
+	http->streams[http->stream_count++] = acceptinfo;
+	/* 切断の検知だけなのでタイムアウトは外す */
+	tcp_server_accept_timeout_stop(acceptinfo);
+	if (http_stream_push(http, acceptinfo, header, sizeof(header) - 1)) {
+		return HTTP_PROCESS_CLOSE;
+	}
+	/* 現在の状態を送る */
+	if (http_command_result(http, "GET_ALERT_STATUS", 1, 0, result, sizeof(result)) == 0) {
+		len = http_event_format(http, "alert", result);
+		if (len < 0 || http_stream_push(http, acceptinfo, http->event_buffer, len)) {
+			return HTTP_PROCESS_CLOSE;
+		}
+	}
+	if (http_command_result(http, "GET_MONITOR_STATUS", 1, 0, result, sizeof(result)) == 0) {
+		len = http_event_format(http, "monitor", result);
+		if (len < 0 || http_stream_push(http, acceptinfo, http->event_buffer, len)) {
+			return HTTP_PROCESS_CLOSE;
+		}
+	}
+	len = http_event_format(http, "occupancy",
+	    sensor_get_presence(http->sensor) ? "1" : "0");
+	if (len < 0 || http_stream_push(http, acceptinfo, http->event_buffer, len)) {
+		return HTTP_PROCESS_CLOSE;
+	}
+
+	return HTTP_PROCESS_STREAM;
+}
+
+/*
+ * ヘッダ部分(headerからendまで)のContent-Lengthを壊さずに読む
+ * 無ければ0、不正なら-1
+ */
+static long
+http_content_length(const char *header, const char *end) {
+	static const char name[] = "\r\nContent-Length:";
+	const char *p;
+	char *endptr;
+	long len;
+
+	for (p = header; p + sizeof(name) - 1 < end; p++) {
+		if (*p != '\r' || strncasecmp(p, name, sizeof(name) - 1) != 0) {
+			continue;
+		}
+		len = strtol(p + sizeof(name) - 1, &endptr, 10);
+		if (endptr == p + sizeof(name) - 1 || len < 0 || len > HTTP_REQUEST_SIZE) {
+			return -1;
+		}
+		return len;
+	}
+
+	return 0;
+}
+
+/*
+ * 揃ったリクエストをパースする (バッファは書き換える)
+ * headerはリクエストの先頭、endはヘッダ終端の"\r\n\r\n"
+ */
+static int
+http_request_parse(struct http_request *request, char *header, char *end) {
+	char *line, *next, *version, *value;
+
+	*end = '\0';
+	memset(request, 0, sizeof(*request));
+	/* リクエストライン */
+	next = header;
+	line = strsep(&next, "\r");
+	request->method = strsep(&line, " ");
+	request->path = strsep(&line, " ");
+	version = line;
+	if (request->path == NULL || version == NULL || request->path[0] == '\0') {
+		return 1;
+	}
+	request->keep_alive = (strcmp(version, "HTTP/1.1") == 0);
+	request->query = strchr(request->path, '?');
+	if (request->query) {
+		*request->query++ = '\0';
+	}
+	/* ヘッダ */
+	while (next != NULL) {
+		if (*next == '\n') {
+			next++;
+		}
+		line = strsep(&next, "\r");
+		value = strchr(line, ':');
+		if (value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t') {
+			value++;
+		}
+		if (strcasecmp(line, "Host") == 0) {
+			request->host = value;
+		} else if (strcasecmp(line, "Origin") == 0) {
+			request->origin = value;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			if (strcasecmp(value, "close") == 0) {
+				request->keep_alive = 0;
+			} else if (strcasecmp(value, "keep-alive") == 0) {
+				request->keep_alive = 1;
+			}
+		}
+	}
+	request->body = end + 4;
+
+	return 0;
+}
+
+/* バッファの先頭にあるリクエストを1つ処理する */
+static int
+http_request_process(struct http *http, tcp_accept_info_t *acceptinfo) {
+	struct http_connection *conn = acceptinfo->ctx;
+	struct http_request request;
+	char *end;
+	long content_length;
+	size_t total;
+	int error;
+
+	conn->buffer[conn->len] = '\0';
+	end = strstr(conn->buffer, "\r\n\r\n");
+	if (end == NULL) {
+		if (conn->len >= HTTP_REQUEST_SIZE) {
+			http_response_error(acceptinfo, "413 Request Entity Too Large", 0);
+			return HTTP_PROCESS_CLOSE;
+		}
+		return HTTP_PROCESS_NEED_MORE;
+	}
+	content_length = http_content_length(conn->buffer, end);
+	if (content_length < 0) {
+		http_response_error(acceptinfo, "400 Bad Request", 0);
+		return HTTP_PROCESS_CLOSE;
+	}
+	total = (end + 4 - conn->buffer) + content_length;
+	if (total > HTTP_REQUEST_SIZE) {
+		http_response_error(acceptinfo, "413 Request Entity Too Large", 0);
+		return HTTP_PROCESS_CLOSE;
+	}
+	if (conn->len < total) {
+		/* ボディ待ち */
+		return HTTP_PROCESS_NEED_MORE;
+	}
+	if (http_request_parse(&request, conn->buffer, end)) {
+		http_response_error(acceptinfo, "400 Bad Request", 0);
+		return HTTP_PROCESS_CLOSE;
+	}
+	request.body_len = content_length;
+	if (strncmp(request.path, HTTP_API_PATH, sizeof(HTTP_API_PATH) - 1) == 0) {
+		if (strcmp(request.method, "GET") != 0 &&
+		    strcmp(request.method, "POST") != 0) {
+			error = http_response_error(acceptinfo, "405 Method Not Allowed", request.keep_alive);
+		} else {
+			error = http_api(http, acceptinfo, &request);
+		}
+	} else if (strcmp(request.path, HTTP_EVENTS_PATH) == 0 &&
+	    strcmp(request.method, "GET") == 0) {
+		conn->len = 0;
+		return http_events(http, acceptinfo, &request);
+	} else if (strcmp(request.path, HTTP_METRICS_PATH) == 0 &&
+	    strcmp(request.method, "GET") == 0) {
+		error = http_metrics(http, acceptinfo, &request);
+	} else if (http->document_root != NULL &&
+	    strcmp(request.method, "GET") == 0) {
+		error = http_static(http, acceptinfo, &request);
+	} else {
+		error = http_response_error(acceptinfo, "404 Not Found", request.keep_alive);
+	}
+	if (error || !request.keep_alive) {
+		return HTTP_PROCESS_CLOSE;
+	}
+	/* パイプライン化された次のリクエストを前に詰める */
+	memmove(conn->buffer, &conn->buffer[total], conn->len - total);
+	conn->len -= total;
+
+	return HTTP_PROCESS_KEEP;
+}
+
+/* TCP ACCEPT直後の処理 */
+static int
+http_accept_init(int sd, void *info) {
+	tcp_accept_info_t *acceptinfo = info;
+	struct http *http = acceptinfo->args;
+	struct http_connection *conn;
+	int flags;
+
+	conn = malloc(sizeof(struct http_connection));
+	if (conn == NULL) {
+		return 1;
+	}
+	memset(conn, 0, sizeof(struct http_connection));
+	conn->file_fd = -1;
+	token_bucket_init(&conn->bucket, http->rpc->command_burst, stats_now());
+	acceptinfo->ctx = conn;
+	/* 遅いクライアントでも待たないようにノンブロッキングにする */
+	flags = fcntl(sd, F_GETFL, 0);
+	if (flags < 0 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		free(conn);
+		acceptinfo->ctx = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * 受信済みのリクエストを順に処理する
+ * レスポンスを送り切れなければ、送り切ってから (EV_WRITE) 続きを処理する
+ */
+static void
+http_connection_process(struct http *http, tcp_accept_info_t *acceptinfo) {
+	struct http_connection *conn = acceptinfo->ctx;
+	int result;
+
+	do {
+		result = http_request_process(http, acceptinfo);
+		if (result == HTTP_PROCESS_STREAM) {
+			return;
+		}
+		if (conn->out_len > 0 || conn->file_fd >= 0) {
+			if (http_connection_flush(http, acceptinfo)) {
+				http_connection_close(http, acceptinfo);
+				return;
+			}
+			if (conn->write_pending) {
+				conn->close_after = (result == HTTP_PROCESS_CLOSE);
+				return;
+			}
+		}
+		if (result == HTTP_PROCESS_CLOSE) {
+			http_connection_close(http, acceptinfo);
+			return;
+		}
+	} while (result == HTTP_PROCESS_KEEP && conn->len > 0);
+}
+
+/* 送り切れなかったレスポンスの続きを送り、送り切ったら読み込みに戻る */
+static void
+http_connection_writable(struct http *http, tcp_accept_info_t *acceptinfo) {
+	struct http_connection *conn = acceptinfo->ctx;
+
+	conn->write_pending = 0;
+	if (http_connection_flush(http, acceptinfo)) {
+		http_connection_close(http, acceptinfo);
+		return;
+	}
+	if (conn->write_pending) {
+		return;
+	}
+	if (conn->close_after || tcp_server_accept_wait(acceptinfo) < 0) {
+		http_connection_close(http, acceptinfo);
+		return;
+	}
+	if (conn->len > 0) {
+		http_connection_process(http, acceptinfo);
+	}
+}
+
+/*
+ * TCP ACCEPT後の処理
+ * keep-aliveのためEV_PERSISTで呼ばれ続ける
+ */
+static void
+http_accept_handle(int sd, short event, void *info) {
+	tcp_accept_info_t *acceptinfo = info;
+	struct http *http = acceptinfo->args;
+	struct http_connection *conn = acceptinfo->ctx;
+	ssize_t n;
+
+	if (event & EV_TIMEOUT) {
+		http_connection_close(http, acceptinfo);
+		return;
+	}
+	if (event & EV_WRITE) {
+		http_connection_writable(http, acceptinfo);
+		return;
+	}
+	if (!(event & EV_READ)) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	if (conn->stream) {
+		/* /eventsの接続から来たものは読み捨てて切断を待つ */
+		n = read(sd, conn->buffer, HTTP_REQUEST_SIZE);
+		if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+			http_connection_close(http, acceptinfo);
+		}
+		return;
+	}
+	n = read(sd, &conn->buffer[conn->len], HTTP_REQUEST_SIZE - conn->len);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			return;
+		}
+		http_connection_close(http, acceptinfo);
+		return;
+	}
+	conn->len += n;
+	http_connection_process(http, acceptinfo);
+}
+
+static void
+http_accept_main(int sd, short event, void *info) {
+	watchdog_enter("http_accept_main");
+	http_accept_handle(sd, event, info);
+	watchdog_leave();
+}
+
+/* accept終了時の処理 */
+static int
+http_accept_finish(int sd, void *info) {
+	tcp_accept_info_t *acceptinfo = info;
+
+	http_connection_free(acceptinfo->args, acceptinfo);
+
+	return 0;
+}
+
+/* listen前にしておきたい処理 */
+static int
+http_listen_init(int sd, void *args) {
+	return 0;
+}
+
+/* listen終了時のの処理 */
+static int
+http_listen_finish(int sd, void *args) {
+	return 0;
+}
+
+int
+http_create(
+    struct http **http,
+    const char *bind_port,
+    const char *document_root,
+    int http_timeout,
+    struct rpc *rpc,
+    struct alert *alert,
+    struct sensor *sensor,
+    struct event_base *event_base)
+{
+	struct http *inst = NULL;
+	char *bport = NULL;
+	char *droot = NULL;
+
+	*http = NULL;
+	inst = malloc(sizeof(struct http));
+	bport = strdup(bind_port);
+	if (inst == NULL ||
+	    bport == NULL) {
+		goto fail;
+	}
+	if (document_root && document_root[0] != '\0') {
+		droot = strdup(document_root);
+		if (droot == NULL) {
+			goto fail;
+		}
+	}
+	memset(inst, 0, sizeof(struct http));
+	inst->bind_port = bport;
+	inst->document_root = droot;
+	inst->http_timeout = http_timeout;
+	inst->rpc = rpc;
+	inst->alert = alert;
+	inst->sensor = sensor;
+	inst->event_base = event_base;
+	if (alert_add_listener(alert, http_alert_status_changed, inst) ||
+	    sensor_add_listener(sensor, http_sensor_event, inst)) {
+		goto fail;
+	}
+	*http = inst;
+
+	return 0;
+
+fail:
+	if (inst) {
+		alert_remove_listener(alert, http_alert_status_changed, inst);
+		sensor_remove_listener(sensor, http_sensor_event, inst);
+	}
+	free(inst);
+	free(bport);
+	free(droot);
+
+	return 1;
+}
+
+int
+http_start(struct http *http) {
+	tcp_server_t *tcpserver = NULL;
+	struct timeval timeout;
+
+	/* keep-aliveのアイドルタイムアウト */
+	http->timeout.tv_sec = http->http_timeout;
+	http->timeout.tv_usec = 0;
+	/* TCPサーバーの生成 */
+	if (tcp_server_create(
+	    &tcpserver,
+	    NULL,
+	    http->bind_port,
+	    RECV_BUFF,
+	    EV_READ | EV_PERSIST,
+	    &http->timeout,
+	    http_accept_init,
+	    http_accept_main,
+	    http_accept_finish,
+	    http_listen_init,
+	    http_listen_finish,
+	    http,
+	    http->event_base)) {
+		fprintf(stderr, "failed in create http server instance.\n");
+		return 1;
+	}
+	/* 接続元ごとの接続数はRPCと同じだけに制限する */
+	tcp_server_set_rate_limit(tcpserver, http->rpc->connect_rate, http->rpc->connect_burst);
+	/* 引き継いだsdがあればlistenせずにそれを使う */
+	if (http->inherit_count > 0 &&
+	    tcp_server_set_listen_fds(tcpserver, http->inherit_sd, http->inherit_count)) {
+		tcp_server_destroy(tcpserver);
+		return 1;
+	}
+	/* TCPサーバーの開始 */
+	if (tcp_server_start(tcpserver)) {
+		fprintf(stderr, "failed in start up http server instance.\n");
+		tcp_server_destroy(tcpserver);
+		return 1;
+	}
+	http->tcpserver = tcpserver;
+	/* /eventsの生存確認 */
+	timeout.tv_sec = HTTP_STREAM_HEARTBEAT;
+	timeout.tv_usec = 0;
+	event_set(&http->heartbeat_event, -1, EV_PERSIST, http_heartbeat, http);
+	event_base_set(http->event_base, &http->heartbeat_event);
+	event_priority_set(&http->heartbeat_event, EVENT_PRIORITY_LOW);
+	evtimer_add(&http->heartbeat_event, &timeout);
+
+	return 0;
+}
+
+void
+http_set_timeout(struct http *http, int http_timeout) {
+	http->http_timeout = http_timeout;
+	http->timeout.tv_sec = http_timeout;
+	http->timeout.tv_usec = 0;
+	if (http->tcpserver) {
+		tcp_server_timeout_update(http->tcpserver);
+	}
+}
+
+int
+http_listen_fds(struct http *http, int *sd, int sd_max) {
+	if (http->tcpserver == NULL) {
+		return 0;
+	}
+
+	return tcp_server_listen_fds(http->tcpserver, sd, sd_max);
+}
+
+int
+http_set_listen_fds(struct http *http, const int *sd, int count) {
+	int i;
+
+	if (count > HTTP_LISTEN_FD_LIMIT) {
+		fprintf(stderr, "too many http listen sockets (%d).\n", count);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		http->inherit_sd[i] = sd[i];
+	}
+	http->inherit_count = count;
+
+	return 0;
+}
+
+void
+http_listen_detach(struct http *http) {
+	if (http->tcpserver) {
+		tcp_server_listen_detach(http->tcpserver);
+	}
+}
+
+void
+http_finish(struct http *http) {
+	evtimer_del(&http->heartbeat_event);
+	if (http->tcpserver) {
+		tcp_server_stop(http->tcpserver);
+	}
+}
+
+void
+http_destroy(struct http *http) {
+	if (http) {
+		if (http->tcpserver) {
+			tcp_server_destroy(http->tcpserver);
+		}
+		alert_remove_listener(http->alert, http_alert_status_changed, http);
+		sensor_remove_listener(http->sensor, http_sensor_event, http);
+		free(http->bind_port);
+		free(http->document_root);
+		free(http);
+	}
+}
@@ -0,0 +1,108 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef HTTP_H
+#define HTTP_H
+
+#define HTTP_REQUEST_SIZE    4096           /* 1リクエスト(ヘッダ+ボディ)の最大サイズ */
+#define HTTP_HEADER_SIZE     512            /* レスポンスヘッダのバッファサイズ */
+#define HTTP_FILE_SIZE_LIMIT (1024 * 1024)  /* 静的ファイルの最大サイズ */
+#define HTTP_STREAM_LIMIT    16             /* /eventsを同時に受けられる接続数 */
+#define HTTP_STREAM_BUFFER   4096           /* /eventsの接続ごとの送信バッファ
+                                             * 溢れるほど遅いクライアントは切断する */
+#define HTTP_STREAM_HEARTBEAT 15            /* /eventsの生存確認を送る間隔(sec) */
+#define HTTP_EVENT_SIZE      128            /* イベント1つ分のバッファサイズ */
+#define HTTP_METRICS_SIZE    (32 * 1024)    /* /metricsのバッファサイズ */
+#define HTTP_OUTPUT_SIZE     (HTTP_HEADER_SIZE + HTTP_METRICS_SIZE)
+                                            /* 送り切れなかったレスポンスを溜める送信バッファ */
+#define HTTP_LISTEN_FD_LIMIT 10             /* 引き継げるlisten sdの数 (tcpsock.hのLISTEN_LIMIT) */
+
+struct http {
+	struct event_base *event_base;
+	struct tcp_server *tcpserver;   /* tcpサーバーのインスタンス */
+	char *bind_port;                /* バインドするポート */
+	char *document_root;            /* 静的ファイルのルート、NULLなら返さない */
+	int http_timeout;               /* keep-aliveのアイドルタイムアウト */
+	struct timeval timeout;         /* tcpサーバーに渡すタイムアウト */
+	struct rpc *rpc;                /* コマンドを実行するrpcのインスタンス */
+	struct alert *alert;            /* alertのインスタンス */
+	struct sensor *sensor;          /* sensorのインスタンス */
+	struct tcp_accept_info *streams[HTTP_STREAM_LIMIT]; /* /eventsの接続 */
+	int stream_count;
+	struct event heartbeat_event;   /* /eventsの生存確認用タイマー */
+	char event_buffer[HTTP_EVENT_SIZE]; /* 全接続で共有するイベント */
+	char metrics_buffer[HTTP_METRICS_SIZE]; /* /metricsを作るバッファ、スクレイプごとに使い回す */
+	int inherit_sd[HTTP_LISTEN_FD_LIMIT]; /* 引き継いだlisten sd */
+	int inherit_count;
+};
+
+/* httpのインスタンス生成 */
+int http_create(
+    struct http **http,
+    const char *bind_port,
+    const char *document_root,
+    int http_timeout,
+    struct rpc *rpc,
+    struct alert *alert,
+    struct sensor *sensor,
+    struct event_base *event_base);
+/*
+ * httpの開始
+ * listenするだけで、イベントループは呼び出し側で回す
+ */
+int http_start(
+    struct http *http);
+/*
+ * keep-aliveのアイドルタイムアウトを変える
+ * 次にタイムアウトを登録する接続から新しい値を使う
+ */
+void http_set_timeout(
+    struct http *http,
+    int http_timeout);
+/*
+ * listenしているsdをsdに書いてその数を返す
+ * listenしていなければ0、sd_maxより多ければ-1を返す
+ */
+int http_listen_fds(
+    struct http *http,
+    int *sd,
+    int sd_max);
+/*
+ * 他のプロセスから引き継いだlisten済みのsdを使う
+ * http_startの前に呼ぶ。startではlistenせずにこのsdでacceptする
+ */
+int http_set_listen_fds(
+    struct http *http,
+    const int *sd,
+    int count);
+/*
+ * acceptを止める
+ * listen sdを他のプロセスに渡した後に呼ぶ。処理中の接続はhttp_finishまで扱う
+ */
+void http_listen_detach(
+    struct http *http);
+/* httpの終了 */
+void http_finish(
+    struct http *http);
+/* httpのインスタンス削除 */
+void http_destroy(
+    struct http *http);
+
+#endif
@@ -20,11 +20,18 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <netdb.h>
 #include <signal.h>
+#include <pthread.h>
 #include <event.h>
 
 #include "macro.h"
@@ -32,37 +39,749 @@
 #include "alert.h"
 #include "sensor.h"
 #include "rpc.h"
+#include "http.h"
+#include "status_page.h"
+#include "status_publisher.h"
+#include "upgrade.h"
+#include "supervisor.h"
+#include "history.h"
+#include "archive.h"
+#include "logger.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "priority.h"
 #include "ids.h"
 
+/* 登録したイベントを全て削除してイベントループを抜けさせる */
+static void
+finish_instances(struct ids *ids) {
+     	signal_del(&ids->hup_event);
+     	signal_del(&ids->term_event);
+     	signal_del(&ids->int_event);
+     	signal_del(&ids->usr2_event);
+	if (ids->upgrade_channel != -1) {
+		event_del(&ids->upgrade_event);
+		close(ids->upgrade_channel);
+		ids->upgrade_channel = -1;
+	}
+	if (ids->upgraded) {
+		/* alertとsensorは新しいプロセスに引き継いだ時に止めている */
+		evtimer_del(&ids->drain_event);
+	} else {
+		alert_cancel(ids->alert);
+		sensor_finish(ids->sensor);
+	}
+	rpc_finish(ids->rpc);
+	if (ids->http) {
+		http_finish(ids->http);
+	}
+	if (ids->status_publisher) {
+		status_publisher_finish(ids->status_publisher);
+	}
+	watchdog_finish();
+}
+
 static void
 terminate(int fd, short event, void *args) {
 	struct ids *ids = args;
 
-	printf("catch signal\n");
+	logger_write(LOGGER_INFO, "signal", "signal=%d", fd);
         /* 終了処理 */
 	if (event != EV_SIGNAL) {
 		ABORT();	
 		/* NOT REACHED */
 	}
+	supervisor_notify("STOPPING=1");
+	finish_instances(ids);
+}
+
+/*
+ * 最初のポーリングを終えたら起動を終えたことにする
+ * 起動からの時間を統計に入れて、サービスマネージャーに知らせる
+ * (入れ替えで起動された場合はpidが変わったことも知らせる)
+ */
+static void
+startup_sensor_event(int event, void *args) {
+	struct ids *ids = args;
+	char state[SUPERVISOR_STATE_SIZE];
+	uint64_t elapsed;
+	int sampled;
+
+	if (event != SENSOR_EVENT_SAMPLE || ids->ready) {
+		return;
+	}
+	ids->ready = 1;
+	elapsed = stats_now() - ids->start_time;
+	stats_record(STATS_STARTUP, elapsed);
+	sampled = (sensor_get_sample_count(ids->sensor) > 0);
+	logger_write(LOGGER_INFO, "ready", "first_poll_us=%lu result=%s",
+	    (unsigned long)elapsed, sampled ? "sampled" : "failed");
+	snprintf(state, sizeof(state), "READY=1\nMAINPID=%d\nSTATUS=first poll in %lu us (%s)",
+	    (int)getpid(), (unsigned long)elapsed, sampled ? "sampled" : "failed");
+	supervisor_notify(state);
+}
+
+/* デフォルト値のconfigを作ってコンフィグファイルを読む */
+static int
+load_config(struct ids *ids, struct config **config) {
+	if (config_create(
+	    config,
+	    DEFAULT_FIRST_ALERT_SCRIPT,
+	    DEFAULT_SECOND_ALERT_SCRIPT,
+	    DEFAULT_CANCEL_WAIT_TIME,
+	    DEFAULT_POLL_INTERVAL,
+	    DEFAULT_ALERT_THRESHOLD,
+	    DEFAULT_RPC_PORT,
+	    DEFAULT_RPC_TIMEOUT,
+	    DEFAULT_PID_FILE_PATH)) {
+		fprintf(stderr, "failed in create cofig instance.\n");
+		return 1;
+	}
+	if (config_load(*config, ids->config_path)) {
+		fprintf(stderr, "failed in load config.\n");
+		config_destroy(*config);
+		*config = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * [action]を警報スクリプトの後に続けて実行するスクリプトにする
+ * 扱うセンサー (最初の[sensor]) のzoneのものと、zoneを指定していないものだけ
+ */
+static int
+apply_actions(struct ids *ids, struct config *config) {
+	struct alert_action *actions = NULL;
+	struct config_action *action;
+	int zone = -1;
+	int count = 0;
+	int error;
+	int i;
+
+	if (config->sensor_count > 0) {
+		zone = config->sensors[0].zone;
+	}
+	if (config->action_count > 0) {
+		actions = malloc(sizeof(struct alert_action) * config->action_count);
+		if (actions == NULL) {
+			return 1;
+		}
+	}
+	for (i = 0; i < config->action_count; i++) {
+		action = &config->actions[i];
+		if (action->zone >= 0 && action->zone != zone) {
+			continue;
+		}
+		actions[count].status = (action->level == CONFIG_ACTION_FIRST) ?
+		    ALERT_STATUS_FIRST_ALERT : ALERT_STATUS_SECOND_ALERT;
+		actions[count].script = config_string(config, action->script);
+		count++;
+	}
+	error = alert_set_actions(ids->alert, actions, count);
+	free(actions);
+
+	return error;
+}
+
+/*
+ * 変わった設定項目を動いているインスタンスに反映する
+ * 反映できない項目は1を返して、動いている値のままにする
+ */
+static int
+reload_apply(int key, struct config *old_config, struct config *new_config, void *args) {
+	struct ids *ids = args;
+
+	switch (key) {
+	case CONFIG_KEY_POLL_INTERVAL:
+		sensor_set_poll_interval(ids->sensor, new_config->poll_interval);
+		break;
+	case CONFIG_KEY_ALERT_THRESHOLD:
+		sensor_set_alert_threshold(ids->sensor, new_config->alert_threshold);
+		break;
+	case CONFIG_KEY_CANCEL_WAIT_TIME:
+		alert_set_cancel_wait_time(ids->alert, new_config->cancel_wait_time);
+		break;
+	case CONFIG_KEY_RPC_TIMEOUT:
+		rpc_set_timeout(ids->rpc, new_config->rpc_timeout);
+		if (ids->http) {
+			http_set_timeout(ids->http, new_config->rpc_timeout);
+		}
+		break;
+	case CONFIG_KEY_FIRST_ALERT_SCRIPT:
+	case CONFIG_KEY_SECOND_ALERT_SCRIPT:
+		if (alert_set_scripts(ids->alert,
+		    new_config->first_alert_script,
+		    new_config->second_alert_script)) {
+			logger_write(LOGGER_ERROR, "reload", "key=%s error=\"failed in change alert scripts\"",
+			    config_key_name(key));
+			return 1;
+		}
+		break;
+	case CONFIG_KEY_LOG_LEVEL:
+		logger_set_level(new_config->log_level);
+		break;
+	case CONFIG_KEY_RPC_TCP_MUTATE:
+		rpc_set_tcp_mutate(ids->rpc, new_config->rpc_tcp_mutate);
+		break;
+	case CONFIG_KEY_RPC_PORT:
+		/* ポートが変わった時だけlistenし直す */
+		if (rpc_rebind(ids->rpc, new_config->rpc_port)) {
+			logger_write(LOGGER_ERROR, "reload", "key=%s error=\"failed in rebind\" port=%s keep=%s",
+			    config_key_name(key), new_config->rpc_port, old_config->rpc_port);
+			return 1;
+		}
+		break;
+	default:
+		logger_write(LOGGER_WARN, "reload", "key=%s error=\"can not be changed without restart\"",
+		    config_key_name(key));
+		return 1;
+	}
+	logger_write(LOGGER_INFO, "reload", "key=%s changed=1", config_key_name(key));
+
+	return 0;
+}
+
+/*
+ * 設定を読み直して、変わった項目だけを止めずに反映する
+ * 読めなかった場合は今の設定のまま動き続ける
+ */
+static void
+reload(int fd, short event, void *args) {
+	struct ids *ids = args;
+	struct config *config;
+
+	if (event != EV_SIGNAL) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	watchdog_enter("reload");
+	logger_write(LOGGER_INFO, "reload", "path=%s", ids->config_path);
+	/* ローテーションされたログファイルを開き直す */
+	logger_reopen();
+	if (load_config(ids, &config)) {
+		logger_write(LOGGER_ERROR, "reload", "error=\"failed in load config, keep running config\"");
+		goto last;
+	}
+	if (config_diff(ids->config, config, reload_apply, ids) < 0) {
+		logger_write(LOGGER_ERROR, "reload", "error=\"failed in apply config\"");
+		config_destroy(config);
+		goto last;
+	}
+	if (!config_sections_equal(ids->config, config)) {
+		if (apply_actions(ids, config)) {
+			logger_write(LOGGER_ERROR, "reload", "error=\"failed in change actions\"");
+		} else {
+			logger_write(LOGGER_INFO, "reload", "sections=changed");
+		}
+	}
+	config_destroy(ids->config);
+	ids->config = config;
+last:
+	watchdog_leave();
+}
+
+/*
+ * RPCのSET, GETで扱う項目の番号
+ * 接続を受けているtcpサーバーを作り直さずに変えられるものだけ
+ */
+static int
+tunable_key(const char *name) {
+	int key;
+
+	key = config_key_lookup(name);
+	switch (key) {
+	case CONFIG_KEY_POLL_INTERVAL:
+	case CONFIG_KEY_ALERT_THRESHOLD:
+	case CONFIG_KEY_CANCEL_WAIT_TIME:
+	case CONFIG_KEY_RPC_TIMEOUT:
+		return key;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * RPCのSET
+ * 動いている設定の複製に値を入れて、reloadと同じように反映する
+ */
+static int
+tunable_set(const char *name, const char *value, int persist, void *args) {
+	struct ids *ids = args;
+	struct config *config;
+	char buf[32];
+	int key;
+	int reverted;
+
+	key = tunable_key(name);
+	if (key < 0) {
+		return RPC_CONFIG_UNKNOWN_KEY;
+	}
+	if (config_copy(&config, ids->config)) {
+		return RPC_CONFIG_ERROR;
+	}
+	if (config_set(config, key, value)) {
+		config_destroy(config);
+		return RPC_CONFIG_INVALID_VALUE;
+	}
+	reverted = config_diff(ids->config, config, reload_apply, ids);
+	if (reverted != 0) {
+		config_destroy(config);
+		return RPC_CONFIG_ERROR;
+	}
+	config_destroy(ids->config);
+	ids->config = config;
+	if (persist) {
+		/* 受け取った文字列ではなく解釈した値を書く */
+		if (config_format(config, key, buf, sizeof(buf)) < 0 ||
+		    config_save(config, ids->config_path, key, buf)) {
+			logger_write(LOGGER_ERROR, "config_set", "key=%s path=%s error=\"failed in save\"",
+			    config_key_name(key), ids->config_path);
+			return RPC_CONFIG_NOT_SAVED;
+		}
+	}
+
+	return RPC_CONFIG_OK;
+}
+
+/* RPCのGET */
+static int
+tunable_get(const char *name, char *buf, size_t size, void *args) {
+	struct ids *ids = args;
+	int key;
+
+	key = tunable_key(name);
+	if (key < 0) {
+		return RPC_CONFIG_UNKNOWN_KEY;
+	}
+	if (config_format(ids->config, key, buf, size) < 0) {
+		return RPC_CONFIG_ERROR;
+	}
+
+	return RPC_CONFIG_OK;
+}
+
+/* 入れ替えをやめて新しいプロセスを止める */
+static void
+upgrade_abort(struct ids *ids) {
+	event_del(&ids->upgrade_event);
+	close(ids->upgrade_channel);
+	ids->upgrade_channel = -1;
+	/* 途中まで起動していてもalert, sensor, pidファイルにはまだ触っていない */
+	kill(ids->upgrade_pid, SIGKILL);
+	waitpid(ids->upgrade_pid, NULL, 0);
+	logger_write(LOGGER_ERROR, "upgrade", "pid=%d error=\"failed in upgrade, keep running\"",
+	    (int)ids->upgrade_pid);
+}
+
+/* 引き継いだ後、処理中の接続を待ち終えたら終了する */
+static void
+upgrade_drained(int fd, short event, void *args) {
+	struct ids *ids = args;
+
+	if (event != EV_TIMEOUT) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	logger_write(LOGGER_INFO, "upgrade", "finished=1");
+	finish_instances(ids);
+}
+
+/*
+ * 新しいプロセスに渡した状態でこのプロセスのポーリングを再開する
+ * 新しいプロセスは止める
+ */
+static void
+upgrade_resume(struct ids *ids) {
+	struct upgrade_state state;
+
+	upgrade_abort(ids);
+	memset(&state, 0, sizeof(state));
+	alert_get_state(ids->alert, &state.alert);
+	sensor_get_state(ids->sensor, &state.sensor);
+	alert_set_state(ids->alert, &state.alert);
+	sensor_set_state(ids->sensor, &state.sensor);
+	if (sensor_start(ids->sensor)) {
+		logger_write(LOGGER_ERROR, "upgrade", "error=\"failed in restart sensor\"");
+	}
+	/* 新しいプロセスが作り直していたら消されているので、こちらも作り直す */
+	if (ids->status_publisher) {
+		status_publisher_finish(ids->status_publisher);
+		if (status_publisher_start(ids->status_publisher)) {
+			logger_write(LOGGER_ERROR, "upgrade", "error=\"failed in restart status page\"");
+		}
+	}
+}
+
+/*
+ * 新しいプロセスがポーリングなどを開始できたら、acceptをやめて処理中の接続が終わるのを待つ
+ * STARTEDが来なければこのプロセスで続ける
+ */
+static void
+upgrade_started(int fd, short event, void *args) {
+	struct ids *ids = args;
+	struct upgrade_header started;
+	struct timeval drain_time;
+
+	watchdog_enter("upgrade_started");
+	if (event == EV_TIMEOUT) {
+		logger_write(LOGGER_ERROR, "upgrade", "pid=%d error=\"timeout in wait new process start\"",
+		    (int)ids->upgrade_pid);
+		upgrade_resume(ids);
+		goto last;
+	}
+	if (upgrade_recv(fd, UPGRADE_MESSAGE_STARTED, &started, sizeof(started))) {
+		upgrade_resume(ids);
+		goto last;
+	}
+	event_del(&ids->upgrade_event);
+	close(ids->upgrade_channel);
+	ids->upgrade_channel = -1;
+	ids->upgraded = 1;
+	rpc_listen_detach(ids->rpc);
+	if (ids->http) {
+		http_listen_detach(ids->http);
+	}
+	/* ステータスページは新しいプロセスが作り直す */
+	if (ids->status_publisher) {
+		status_publisher_release(ids->status_publisher);
+	}
      	signal_del(&ids->hup_event);
-     	signal_del(&ids->term_event);
-     	signal_del(&ids->int_event);
-	alert_cancel(ids->alert);
+     	signal_del(&ids->usr2_event);
+	logger_write(LOGGER_INFO, "upgrade", "handed_over=1 pid=%d", (int)ids->upgrade_pid);
+	drain_time.tv_sec = UPGRADE_DRAIN_TIME;
+	drain_time.tv_usec = 0;
+	evtimer_set(&ids->drain_event, upgrade_drained, ids);
+	event_base_set(ids->event_base, &ids->drain_event);
+	evtimer_add(&ids->drain_event, &drain_time);
+last:
+	watchdog_leave();
+}
+
+/*
+ * 新しいプロセスがインスタンスを作り終えたら、ポーリングを止めて状態を渡し、
+ * STARTEDを待つ
+ */
+static void
+upgrade_ready(int fd, short event, void *args) {
+	struct ids *ids = args;
+	struct upgrade_header ready;
+	struct upgrade_state state;
+	struct timeval timeout;
+
+	watchdog_enter("upgrade_ready");
+	if (event == EV_TIMEOUT) {
+		logger_write(LOGGER_ERROR, "upgrade", "pid=%d error=\"timeout in wait new process\"",
+		    (int)ids->upgrade_pid);
+		upgrade_abort(ids);
+		goto last;
+	}
+	if (upgrade_recv(fd, UPGRADE_MESSAGE_READY, &ready, sizeof(ready))) {
+		upgrade_abort(ids);
+		goto last;
+	}
+	/* USBデバイスを新しいプロセスが開けるように閉じてから状態を取る */
 	sensor_finish(ids->sensor);
-	rpc_finish(ids->rpc);
+	alert_finish(ids->alert);
+	memset(&state, 0, sizeof(state));
+	alert_get_state(ids->alert, &state.alert);
+	sensor_get_state(ids->sensor, &state.sensor);
+	if (upgrade_send(fd, UPGRADE_MESSAGE_STATE, &state, sizeof(state))) {
+		/* 新しいプロセスは状態を受け取れずに終わるので、このプロセスで続ける */
+		upgrade_resume(ids);
+		goto last;
+	}
+	timeout.tv_sec = UPGRADE_TIMEOUT / 1000;
+	timeout.tv_usec = (UPGRADE_TIMEOUT % 1000) * 1000;
+	event_set(&ids->upgrade_event, ids->upgrade_channel, EV_READ, upgrade_started, ids);
+	event_base_set(ids->event_base, &ids->upgrade_event);
+	event_priority_set(&ids->upgrade_event, EVENT_PRIORITY_HIGH);
+	event_add(&ids->upgrade_event, &timeout);
+last:
+	watchdog_leave();
+}
+
+/* SIGUSR2で新しいバイナリをexecしてlistenしているsdを渡す */
+static void
+upgrade_begin(int fd, short event, void *args) {
+	struct ids *ids = args;
+	int count[UPGRADE_LISTEN_COUNT];
+	int sd[UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT];
+	int total = 0;
+	struct timeval timeout;
+
+	if (event != EV_SIGNAL) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	watchdog_enter("upgrade_begin");
+	if (ids->upgrade_channel != -1) {
+		logger_write(LOGGER_WARN, "upgrade", "error=\"already upgrading\"");
+		goto last;
+	}
+	count[UPGRADE_LISTEN_RPC] = rpc_listen_fds(ids->rpc, 0, &sd[total], UPGRADE_LISTEN_FD_LIMIT);
+	total += count[UPGRADE_LISTEN_RPC];
+	count[UPGRADE_LISTEN_RPC_UNIX] = rpc_listen_fds(ids->rpc, 1, &sd[total], UPGRADE_LISTEN_FD_LIMIT);
+	total += count[UPGRADE_LISTEN_RPC_UNIX];
+	count[UPGRADE_LISTEN_HTTP] = ids->http ?
+	    http_listen_fds(ids->http, &sd[total], UPGRADE_LISTEN_FD_LIMIT) : 0;
+	if (count[UPGRADE_LISTEN_RPC] < 0 ||
+	    count[UPGRADE_LISTEN_RPC_UNIX] < 0 ||
+	    count[UPGRADE_LISTEN_HTTP] < 0) {
+		logger_write(LOGGER_ERROR, "upgrade", "error=\"too many listen sockets\"");
+		goto last;
+	}
+	logger_write(LOGGER_INFO, "upgrade", "binary=%s", ids->argv[0]);
+	if (upgrade_spawn(ids->argv, &ids->upgrade_channel, &ids->upgrade_pid)) {
+		logger_write(LOGGER_ERROR, "upgrade", "error=\"failed in spawn, keep running\"");
+		goto last;
+	}
+	if (upgrade_send_listen(ids->upgrade_channel, count, sd)) {
+		upgrade_abort(ids);
+		goto last;
+	}
+	timeout.tv_sec = UPGRADE_TIMEOUT / 1000;
+	timeout.tv_usec = (UPGRADE_TIMEOUT % 1000) * 1000;
+	event_set(&ids->upgrade_event, ids->upgrade_channel, EV_READ, upgrade_ready, ids);
+	event_base_set(ids->event_base, &ids->upgrade_event);
+	event_priority_set(&ids->upgrade_event, EVENT_PRIORITY_HIGH);
+	event_add(&ids->upgrade_event, &timeout);
+last:
+	watchdog_leave();
+}
+
+/*
+ * listenしているsdをrpc, httpに使わせる
+ * sdはcountのUPGRADE_LISTEN_*の順に並べておく。今の設定で使わないものは閉じる
+ */
+static void
+use_listen_fds(struct ids *ids, const int *count, int *sd) {
+	int *p = sd;
+	int used;
+	int i, j;
+
+	for (i = 0; i < UPGRADE_LISTEN_COUNT; i++) {
+		used = 0;
+		switch (i) {
+		case UPGRADE_LISTEN_RPC:
+			used = (ids->config->rpc_port[0] != '\0' &&
+			    rpc_set_listen_fds(ids->rpc, 0, p, count[i]) == 0);
+			break;
+		case UPGRADE_LISTEN_RPC_UNIX:
+			used = (ids->config->rpc_unix_path[0] != '\0' &&
+			    rpc_set_listen_fds(ids->rpc, 1, p, count[i]) == 0);
+			break;
+		case UPGRADE_LISTEN_HTTP:
+			used = (ids->http != NULL &&
+			    http_set_listen_fds(ids->http, p, count[i]) == 0);
+			break;
+		default:
+			break;
+		}
+		for (j = 0; !used && j < count[i]; j++) {
+			close(p[j]);
+		}
+		p += count[i];
+	}
+}
+
+/* 前のプロセスからlistenしているsdを受け取る (新しいプロセス側) */
+static int
+inherit_listen(struct ids *ids, int channel) {
+	int count[UPGRADE_LISTEN_COUNT];
+	int sd[UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT];
+
+	if (upgrade_recv_listen(channel, count, sd, UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT)) {
+		return 1;
+	}
+	use_listen_fds(ids, count, sd);
+
+	return 0;
+}
+
+/*
+ * サービスマネージャーがlistenしたsdがどれに使うものかを返す
+ * unix domain socketはrpc_unix_path、TCPはポート番号で見分ける
+ * どれでもなければ-1
+ */
+static int
+listen_kind(struct config *config, int sd) {
+	struct sockaddr_storage ss;
+	struct sockaddr_un *sun;
+	socklen_t len = sizeof(ss);
+	char port[NI_MAXSERV];
+	int type;
+	int accepting;
+	socklen_t optlen;
+
+	optlen = sizeof(type);
+	if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0 || type != SOCK_STREAM) {
+		return -1;
+	}
+	optlen = sizeof(accepting);
+	if (getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &optlen) < 0 || !accepting) {
+		return -1;
+	}
+	if (getsockname(sd, (struct sockaddr *)&ss, &len) < 0) {
+		return -1;
+	}
+	switch (ss.ss_family) {
+	case AF_UNIX:
+		sun = (struct sockaddr_un *)&ss;
+		if (config->rpc_unix_path[0] != '\0' &&
+		    strcmp(sun->sun_path, config->rpc_unix_path) == 0) {
+			return UPGRADE_LISTEN_RPC_UNIX;
+		}
+		break;
+	case AF_INET:
+	case AF_INET6:
+		if (getnameinfo((struct sockaddr *)&ss, len,
+		    NULL, 0, port, sizeof(port), NI_NUMERICSERV)) {
+			return -1;
+		}
+		if (strcmp(port, config->rpc_port) == 0) {
+			return UPGRADE_LISTEN_RPC;
+		}
+		if (strcmp(port, config->http_port) == 0) {
+			return UPGRADE_LISTEN_HTTP;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -1;
+}
+
+/*
+ * サービスマネージャーから渡されたsdをrpc, httpに使わせる
+ * どれにも当てはまらないsdは閉じる
+ */
+static void
+activate_listen(struct ids *ids, const int *activated, int activated_count) {
+	int count[UPGRADE_LISTEN_COUNT];
+	int sd[UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT];
+	int kind[UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT];
+	int total = 0;
+	int i, j;
+
+	for (i = 0; i < activated_count; i++) {
+		kind[i] = listen_kind(ids->config, activated[i]);
+		if (kind[i] < 0) {
+			fprintf(stderr, "unknown listen socket %d, close it.\n", activated[i]);
+			close(activated[i]);
+		}
+	}
+	/* 種類の順に並べ直す */
+	for (i = 0; i < UPGRADE_LISTEN_COUNT; i++) {
+		count[i] = 0;
+		for (j = 0; j < activated_count; j++) {
+			if (kind[j] != i) {
+				continue;
+			}
+			if (count[i] >= UPGRADE_LISTEN_FD_LIMIT) {
+				fprintf(stderr, "too many listen sockets, close %d.\n", activated[j]);
+				close(activated[j]);
+				continue;
+			}
+			sd[total++] = activated[j];
+			count[i]++;
+		}
+	}
+	use_listen_fds(ids, count, sd);
+}
+
+/*
+ * インスタンスを作り終えたことを前のプロセスに知らせて、
+ * 前のプロセスが止めたalertとsensorの状態を受け取る (新しいプロセス側)
+ */
+static int
+resume_state(struct ids *ids, int channel) {
+	struct upgrade_header ready;
+	struct upgrade_state state;
+
+	memset(&ready, 0, sizeof(ready));
+	if (upgrade_send(channel, UPGRADE_MESSAGE_READY, &ready, sizeof(ready))) {
+		return 1;
+	}
+	if (upgrade_recv(channel, UPGRADE_MESSAGE_STATE, &state, sizeof(state))) {
+		return 1;
+	}
+	alert_set_state(ids->alert, &state.alert);
+	sensor_set_state(ids->sensor, &state.sensor);
+	logger_write(LOGGER_INFO, "upgrade", "alert=%d monitor=%d",
+	    state.alert.status, state.sensor.execute_alert);
+
+	return 0;
+}
+
+/* ポーリングなどを開始できたことを前のプロセスに知らせる (新しいプロセス側) */
+static int
+upgrade_send_started(int channel) {
+	struct upgrade_header started;
+
+	memset(&started, 0, sizeof(started));
+	if (upgrade_send(channel, UPGRADE_MESSAGE_STARTED, &started, sizeof(started))) {
+		return 1;
+	}
+	logger_write(LOGGER_INFO, "upgrade", "started=1 pid=%d", (int)getpid());
+
+	return 0;
+}
+
+/*
+ * event baseの生成
+ * センサーやアラートのタイマーをRPCより先に処理させるため優先度を使う
+ */
+static struct event_base *
+make_event_base(void) {
+	struct event_base *event_base;
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02010000
+	struct event_config *event_config;
+
+	/* 低優先度のコールバックは1回のループでEVENT_LOW_DISPATCH_LIMITまで */
+	event_config = event_config_new();
+	if (event_config == NULL) {
+		return NULL;
+	}
+	if (event_config_set_max_dispatch_interval(event_config,
+	    NULL, EVENT_LOW_DISPATCH_LIMIT, EVENT_PRIORITY_LOW)) {
+		event_config_free(event_config);
+		return NULL;
+	}
+	event_base = event_base_new_with_config(event_config);
+	event_config_free(event_config);
+#else
+	event_base = event_init();
+#endif
+	if (event_base == NULL) {
+		return NULL;
+	}
+	if (event_base_priority_init(event_base, EVENT_PRIORITY_COUNT)) {
+		event_base_free(event_base);
+		return NULL;
+	}
+
+	return event_base;
 }
 
+/*
+ * pidファイルを作る
+ * replaceが0ならすでにあれば二重起動とみなす
+ * (入れ替えでは前のプロセスのpidを書き換える)
+ */
 static int 
-make_pidfile(const char *path) {
+make_pidfile(const char *path, int replace) {
         FILE *fp;
 
         /* 二重起動防止 */
-	if (access(path, R_OK|W_OK) == 0) {
+	if (!replace && access(path, R_OK|W_OK) == 0) {
 		fprintf(stderr, "already exist process id file.\n");
 		return 1;
 	}
         /* ファイル生成 */
-        fp = fopen(path, "w+");
+        fp = fopen(path, "w+e");
 	if (fp == NULL) {	
 		fprintf(stderr, "failed in open process id file.\n");
 		return 1;
@@ -106,50 +825,78 @@ main(int argc, char **argv)
 	struct sensor *sensor = NULL;
 	struct alert *alert = NULL;
 	struct rpc *rpc = NULL;
+	struct http *http = NULL;
+	struct status_publisher *status_publisher = NULL;
 	struct event_base *event_base;
+	int upgrade_fd;
+	int pidfile_owner;
+	int activated[UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT];
+	int activated_count;
 
 	memset(&ids, 0, sizeof(ids));
+	ids.start_time = stats_now();
+	ids.argv = argv;
+	ids.upgrade_channel = -1;
+	/* 入れ替えで起動された場合は前のプロセスとやり取りするsdがある */
+	upgrade_fd = upgrade_channel();
+	/* 入れ替えで起動された場合、STARTEDを送るまでpidファイルは前のプロセスのもの */
+	pidfile_owner = (upgrade_fd == -1);
+	/* サービスマネージャーがlistenしたsd (pidで確かめるのでdaemonの前に受け取る) */
+	activated_count = supervisor_listen_fds(activated,
+	    UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT);
+	if (activated_count < 0) {
+		return 1;
+	}
         /* 引数チェック */
 	if (get_args(&ids, argc, argv)) {
 		usage(argv[0]);
 		return 1;
 	}
-        /* config作成＆初期化 */
-	if (config_create(
-	    &config,
-	    DEFAULT_FIRST_ALERT_SCRIPT,
-	    DEFAULT_SECOND_ALERT_SCRIPT,
-	    DEFAULT_CANCEL_WAIT_TIME,
-	    DEFAULT_POLL_INTERVAL,
-	    DEFAULT_ALERT_THRESHOLD,
-	    DEFAULT_RPC_PORT,
-	    DEFAULT_RPC_TIMEOUT,
-	    DEFAULT_PID_FILE_PATH)) {
-		fprintf(stderr, "failed in create cofig instance.\n");
-		return 1;
-	}
-        /* 設定読み込み */
+        /* config作成＆設定読み込み */
 	printf("config path = %s\n", ids.config_path);
-	if (config_load(config, ids.config_path)) {
-		fprintf(stderr, "failed in load config.\n");
+	if (load_config(&ids, &config)) {
 		return 1;
 	}
+	ids.config = config;
 	config_print(config);
-	/* デーモン化 */
-	if (daemon(1, 1)) {
-		fprintf(stderr, "failed in daemon.\n");
-		return 1;
+	if (config->sensor_count > 1) {
+		fprintf(stderr, "use only [sensor \"%s\"], %d other sensors are ignored.\n",
+		    config_string(config, config->sensors[0].name),
+		    config->sensor_count - 1);
 	}
-        /*
-         * pidファイル作る
-         * 二重起動防止のチェックもする
-         */
-	if (make_pidfile(config->pid_file_path)) {
-		fprintf(stderr, "failed in make process id file (%s).\n", config->pid_file_path);
-		return 1;
+	/*
+	 * デーモン化
+	 * 入れ替えで起動された場合は前のプロセスがデーモンになっている
+	 * pidファイルは状態を引き継いでから書き換える
+	 */
+	if (upgrade_fd == -1) {
+		if (daemon(1, 1)) {
+			fprintf(stderr, "failed in daemon.\n");
+			return 1;
+		}
+		/*
+		 * pidファイル作る
+		 * 二重起動防止のチェックもする
+		 */
+		if (make_pidfile(config->pid_file_path, 0)) {
+			fprintf(stderr, "failed in make process id file (%s).\n", config->pid_file_path);
+			return 1;
+		}
+		ids.pid_file_path = strdup(config->pid_file_path);
+	}
+	/* ログの書き出しスレッドはforkで無くなるのでデーモンになってから作る */
+	if (logger_start(config->log_path, config->log_level)) {
+		fprintf(stderr, "failed in start up logger.\n");
+		error = 1;
+		goto finish;
 	}
         /* スレッド使わないけど、今後変えるかも的な */
-        event_base = event_init();
+        event_base = make_event_base();
+	if (event_base == NULL) {
+		fprintf(stderr, "failed in create event base.\n");
+		error = 1;
+		goto finish;
+	}
 	ids.event_base = event_base;
         /* アラート生成 */
 	if (alert_create(
@@ -163,6 +910,11 @@ main(int argc, char **argv)
 		goto finish;
 	}
 	ids.alert = alert;
+	if (apply_actions(&ids, config)) {
+		fprintf(stderr, "failed in set actions.\n");
+		error = 1;
+		goto finish;
+	}
         /* センサー生成 */
 	if (sensor_create(&sensor,
 	    alert,
@@ -174,10 +926,51 @@ main(int argc, char **argv)
 		goto finish;
 	}
 	ids.sensor = sensor;
+	if (sensor_set_usb_path(sensor, config->usb_path)) {
+		fprintf(stderr, "failed in set usb path (%s), use <bus>-<port>[.<port>...].\n",
+		    config->usb_path);
+		error = 1;
+		goto finish;
+	}
+	if (sensor_add_listener(sensor, startup_sensor_event, &ids)) {
+		fprintf(stderr, "failed in add sensor listener.\n");
+		error = 1;
+		goto finish;
+	}
+        /* 在室率の履歴生成 (history_pathが空なら使わない) */
+	if (config->history_path[0] != '\0') {
+		if (history_create(&ids.history,
+		     config->history_path,
+		     (config->sensor_count > 0) ?
+		     config_string(config, config->sensors[0].name) : DEFAULT_SENSOR_NAME)) {
+			fprintf(stderr, "failed in create history instance.\n");
+			error = 1;
+			goto finish;
+		}
+		sensor_set_history(sensor, ids.history);
+	}
+        /* サンプルのアーカイブ生成 (archive_pathが空なら使わない) */
+	if (config->archive_path[0] != '\0') {
+		if (archive_create(&ids.archive, config->archive_path)) {
+			fprintf(stderr, "failed in create archive instance.\n");
+			error = 1;
+			goto finish;
+		}
+		sensor_set_archive(sensor, ids.archive);
+	}
         /* rpc生成 */
 	if (rpc_create(&rpc,
 	     config->rpc_port,
+	     config->rpc_unix_path,
+	     config->rpc_allow_uids,
 	     config->rpc_timeout,
+	     config->rpc_connect_rate,
+	     config->rpc_connect_burst,
+	     config->rpc_command_rate,
+	     config->rpc_command_burst,
+	     config->rpc_io_uring,
+	     config->rpc_defer_accept,
+	     config->rpc_fast_open,
 	     alert,
 	     sensor,
 	     event_base)) {
@@ -186,50 +979,166 @@ main(int argc, char **argv)
 		goto finish;
 	}
 	ids.rpc = rpc;
+	rpc_set_config_handler(rpc, tunable_set, tunable_get, &ids);
+	rpc_set_tcp_mutate(rpc, config->rpc_tcp_mutate);
+	if (ids.history) {
+		rpc_set_history(rpc, ids.history);
+	}
+        /* http生成 (http_portが空なら使わない) */
+	if (config->http_port[0] != '\0') {
+		if (http_create(&http,
+		     config->http_port,
+		     config->http_document_root,
+		     config->rpc_timeout,
+		     rpc,
+		     alert,
+		     sensor,
+		     event_base)) {
+			fprintf(stderr, "failed in create http instance.\n");
+			error = 1;
+			goto finish;
+		}
+		ids.http = http;
+	}
+        /* 共有メモリのステータスページ生成 (status_page_nameが空なら使わない) */
+	if (config->status_page_name[0] != '\0') {
+		if (status_publisher_create(&status_publisher,
+		     config->status_page_name,
+		     alert,
+		     sensor)) {
+			fprintf(stderr, "failed in create status publisher instance.\n");
+			error = 1;
+			goto finish;
+		}
+		ids.status_publisher = status_publisher;
+	}
+	/* 前のプロセスがlistenしているsdを受け取る */
+	if (upgrade_fd != -1 && inherit_listen(&ids, upgrade_fd)) {
+		fprintf(stderr, "failed in inherit listen sockets.\n");
+		error = 1;
+		goto finish;
+	}
+	if (activated_count > 0) {
+		activate_listen(&ids, activated, activated_count);
+	}
 	/*
-         * hup, int, termのシグナルがきたら終了する
-         * reloadは実装する気ない
+	 * hupのシグナルがきたら設定を読み直す
+	 * int, termのシグナルがきたら終了する
+	 * usr2のシグナルがきたら新しいバイナリに入れ替える
 	 */
-	signal_set(&ids.hup_event, SIGHUP, terminate, &ids);
+	signal_set(&ids.hup_event, SIGHUP, reload, &ids);
 	event_base_set(event_base, &ids.hup_event);
+	event_priority_set(&ids.hup_event, EVENT_PRIORITY_HIGH);
      	signal_add(&ids.hup_event, NULL);
 	signal_set(&ids.term_event, SIGTERM, terminate, &ids);
 	event_base_set(event_base, &ids.term_event);
+	event_priority_set(&ids.term_event, EVENT_PRIORITY_HIGH);
      	signal_add(&ids.term_event, NULL);
 	signal_set(&ids.int_event, SIGINT, terminate, &ids);
 	event_base_set(event_base, &ids.int_event);
+	event_priority_set(&ids.int_event, EVENT_PRIORITY_HIGH);
      	signal_add(&ids.int_event, NULL);
+	signal_set(&ids.usr2_event, SIGUSR2, upgrade_begin, &ids);
+	event_base_set(event_base, &ids.usr2_event);
+	event_priority_set(&ids.usr2_event, EVENT_PRIORITY_HIGH);
+     	signal_add(&ids.usr2_event, NULL);
 	/* SIGPIPEは無視 */
 	signal( SIGPIPE , SIG_IGN ); 
 
+	/* 前のプロセスのalertとsensorの状態を引き継ぐ */
+	if (upgrade_fd != -1 && resume_state(&ids, upgrade_fd)) {
+		fprintf(stderr, "failed in resume state.\n");
+		error = 1;
+		goto finish;
+	}
+
         /* センサーポーリング開始 */
 	if (sensor_start(sensor)) {
 		fprintf(stderr, "failed in start up  sensor.\n");
 		error = 1;
 		goto finish;
 	}
-	/* 
-         * RPC開始 
-         * RPC内のイベントループに入る。
-         */
+	/* RPC開始 */
 	if (rpc_start(rpc)) {
-		fprintf(stderr, "failed in start up  sensor.\n");
+		fprintf(stderr, "failed in start up rpc.\n");
+		error = 1;
+		goto finish;
+	}
+	/* イベントループの監視開始 */
+	if (watchdog_start(config->callback_budget, event_base)) {
+		fprintf(stderr, "failed in start up watchdog.\n");
+		error = 1;
+		goto finish;
+	}
+	/* ステータスページ開始 */
+	if (status_publisher && status_publisher_start(status_publisher)) {
+		fprintf(stderr, "failed in start up status publisher.\n");
 		error = 1;
 		goto finish;
 	}
-	printf("program ending.\n");
+	/* HTTP開始 */
+	if (http && http_start(http)) {
+		fprintf(stderr, "failed in start up http.\n");
+		error = 1;
+		goto finish;
+	}
+	/*
+	 * 前のプロセスに開始できたことを知らせる
+	 * ここまでに失敗して終わると、前のプロセスがポーリングを再開する
+	 */
+	if (upgrade_fd != -1) {
+		if (upgrade_send_started(upgrade_fd)) {
+			fprintf(stderr, "failed in notify start.\n");
+			error = 1;
+			goto finish;
+		}
+		close(upgrade_fd);
+		upgrade_fd = -1;
+		pidfile_owner = 1;
+		if (make_pidfile(config->pid_file_path, 1)) {
+			logger_write(LOGGER_ERROR, "upgrade", "path=%s error=\"failed in make process id file\"",
+			    config->pid_file_path);
+		} else {
+			ids.pid_file_path = strdup(config->pid_file_path);
+		}
+	}
+	/*
+	 * イベントループに入る
+	 * 終了時は全てのイベントが削除されて抜けてくる
+	 */
+	if (event_base_dispatch(event_base) < 0) {
+		fprintf(stderr, "failed in dispatch event.\n");
+		error = 1;
+	}
+	logger_write(LOGGER_INFO, "exit", "error=%d", error);
 
 finish:
+	if (upgrade_fd != -1) {
+		close(upgrade_fd);
+	}
+        /* ステータスページ削除 */
+	status_publisher_destroy(status_publisher);
+        /* HTTP削除 */
+	http_destroy(http);
         /* RPC削除 */
 	rpc_destroy(rpc);
         /* センサー削除 */
 	sensor_destroy(sensor);
+        /* 履歴削除 */
+	history_destroy(ids.history);
+        /* アーカイブ削除 (書いている途中のblockを書き出す) */
+	archive_destroy(ids.archive);
         /* アラート削除 */
 	alert_destroy(alert);
-        /* config削除 */
-	config_destroy(config);
-        /* pidファイル削除 */
-	unlink(DEFAULT_PID_FILE_PATH);
+        /* config削除 (reloadで差し替わっていることがある) */
+	config_destroy(ids.config);
+        /* pidファイル削除 (引き継いだ場合は新しいプロセスのもの) */
+	if (pidfile_owner && !ids.upgraded && ids.pid_file_path) {
+		unlink(ids.pid_file_path);
+	}
+	free(ids.pid_file_path);
+        /* 残ったログを書き出す */
+	logger_finish();
 
 	return error;
 }
@@ -23,16 +23,32 @@
 
 #define DEFAULT_CONFIG_FILE_PATH 	 "/var/ids/ids.conf"
 #define DEFAULT_PID_FILE_PATH  		 "/var/run/ids.pid"
+#define DEFAULT_SENSOR_NAME              "default"   /* [sensor]が無い場合のセンサーの名前 */
 
 struct ids {
 	struct alert *alert;
 	struct sensor *sensor;
 	struct rpc *rpc;
+	struct http *http;
+	struct status_publisher *status_publisher;
+	struct history *history;
+	struct archive *archive;
 	struct event hup_event;
 	struct event term_event;
 	struct event int_event;
+	struct event usr2_event;
+	struct event upgrade_event;     /* 新しいプロセスからのREADY, STARTEDを待つ */
+	struct event drain_event;       /* 引き継いだ後に処理中の接続を待つ */
 	struct event_base *event_base;
 	const char *config_path;
+	char *pid_file_path;            /* 作ったpidファイル (終了時に消す)、作っていなければNULL */
+	struct config *config;          /* 動いている設定 (SIGHUPで差し替える) */
+	char **argv;                    /* 新しいバイナリに渡すコマンドライン */
+	int upgrade_channel;            /* 新しいプロセスとやり取りするsd、入れ替え中でなければ-1 */
+	pid_t upgrade_pid;              /* 新しいプロセスのpid */
+	int upgraded;                   /* 新しいプロセスに引き継いだ */
+	uint64_t start_time;            /* 起動した時刻 (stats_now()の値) */
+	int ready;                      /* 最初のポーリングを終えた */
 };
 
 #endif
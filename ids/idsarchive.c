@@ -0,0 +1,146 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/*
+ * idsデーモンが書いたサンプルのアーカイブを読む
+ * 通常はrunを1行ずつ "<開始時刻> <値> <サンプル数> <長さ (usec)>" で表示する
+ * -s で件数と読み込みの速さだけを表示する
+ */
+
+static void
+usage(char *cmd)
+{
+	printf("%s [-f <from>] [-t <to>] [-s] <archive file>\n", cmd);
+}
+
+static int
+parse_time(const char *str, uint64_t *value) {
+	char *end;
+	unsigned long seconds;
+
+	seconds = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0') {
+		return 1;
+	}
+	*value = (uint64_t)seconds * 1000000;
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct archive_reader *reader;
+	struct archive_run run;
+	struct timespec start, end;
+	uint64_t from = 0, to = UINT64_MAX;
+	uint64_t runs = 0, samples = 0, present = 0;
+	uint64_t first = 0, last = 0;
+	double elapsed;
+	int opt, summary = 0;
+
+	while ((opt = getopt(argc, argv, "f:t:s")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (parse_time(optarg, &from)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			if (parse_time(optarg, &to)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc || to <= from) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (archive_reader_open(&reader, argv[optind])) {
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	archive_reader_seek(reader, from);
+	while (archive_reader_next(reader, &run) == 0) {
+		if (run.start + run.span < from) {
+			continue;
+		}
+		if (run.start >= to) {
+			break;
+		}
+		if (runs == 0) {
+			first = run.start;
+		}
+		last = run.start + run.span;
+		runs++;
+		samples += run.count;
+		if (run.value == 0xff) {
+			present += run.count;
+		}
+		if (!summary) {
+			printf("%lu.%06lu %02x %lu %lu\n",
+			    (unsigned long)(run.start / 1000000),
+			    (unsigned long)(run.start % 1000000),
+			    run.value,
+			    (unsigned long)run.count,
+			    (unsigned long)run.span);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (summary) {
+		printf("blocks = %lu\n", (unsigned long)reader->block_count);
+		printf("bad_blocks = %lu\n", (unsigned long)reader->bad_blocks);
+		printf("runs = %lu\n", (unsigned long)runs);
+		printf("samples = %lu\n", (unsigned long)samples);
+		printf("present = %lu\n", (unsigned long)present);
+		printf("first = %lu.%06lu\n",
+		    (unsigned long)(first / 1000000), (unsigned long)(first % 1000000));
+		printf("last = %lu.%06lu\n",
+		    (unsigned long)(last / 1000000), (unsigned long)(last % 1000000));
+		printf("bytes_per_sample = %.4f\n",
+		    samples ? (double)reader->size / samples : 0.0);
+		printf("decode = %.3f sec, %.1f Mruns/s, %.1f Msamples/s\n",
+		    elapsed, runs / elapsed / 1e6, samples / elapsed / 1e6);
+	} else if (reader->bad_blocks > 0) {
+		fprintf(stderr, "skipped %lu broken blocks.\n", (unsigned long)reader->bad_blocks);
+	}
+	archive_reader_close(reader);
+
+	return 0;
+}
@@ -0,0 +1,319 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "supervisor.h"
+
+/*
+ * systemd無しでソケットアクティベーションを試すための小さなランチャー
+ * -lのポートやunix domain socketのパスを自分でlistenしたまま、
+ * LISTEN_PID, LISTEN_FDSを付けてコマンドを起動し、終了したら起動し直す
+ * ソケットはランチャーが持ち続けるので、再起動の間の接続はbacklogで待たされる
+ * idsのように自分でデーモンになるコマンドは -p でpidファイルを指定すると、
+ * そのpidが終了したら起動し直す (SIGUSR2の入れ替えで変わったpidには付いていく)
+ */
+
+#define IDSLAUNCH_FD_LIMIT      16      /* 渡すsdの最大数 */
+#define IDSLAUNCH_FD_BASE       64      /* 起動するまでsdを置いておく番号 (渡す番号と重ならないように) */
+#define IDSLAUNCH_POLL_INTERVAL 100000  /* pidファイルとプロセスを見る間隔 (usec) */
+#define IDSLAUNCH_START_WAIT    100     /* pidファイルが書かれるのを待つ回数 */
+
+static void
+usage(char *cmd)
+{
+	printf("%s -l <port|path> [-l <port|path> ...] [-p <pid file>] <command> [args...]\n", cmd);
+}
+
+/* 渡すまで使わない番号に移してclose-on-execにする */
+static int
+move_fd(int fd) {
+	int new_fd;
+
+	new_fd = fcntl(fd, F_DUPFD_CLOEXEC, IDSLAUNCH_FD_BASE);
+	close(fd);
+
+	return new_fd;
+}
+
+/* TCPのポートを全てのアドレスでlistenする */
+static int
+listen_tcp(const char *port, int *sd, int sd_max) {
+	struct addrinfo hints, *res0, *res;
+	int count = 0;
+	int fd;
+	int on = 1;
+	int error;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	error = getaddrinfo(NULL, port, &hints, &res0);
+	if (error) {
+		fprintf(stderr, "failed in getaddrinfo (%s): %s.\n", port, gai_strerror(error));
+		return -1;
+	}
+	for (res = res0; res; res = res->ai_next) {
+		if (count >= sd_max) {
+			fprintf(stderr, "too many listen sockets.\n");
+			goto fail;
+		}
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+#ifdef IPV6_V6ONLY
+		if (res->ai_family == AF_INET6) {
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		}
+#endif
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+		    listen(fd, SOMAXCONN) < 0) {
+			fprintf(stderr, "failed in listen (%s): %s.\n", port, strerror(errno));
+			close(fd);
+			goto fail;
+		}
+		sd[count] = move_fd(fd);
+		if (sd[count] < 0) {
+			goto fail;
+		}
+		count++;
+	}
+	freeaddrinfo(res0);
+	if (count == 0) {
+		fprintf(stderr, "no address to listen (%s).\n", port);
+		return -1;
+	}
+
+	return count;
+
+fail:
+	while (count > 0) {
+		close(sd[--count]);
+	}
+	freeaddrinfo(res0);
+
+	return -1;
+}
+
+/* unix domain socketのパスでlistenする (残っているファイルは消す) */
+static int
+listen_unix(const char *path, int *sd) {
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "too long path (%s).\n", path);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failed in socket (%s): %s.\n", path, strerror(errno));
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "failed in listen (%s): %s.\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	*sd = move_fd(fd);
+
+	return (*sd < 0) ? -1 : 1;
+}
+
+/* sdをfd 3から並べてコマンドを起動し、終了を待ってexitの値を返す */
+static int
+launch(int *sd, int count, char **argv) {
+	char buf[32];
+	pid_t pid;
+	int status;
+	int i;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "failed in fork: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		for (i = 0; i < count; i++) {
+			if (dup2(sd[i], SUPERVISOR_LISTEN_FDS_START + i) < 0) {
+				_exit(127);
+			}
+		}
+		snprintf(buf, sizeof(buf), "%ld", (long)getpid());
+		setenv(SUPERVISOR_LISTEN_PID_ENV, buf, 1);
+		snprintf(buf, sizeof(buf), "%d", count);
+		setenv(SUPERVISOR_LISTEN_FDS_ENV, buf, 1);
+		execvp(argv[0], argv);
+		fprintf(stderr, "failed in exec (%s): %s.\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* pidファイルのpidが生きていればそれを、無ければ0を返す */
+static pid_t
+read_pid(const char *path) {
+	FILE *fp;
+	long pid;
+	int n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	n = fscanf(fp, "%ld", &pid);
+	fclose(fp);
+	if (n != 1 || pid <= 0) {
+		return 0;
+	}
+	if (kill((pid_t)pid, 0) < 0 && errno != EPERM) {
+		return 0;
+	}
+
+	return (pid_t)pid;
+}
+
+/* デーモンになったコマンドが終了するまで待つ */
+static int
+wait_daemon(const char *pid_file, pid_t *last) {
+	pid_t pid = 0;
+	int i;
+
+	/* 前のプロセスと違うpidが書かれるまで待つ */
+	for (i = 0; i < IDSLAUNCH_START_WAIT; i++) {
+		pid = read_pid(pid_file);
+		if (pid != 0 && pid != *last) {
+			break;
+		}
+		usleep(IDSLAUNCH_POLL_INTERVAL);
+	}
+	if (pid == 0 || pid == *last) {
+		fprintf(stderr, "no process in pid file (%s).\n", pid_file);
+		return 1;
+	}
+	printf("started %ld\n", (long)pid);
+	fflush(stdout);
+	while (pid != 0) {
+		*last = pid;
+		while (kill(pid, 0) == 0 || errno == EPERM) {
+			usleep(IDSLAUNCH_POLL_INTERVAL);
+		}
+		/* 入れ替えで新しいプロセスになっていればそちらを待つ */
+		pid = read_pid(pid_file);
+		if (pid == *last) {
+			pid = 0;
+		}
+		if (pid != 0) {
+			printf("upgraded %ld\n", (long)pid);
+			fflush(stdout);
+		}
+	}
+	printf("exited %ld\n", (long)*last);
+	fflush(stdout);
+	/* 落ちて残ったpidファイルがあると次のプロセスが二重起動とみなすので消す */
+	if (read_pid(pid_file) == 0) {
+		unlink(pid_file);
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int sd[IDSLAUNCH_FD_LIMIT];
+	int count = 0;
+	int n;
+	int opt;
+	int status;
+	char *pid_file = NULL;
+	pid_t last = 0;
+
+	while ((opt = getopt(argc, argv, "+l:p:")) != -1) {
+		switch (opt) {
+		case 'l':
+			if (strchr(optarg, '/') != NULL) {
+				if (count >= IDSLAUNCH_FD_LIMIT) {
+					fprintf(stderr, "too many listen sockets.\n");
+					return 1;
+				}
+				n = listen_unix(optarg, &sd[count]);
+			} else {
+				n = listen_tcp(optarg, &sd[count], IDSLAUNCH_FD_LIMIT - count);
+			}
+			if (n < 0) {
+				return 1;
+			}
+			count += n;
+			break;
+		case 'p':
+			pid_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc || count == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	while (1) {
+		status = launch(sd, count, &argv[optind]);
+		if (status != 0) {
+			fprintf(stderr, "command exited with %d.\n", status);
+			return 1;
+		}
+		if (pid_file != NULL && wait_daemon(pid_file, &last)) {
+			return 1;
+		}
+		usleep(IDSLAUNCH_POLL_INTERVAL);
+	}
+
+	/* NOT REACHED */
+	return 0;
+}
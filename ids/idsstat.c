@@ -0,0 +1,127 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "status_page.h"
+
+/*
+ * idsデーモンが共有メモリに置いた状態を表示する
+ * -b <回数> で読み込みのベンチマークをする
+ */
+
+static const char *alert_status_string[] = {
+	"GOOD",
+	"FIRST ALERT",
+	"SECOND ALERT",
+};
+
+static void
+usage(char *cmd)
+{
+	printf("%s [-n <status page name>] [-b <count>]\n", cmd);
+}
+
+static void
+print_snapshot(const struct status_page_snapshot *snapshot) {
+	printf("pid = %lu\n", (unsigned long)snapshot->pid);
+	printf("alert_status = %s\n",
+	    (snapshot->alert_status < sizeof(alert_status_string) / sizeof(alert_status_string[0])) ?
+	    alert_status_string[snapshot->alert_status] : "UNKNOWN");
+	printf("monitor_status = %s\n", snapshot->execute_alert ? "RUNNING" : "STOPPING");
+	printf("presence = %lu\n", (unsigned long)snapshot->presence);
+	printf("detect_count = %lu\n", (unsigned long)snapshot->detect_count);
+	printf("last_sample = %lu.%06lu\n",
+	    (unsigned long)snapshot->last_sample_sec,
+	    (unsigned long)snapshot->last_sample_usec);
+	printf("sample_count = %lu\n", (unsigned long)snapshot->sample_count);
+	printf("error_count = %lu\n", (unsigned long)snapshot->error_count);
+	printf("first_alert_count = %lu\n", (unsigned long)snapshot->first_alert_count);
+	printf("second_alert_count = %lu\n", (unsigned long)snapshot->second_alert_count);
+}
+
+static int
+bench(struct status_page *page, long count) {
+	struct status_page_snapshot snapshot;
+	struct timespec start, end;
+	double elapsed;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		if (status_page_read(page, &snapshot)) {
+			fprintf(stderr, "failed in read status page.\n");
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("%ld reads, %.1f ns/read\n", count, elapsed / count);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = STATUS_PAGE_DEFAULT_NAME;
+	struct status_page *page;
+	struct status_page_snapshot snapshot;
+	long count = 0;
+	int opt, error = 0;
+
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'b':
+			count = strtol(optarg, NULL, 10);
+			if (count <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (status_page_open(&page, name)) {
+		fprintf(stderr, "failed in open status page (%s).\n", name);
+		return 1;
+	}
+	if (count > 0) {
+		error = bench(page, count);
+	} else if (status_page_read(page, &snapshot)) {
+		fprintf(stderr, "failed in read status page.\n");
+		error = 1;
+	} else {
+		print_snapshot(&snapshot);
+	}
+	status_page_destroy(page);
+
+	return error;
+}
@@ -0,0 +1,764 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "archive.h"
+#include "detector.h"
+
+/*
+ * サンプルのアーカイブを読み直して、poll_intervalとalert_thresholdの組み合わせごとに
+ * 検出までの時間と誤報の数を出す
+ *
+ * 正解は記録そのものから作る。人がいた区間を間隔が -g 以下なら繋ぎ、
+ * -m 以上続いたものを人が来たevent、それ以外の警報を誤報とする。
+ * poll_intervalごとに記録をその間隔のサンプルに取り直し (各時刻の直前のサンプルの値)、
+ * 人がいたかを1ビットにしたビットマップを作る。
+ * ビットマップは64サンプルずつ見て同じ値が続く区間にまとめ、
+ * 区間ごとにSWEEP_LANES個のalert_thresholdをまとめてdetector_feedに入れる。
+ * 仕事は (poll_interval, alert_thresholdのまとまり) ごとに分けて、スレッドで並べて処理する。
+ */
+
+#define SWEEP_CHUNK_WORDS      16384  /* 1回に作るビットマップの語数 (約100万サンプル) */
+#define SWEEP_CHUNK_BITS       (SWEEP_CHUNK_WORDS * 64)
+#define SWEEP_LANES            64     /* 1つの仕事でまとめて評価するalert_thresholdの数 */
+#define SWEEP_USEC             UINT64_C(1000000)
+
+struct sweep_range {
+	unsigned long from;
+	unsigned long to;
+	unsigned long step;
+};
+
+/* 人が来た区間 (usec) */
+struct sweep_event {
+	uint64_t start;
+	uint64_t end;
+};
+
+/* 組み合わせごとの結果 */
+struct sweep_result {
+	unsigned long detected;        /* 警報を出せたevent数 */
+	uint64_t latency_sum;          /* eventの始まりから最初の警報までの時間の合計 (usec) */
+	uint64_t latency_max;
+	unsigned long false_alarms;    /* event以外で出した警報の数 */
+};
+
+struct sweep {
+	const char *path;
+	uint64_t from;                 /* 評価する時間 [from, to) (usec) */
+	uint64_t to;
+	uint64_t hold;                 /* サンプルの値を保つ最長の時間 (usec) */
+	struct sweep_event *events;
+	size_t event_count;
+	unsigned long *intervals;
+	size_t interval_count;
+	unsigned long *thresholds;
+	size_t threshold_count;
+	size_t group_count;            /* alert_thresholdのまとまりの数 */
+	struct sweep_result *results;  /* [interval][threshold] */
+	struct sweep_result *checks;   /* -cのときに1サンプルずつ評価した結果 */
+	size_t next_job;
+	int failed;
+};
+
+/* アーカイブのrunを、その値が続いていた区間 [begin, end) にして返す */
+struct sweep_cursor {
+	struct archive_reader *reader;
+	struct archive_run next;
+	int has_next;
+	uint64_t hold;
+};
+
+/* 1つの仕事の途中の状態 */
+struct sweep_job {
+	struct sweep *sweep;
+	uint64_t interval;
+	const unsigned long *thresholds;
+	size_t lanes;
+	struct sweep_result *results;
+	unsigned long count[SWEEP_LANES];  /* 連続検出回数 */
+	int hit[SWEEP_LANES];              /* 今のeventで警報を出したか */
+	int zero;                          /* 全てのcountが0か */
+};
+
+static void
+usage(char *cmd)
+{
+	printf("%s [-f <from>] [-t <to>] [-T <threshold from>:<to>[:<step>]]\n"
+	    "    [-P <poll_interval from>:<to>[:<step>]] [-m <event msec>] [-g <gap msec>]\n"
+	    "    [-j <threads>] [-c] <archive file>\n", cmd);
+}
+
+static int
+parse_range(const char *str, struct sweep_range *range) {
+	char *end;
+
+	range->from = strtoul(str, &end, 10);
+	range->to = range->from;
+	range->step = 1;
+	if (*end == ':') {
+		range->to = strtoul(end + 1, &end, 10);
+		if (*end == ':') {
+			range->step = strtoul(end + 1, &end, 10);
+		}
+	}
+	if (str[0] == '\0' || *end != '\0' ||
+	    range->from == 0 || range->to < range->from || range->step == 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned long *
+expand_range(const struct sweep_range *range, size_t *count) {
+	unsigned long *values;
+	unsigned long value;
+	size_t i = 0;
+
+	*count = (range->to - range->from) / range->step + 1;
+	values = malloc(sizeof(unsigned long) * *count);
+	if (values == NULL) {
+		return NULL;
+	}
+	for (value = range->from; i < *count; value += range->step) {
+		values[i++] = value;
+	}
+
+	return values;
+}
+
+static int
+parse_number(const char *str, unsigned long *value) {
+	char *end;
+
+	*value = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0') {
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+cursor_open(struct sweep_cursor *cursor, const char *path, uint64_t from, uint64_t hold) {
+	if (archive_reader_open(&cursor->reader, path)) {
+		return 1;
+	}
+	archive_reader_seek(cursor->reader, (from > hold) ? from - hold : 0);
+	cursor->has_next = (archive_reader_next(cursor->reader, &cursor->next) == 0);
+	cursor->hold = hold;
+
+	return 0;
+}
+
+static void
+cursor_close(struct sweep_cursor *cursor) {
+	archive_reader_close(cursor->reader);
+}
+
+/* 終わりなら1を返す */
+static int
+cursor_next(struct sweep_cursor *cursor, uint8_t *value, uint64_t *begin, uint64_t *end) {
+	struct archive_run run;
+	uint64_t last;
+
+	if (!cursor->has_next) {
+		return 1;
+	}
+	run = cursor->next;
+	cursor->has_next = (archive_reader_next(cursor->reader, &cursor->next) == 0);
+	last = run.start + run.span;
+	*value = run.value;
+	*begin = run.start;
+	*end = last + cursor->hold;
+	/* 次のrunが間を空けずに続いていればそこまで */
+	if (cursor->has_next && cursor->next.start >= last && cursor->next.start < *end) {
+		*end = cursor->next.start;
+	}
+
+	return 0;
+}
+
+/* 時刻以降の最初のサンプルの番号 */
+static uint64_t
+sample_index(const struct sweep *sweep, uint64_t interval, uint64_t sample_time) {
+	if (sample_time <= sweep->from) {
+		return 0;
+	}
+	if (sample_time >= sweep->to) {
+		sample_time = sweep->to;
+	}
+
+	return (sample_time - sweep->from + interval - 1) / interval;
+}
+
+/* ビットマップの [lo, hi) を1にする */
+static void
+set_bits(uint64_t *bitmap, uint64_t lo, uint64_t hi) {
+	uint64_t lo_word = lo >> 6, hi_word = hi >> 6;
+	uint64_t lo_mask = ~UINT64_C(0) << (lo & 63);
+	uint64_t hi_mask = (hi & 63) ? ~UINT64_C(0) >> (64 - (hi & 63)) : 0;
+	uint64_t i;
+
+	if (lo >= hi) {
+		return;
+	}
+	if (lo_word == hi_word) {
+		bitmap[lo_word] |= lo_mask & hi_mask;
+		return;
+	}
+	bitmap[lo_word] |= lo_mask;
+	for (i = lo_word + 1; i < hi_word; i++) {
+		bitmap[i] = ~UINT64_C(0);
+	}
+	if (hi_mask) {
+		bitmap[hi_word] |= hi_mask;
+	}
+}
+
+/* posから同じ値が続く区間の終わり (limitまで) を返し、その値をvalueに入れる */
+static uint64_t
+run_end(const uint64_t *bitmap, uint64_t pos, uint64_t limit, int *value) {
+	uint64_t word = pos >> 6;
+	uint64_t fill, diff, end;
+
+	*value = (int)((bitmap[word] >> (pos & 63)) & 1);
+	fill = *value ? ~UINT64_C(0) : 0;
+	diff = (bitmap[word] ^ fill) & (~UINT64_C(0) << (pos & 63));
+	/* 64サンプルずつ同じ値の語を読み飛ばす */
+	while (diff == 0) {
+		if (++word * 64 >= limit) {
+			return limit;
+		}
+		diff = bitmap[word] ^ fill;
+	}
+	end = word * 64 + (uint64_t)__builtin_ctzll(diff);
+
+	return (end < limit) ? end : limit;
+}
+
+/* 同じ値がn個続く区間をまとめてのalert_thresholdに入れる */
+static void
+job_feed(
+    struct sweep_job *job,
+    int presence,
+    uint64_t index,
+    uint64_t n,
+    int in_event,
+    uint64_t event_index)
+{
+	struct sweep_result *result;
+	unsigned long alerts, first;
+	uint64_t latency;
+	size_t lane;
+
+	if (!presence) {
+		if (!job->zero) {
+			memset(job->count, 0, sizeof(job->count));
+			job->zero = 1;
+		}
+		return;
+	}
+	job->zero = 0;
+	for (lane = 0; lane < job->lanes; lane++) {
+		alerts = detector_feed(&job->count[lane], job->thresholds[lane], 1, (unsigned long)n, &first);
+		if (alerts == 0) {
+			continue;
+		}
+		result = &job->results[lane];
+		if (!in_event) {
+			result->false_alarms += alerts;
+		} else if (!job->hit[lane]) {
+			job->hit[lane] = 1;
+			latency = (index + first - event_index) * job->interval;
+			result->detected++;
+			result->latency_sum += latency;
+			if (latency > result->latency_max) {
+				result->latency_max = latency;
+			}
+		}
+	}
+}
+
+/* ビットマップを同じ値が続く区間に分けて入れる (eventの境目でも分ける) */
+static void
+job_scan(
+    struct sweep_job *job,
+    const uint64_t *bitmap,
+    uint64_t base,
+    uint64_t nbits,
+    uint64_t total,
+    size_t *event,
+    size_t *entered)
+{
+	struct sweep *sweep = job->sweep;
+	uint64_t pos = 0, index, limit, end;
+	uint64_t event_start = 0, event_end = 0;
+	int value, in_event;
+
+	while (pos < nbits) {
+		index = base + pos;
+		/* 終わったeventと、サンプルに取り直すと空になるeventを飛ばす */
+		while (*event < sweep->event_count) {
+			event_start = sample_index(sweep, job->interval, sweep->events[*event].start);
+			event_end = sample_index(sweep, job->interval, sweep->events[*event].end);
+			if (event_end > index && event_end > event_start) {
+				break;
+			}
+			(*event)++;
+		}
+		in_event = (*event < sweep->event_count && event_start <= index);
+		if (in_event && *entered != *event) {
+			memset(job->hit, 0, sizeof(job->hit));
+			*entered = *event;
+		}
+		if (in_event) {
+			limit = event_end;
+		} else if (*event < sweep->event_count) {
+			limit = event_start;
+		} else {
+			limit = total;
+		}
+		limit = (limit - base < nbits) ? limit - base : nbits;
+		end = run_end(bitmap, pos, limit, &value);
+		job_feed(job, value, index, end - pos, in_event, event_start);
+		pos = end;
+	}
+}
+
+/* 1サンプルずつdetector_feedに入れて数える (-cでjob_scanと比べる) */
+static void
+job_check(
+    struct sweep_job *job,
+    const uint64_t *bitmap,
+    uint64_t base,
+    uint64_t nbits,
+    size_t *event,
+    size_t *entered)
+{
+	struct sweep *sweep = job->sweep;
+	uint64_t pos, index;
+	uint64_t event_start = 0, event_end = 0;
+	int in_event;
+
+	for (pos = 0; pos < nbits; pos++) {
+		index = base + pos;
+		while (*event < sweep->event_count) {
+			event_start = sample_index(sweep, job->interval, sweep->events[*event].start);
+			event_end = sample_index(sweep, job->interval, sweep->events[*event].end);
+			if (event_end > index && event_end > event_start) {
+				break;
+			}
+			(*event)++;
+		}
+		in_event = (*event < sweep->event_count && event_start <= index);
+		if (in_event && *entered != *event) {
+			memset(job->hit, 0, sizeof(job->hit));
+			*entered = *event;
+		}
+		job_feed(job, (int)((bitmap[pos >> 6] >> (pos & 63)) & 1), index, 1, in_event, event_start);
+	}
+}
+
+/* 1つのpoll_intervalと、SWEEP_LANES個までのalert_thresholdを評価する */
+static int
+job_run(
+    struct sweep *sweep,
+    size_t job_index,
+    uint64_t *bitmap,
+    int check)
+{
+	struct sweep_job job, check_job;
+	struct sweep_cursor cursor;
+	size_t interval_index = job_index / sweep->group_count;
+	size_t group = job_index % sweep->group_count;
+	size_t offset = interval_index * sweep->threshold_count + group * SWEEP_LANES;
+	size_t event = 0, entered = (size_t)-1;
+	size_t check_event = 0, check_entered = (size_t)-1;
+	uint64_t total, base, nbits, lo, hi;
+	uint64_t begin = 0, end = 0;
+	uint8_t value = 0;
+	int pending = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.sweep = sweep;
+	job.interval = sweep->intervals[interval_index];
+	job.thresholds = &sweep->thresholds[group * SWEEP_LANES];
+	job.lanes = sweep->threshold_count - group * SWEEP_LANES;
+	if (job.lanes > SWEEP_LANES) {
+		job.lanes = SWEEP_LANES;
+	}
+	job.results = &sweep->results[offset];
+	check_job = job;
+	if (check) {
+		check_job.results = &sweep->checks[offset];
+	}
+	if (cursor_open(&cursor, sweep->path, sweep->from, sweep->hold)) {
+		return 1;
+	}
+	total = sample_index(sweep, job.interval, sweep->to);
+	for (base = 0; base < total; base += nbits) {
+		nbits = (total - base < SWEEP_CHUNK_BITS) ? total - base : SWEEP_CHUNK_BITS;
+		/* 人がいたサンプルのビットを立てる */
+		memset(bitmap, 0, SWEEP_CHUNK_WORDS * sizeof(uint64_t));
+		for (;;) {
+			if (!pending) {
+				if (cursor_next(&cursor, &value, &begin, &end)) {
+					break;
+				}
+				pending = 1;
+			}
+			lo = sample_index(sweep, job.interval, begin);
+			hi = sample_index(sweep, job.interval, end);
+			if (lo >= base + nbits) {
+				break;
+			}
+			if (value == 0xff && hi > base) {
+				set_bits(bitmap,
+				    ((lo > base) ? lo : base) - base,
+				    ((hi < base + nbits) ? hi : base + nbits) - base);
+			}
+			if (hi > base + nbits) {
+				break;
+			}
+			pending = 0;
+		}
+		job_scan(&job, bitmap, base, nbits, total, &event, &entered);
+		if (check) {
+			job_check(&check_job, bitmap, base, nbits, &check_event, &check_entered);
+		}
+	}
+	cursor_close(&cursor);
+
+	return 0;
+}
+
+static void *
+sweep_main(void *args) {
+	struct sweep *sweep = args;
+	uint64_t *bitmap;
+	size_t job_index;
+
+	bitmap = malloc(SWEEP_CHUNK_WORDS * sizeof(uint64_t));
+	if (bitmap == NULL) {
+		__atomic_store_n(&sweep->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	for (;;) {
+		job_index = __atomic_fetch_add(&sweep->next_job, 1, __ATOMIC_RELAXED);
+		if (job_index >= sweep->interval_count * sweep->group_count) {
+			break;
+		}
+		if (job_run(sweep, job_index, bitmap, (sweep->checks != NULL))) {
+			__atomic_store_n(&sweep->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	free(bitmap);
+
+	return NULL;
+}
+
+/*
+ * 1回目で記録のポーリング間隔を見積もり、2回目で人が来たeventを作る
+ * from, toが0なら記録の最初と最後にする
+ */
+static int
+sweep_prepare(struct sweep *sweep, uint64_t event_min, uint64_t event_gap) {
+	struct archive_reader *reader;
+	struct archive_run run;
+	struct sweep_cursor cursor;
+	struct sweep_event current, *events;
+	uint64_t spans = 0, intervals = 0, first = 0, last = 0;
+	uint64_t begin, end;
+	size_t size = 0;
+	uint8_t value;
+	int open = 0;
+
+	if (archive_reader_open(&reader, sweep->path)) {
+		return 1;
+	}
+	while (archive_reader_next(reader, &run) == 0) {
+		if (first == 0) {
+			first = run.start;
+		}
+		if (run.start + run.span > last) {
+			last = run.start + run.span;
+		}
+		if (run.count > 1) {
+			spans += run.span;
+			intervals += run.count - 1;
+		}
+	}
+	archive_reader_close(reader);
+	if (intervals == 0 || spans == 0) {
+		fprintf(stderr, "archive file (%s) has no samples.\n", sweep->path);
+		return 1;
+	}
+	/* archive_addがrunを切るのと同じ間隔まで値を保つ */
+	sweep->hold = spans / intervals * ARCHIVE_GAP_FACTOR;
+	if (sweep->from == 0) {
+		sweep->from = first;
+	}
+	if (sweep->to == 0) {
+		sweep->to = last + 1;
+	}
+	if (sweep->to <= sweep->from) {
+		fprintf(stderr, "no samples in the range.\n");
+		return 1;
+	}
+	if (cursor_open(&cursor, sweep->path, sweep->from, sweep->hold)) {
+		return 1;
+	}
+	memset(&current, 0, sizeof(current));
+	while (cursor_next(&cursor, &value, &begin, &end) == 0) {
+		if (value != 0xff || end <= sweep->from) {
+			continue;
+		}
+		if (begin >= sweep->to) {
+			break;
+		}
+		if (open && begin <= current.end + event_gap) {
+			if (end > current.end) {
+				current.end = end;
+			}
+			continue;
+		}
+		if (open && current.end - current.start >= event_min) {
+			if (sweep->event_count == size) {
+				size = size ? size * 2 : 1024;
+				events = realloc(sweep->events, sizeof(struct sweep_event) * size);
+				if (events == NULL) {
+					cursor_close(&cursor);
+					return 1;
+				}
+				sweep->events = events;
+			}
+			sweep->events[sweep->event_count++] = current;
+		}
+		current.start = begin;
+		current.end = end;
+		open = 1;
+	}
+	cursor_close(&cursor);
+	if (open && current.end - current.start >= event_min) {
+		events = realloc(sweep->events, sizeof(struct sweep_event) * (sweep->event_count + 1));
+		if (events == NULL) {
+			return 1;
+		}
+		sweep->events = events;
+		sweep->events[sweep->event_count++] = current;
+	}
+
+	return 0;
+}
+
+static int
+sweep_compare(const struct sweep_result *a, const struct sweep_result *b) {
+	return a->detected != b->detected ||
+	    a->latency_sum != b->latency_sum ||
+	    a->latency_max != b->latency_max ||
+	    a->false_alarms != b->false_alarms;
+}
+
+static void
+sweep_print(const struct sweep *sweep) {
+	const struct sweep_result *result;
+	double days = (double)(sweep->to - sweep->from) / SWEEP_USEC / 86400;
+	size_t i, j;
+
+	printf("# events = %lu, days = %.3f, sample interval = %lu usec\n",
+	    (unsigned long)sweep->event_count, days,
+	    (unsigned long)(sweep->hold / ARCHIVE_GAP_FACTOR));
+	printf("# poll_interval alert_threshold detected detect_rate latency_mean_ms latency_max_ms false_alarms false_per_day\n");
+	for (i = 0; i < sweep->interval_count; i++) {
+		for (j = 0; j < sweep->threshold_count; j++) {
+			result = &sweep->results[i * sweep->threshold_count + j];
+			printf("%lu %lu %lu %.4f %.1f %.1f %lu %.2f\n",
+			    sweep->intervals[i],
+			    sweep->thresholds[j],
+			    result->detected,
+			    sweep->event_count ? (double)result->detected / sweep->event_count : 0.0,
+			    result->detected ? (double)result->latency_sum / result->detected / 1000 : 0.0,
+			    (double)result->latency_max / 1000,
+			    result->false_alarms,
+			    (days > 0) ? result->false_alarms / days : 0.0);
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sweep sweep;
+	struct sweep_range threshold_range = { 1, 100, 1 };
+	struct sweep_range interval_range = { 5000, 50000, 5000 };
+	struct timespec start, end;
+	pthread_t *threads = NULL;
+	unsigned long event_min = 2000, event_gap = 500, value;
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	long started = 0, i;
+	size_t combos, j;
+	double elapsed, samples = 0;
+	int opt, check = 0, error = 1;
+
+	memset(&sweep, 0, sizeof(sweep));
+	while ((opt = getopt(argc, argv, "f:t:T:P:m:g:j:c")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (parse_number(optarg, &value)) {
+				usage(argv[0]);
+				return 1;
+			}
+			sweep.from = (uint64_t)value * SWEEP_USEC;
+			break;
+		case 't':
+			if (parse_number(optarg, &value)) {
+				usage(argv[0]);
+				return 1;
+			}
+			sweep.to = (uint64_t)value * SWEEP_USEC;
+			break;
+		case 'T':
+			if (parse_range(optarg, &threshold_range)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'P':
+			if (parse_range(optarg, &interval_range)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (parse_number(optarg, &event_min)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'g':
+			if (parse_number(optarg, &event_gap)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			if (parse_number(optarg, &value) || value == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			thread_count = (long)value;
+			break;
+		case 'c':
+			check = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (thread_count <= 0) {
+		thread_count = 1;
+	}
+	sweep.path = argv[optind];
+	sweep.thresholds = expand_range(&threshold_range, &sweep.threshold_count);
+	sweep.intervals = expand_range(&interval_range, &sweep.interval_count);
+	if (sweep.thresholds == NULL || sweep.intervals == NULL) {
+		goto finish;
+	}
+	sweep.group_count = (sweep.threshold_count + SWEEP_LANES - 1) / SWEEP_LANES;
+	combos = sweep.interval_count * sweep.threshold_count;
+	sweep.results = calloc(combos, sizeof(struct sweep_result));
+	if (sweep.results == NULL) {
+		goto finish;
+	}
+	if (check) {
+		sweep.checks = calloc(combos, sizeof(struct sweep_result));
+		if (sweep.checks == NULL) {
+			goto finish;
+		}
+	}
+	if (sweep_prepare(&sweep, (uint64_t)event_min * 1000, (uint64_t)event_gap * 1000)) {
+		goto finish;
+	}
+	threads = malloc(sizeof(pthread_t) * (size_t)thread_count);
+	if (threads == NULL) {
+		goto finish;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(&threads[i], NULL, sweep_main, &sweep)) {
+			fprintf(stderr, "failed in create thread.\n");
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (started == 0 || sweep.failed) {
+		goto finish;
+	}
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	for (j = 0; j < sweep.interval_count; j++) {
+		samples += (double)((sweep.to - sweep.from) / sweep.intervals[j]) * sweep.threshold_count;
+	}
+	sweep_print(&sweep);
+	fprintf(stderr, "%lu combinations, %ld threads, %.3f sec, %.1f G sample-evaluations/s\n",
+	    (unsigned long)combos, started, elapsed, samples / elapsed / 1e9);
+	error = 0;
+	if (check) {
+		for (j = 0; j < combos; j++) {
+			if (sweep_compare(&sweep.results[j], &sweep.checks[j])) {
+				fprintf(stderr, "check failed (poll_interval = %lu, alert_threshold = %lu).\n",
+				    sweep.intervals[j / sweep.threshold_count],
+				    sweep.thresholds[j % sweep.threshold_count]);
+				error = 1;
+			}
+		}
+		if (!error) {
+			fprintf(stderr, "check ok.\n");
+		}
+	}
+
+finish:
+	free(threads);
+	free(sweep.events);
+	free(sweep.results);
+	free(sweep.checks);
+	free(sweep.intervals);
+	free(sweep.thresholds);
+
+	return error;
+}
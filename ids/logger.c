@@ -0,0 +1,378 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "stats.h"
+#include "logger.h"
+
+#define LOGGER_LINE_SIZE  (LOGGER_RECORD_SIZE + 96)  /* 時刻などを付けた1行の大きさ */
+#define LOGGER_NO_RING    LOGGER_RING_MAX            /* リングを割り当てられなかったスレッド */
+
+struct logger_record {
+	struct timeval time;
+	const char *event;
+	int level;
+	char text[LOGGER_RECORD_SIZE];
+};
+
+/*
+ * 書くスレッド1つと書き出しスレッドのリング
+ * headとtailは別のスレッドが書くのでキャッシュラインを分ける
+ */
+struct logger_ring {
+	uint64_t head __attribute__((aligned(64)));  /* 次に書く位置 (書くスレッドだけが進める) */
+	uint64_t tail __attribute__((aligned(64)));  /* 次に読む位置 (書き出しスレッドだけが進める) */
+	struct logger_record records[LOGGER_RING_SIZE];
+};
+
+struct logger {
+	struct logger_ring rings[LOGGER_RING_MAX];
+	int ring_count;                 /* 割り当てたリングの数 */
+	int level;                      /* これより詳しいレベルは捨てる */
+	char *path;
+	int fd;                         /* 書き出し先、syslogなら-1 */
+	pthread_t thread;
+	int running;                    /* 書き出しスレッドが動いている */
+	int stop;                       /* 書き出しスレッドへの終了の指示 */
+	int reopen;                     /* 書き出しスレッドへの開き直しの指示 */
+	char buffer[LOGGER_BATCH * LOGGER_LINE_SIZE];  /* 書き出しスレッドが使う */
+};
+
+static struct logger ids_logger = {
+	.level = LOGGER_INFO,
+	.fd = STDERR_FILENO,
+};
+
+/* このスレッドのリングの番号、-1なら未割り当て */
+static __thread int logger_ring_index = -1;
+
+static const char *logger_level_name[] = {
+	"error",
+	"warn",
+	"info",
+	"debug",
+};
+
+static const int logger_priority[] = {
+	LOG_ERR,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_DEBUG,
+};
+
+/* 1行に整形して長さを返す */
+static size_t
+logger_format(const struct logger_record *record, char *buffer, size_t size) {
+	struct tm tm;
+	char date[32];
+	int length;
+
+	localtime_r(&record->time.tv_sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+	length = snprintf(buffer, size, "%s.%06ld level=%s event=%s%s%s\n",
+	    date, (long)record->time.tv_usec,
+	    logger_level_name[record->level], record->event,
+	    (record->text[0] != '\0') ? " " : "", record->text);
+	if (length < 0) {
+		return 0;
+	}
+	/* 入りきらなければ切り詰めて改行で終える */
+	if ((size_t)length >= size) {
+		length = (int)size - 1;
+		buffer[length - 1] = '\n';
+	}
+
+	return (size_t)length;
+}
+
+/* 全部書く。書けなかった分は捨てる */
+static void
+logger_flush(int fd, const char *buffer, size_t length) {
+	ssize_t n;
+
+	while (length > 0) {
+		n = write(fd, buffer, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buffer += n;
+		length -= (size_t)n;
+	}
+}
+
+/* 書き出し先を開く (開き直す場合は開けなければ前のまま) */
+static int
+logger_open(void) {
+	int fd;
+
+	if (strcmp(ids_logger.path, LOGGER_SYSLOG) == 0) {
+		if (ids_logger.fd != -1) {
+			openlog("ids", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+			ids_logger.fd = -1;
+		}
+		return 0;
+	}
+	if (ids_logger.path[0] == '\0') {
+		ids_logger.fd = STDERR_FILENO;
+		return 0;
+	}
+	fd = open(ids_logger.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed in open log file (%s: %s).\n",
+		    ids_logger.path, strerror(errno));
+		return 1;
+	}
+	if (ids_logger.fd > STDERR_FILENO) {
+		close(ids_logger.fd);
+	}
+	ids_logger.fd = fd;
+
+	return 0;
+}
+
+/*
+ * 全てのリングから書き出す
+ * 書き出したレコードの数を返す
+ */
+static int
+logger_drain(void) {
+	struct logger_ring *ring;
+	struct logger_record *record;
+	uint64_t head, tail;
+	size_t length;
+	int ring_count;
+	int total = 0;
+	int i, n;
+
+	ring_count = __atomic_load_n(&ids_logger.ring_count, __ATOMIC_ACQUIRE);
+	if (ring_count > LOGGER_RING_MAX) {
+		ring_count = LOGGER_RING_MAX;
+	}
+	for (i = 0; i < ring_count; i++) {
+		ring = &ids_logger.rings[i];
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			length = 0;
+			for (n = 0; tail != head && n < LOGGER_BATCH; n++, tail++) {
+				record = &ring->records[tail & (LOGGER_RING_SIZE - 1)];
+				if (ids_logger.fd == -1) {
+					syslog(logger_priority[record->level], "event=%s %s",
+					    record->event, record->text);
+				} else {
+					length += logger_format(record, &ids_logger.buffer[length],
+					    sizeof(ids_logger.buffer) - length);
+				}
+			}
+			if (length > 0) {
+				logger_flush(ids_logger.fd, ids_logger.buffer, length);
+			}
+			/* 書き終えてから空ける */
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			total += n;
+		}
+	}
+
+	return total;
+}
+
+/* 書き出しスレッド */
+static void *
+logger_main(void *args) {
+	struct timespec interval;
+	int stop;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = LOGGER_FLUSH_INTERVAL * 1000000L;
+	while (1) {
+		/* 終了の指示より前に書かれたレコードは全て書き出してから抜ける */
+		stop = __atomic_load_n(&ids_logger.stop, __ATOMIC_ACQUIRE);
+		if (__atomic_exchange_n(&ids_logger.reopen, 0, __ATOMIC_ACQ_REL)) {
+			logger_open();
+		}
+		if (logger_drain() > 0) {
+			continue;
+		}
+		if (stop) {
+			break;
+		}
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/* このスレッドのリング、割り当てられなければNULL */
+static struct logger_ring *
+logger_ring(void) {
+	int index = logger_ring_index;
+
+	if (index < 0) {
+		index = __atomic_fetch_add(&ids_logger.ring_count, 1, __ATOMIC_ACQ_REL);
+		if (index >= LOGGER_RING_MAX) {
+			index = LOGGER_NO_RING;
+		}
+		logger_ring_index = index;
+	}
+	if (index == LOGGER_NO_RING) {
+		return NULL;
+	}
+
+	return &ids_logger.rings[index];
+}
+
+int
+logger_start(const char *path, int level) {
+	sigset_t mask, old_mask;
+	int error;
+
+	if (path == NULL ||
+	    level < LOGGER_ERROR || level > LOGGER_DEBUG) {
+		fprintf(stderr, "invalid argument\n");
+		return 1;
+	}
+	ids_logger.path = strdup(path);
+	if (ids_logger.path == NULL) {
+		fprintf(stderr, "failed in allocate memory of log path.\n");
+		return 1;
+	}
+	if (logger_open()) {
+		goto fail;
+	}
+	ids_logger.level = level;
+	ids_logger.stop = 0;
+	ids_logger.reopen = 0;
+	/* シグナルは全てメインスレッドで受ける */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	error = pthread_create(&ids_logger.thread, NULL, logger_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (error) {
+		fprintf(stderr, "failed in create log thread (%s).\n", strerror(error));
+		goto fail;
+	}
+	__atomic_store_n(&ids_logger.running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+
+fail:
+	if (ids_logger.fd > STDERR_FILENO) {
+		close(ids_logger.fd);
+	}
+	ids_logger.fd = STDERR_FILENO;
+	free(ids_logger.path);
+	ids_logger.path = NULL;
+
+	return 1;
+}
+
+void
+logger_finish(void) {
+	if (!ids_logger.running) {
+		return;
+	}
+	/* これから書かれるものはstderrに直接書く */
+	__atomic_store_n(&ids_logger.running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&ids_logger.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(ids_logger.thread, NULL);
+	if (ids_logger.fd == -1) {
+		closelog();
+	} else if (ids_logger.fd > STDERR_FILENO) {
+		close(ids_logger.fd);
+	}
+	ids_logger.fd = STDERR_FILENO;
+	free(ids_logger.path);
+	ids_logger.path = NULL;
+}
+
+void
+logger_set_level(int level) {
+	if (level < LOGGER_ERROR || level > LOGGER_DEBUG) {
+		return;
+	}
+	__atomic_store_n(&ids_logger.level, level, __ATOMIC_RELAXED);
+}
+
+void
+logger_reopen(void) {
+	__atomic_store_n(&ids_logger.reopen, 1, __ATOMIC_RELEASE);
+}
+
+void
+logger_write(int level, const char *event, const char *format, ...) {
+	struct logger_ring *ring;
+	struct logger_record *record;
+	struct logger_record direct;
+	char line[LOGGER_LINE_SIZE];
+	uint64_t head, tail;
+	va_list ap;
+
+	if (level > __atomic_load_n(&ids_logger.level, __ATOMIC_RELAXED)) {
+		return;
+	}
+	if (!__atomic_load_n(&ids_logger.running, __ATOMIC_ACQUIRE)) {
+		/* 書き出しスレッドがいないので直接書く */
+		record = &direct;
+	} else {
+		ring = logger_ring();
+		if (ring == NULL) {
+			stats_add(STATS_LOG_DROPPED, 1);
+			return;
+		}
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - tail >= LOGGER_RING_SIZE) {
+			/* 一杯なので待たずに捨てる */
+			stats_add(STATS_LOG_DROPPED, 1);
+			return;
+		}
+		record = &ring->records[head & (LOGGER_RING_SIZE - 1)];
+	}
+	gettimeofday(&record->time, NULL);
+	record->event = event;
+	record->level = level;
+	va_start(ap, format);
+	vsnprintf(record->text, sizeof(record->text), format, ap);
+	va_end(ap);
+	if (record == &direct) {
+		logger_flush(STDERR_FILENO, line, logger_format(record, line, sizeof(line)));
+		return;
+	}
+	/* レコードを書き終えてから書き出しスレッドに見せる */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+ * 非同期のログ
+ *
+ * logger_writeはレコードを書いたスレッドのリングに入れるだけで、書き込みはしない。
+ * 書き出しスレッドがリングからまとめて取り出して、ファイル (またはstderr, syslog) に書く。
+ * リングは書くスレッドと書き出しスレッドの2つだけが触るのでロックはとらない。
+ * リングが一杯ならそのレコードは捨てて ids_log_dropped_total を増やす
+ * (ポーリングを止めないことを優先する)。
+ *
+ * 1行は "<時刻> level=<レベル> event=<イベント名> <項目>" の形
+ * (syslogには時刻を付けずに送る)。項目は "key=value" を空白で区切って書く。
+ *
+ * logger_startの前とlogger_finishの後はstderrに直接書く。
+ * シグナルハンドラとforkした子プロセスからは使わないこと。
+ * インスタンスは1つだけ。
+ */
+
+#define LOGGER_RING_MAX        4      /* リングの数 (ログを書けるスレッドの数) */
+#define LOGGER_RING_SIZE       1024   /* 1つのリングのレコード数 (2のべき乗) */
+#define LOGGER_RECORD_SIZE     224    /* 1レコードの項目の大きさ */
+#define LOGGER_BATCH           64     /* 書き出しスレッドがまとめて書くレコード数 */
+#define LOGGER_FLUSH_INTERVAL  20     /* 書き出しスレッドがリングを見に行く間隔 (msec) */
+#define LOGGER_SYSLOG          "syslog"  /* log_pathにこれを書くとsyslogに送る */
+
+enum logger_level {
+	LOGGER_ERROR = 0,
+	LOGGER_WARN,
+	LOGGER_INFO,
+	LOGGER_DEBUG
+};
+
+/*
+ * 書き出しスレッドの開始
+ * pathが空ならstderr、LOGGER_SYSLOGならsyslog、それ以外はそのファイルに追記する
+ * daemonでforkした後に呼ぶ
+ */
+int logger_start(
+    const char *path,
+    int level);
+/* リングに残ったレコードを書き出してから書き出しスレッドを終了する */
+void logger_finish(void);
+/* 出力するレベルを変える (これより詳しいレベルは捨てる) */
+void logger_set_level(
+    int level);
+/* ファイルを開き直す (ログのローテーション用) */
+void logger_reopen(void);
+/*
+ * ログを書く
+ * eventは静的な文字列、formatは項目の書式
+ */
+void logger_write(
+    int level,
+    const char *event,
+    const char *format,
+    ...) __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -0,0 +1,43 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+/*
+ * イベントの優先度 (libeventのpriority, 小さいほど先に処理される)
+ *
+ * libeventは1回のループで活性化したイベントのうち一番高い優先度のものだけを処理する。
+ * センサーのポーリングやアラートのタイマーはRPCやHTTPの接続が
+ * どれだけ溜まっていても先に処理させる。
+ */
+#define EVENT_PRIORITY_HIGH	0	/* センサー, アラート, シグナル, 遅延プローブ */
+#define EVENT_PRIORITY_LOW	1	/* RPC, HTTPのacceptと読み書き */
+#define EVENT_PRIORITY_COUNT	2
+
+/*
+ * 1回のループで処理する低優先度のコールバック数の上限
+ * これを超えたら高優先度のイベントが来ていないか確認しなおす
+ * (libevent 2.1以降のみ)
+ */
+#define EVENT_LOW_DISPATCH_LIMIT	4
+
+#endif
@@ -22,25 +22,29 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <event.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/queue.h>
+#include <arpa/inet.h>
+#include <pwd.h>
 
 #include "macro.h"
 #include "string_util.h"
 #include "alert.h"
 #include "sensor.h"
+#include "token_bucket.h"
 #include "tcpsock.h"
 #include "rpc.h"
-
-/* RPC コマンド */
-#define COMMAND_START_MONITOR           "START_MONITOR"
-#define COMMAND_STOP_MONITOR            "STOP_MONITOR"
-#define COMMAND_GET_MONITOR_STATUS      "GET_MONITOR_STATUS"
-#define COMMAND_CANCEL_ALERT            "CANCEL_ALERT"
-#define COMMAND_GET_ALERT_STATUS        "GET_ALERT_STATUS"
-#define COMMAND_CLEAR_ALERT_STATUS      "CLEAR_ALERT_STATUS"
+#include "history.h"
+#include "logger.h"
+#include "rpc_parse.h"
+#include "stats.h"
+#include "watchdog.h"
 
 /* RPC レスポンス */
 #define RESPONSE_OK                     "OK\r\n"
@@ -50,8 +54,988 @@
 #define RESPONSE_FIRST_ALERT            "FIRST ALERT\r\n"
 #define RESPONSE_SECOND_ALERT           "SECOND ALERT\r\n"
 #define RESPONSE_UNKNOWN_COMMAND        "UNKNOWN COMMAND\r\n"
+#define RESPONSE_INVALID_ARGUMENT       "INVALID ARGUMENT\r\n"
 #define RESPONSE_TIMEOUT                "TIMEOUT\r\n"
 #define RESPONSE_INTERNAL_ERROR         "INTERNAL ERROR\r\n"
+#define RESPONSE_SUBSCRIBER_FULL        "SUBSCRIBER FULL\r\n"
+#define RESPONSE_PERMISSION_DENIED      "PERMISSION DENIED\r\n"
+#define RESPONSE_UNSUPPORTED_COMMAND    "UNSUPPORTED COMMAND\r\n"
+#define RESPONSE_UNKNOWN_KEY            "UNKNOWN KEY\r\n"
+#define RESPONSE_NOT_SAVED              "NOT SAVED\r\n"
+#define RESPONSE_UNKNOWN_SENSOR         "UNKNOWN SENSOR\r\n"
+
+/* コマンドのフラグ */
+#define RPC_MUTATE                      0x01
+#define RPC_STREAM                      0x02
+#define RPC_LOCAL                       0x04
+
+/* SUBSCRIBE中に送る通知 */
+#define NOTIFY_ALERT_STATUS             "ALERT_STATUS "
+#define NOTIFY_MONITOR_STATUS           "MONITOR_STATUS "
+
+/* SETでコンフィグファイルにも書く指定 */
+#define SET_PERSIST                     "PERSIST"
+
+/* パース済みのリクエスト */
+struct rpc_request {
+	int argc;                       /* コマンド名を含む個数 */
+	char *argv[RPC_ARG_MAX + 1];    /* argv[0]はコマンド名 */
+	tcp_accept_info_t *acceptinfo;  /* リクエストを受けた接続 */
+	int binary;                     /* バイナリプロトコルで来たリクエスト */
+	int keep_connection;            /* 処理後も接続を閉じない */
+	int read_only;                  /* 状態を変更するコマンドを許さない (HTTPのGETなど) */
+	int loopback;                   /* 接続を持たない経路 (HTTP) の接続元がループバックアドレス */
+};
+
+/* レスポンスフレームの最大長 */
+#define RPC_BINARY_OUT_SIZE						\
+	(RPC_BINARY_FRAME_HEADER +					\
+	RPC_BINARY_ENTRY_LIMIT * (RPC_BINARY_ENTRY_HEADER + RPC_RESULT_SIZE))
+
+/* テキストのリクエスト1行の最大長 */
+#define RPC_TEXT_LINE_SIZE              128
+
+/*
+ * 接続のコンテキスト (acceptinfo->ctx) はどちらもbinaryから始めて区別する
+ */
+
+/* 行の途中までしか届いていないテキストの接続のコンテキスト */
+struct rpc_text_connection {
+	int binary;                                        /* 常に0 */
+	size_t len;                                        /* bufferに溜まっている長さ */
+	char buffer[RPC_TEXT_LINE_SIZE];                   /* 受信した行の途中まで */
+};
+
+/* バイナリプロトコルの接続のコンテキスト */
+struct rpc_binary_connection {
+	int binary;                                        /* 常に1 */
+	size_t len;                                        /* bufferに溜まっている長さ */
+	unsigned char buffer[4 + RPC_BINARY_FRAME_MAX];    /* 受信したフレーム */
+	unsigned char out[RPC_BINARY_OUT_SIZE];            /* レスポンスのフレーム */
+	size_t out_len;                                    /* outのレスポンスの長さ */
+	size_t out_pos;                                    /* outの送った位置 */
+	struct token_bucket bucket;                        /* コマンド数の制限 */
+};
+
+/*
+ * コマンドの処理関数の雛型
+ * resultにレスポンスを書いて、その長さを返す
+ */
+#define RPC_COMMAND_FUNC(name)						\
+static int								\
+rpc_command_##name(							\
+    struct rpc *rpc,							\
+    struct rpc_request *request,					\
+    char *result,							\
+    size_t result_size)
+
+/* 固定のレスポンスをresultに入れる */
+static int
+rpc_result_set(char *result, size_t result_size, const char *response) {
+	size_t len = strlen(response);
+
+	if (len >= result_size) {
+		return -1;
+	}
+	memcpy(result, response, len + 1);
+
+	return (int)len;
+}
+
+/* 長さの分かっているレスポンスをresultに入れる */
+static int
+rpc_result_copy(char *result, size_t result_size, const char *response, size_t len) {
+	if (len >= result_size) {
+		return -1;
+	}
+	memcpy(result, response, len + 1);
+
+	return (int)len;
+}
+
+/* エラーのレスポンスをresultに入れる */
+static int
+rpc_error_set(char *result, size_t result_size, const char *response) {
+	stats_add(STATS_RPC_ERRORS, 1);
+	return rpc_result_set(result, result_size, response);
+}
+
+/* 現在のalertステータスのレスポンス */
+static const char *
+rpc_alert_status_response(struct rpc *rpc) {
+	switch (alert_get_status(rpc->alert)) {
+	case ALERT_STATUS_NO_ALERT:
+		return RESPONSE_GOOD;
+	case ALERT_STATUS_FIRST_ALERT:
+		return RESPONSE_FIRST_ALERT;
+	case ALERT_STATUS_SECOND_ALERT:
+		return RESPONSE_SECOND_ALERT;
+	default:
+		ABORT();
+		/* NOT REACHED */
+	}
+	return NULL;
+}
+
+/* 現在の監視状態のレスポンス */
+static const char *
+rpc_monitor_status_response(struct rpc *rpc) {
+	if (sensor_get_monitor_status(rpc->sensor)) {
+		return RESPONSE_RUNNING;
+	}
+	return RESPONSE_STOPPING;
+}
+
+/*
+ * 状態のレスポンスを作り直す
+ * 状態が変わった時だけ呼び、GET_*_STATUSとSUBSCRIBEはこれをそのまま返す
+ */
+static void
+rpc_status_render(struct rpc *rpc) {
+	rpc->alert_response = rpc_alert_status_response(rpc);
+	rpc->alert_response_len = strlen(rpc->alert_response);
+	rpc->monitor_response = rpc_monitor_status_response(rpc);
+	rpc->monitor_response_len = strlen(rpc->monitor_response);
+}
+
+/* SUBSCRIBE中の接続を外す */
+static void
+rpc_subscriber_remove(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	int i;
+
+	for (i = 0; i < rpc->subscriber_count; i++) {
+		if (rpc->subscribers[i] == acceptinfo) {
+			rpc->subscriber_count--;
+			rpc->subscribers[i] = rpc->subscribers[rpc->subscriber_count];
+			rpc->subscribers[rpc->subscriber_count] = NULL;
+			return;
+		}
+	}
+}
+
+/* 接続を閉じる */
+static void
+rpc_connection_close(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	rpc_subscriber_remove(rpc, acceptinfo);
+	free(acceptinfo->ctx);
+	acceptinfo->ctx = NULL;
+	tcp_server_accept_clear(acceptinfo);
+}
+
+/* バイナリプロトコルの接続かどうか */
+static int
+rpc_connection_binary(tcp_accept_info_t *acceptinfo) {
+	const int *binary = acceptinfo->ctx;
+
+	return binary != NULL && *binary;
+}
+
+/* SUBSCRIBE中の接続かどうか */
+static int
+rpc_subscriber_find(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	int i;
+
+	for (i = 0; i < rpc->subscriber_count; i++) {
+		if (rpc->subscribers[i] == acceptinfo) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * 全subscriberに通知する
+ * メッセージは一度だけnotify_bufferに作って全接続で共有する
+ * io_uringの出力キューに溜まっている応答を追い越さないようにtcp_serverを通して送り、
+ * 送りきれない接続は待たずに切断する
+ */
+static void
+rpc_broadcast(struct rpc *rpc, const char *prefix, const char *response) {
+	tcp_accept_info_t *acceptinfo;
+	ssize_t len;
+	int i;
+
+	if (rpc->subscriber_count == 0) {
+		return;
+	}
+	len = snprintf(rpc->notify_buffer, sizeof(rpc->notify_buffer),
+	    "%s%s", prefix, response);
+	if (len < 0 || (size_t)len >= sizeof(rpc->notify_buffer)) {
+		return;
+	}
+	i = 0;
+	while (i < rpc->subscriber_count) {
+		acceptinfo = rpc->subscribers[i];
+		if (tcp_server_accept_write(acceptinfo, rpc->notify_buffer, len) != len) {
+			logger_write(LOGGER_WARN, "rpc_subscribe", "error=\"subscriber is too slow, disconnect\"");
+			rpc_connection_close(rpc, acceptinfo);
+			continue;
+		}
+		i++;
+	}
+}
+
+/* alertステータスの変化通知 */
+static void
+rpc_alert_status_changed(int status, void *args) {
+	struct rpc *rpc = args;
+
+	rpc_status_render(rpc);
+	rpc_broadcast(rpc, NOTIFY_ALERT_STATUS, rpc->alert_response);
+}
+
+/* sensorの状態変化通知 */
+static void
+rpc_sensor_event(int event, void *args) {
+	struct rpc *rpc = args;
+
+	if (event == SENSOR_EVENT_MONITOR) {
+		rpc_status_render(rpc);
+		rpc_broadcast(rpc, NOTIFY_MONITOR_STATUS, rpc->monitor_response);
+	}
+}
+
+RPC_COMMAND_FUNC(stop_monitor) {
+	alert_cancel(rpc->alert);
+	sensor_monitor_stop(rpc->sensor);
+	return rpc_result_set(result, result_size, RESPONSE_OK);
+}
+
+RPC_COMMAND_FUNC(start_monitor) {
+	sensor_monitor_start(rpc->sensor);
+	return rpc_result_set(result, result_size, RESPONSE_OK);
+}
+
+RPC_COMMAND_FUNC(get_monitor_status) {
+	return rpc_result_copy(result, result_size,
+	    rpc->monitor_response, rpc->monitor_response_len);
+}
+
+RPC_COMMAND_FUNC(cancel_alert) {
+	alert_cancel(rpc->alert);
+	return rpc_result_set(result, result_size, RESPONSE_OK);
+}
+
+RPC_COMMAND_FUNC(get_alert_status) {
+	return rpc_result_copy(result, result_size,
+	    rpc->alert_response, rpc->alert_response_len);
+}
+
+/* 統計を key=value の1行で返す */
+RPC_COMMAND_FUNC(get_stats) {
+	int len;
+
+	len = stats_format(result, result_size - 2);
+	if (len < 0) {
+		return rpc_result_set(result, result_size, RESPONSE_INTERNAL_ERROR);
+	}
+	memcpy(&result[len], "\r\n", 3);
+
+	return len + 2;
+}
+
+RPC_COMMAND_FUNC(clear_alert_status) {
+	alert_clear_status(rpc->alert);
+	return rpc_result_set(result, result_size, RESPONSE_OK);
+}
+
+/* SET, GETのコールバックの結果をレスポンスにする */
+static int
+rpc_config_result(char *result, size_t result_size, int error) {
+	switch (error) {
+	case RPC_CONFIG_OK:
+		return rpc_result_set(result, result_size, RESPONSE_OK);
+	case RPC_CONFIG_UNKNOWN_KEY:
+		return rpc_error_set(result, result_size, RESPONSE_UNKNOWN_KEY);
+	case RPC_CONFIG_INVALID_VALUE:
+		return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+	case RPC_CONFIG_NOT_SAVED:
+		return rpc_error_set(result, result_size, RESPONSE_NOT_SAVED);
+	default:
+		return rpc_error_set(result, result_size, RESPONSE_INTERNAL_ERROR);
+	}
+}
+
+/*
+ * 動いている設定を変える
+ *   SET <key> <value> [PERSIST]
+ * PERSISTを付けるとコンフィグファイルにも書く
+ * (反映した後に書けなかった場合はNOT SAVEDを返す)
+ */
+RPC_COMMAND_FUNC(set) {
+	int persist = 0;
+
+	if (rpc->config_set_cb == NULL) {
+		return rpc_error_set(result, result_size, RESPONSE_UNSUPPORTED_COMMAND);
+	}
+	if (request->argc > 3) {
+		if (strcasecmp(request->argv[3], SET_PERSIST) != 0) {
+			return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+		}
+		persist = 1;
+	}
+
+	return rpc_config_result(result, result_size,
+	    rpc->config_set_cb(request->argv[1], request->argv[2], persist,
+	    rpc->config_args));
+}
+
+/*
+ * 動いている設定の値を返す
+ *   GET <key>
+ */
+RPC_COMMAND_FUNC(get) {
+	int error;
+	size_t len;
+
+	if (rpc->config_get_cb == NULL) {
+		return rpc_error_set(result, result_size, RESPONSE_UNSUPPORTED_COMMAND);
+	}
+	error = rpc->config_get_cb(request->argv[1], result, result_size - 2,
+	    rpc->config_args);
+	if (error != RPC_CONFIG_OK) {
+		return rpc_config_result(result, result_size, error);
+	}
+	len = strlen(result);
+	memcpy(&result[len], "\r\n", 3);
+
+	return (int)(len + 2);
+}
+
+/* 10進の数値の引数を読む */
+static int
+rpc_parse_number(const char *str, unsigned long *value) {
+	char *end;
+
+	if (*str < '0' || *str > '9') {
+		return 1;
+	}
+	errno = 0;
+	*value = strtoul(str, &end, 10);
+	if (errno || *end != '\0') {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * 在室率の履歴を返す
+ *   GET_HISTORY <sensor> <from> <to> <res>
+ * from, toはエポック秒 ([from, to))、resは区間の秒数 (1, 60, 3600)
+ */
+RPC_COMMAND_FUNC(get_history) {
+	unsigned long from, to, seconds;
+	int resolution;
+	int len;
+
+	if (rpc->history == NULL) {
+		return rpc_error_set(result, result_size, RESPONSE_UNSUPPORTED_COMMAND);
+	}
+	if (strcmp(request->argv[1], rpc->history->name) != 0) {
+		return rpc_error_set(result, result_size, RESPONSE_UNKNOWN_SENSOR);
+	}
+	if (rpc_parse_number(request->argv[2], &from) ||
+	    rpc_parse_number(request->argv[3], &to) ||
+	    rpc_parse_number(request->argv[4], &seconds) ||
+	    from >= to) {
+		return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+	}
+	resolution = history_resolution(seconds);
+	if (resolution < 0) {
+		return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+	}
+	len = history_format(rpc->history, resolution, (time_t)from, (time_t)to,
+	    result, result_size - 2);
+	if (len < 0) {
+		return rpc_error_set(result, result_size, RESPONSE_INTERNAL_ERROR);
+	}
+	memcpy(&result[len], "\r\n", 3);
+
+	return len + 2;
+}
+
+/*
+ * 接続を開いたままにして、状態が変わるたびに通知を送る
+ * 最初に現在の状態を送る
+ */
+RPC_COMMAND_FUNC(subscribe) {
+	if (request->acceptinfo == NULL) {
+		return rpc_result_set(result, result_size, RESPONSE_INTERNAL_ERROR);
+	}
+	if (rpc_subscriber_find(rpc, request->acceptinfo)) {
+		return rpc_result_set(result, result_size, RESPONSE_OK);
+	}
+	if (rpc->subscriber_count >= RPC_SUBSCRIBER_LIMIT) {
+		return rpc_result_set(result, result_size, RESPONSE_SUBSCRIBER_FULL);
+	}
+	rpc->subscribers[rpc->subscriber_count++] = request->acceptinfo;
+	request->keep_connection = 1;
+
+	return snprintf(result, result_size, "%s%s%s%s%s",
+	    RESPONSE_OK,
+	    NOTIFY_ALERT_STATUS, rpc->alert_response,
+	    NOTIFY_MONITOR_STATUS, rpc->monitor_response);
+}
+
+/* コマンドテーブル (並びはrpc_command_namesと同じ) */
+struct rpc_command {
+	int min_args;
+	int max_args;
+	int flags;
+	int (*func)(struct rpc *rpc, struct rpc_request *request,
+	    char *result, size_t result_size);
+};
+#define RPC_COMMAND(name, func, min_args, max_args, flags)		\
+	{ min_args, max_args, flags, rpc_command_##func },
+static const struct rpc_command rpc_command_table[] = {
+#include "rpc_command.def"
+};
+#undef RPC_COMMAND
+
+/* コマンド名からコマンドを引く */
+static const struct rpc_command *
+rpc_command_lookup(const char *name, size_t len) {
+	int idx;
+
+	idx = rpc_command_index(name, len);
+	if (idx < 0) {
+		return NULL;
+	}
+
+	return &rpc_command_table[idx];
+}
+
+/* 1行をコマンド名と引数に分割する、引数が多すぎる場合は1を返す */
+static int
+rpc_request_parse(struct rpc_request *request, char *line) {
+	return rpc_parse_line(line, request->argv, &request->argc);
+}
+
+/* unix domain socketで受けた接続か */
+static int
+rpc_request_unix(struct rpc_request *request) {
+	return request->acceptinfo != NULL &&
+	    request->acceptinfo->tcpaccept->tcpserver->unix_domain;
+}
+
+/*
+ * コマンドを実行してよいか
+ * 状態を変更するコマンドは
+ *   unix domain socket: 接続元のuidが取れて、rootかrpc_allow_uidsのuidの場合だけ
+ *   TCP, HTTP: RPC_LOCALでなく、read_onlyでなく、rpc_tcp_mutateが1か、
+ *              2で接続元がループバックアドレスの場合だけ
+ * に許す。分からない場合は許さない
+ */
+static int
+rpc_command_permitted(
+    struct rpc *rpc,
+    const struct rpc_command *command,
+    struct rpc_request *request)
+{
+	int i;
+
+	if (!(command->flags & RPC_MUTATE)) {
+		return 1;
+	}
+	if (request->read_only) {
+		return 0;
+	}
+	if (!rpc_request_unix(request)) {
+		if (command->flags & RPC_LOCAL) {
+			return 0;
+		}
+		if (rpc->tcp_mutate == RPC_TCP_MUTATE_LOOPBACK) {
+			return request->acceptinfo != NULL ?
+			    tcp_server_accept_loopback(request->acceptinfo) : request->loopback;
+		}
+		return rpc->tcp_mutate == RPC_TCP_MUTATE_ALL;
+	}
+	if (!request->acceptinfo->peer_cred_valid) {
+		return 0;
+	}
+	if (request->acceptinfo->peer_uid == 0) {
+		return 1;
+	}
+	for (i = 0; i < rpc->allow_uid_count; i++) {
+		if (rpc->allow_uids[i] == request->acceptinfo->peer_uid) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* 1行分のコマンドを処理してresultにレスポンスを書く */
+static int
+rpc_dispatch(
+    struct rpc *rpc,
+    struct rpc_request *request,
+    char *line,
+    char *result,
+    size_t result_size)
+{
+	const struct rpc_command *command;
+	int nargs;
+
+	stats_add(STATS_RPC_REQUESTS, 1);
+	if (rpc_request_parse(request, line)) {
+		return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+	}
+	if (request->argc == 0) {
+		logger_write(LOGGER_INFO, "rpc", "error=\"unknown command\"");
+		return rpc_error_set(result, result_size, RESPONSE_UNKNOWN_COMMAND);
+	}
+	command = rpc_command_lookup(request->argv[0], strlen(request->argv[0]));
+	if (command == NULL) {
+		logger_write(LOGGER_INFO, "rpc", "error=\"unknown command\"");
+		return rpc_error_set(result, result_size, RESPONSE_UNKNOWN_COMMAND);
+	}
+	if ((command->flags & RPC_STREAM) && request->binary) {
+		return rpc_error_set(result, result_size, RESPONSE_UNSUPPORTED_COMMAND);
+	}
+	if (!rpc_command_permitted(rpc, command, request)) {
+		if (rpc_request_unix(request) && request->acceptinfo->peer_cred_valid) {
+			logger_write(LOGGER_WARN, "rpc", "error=\"permission denied\" command=%s uid=%lu",
+			    request->argv[0], (unsigned long)request->acceptinfo->peer_uid);
+		} else {
+			logger_write(LOGGER_WARN, "rpc", "error=\"permission denied\" command=%s transport=%s",
+			    request->argv[0], rpc_request_unix(request) ? "unix" :
+			    request->acceptinfo != NULL ? "tcp" : "http");
+		}
+		return rpc_error_set(result, result_size, RESPONSE_PERMISSION_DENIED);
+	}
+	nargs = request->argc - 1;
+	if (nargs < command->min_args || nargs > command->max_args) {
+		return rpc_error_set(result, result_size, RESPONSE_INVALID_ARGUMENT);
+	}
+
+	return command->func(rpc, request, result, result_size);
+}
+
+int
+rpc_execute(struct rpc *rpc, char *line, int read_only, int loopback, char *result, size_t result_size) {
+	struct rpc_request request;
+
+	memset(&request, 0, sizeof(request));
+	request.read_only = read_only;
+	request.loopback = loopback;
+	return rpc_dispatch(rpc, &request, line, result, result_size);
+}
+
+static void
+rpc_put16(unsigned char *p, uint16_t v) {
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+rpc_put32(unsigned char *p, uint32_t v) {
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t
+rpc_get16(const unsigned char *p) {
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+static uint32_t
+rpc_get32(const unsigned char *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+/* RPC_BINARY_OP_STATUSのレスポンスを書く */
+static void
+rpc_binary_status(struct rpc *rpc, unsigned char *p) {
+	memset(p, 0, RPC_BINARY_STATUS_SIZE);
+	p[0] = RPC_BINARY_STATUS_VERSION;
+	p[1] = (unsigned char)alert_get_status(rpc->alert);
+	p[2] = sensor_get_monitor_status(rpc->sensor) ? 1 : 0;
+	p[3] = sensor_get_presence(rpc->sensor) ? 1 : 0;
+	rpc_put32(&p[4], (uint32_t)sensor_get_detect_count(rpc->sensor));
+	rpc_put32(&p[8], (uint32_t)sensor_get_alert_threshold(rpc->sensor));
+}
+
+/* RPC_BINARY_OP_TEXTのレスポンスを書いて、その長さを返す */
+static int
+rpc_binary_text(
+    struct rpc *rpc,
+    tcp_accept_info_t *acceptinfo,
+    const unsigned char *data,
+    size_t data_len,
+    unsigned char *p)
+{
+	char line[128];
+	char result[RPC_RESULT_SIZE];
+	struct rpc_request request;
+	int len;
+
+	if (data_len >= sizeof(line)) {
+		len = rpc_result_set(result, sizeof(result), RESPONSE_INVALID_ARGUMENT);
+	} else {
+		memcpy(line, data, data_len);
+		line[data_len] = '\0';
+		memset(&request, 0, sizeof(request));
+		request.acceptinfo = acceptinfo;
+		request.binary = 1;
+		len = rpc_dispatch(rpc, &request, line, result, sizeof(result));
+		if (len < 0) {
+			len = rpc_result_set(result, sizeof(result), RESPONSE_INTERNAL_ERROR);
+		}
+	}
+	while (len > 0 && (result[len - 1] == '\r' || result[len - 1] == '\n')) {
+		len--;
+	}
+	memcpy(p, result, len);
+
+	return len;
+}
+
+/*
+ * 1フレーム分のリクエストを処理してconn->outにレスポンスのフレームを作る
+ * frameは長さの4バイトを除いたもの
+ * 形式がおかしい場合は-1を返す
+ */
+static ssize_t
+rpc_binary_frame(
+    struct rpc *rpc,
+    tcp_accept_info_t *acceptinfo,
+    const unsigned char *frame,
+    size_t frame_len)
+{
+	struct rpc_binary_connection *conn = acceptinfo->ctx;
+	unsigned char *out = conn->out;
+	size_t pos, olen, data_len;
+	unsigned int count, i;
+	int op, len;
+
+	if (frame_len < 2) {
+		return -1;
+	}
+	count = rpc_get16(frame);
+	if (count > RPC_BINARY_ENTRY_LIMIT) {
+		return -1;
+	}
+	pos = 2;
+	olen = RPC_BINARY_FRAME_HEADER;
+	for (i = 0; i < count; i++) {
+		if (frame_len - pos < RPC_BINARY_ENTRY_HEADER) {
+			return -1;
+		}
+		op = frame[pos];
+		data_len = rpc_get16(&frame[pos + 1]);
+		pos += RPC_BINARY_ENTRY_HEADER;
+		if (frame_len - pos < data_len) {
+			return -1;
+		}
+		switch (op) {
+		case RPC_BINARY_OP_TEXT:
+			len = rpc_binary_text(rpc, acceptinfo, &frame[pos], data_len,
+			    &out[olen + RPC_BINARY_ENTRY_HEADER]);
+			break;
+		case RPC_BINARY_OP_STATUS:
+			rpc_binary_status(rpc, &out[olen + RPC_BINARY_ENTRY_HEADER]);
+			len = RPC_BINARY_STATUS_SIZE;
+			break;
+		default:
+			op = RPC_BINARY_OP_ERROR;
+			len = 0;
+			break;
+		}
+		out[olen] = (unsigned char)op;
+		rpc_put16(&out[olen + 1], (uint16_t)len);
+		olen += RPC_BINARY_ENTRY_HEADER + len;
+		pos += data_len;
+	}
+	if (pos != frame_len) {
+		return -1;
+	}
+	rpc_put32(out, (uint32_t)(olen - 4));
+	rpc_put16(&out[4], (uint16_t)count);
+
+	return (ssize_t)olen;
+}
+
+/*
+ * コマンド数の制限を超えたフレームのレスポンスを作って、その長さを返す
+ * エントリの中身は見ずに、エントリ数分のRATE LIMITEDを返す
+ */
+static ssize_t
+rpc_binary_throttle(struct rpc_binary_connection *conn, unsigned int count) {
+	static const char message[] = RPC_BINARY_RATE_LIMITED;
+	unsigned char *out = conn->out;
+	size_t olen;
+	unsigned int i;
+
+	olen = RPC_BINARY_FRAME_HEADER;
+	for (i = 0; i < count; i++) {
+		out[olen] = RPC_BINARY_OP_ERROR;
+		rpc_put16(&out[olen + 1], sizeof(message) - 1);
+		memcpy(&out[olen + RPC_BINARY_ENTRY_HEADER], message, sizeof(message) - 1);
+		olen += RPC_BINARY_ENTRY_HEADER + sizeof(message) - 1;
+	}
+	rpc_put32(out, (uint32_t)(olen - 4));
+	rpc_put16(&out[4], (uint16_t)count);
+
+	return (ssize_t)olen;
+}
+
+/*
+ * outに残っているレスポンスをブロックせずに送る
+ * 送り切ったら0、残りを書けるようになるまで待つ場合は1、失敗したら-1を返す
+ */
+static int
+rpc_binary_flush(tcp_accept_info_t *acceptinfo) {
+	struct rpc_binary_connection *conn = acceptinfo->ctx;
+	ssize_t n;
+
+	while (conn->out_pos < conn->out_len) {
+		n = tcp_server_accept_write(acceptinfo,
+		    &conn->out[conn->out_pos], conn->out_len - conn->out_pos);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return tcp_server_accept_wait_write(acceptinfo) < 0 ? -1 : 1;
+			}
+			return -1;
+		}
+		conn->out_pos += n;
+	}
+	conn->out_len = 0;
+	conn->out_pos = 0;
+
+	return 0;
+}
+
+/*
+ * バイナリプロトコルの接続に溜まっているフレームを
+ * すべて処理してから次の読み込みを待つ
+ * レスポンスを送り切れなければ、残りを送ってから (EV_WRITE) 続きのフレームを処理する
+ */
+static void
+rpc_binary_process(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	struct rpc_binary_connection *conn = acceptinfo->ctx;
+	size_t total, consumed = 0;
+	uint32_t frame_len;
+	unsigned int count;
+	ssize_t olen;
+	uint64_t start;
+	int pending = 0;
+
+	while (conn->len - consumed >= 4) {
+		frame_len = rpc_get32(&conn->buffer[consumed]);
+		if (frame_len > RPC_BINARY_FRAME_MAX) {
+			logger_write(LOGGER_WARN, "rpc", "error=\"binary frame is too large\"");
+			rpc_connection_close(rpc, acceptinfo);
+			return;
+		}
+		total = 4 + (size_t)frame_len;
+		if (conn->len - consumed < total) {
+			break;
+		}
+		start = stats_now();
+		count = (frame_len >= 2) ? rpc_get16(&conn->buffer[consumed + 4]) : 0;
+		if (rpc->command_rate > 0 &&
+		    count <= RPC_BINARY_ENTRY_LIMIT &&
+		    token_bucket_take(&conn->bucket,
+		    rpc->command_rate, rpc->command_burst, count, start)) {
+			stats_add(STATS_RPC_THROTTLES, count);
+			olen = rpc_binary_throttle(conn, count);
+		} else {
+			olen = rpc_binary_frame(rpc, acceptinfo,
+			    &conn->buffer[consumed + 4], frame_len);
+		}
+		if (olen < 0) {
+			logger_write(LOGGER_WARN, "rpc", "error=\"binary frame is broken\"");
+			rpc_connection_close(rpc, acceptinfo);
+			return;
+		}
+		conn->out_len = (size_t)olen;
+		conn->out_pos = 0;
+		pending = rpc_binary_flush(acceptinfo);
+		if (pending < 0) {
+			rpc_connection_close(rpc, acceptinfo);
+			return;
+		}
+		stats_record(STATS_RPC_HANDLE, stats_now() - start);
+		consumed += total;
+		if (pending) {
+			break;
+		}
+	}
+	/* 途中までのフレームを前に詰める */
+	memmove(conn->buffer, &conn->buffer[consumed], conn->len - consumed);
+	conn->len -= consumed;
+	if (pending) {
+		return;
+	}
+	if (tcp_server_accept_wait(acceptinfo) < 0) {
+		rpc_connection_close(rpc, acceptinfo);
+	}
+}
+
+/* 書けるようになったらレスポンスの残りを送って、続きのフレームを処理する */
+static void
+rpc_binary_write(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	int pending;
+
+	pending = rpc_binary_flush(acceptinfo);
+	if (pending < 0) {
+		rpc_connection_close(rpc, acceptinfo);
+		return;
+	}
+	if (pending) {
+		return;
+	}
+	rpc_binary_process(rpc, acceptinfo);
+}
+
+/* バイナリプロトコルの接続から読み込む */
+static void
+rpc_binary_read(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	struct rpc_binary_connection *conn = acceptinfo->ctx;
+	ssize_t n;
+
+	n = tcp_server_accept_read(acceptinfo, &conn->buffer[conn->len],
+	    sizeof(conn->buffer) - conn->len);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			if (tcp_server_accept_wait(acceptinfo) < 0) {
+				rpc_connection_close(rpc, acceptinfo);
+			}
+			return;
+		}
+		rpc_connection_close(rpc, acceptinfo);
+		return;
+	}
+	conn->len += n;
+	rpc_binary_process(rpc, acceptinfo);
+}
+
+/*
+ * 最初の読み込みがマジックで始まっていたらバイナリプロトコルの接続にする
+ * マジックの後に読めていたデータはフレームとして処理する
+ */
+static int
+rpc_binary_negotiate(
+    struct rpc *rpc,
+    tcp_accept_info_t *acceptinfo,
+    const char *data,
+    size_t len)
+{
+	struct rpc_binary_connection *conn;
+
+	conn = malloc(sizeof(struct rpc_binary_connection));
+	if (conn == NULL) {
+		return 1;
+	}
+	conn->binary = 1;
+	memcpy(conn->buffer, data, len);
+	conn->len = len;
+	conn->out_len = 0;
+	conn->out_pos = 0;
+	token_bucket_init(&conn->bucket, rpc->command_burst, stats_now());
+	acceptinfo->ctx = conn;
+	rpc_binary_process(rpc, acceptinfo);
+
+	return 0;
+}
+
+/*
+ * 接続の最初の読み込み
+ * CGIのような1回で終わる接続は、ストリームを使わずにここで読んだ1行を処理して
+ * 1回で送り返す。行の途中までしか届いていなければ、読んだ分をコンテキストに
+ * 溜めて次のEV_READを待つ (1を返す)。bufferが一杯になったらそこまでを1行とする
+ * 閉じた場合は-1、バイナリプロトコルの接続にした場合と続きを待つ場合は1を返す
+ */
+static int
+rpc_text_read(
+    struct rpc *rpc,
+    tcp_accept_info_t *acceptinfo,
+    char *buffer,
+    size_t size)
+{
+	struct rpc_text_connection *conn = acceptinfo->ctx;
+	size_t len = 0;
+	ssize_t n;
+
+	ASSERT(size <= sizeof(conn->buffer));
+	if (conn) {
+		memcpy(buffer, conn->buffer, conn->len);
+		len = conn->len;
+	}
+	n = tcp_server_accept_read(acceptinfo, &buffer[len], size - 1 - len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		/* まだ何も届いていなかった */
+		if (tcp_server_accept_wait(acceptinfo) < 0) {
+			rpc_connection_close(rpc, acceptinfo);
+			return -1;
+		}
+		return 1;
+	}
+	if (n <= 0) {
+		rpc_connection_close(rpc, acceptinfo);
+		return -1;
+	}
+	len += n;
+	if (conn == NULL && (unsigned char)buffer[0] == RPC_BINARY_MAGIC) {
+		if (rpc_binary_negotiate(rpc, acceptinfo, &buffer[1], len - 1)) {
+			rpc_connection_close(rpc, acceptinfo);
+			return -1;
+		}
+		return 1;
+	}
+	if (memchr(buffer, '\n', len) == NULL && len < size - 1) {
+		if (conn == NULL) {
+			conn = malloc(sizeof(struct rpc_text_connection));
+			if (conn == NULL) {
+				rpc_connection_close(rpc, acceptinfo);
+				return -1;
+			}
+			conn->binary = 0;
+			acceptinfo->ctx = conn;
+		}
+		memcpy(conn->buffer, buffer, len);
+		conn->len = len;
+		if (tcp_server_accept_wait(acceptinfo) < 0) {
+			rpc_connection_close(rpc, acceptinfo);
+			return -1;
+		}
+		return 1;
+	}
+	free(conn);
+	acceptinfo->ctx = NULL;
+	buffer[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * SUBSCRIBE中に来たものはブロックせずに読めるだけ読み捨てて切断を待つ
+ * (行の途中で止まっている相手を待たないようにストリームは使わない)
+ */
+static void
+rpc_subscriber_drain(struct rpc *rpc, tcp_accept_info_t *acceptinfo) {
+	char buffer[128];
+	ssize_t n;
+
+	do {
+		n = tcp_server_accept_read(acceptinfo, buffer, sizeof(buffer));
+	} while (n > 0);
+	if (n == 0 || (errno != EAGAIN && errno != EINTR) ||
+	    tcp_server_accept_wait(acceptinfo) < 0) {
+		rpc_connection_close(rpc, acceptinfo);
+	}
+}
 
 /* TCP ACCEPT前にしておきたい処理 */
 static int 
@@ -61,78 +1045,66 @@ rpc_accept_init(int sd, void *info) {
 
 /* TCP ACCEPT後の処理 */
 static void
-rpc_accept_main(int sd, short event, void *info) {
+rpc_accept_handle(int sd, short event, void *info) {
 	tcp_accept_info_t *acceptinfo = info;
 	struct rpc *rpc = acceptinfo->args;
 	FILE *sp = acceptinfo->accept_sp;
-	char buffer[128] = "";
+	char buffer[RPC_TEXT_LINE_SIZE] = "";
+	char result[RPC_RESULT_SIZE];
+	struct rpc_request request;
+	uint64_t start = 0;
+	int len;
 
 	if (event == EV_READ) {
-		if (fgets(buffer, sizeof(buffer), sp) == NULL) {
-			tcp_server_accept_clear(acceptinfo);
+		if (rpc_connection_binary(acceptinfo)) {
+			rpc_binary_read(rpc, acceptinfo);
+			return;
+		}
+		if (rpc_subscriber_find(rpc, acceptinfo)) {
+			rpc_subscriber_drain(rpc, acceptinfo);
 			return;
 		}
+		if (rpc_text_read(rpc, acceptinfo, buffer, sizeof(buffer))) {
+			return;
+		}
+		start = stats_now();
 		if (string_rstrip(buffer, "\r\n \t")) {
 			fprintf(sp, RESPONSE_INTERNAL_ERROR);
 			goto end;
 		}
-		if (strncmp(
-		    buffer,
-		    COMMAND_STOP_MONITOR,
-		    sizeof(COMMAND_STOP_MONITOR) - 1) == 0 ) {
-			alert_cancel(rpc->alert);
-			sensor_monitor_stop(rpc->sensor);
-			fprintf(sp, RESPONSE_OK);
-		} else if (strncmp(
-		    buffer,
-		    COMMAND_START_MONITOR,
-		    sizeof(COMMAND_START_MONITOR) - 1) == 0 ) {
-			sensor_monitor_start(rpc->sensor);
-			fprintf(sp, RESPONSE_OK);
-		} else if (strncmp(
-		    buffer,
-		    COMMAND_GET_MONITOR_STATUS,
-		    sizeof(COMMAND_GET_MONITOR_STATUS) - 1) == 0 ) {
-			if (sensor_get_monitor_status(rpc->sensor)) {
-				fprintf(sp, RESPONSE_RUNNING);
-			} else {
-				fprintf(sp, RESPONSE_STOPPING);
-			}
-		} else if (strncmp(
-		    buffer,
-		    COMMAND_CANCEL_ALERT,
-		    sizeof(COMMAND_CANCEL_ALERT) - 1) == 0 ) {
-			alert_cancel(rpc->alert);
-			fprintf(sp, RESPONSE_OK);
-		} else if (strncmp(
-		    buffer,
-		    COMMAND_GET_ALERT_STATUS,
-		    sizeof(COMMAND_GET_ALERT_STATUS) - 1) == 0 ) {
-			switch (alert_get_status(rpc->alert)) {
-			case ALERT_STATUS_NO_ALERT:
-				fprintf(sp, RESPONSE_GOOD);
-				break;
-			case ALERT_STATUS_FIRST_ALERT:
-				fprintf(sp, RESPONSE_FIRST_ALERT);
-				break;
-			case ALERT_STATUS_SECOND_ALERT:
-				fprintf(sp, RESPONSE_SECOND_ALERT);
-				break;
-			default:
-				ABORT();
-				/* NOT REACHED */
+		memset(&request, 0, sizeof(request));
+		request.acceptinfo = acceptinfo;
+		len = rpc_dispatch(rpc, &request, buffer, result, sizeof(result));
+		if (len < 0 || (size_t)len >= sizeof(result)) {
+			fprintf(sp, RESPONSE_INTERNAL_ERROR);
+			goto end;
+		}
+		/* ストリームを通さずに1回で送る */
+		if (tcp_server_accept_write(acceptinfo, result, len) != len) {
+			logger_write(LOGGER_WARN, "rpc", "error=\"failed in send of response\"");
+		}
+		if (request.keep_connection) {
+			/* 切断の検知のためにタイムアウト無しで読み込みを待つ */
+			fflush(sp);
+			stats_record(STATS_RPC_HANDLE, stats_now() - start);
+			tcp_server_accept_timeout_stop(acceptinfo);
+			if (tcp_server_accept_wait(acceptinfo) < 0) {
+				rpc_connection_close(rpc, acceptinfo);
 			}
-		} else if (strncmp(buffer,
-		     COMMAND_CLEAR_ALERT_STATUS,
-		     sizeof(COMMAND_CLEAR_ALERT_STATUS) - 1) == 0 ) {
-			alert_clear_status(rpc->alert);
-			fprintf(sp, RESPONSE_OK);
-		} else {
-			fprintf(stderr, "rpc unknown command.\n");
-			fprintf(sp, RESPONSE_UNKNOWN_COMMAND);
+			return;
 		}
+	} else if (event == EV_WRITE && rpc_connection_binary(acceptinfo)) {
+		rpc_binary_write(rpc, acceptinfo);
+		return;
 	} else if (event == EV_TIMEOUT) {
-		fprintf(stderr, "rpc timeout.\n");
+		if (rpc_connection_binary(acceptinfo)) {
+			/* バイナリの接続は何も返さずに閉じる */
+			stats_add(STATS_RPC_TIMEOUTS, 1);
+			rpc_connection_close(rpc, acceptinfo);
+			return;
+		}
+		logger_write(LOGGER_INFO, "rpc", "error=\"timeout\"");
+		stats_add(STATS_RPC_TIMEOUTS, 1);
 		fprintf(sp, RESPONSE_TIMEOUT);
 	} else {
 		ABORT();        
@@ -140,13 +1112,31 @@ rpc_accept_main(int sd, short event, void *info) {
 	}
 end:
 	fflush(sp);
+	if (start) {
+		stats_record(STATS_RPC_HANDLE, stats_now() - start);
+	}
+	/* 行の途中で時間切れになった接続のコンテキスト */
+	free(acceptinfo->ctx);
+	acceptinfo->ctx = NULL;
 	tcp_server_accept_clear(acceptinfo);
 	return;
 }
 
+static void
+rpc_accept_main(int sd, short event, void *info) {
+	watchdog_enter("rpc_accept_main");
+	rpc_accept_handle(sd, event, info);
+	watchdog_leave();
+}
+
 /* accept終了時の処理 */
 static int
 rpc_accept_finish(int sd, void *info) {
+	tcp_accept_info_t *acceptinfo = info;
+
+	rpc_subscriber_remove(acceptinfo->args, acceptinfo);
+	free(acceptinfo->ctx);
+	acceptinfo->ctx = NULL;
 	return 0;
 }
 
@@ -162,59 +1152,135 @@ rpc_listen_finish(int sd, void *args) {
 	return 0;
 }
 
+/*
+ * "1000,www-data" のようなuidかユーザー名のリストをパースする
+ */
+static int
+rpc_parse_allow_uids(struct rpc *rpc, const char *allow_uids) {
+	char *list, *p, *name, *endptr;
+	struct passwd *pw;
+	unsigned long uid;
+
+	list = strdup(allow_uids);
+	if (list == NULL) {
+		return 1;
+	}
+	p = list;
+	while ((name = strsep(&p, ", \t")) != NULL) {
+		if (*name == '\0') {
+			continue;
+		}
+		if (rpc->allow_uid_count >= RPC_ALLOW_UID_LIMIT) {
+			fprintf(stderr, "too many rpc_allow_uids.\n");
+			free(list);
+			return 1;
+		}
+		uid = strtoul(name, &endptr, 10);
+		if (*endptr != '\0') {
+			pw = getpwnam(name);
+			if (pw == NULL) {
+				fprintf(stderr, "unknown user in rpc_allow_uids (%s).\n", name);
+				free(list);
+				return 1;
+			}
+			uid = pw->pw_uid;
+		}
+		rpc->allow_uids[rpc->allow_uid_count++] = (uid_t)uid;
+	}
+	free(list);
+
+	return 0;
+}
+
 int
 rpc_create(
     struct rpc **rpc,
     const char *bind_port,
+    const char *unix_path,
+    const char *allow_uids,
     int rpc_timeout,
+    int connect_rate,
+    int connect_burst,
+    int command_rate,
+    int command_burst,
+    int io_uring,
+    int defer_accept,
+    int fast_open,
     struct alert *alert,
     struct sensor *sensor,
     struct event_base *event_base)
 {
 	struct rpc *inst = NULL;
 	char *bport = NULL;
+	char *upath = NULL;
 
 	*rpc = NULL;
 	inst = malloc(sizeof(struct rpc));
 	bport = strdup(bind_port);
+	upath = strdup(unix_path);
 	if (inst == NULL ||
-	    bport == NULL) {
+	    bport == NULL ||
+	    upath == NULL) {
 		goto fail;
 	}
 	memset(inst, 0, sizeof(struct rpc));
 	inst->bind_port = bport;
+	inst->unix_path = upath;
 	inst->rpc_timeout = rpc_timeout;
+	inst->connect_rate = connect_rate;
+	inst->connect_burst = connect_burst;
+	inst->command_rate = command_rate;
+	inst->command_burst = command_burst;
+	inst->io_uring = io_uring;
+	inst->defer_accept = defer_accept;
+	inst->fast_open = fast_open;
 	inst->alert = alert;
 	inst->sensor = sensor;
 	inst->event_base = event_base;
+	if (rpc_parse_allow_uids(inst, allow_uids)) {
+		goto fail;
+	}
+	if (alert_add_listener(alert, rpc_alert_status_changed, inst) ||
+	    sensor_add_listener(sensor, rpc_sensor_event, inst)) {
+		goto fail;
+	}
+	rpc_status_render(inst);
 	*rpc = inst;
 
 	return 0;
 
 fail:
+	if (inst) {
+		alert_remove_listener(alert, rpc_alert_status_changed, inst);
+		sensor_remove_listener(sensor, rpc_sensor_event, inst);
+	}
 	free(inst);
 	free(bport);
+	free(upath);
 
 	return 1;
 }
 
+/* tcpサーバーを生成して開始する */
+static int
+rpc_server_start(
+    struct rpc *rpc,
+    struct tcp_server **tcpserver,
+    const char *address,
+    const char *port,
+    const int *inherit_sd,
+    int inherit_count)
+{
+	tcp_server_t *inst = NULL;
 
-int
-rpc_start(struct rpc *rpc) {
-	tcp_server_t *tcpserver = NULL;
-	struct timeval timeout;
-
-	/* タイムアウト値の設定 */
-	timeout.tv_sec = rpc->rpc_timeout;
-	timeout.tv_usec = 0;
 	/* TCPサーバーの生成 */
 	if (tcp_server_create(
-	    &tcpserver,
-	    NULL,
-	    rpc->bind_port,
+	    &inst,
+	    address,
+	    port,
 	    RECV_BUFF,
 	    EV_READ,
-	    &timeout,
+	    &rpc->timeout,
 	    rpc_accept_init,
 	    rpc_accept_main,
 	    rpc_accept_finish,
@@ -225,37 +1291,186 @@ rpc_start(struct rpc *rpc) {
 		fprintf(stderr, "failed in create tcp server instance.\n");
 		return 1;
 	}
-	rpc->tcpserver = tcpserver;
-	/*
-         * TCPサーバーの開始
-         * イベントループで回る
-         */ 
-	if (tcp_server_start(rpc->tcpserver)) {
+	/* 接続元ごとの接続数の制限 */
+	tcp_server_set_rate_limit(inst, rpc->connect_rate, rpc->connect_burst);
+	/* 接続をio_uringで扱う */
+	tcp_server_set_io_uring(inst, rpc->io_uring);
+	/* CGIのような短い接続はリクエストが届いてから起こす */
+	tcp_server_set_accept_options(inst, rpc->defer_accept, rpc->fast_open);
+	/* 引き継いだsdがあればlistenせずにそれを使う */
+	if (inherit_count > 0 &&
+	    tcp_server_set_listen_fds(inst, inherit_sd, inherit_count)) {
+		tcp_server_destroy(inst);
+		return 1;
+	}
+	/* TCPサーバーの開始 */
+	if (tcp_server_start(inst)) {
 		fprintf(stderr, "failed in start up tcp server instance.\n");
-		rpc->tcpserver = NULL;
+		tcp_server_destroy(inst);
+		return 1;
+	}
+	*tcpserver = inst;
+
+	return 0;
+}
+
+int
+rpc_start(struct rpc *rpc) {
+	if (rpc->bind_port[0] == '\0' && rpc->unix_path[0] == '\0') {
+		fprintf(stderr, "neither rpc_port nor rpc_unix_path is specified.\n");
+		return 1;
+	}
+	/* タイムアウト値の設定 */
+	rpc->timeout.tv_sec = rpc->rpc_timeout;
+	rpc->timeout.tv_usec = 0;
+	if (rpc->bind_port[0] != '\0' &&
+	    rpc_server_start(rpc, &rpc->tcpserver, NULL, rpc->bind_port,
+	    rpc->inherit_sd, rpc->inherit_count)) {
+		return 1;
+	}
+	if (rpc->unix_path[0] != '\0' &&
+	    rpc_server_start(rpc, &rpc->unix_tcpserver, rpc->unix_path, NULL,
+	    rpc->unix_inherit_sd, rpc->unix_inherit_count)) {
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+rpc_rebind(struct rpc *rpc, const char *bind_port) {
+	struct tcp_server *tcpserver = NULL;
+	char *bport;
+
+	if (bind_port[0] == '\0' && rpc->unix_path[0] == '\0') {
+		fprintf(stderr, "neither rpc_port nor rpc_unix_path is specified.\n");
+		return 1;
+	}
+	bport = strdup(bind_port);
+	if (bport == NULL) {
+		return 1;
+	}
+	if (bind_port[0] != '\0' &&
+	    rpc_server_start(rpc, &tcpserver, NULL, bind_port, NULL, 0)) {
+		free(bport);
+		return 1;
+	}
+	/* 前のポートの接続は閉じる */
+	if (rpc->tcpserver) {
+		tcp_server_stop(rpc->tcpserver);
+		tcp_server_destroy(rpc->tcpserver);
+	}
+	rpc->tcpserver = tcpserver;
+	free(rpc->bind_port);
+	rpc->bind_port = bport;
+
+	return 0;
+}
+
+void
+rpc_set_tcp_mutate(struct rpc *rpc, int tcp_mutate) {
+	rpc->tcp_mutate = tcp_mutate;
+}
+
+void
+rpc_set_timeout(struct rpc *rpc, int rpc_timeout) {
+	rpc->rpc_timeout = rpc_timeout;
+	rpc->timeout.tv_sec = rpc_timeout;
+	rpc->timeout.tv_usec = 0;
+	if (rpc->tcpserver) {
+		tcp_server_timeout_update(rpc->tcpserver);
+	}
+	if (rpc->unix_tcpserver) {
+		tcp_server_timeout_update(rpc->unix_tcpserver);
+	}
+}
+
+void
+rpc_set_config_handler(
+    struct rpc *rpc,
+    int (*config_set_cb)(const char *key, const char *value, int persist, void *args),
+    int (*config_get_cb)(const char *key, char *buf, size_t size, void *args),
+    void *args)
+{
+	rpc->config_set_cb = config_set_cb;
+	rpc->config_get_cb = config_get_cb;
+	rpc->config_args = args;
+}
+
+void
+rpc_set_history(struct rpc *rpc, struct history *history) {
+	rpc->history = history;
+}
+
+int
+rpc_listen_fds(struct rpc *rpc, int unix_domain, int *sd, int sd_max) {
+	struct tcp_server *tcpserver;
+
+	tcpserver = unix_domain ? rpc->unix_tcpserver : rpc->tcpserver;
+	if (tcpserver == NULL) {
+		return 0;
 	}
 
-        /* 
-         * TCPサーバーの削除
-         */
-	tcp_server_destroy(rpc->tcpserver);
-	rpc->tcpserver = NULL;
-        printf("tcp server end.\n");
+	return tcp_server_listen_fds(tcpserver, sd, sd_max);
+}
+
+int
+rpc_set_listen_fds(struct rpc *rpc, int unix_domain, const int *sd, int count) {
+	int *inherit_sd;
+	int i;
+
+	if (count > RPC_LISTEN_FD_LIMIT) {
+		fprintf(stderr, "too many rpc listen sockets (%d).\n", count);
+		return 1;
+	}
+	inherit_sd = unix_domain ? rpc->unix_inherit_sd : rpc->inherit_sd;
+	for (i = 0; i < count; i++) {
+		inherit_sd[i] = sd[i];
+	}
+	if (unix_domain) {
+		rpc->unix_inherit_count = count;
+	} else {
+		rpc->inherit_count = count;
+	}
 
 	return 0;
 }
 
+void
+rpc_listen_detach(struct rpc *rpc) {
+	if (rpc->tcpserver) {
+		tcp_server_listen_detach(rpc->tcpserver);
+	}
+	if (rpc->unix_tcpserver) {
+		tcp_server_listen_detach(rpc->unix_tcpserver);
+	}
+}
+
 void
 rpc_finish(struct rpc *rpc) {
 	if (rpc->tcpserver) {
 		tcp_server_stop(rpc->tcpserver);
 	}
+	if (rpc->unix_tcpserver) {
+		tcp_server_stop(rpc->unix_tcpserver);
+	}
 }
 
 void
 rpc_destroy(struct rpc *rpc) {
 	if (rpc) {
+		/* TCPサーバーの削除 */
+		if (rpc->tcpserver) {
+			tcp_server_destroy(rpc->tcpserver);
+		}
+		if (rpc->unix_tcpserver) {
+			tcp_server_destroy(rpc->unix_tcpserver);
+		}
+		printf("tcp server end.\n");
+		alert_remove_listener(rpc->alert, rpc_alert_status_changed, rpc);
+		sensor_remove_listener(rpc->sensor, rpc_sensor_event, rpc);
 		free(rpc->bind_port);
+		free(rpc->unix_path);
 		free(rpc);
 	}
 }
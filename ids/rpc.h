@@ -24,26 +24,204 @@
 #define DEFAULT_RPC_TIMEOUT  60
 #define DEFAULT_RPC_PORT     "18000"
 
+#define RPC_SUBSCRIBER_LIMIT  16    /* SUBSCRIBEできる接続数 */
+#define RPC_ALLOW_UID_LIMIT   16    /* rpc_allow_uidsに書けるuidの数 */
+#define RPC_NOTIFY_SIZE       128   /* 通知メッセージのバッファサイズ */
+#define RPC_RESULT_SIZE       2048  /* レスポンスバッファのサイズ (GET_STATSが入る大きさ) */
+#define RPC_LISTEN_FD_LIMIT   10    /* 引き継げるlisten sdの数 (tcpsock.hのLISTEN_LIMIT) */
+
+/* SET, GETのコールバックが返す値 */
+#define RPC_CONFIG_OK             0
+#define RPC_CONFIG_UNKNOWN_KEY    1  /* 無いか、動いている間は変えられない項目 */
+#define RPC_CONFIG_INVALID_VALUE  2  /* 値が範囲外 */
+#define RPC_CONFIG_NOT_SAVED      3  /* 反映したがコンフィグファイルに書けなかった */
+#define RPC_CONFIG_ERROR          4
+
+/*
+ * バイナリプロトコル
+ * 接続して最初の1バイトがRPC_BINARY_MAGICならバイナリ、それ以外はテキストとして扱う
+ * バイナリの接続はrpc_timeoutの間なにも来なければ切断するまで開いたままにする
+ *
+ * フレーム (数値はすべてネットワークバイトオーダー)
+ *   uint32 長さ (この4バイトを除いたフレームの長さ)
+ *   uint16 エントリ数
+ *   エントリ * エントリ数
+ *     uint8  op
+ *     uint16 データの長さ
+ *     データ
+ * レスポンスも同じ形のフレームで、リクエストのエントリごとに同じ順で返す
+ * 形式がおかしいフレームが来たら切断する
+ */
+#define RPC_BINARY_MAGIC          0xb1
+#define RPC_BINARY_FRAME_MAX      4096  /* リクエストのフレームの長さの最大 */
+#define RPC_BINARY_ENTRY_LIMIT    64    /* 1フレームのエントリ数の最大 */
+#define RPC_BINARY_FRAME_HEADER   6     /* 長さとエントリ数 */
+#define RPC_BINARY_ENTRY_HEADER   3     /* opとデータの長さ */
+
+#define RPC_BINARY_OP_TEXT        0x01  /* データはテキストのコマンド1行 (CRLF無し)
+                                         * レスポンスはテキストのレスポンス (CRLF無し) */
+#define RPC_BINARY_OP_STATUS      0x02  /* データ無し、レスポンスは下の固定長の状態 */
+#define RPC_BINARY_OP_ERROR       0xff  /* 不明なopへのレスポンス (データ無し)
+                                         * rpc_command_burstを超えたフレームには
+                                         * 全エントリにこのopでRATE LIMITEDを返す */
+#define RPC_BINARY_RATE_LIMITED   "RATE LIMITED"
+
+/* rpc_tcp_mutateの値 */
+#define RPC_TCP_MUTATE_NONE       0     /* unix domain socketからだけ受け付ける */
+#define RPC_TCP_MUTATE_ALL        1     /* TCPとHTTPのどこからでも受け付ける */
+#define RPC_TCP_MUTATE_LOOPBACK   2     /* TCPとHTTPはループバックアドレスからだけ受け付ける */
+
+/*
+ * RPC_BINARY_OP_STATUSのレスポンス
+ *   uint8  バージョン (RPC_BINARY_STATUS_VERSION)
+ *   uint8  alertの状態 (0: GOOD, 1: FIRST ALERT, 2: SECOND ALERT)
+ *   uint8  監視状態 (0: STOPPING, 1: RUNNING)
+ *   uint8  最後のサンプルで人がいたか (0, 1)
+ *   uint32 連続検出回数
+ *   uint32 alert_threshold
+ *   uint32 予約 (0)
+ */
+#define RPC_BINARY_STATUS_VERSION 1
+#define RPC_BINARY_STATUS_SIZE    16
+
 struct rpc {
 	struct event_base *event_base;
 	struct tcp_server *tcpserver;  /* tcpサーバーのインスタンス */
-	char *bind_port;               /* バインドするポート */
+	struct tcp_server *unix_tcpserver; /* unix domain socketのサーバーのインスタンス */
+	char *bind_port;               /* バインドするポート、空ならTCPは使わない */
+	char *unix_path;               /* unix domain socketのパス、空なら使わない */
+	uid_t allow_uids[RPC_ALLOW_UID_LIMIT]; /* unix domain socketから状態を変更できるuid */
+	int allow_uid_count;
+	int tcp_mutate;                /* TCPとHTTPから状態を変更するコマンドを受け付けるか (RPC_TCP_MUTATE_*) */
         int rpc_timeout;               /* RPCのタイムアウト */
+	int connect_rate;              /* 接続元ごとの1秒あたりの接続数、0なら制限しない */
+	int connect_burst;             /* 接続元ごとにまとめて接続できる数 */
+	int command_rate;              /* バイナリとHTTPの接続ごとの1秒あたりのコマンド数、0なら制限しない */
+	int command_burst;             /* バイナリとHTTPの接続ごとにまとめて実行できるコマンド数 */
+	int io_uring;                  /* 接続をio_uringで扱うかどうか */
+	int defer_accept;              /* TCP_DEFER_ACCEPTの秒数、0なら使わない */
+	int fast_open;                 /* TCP_FASTOPENのキューの長さ、0なら使わない */
+	struct timeval timeout;        /* tcpサーバーに渡すタイムアウト */
 	struct alert *alert;            /* alertのインスタンス */
 	struct sensor *sensor;          /* sensorのインスタンス */
+	struct tcp_accept_info *subscribers[RPC_SUBSCRIBER_LIMIT]; /* SUBSCRIBE中の接続 */
+	int subscriber_count;
+	char notify_buffer[RPC_NOTIFY_SIZE]; /* 全subscriberで共有する通知メッセージ */
+	const char *alert_response;    /* 今のalertステータスのレスポンス (状態が変わった時に作る) */
+	size_t alert_response_len;
+	const char *monitor_response;  /* 今の監視状態のレスポンス (状態が変わった時に作る) */
+	size_t monitor_response_len;
+	int (*config_set_cb)(const char *key, const char *value, int persist, void *args); /* SETの処理 */
+	int (*config_get_cb)(const char *key, char *buf, size_t size, void *args); /* GETの処理 */
+	void *config_args;             /* config_set_cb, config_get_cbの引数 */
+	struct history *history;        /* GET_HISTORYで返す在室率の履歴 */
+	int inherit_sd[RPC_LISTEN_FD_LIMIT]; /* 引き継いだTCPのlisten sd */
+	int inherit_count;
+	int unix_inherit_sd[RPC_LISTEN_FD_LIMIT]; /* 引き継いだunix domain socketのlisten sd */
+	int unix_inherit_count;
 };
 
 /* rpcのインスタンス生成 */
 int rpc_create(
     struct rpc **rpc,
     const char *bind_port,
+    const char *unix_path,
+    const char *allow_uids,
     int rpc_timeout,
+    int connect_rate,
+    int connect_burst,
+    int command_rate,
+    int command_burst,
+    int io_uring,
+    int defer_accept,
+    int fast_open,
     struct alert *alert,
     struct sensor *sensor,
     struct event_base *event_base);
-/* rpcの開始 */
+/*
+ * rpcの開始
+ * listenするだけで、イベントループは呼び出し側で回す
+ */
 int rpc_start(
     struct rpc *rpc);
+/*
+ * 1行分のコマンドを実行してresultにレスポンスを書く
+ * 接続を持たない経路(HTTPなど)から使う
+ * 状態を変更するコマンドはrpc_tcp_mutateが許していて、read_onlyが0の場合だけ実行する
+ * loopbackは接続元がループバックアドレスかどうか (SETは実行しない)
+ * lineは書き換えられる
+ */
+int rpc_execute(
+    struct rpc *rpc,
+    char *line,
+    int read_only,
+    int loopback,
+    char *result,
+    size_t result_size);
+/*
+ * TCPでlistenするポートを変える
+ * 新しいポートでlistenできてから前のポートを閉じる
+ * 失敗した場合は前のポートのまま1を返す。空ならTCPは使わない
+ */
+int rpc_rebind(
+    struct rpc *rpc,
+    const char *bind_port);
+/*
+ * RPCのタイムアウトを変える
+ * 次にタイムアウトを登録する接続から新しい値を使う
+ */
+void rpc_set_timeout(
+    struct rpc *rpc,
+    int rpc_timeout);
+/*
+ * TCPとHTTPから状態を変更するコマンドを受け付けるかを変える (RPC_TCP_MUTATE_*)
+ */
+void rpc_set_tcp_mutate(
+    struct rpc *rpc,
+    int tcp_mutate);
+/*
+ * SET, GETで設定を読み書きするコールバックを登録する
+ * config_set_cbは値を反映してRPC_CONFIG_*を返す。persistが1ならコンフィグファイルにも書く
+ * config_get_cbは値をbufに文字列で書いてRPC_CONFIG_*を返す
+ * 登録しなければSET, GETはUNSUPPORTED COMMANDを返す
+ */
+void rpc_set_config_handler(
+    struct rpc *rpc,
+    int (*config_set_cb)(const char *key, const char *value, int persist, void *args),
+    int (*config_get_cb)(const char *key, char *buf, size_t size, void *args),
+    void *args);
+/*
+ * GET_HISTORYで返す在室率の履歴を登録する
+ * 登録しなければGET_HISTORYはUNSUPPORTED COMMANDを返す
+ */
+void rpc_set_history(
+    struct rpc *rpc,
+    struct history *history);
+/*
+ * listenしているsdをsdに書いてその数を返す
+ * unix_domainが1ならunix domain socket、0ならTCPのsd
+ * listenしていなければ0、sd_maxより多ければ-1を返す
+ */
+int rpc_listen_fds(
+    struct rpc *rpc,
+    int unix_domain,
+    int *sd,
+    int sd_max);
+/*
+ * 他のプロセスから引き継いだlisten済みのsdを使う
+ * rpc_startの前に呼ぶ。startではlistenせずにこのsdでacceptする
+ */
+int rpc_set_listen_fds(
+    struct rpc *rpc,
+    int unix_domain,
+    const int *sd,
+    int count);
+/*
+ * acceptを止める
+ * listen sdを他のプロセスに渡した後に呼ぶ。処理中の接続はrpc_finishまで扱う
+ */
+void rpc_listen_detach(
+    struct rpc *rpc);
 /* rpcの終了 */
 void rpc_finish(
     struct rpc *rpc);
@@ -0,0 +1,29 @@
+/* このファイルは gen_hash.py が rpc_command.def から生成したもの。直接編集しないこと */
+#ifndef RPC_COMMAND_HASH_H
+#define RPC_COMMAND_HASH_H
+
+#define RPC_COMMAND_HASH_COUNT 11
+#define RPC_COMMAND_HASH_SIZE  32
+#define RPC_COMMAND_HASH_SEED  12u
+
+/* FNV-1a (seed付き) */
+static inline unsigned int
+rpc_command_hash(const char *str, size_t len) {
+	unsigned int h = 2166136261u ^ RPC_COMMAND_HASH_SEED;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+
+	return h & (RPC_COMMAND_HASH_SIZE - 1);
+}
+
+/* slot -> 定義順の番号 + 1 (0は空き) */
+static const unsigned char rpc_command_hash_slot[RPC_COMMAND_HASH_SIZE] = {
+	0, 3, 0, 0, 0, 0, 4, 0, 0, 5, 0, 10, 11, 0, 0, 8,
+	0, 0, 2, 0, 1, 0, 0, 7, 0, 0, 6, 0, 0, 0, 0, 9,
+};
+
+#endif
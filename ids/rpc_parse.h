@@ -0,0 +1,103 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef RPC_PARSE_H
+#define RPC_PARSE_H
+
+/*
+ * RPCのリクエスト行の分割とコマンド名の検索
+ * rpc.cとrpcbenchで同じコードを使うためにヘッダーに置く
+ * 使う側は string.h をincludeしてからこのファイルをincludeする
+ */
+#include "rpc_command_hash.h"
+
+#define RPC_ARG_MAX       8    /* コマンド名を除いた引数の最大数 */
+
+/* rpc_command.defの定義順のコマンド名 */
+struct rpc_command_name {
+	const char *name;
+	size_t len;
+};
+#define RPC_COMMAND(name, func, min_args, max_args, flags)		\
+	{ #name, sizeof(#name) - 1 },
+static const struct rpc_command_name rpc_command_names[] = {
+#include "rpc_command.def"
+};
+#undef RPC_COMMAND
+
+/* rpc_command_hash.hが古い場合はコンパイルエラーにする */
+typedef char rpc_command_hash_check[
+    (sizeof(rpc_command_names) / sizeof(rpc_command_names[0])
+    == RPC_COMMAND_HASH_COUNT) ? 1 : -1];
+
+/*
+ * 1行をコマンド名と引数に分割してargvに入れる (lineは書き換える)
+ * 区切りは空白とタブ
+ * 引数がRPC_ARG_MAXより多い場合は1を返す
+ */
+static inline int
+rpc_parse_line(char *line, char **argv, int *argc) {
+	char *p = line;
+
+	*argc = 0;
+	while (1) {
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		if (*argc > RPC_ARG_MAX) {
+			return 1;
+		}
+		argv[(*argc)++] = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		*p++ = '\0';
+	}
+
+	return 0;
+}
+
+/*
+ * コマンド名からrpc_command.defの定義順の番号を引く、無ければ-1を返す
+ * 完全ハッシュでslotを決めて、長さと文字列が完全一致したものだけを返す
+ */
+static inline int
+rpc_command_index(const char *name, size_t len) {
+	unsigned int idx;
+
+	idx = rpc_command_hash_slot[rpc_command_hash(name, len)];
+	if (idx == 0) {
+		return -1;
+	}
+	if (rpc_command_names[idx - 1].len != len ||
+	    memcmp(rpc_command_names[idx - 1].name, name, len) != 0) {
+		return -1;
+	}
+
+	return (int)(idx - 1);
+}
+
+#endif
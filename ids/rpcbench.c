@@ -0,0 +1,116 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc_parse.h"
+
+/*
+ * RPCのリクエスト行の分割とコマンド名の検索の速さを測る
+ * rpc.cと同じコード (rpc_parse.h) で、定義されている全コマンドと
+ * 引数付きの行、存在しないコマンド (前方一致するものを含む) を順に処理する
+ */
+
+#define RPCBENCH_DEFAULT_COUNT 10000000
+#define RPCBENCH_LINE_SIZE     128
+
+/* 引数付きの行と定義されていないコマンド */
+static const char *rpcbench_extra[] = {
+	"GET poll_interval",
+	"SET alert_threshold 20 PERSIST",
+	"GET_HISTORY presence 0 1000 60",
+	"  GET_ALERT_STATUS\t",
+	"STOP_MONITOR_NOW",
+	"GET_ALERT_STATUSX",
+	"GET_STAT",
+	"BOGUS x y",
+	"",
+};
+
+static void
+usage(char *cmd)
+{
+	printf("%s [-n <count>]\n", cmd);
+}
+
+int
+main(int argc, char **argv)
+{
+	char lines[RPC_COMMAND_HASH_COUNT + sizeof(rpcbench_extra) / sizeof(rpcbench_extra[0])][RPCBENCH_LINE_SIZE];
+	char line[RPCBENCH_LINE_SIZE];
+	char *args[RPC_ARG_MAX + 1];
+	struct timespec start, end;
+	unsigned long count = RPCBENCH_DEFAULT_COUNT, i;
+	unsigned long hits = 0, misses = 0;
+	double elapsed;
+	size_t nlines = 0, j;
+	int opt, nargs;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			if (count == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	/* 全コマンドが自分の番号で引けるか確かめる */
+	for (j = 0; j < RPC_COMMAND_HASH_COUNT; j++) {
+		if (rpc_command_index(rpc_command_names[j].name, rpc_command_names[j].len) != (int)j) {
+			fprintf(stderr, "failed in lookup %s.\n", rpc_command_names[j].name);
+			return 1;
+		}
+		snprintf(lines[nlines++], RPCBENCH_LINE_SIZE, "%s", rpc_command_names[j].name);
+	}
+	for (j = 0; j < sizeof(rpcbench_extra) / sizeof(rpcbench_extra[0]); j++) {
+		snprintf(lines[nlines++], RPCBENCH_LINE_SIZE, "%s", rpcbench_extra[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		/* 分割で書き換わるのでrpc.cと同じように受信バッファからコピーして使う */
+		strcpy(line, lines[i % nlines]);
+		if (rpc_parse_line(line, args, &nargs) == 0 && nargs > 0 &&
+		    rpc_command_index(args[0], strlen(args[0])) >= 0) {
+			hits++;
+		} else {
+			misses++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("commands = %d\n", RPC_COMMAND_HASH_COUNT);
+	printf("lines = %lu\n", count);
+	printf("hits = %lu\n", hits);
+	printf("misses = %lu\n", misses);
+	printf("parse+lookup = %.3f sec, %.1f nsec/line, %.1f Mlines/s\n",
+	    elapsed, elapsed * 1e9 / count, count / elapsed / 1e6);
+
+	return 0;
+}
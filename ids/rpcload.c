@@ -0,0 +1,600 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "rpc.h"
+
+/*
+ * 動いているidsのRPCポートに負荷をかけて、1秒あたりの往復数を測る
+ *   text    1往復ごとに-kの数だけ接続し、それぞれ1コマンド送ってEOFまで読んで閉じる
+ *           (CGIや今のコントローラと同じ使い方)
+ *           -fならTCP Fast Openでリクエストを接続と一緒に送る (idsはrpc_fast_openを設定し、
+ *           クライアント側はnet.ipv4.tcp_fastopenの1のビットを立てておく)
+ *   binary  1本の接続を開いたままにして、-kの数のエントリを入れたフレームを往復させる
+ * コマンドはGET_ALERT_STATUS, GET_MONITOR_STATUSの順に繰り返し、binaryでは
+ * 3つ目ごとにOP_STATUSにする (-k 3でtextの3接続とbinaryの1フレームが同じ値を取る)
+ *   flood   -cの数のプロセスがbinaryの接続で、-kの数のGET_STATSを入れたフレームを
+ *           -tの秒数の間送り続け、終わったらGET_STATSのpoll_jitterを表示する
+ *           (RPCが溢れている間のセンサーのポーリングの遅れを見る。poll_jitterは起動してから
+ *           の累計なので、負荷なしの値と比べる時はどちらもidsを起動し直してから同じ時間測る)
+ * 接続数やコマンド数の制限に掛からないように、ids側は
+ * rpc_connect_rate = 0, rpc_command_rate = 0 にしておく
+ * 1往復あたりのidsのシステムコール数は、text/binaryの間 strace -c -f -p <idsのpid> で数え、
+ * 負荷をかけずに同じ時間数えた分を引いて往復数で割る
+ */
+
+#define RPCLOAD_DEFAULT_HOST   "127.0.0.1"
+#define RPCLOAD_DEFAULT_COUNT  5000
+#define RPCLOAD_DEFAULT_VALUES 3
+#define RPCLOAD_DEFAULT_CLIENTS 8
+#define RPCLOAD_DEFAULT_SECONDS 10
+#define RPCLOAD_LINE_SIZE      128
+#define RPCLOAD_FLOOD_COMMAND  "GET_STATS"
+#define RPCLOAD_JITTER_PREFIX  "poll_jitter"
+#define RPCLOAD_RESPONSE_SIZE						\
+	(RPC_BINARY_FRAME_HEADER +					\
+	RPC_BINARY_ENTRY_LIMIT * (RPC_BINARY_ENTRY_HEADER + RPC_RESULT_SIZE))
+
+/* 順に使うテキストのコマンド */
+static const char *rpcload_commands[] = {
+	"GET_ALERT_STATUS",
+	"GET_MONITOR_STATUS",
+};
+
+#define RPCLOAD_COMMAND_COUNT (sizeof(rpcload_commands) / sizeof(rpcload_commands[0]))
+
+/* qsort用 */
+static int
+rpcload_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+rpcload_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 接続する */
+static int
+rpcload_connect(struct addrinfo *ai)
+{
+	int sd;
+	int one = 1;
+
+	sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sd < 0) {
+		fprintf(stderr, "failed in create socket.\n");
+		return -1;
+	}
+	if (connect(sd, ai->ai_addr, ai->ai_addrlen)) {
+		fprintf(stderr, "failed in connect (%s).\n", strerror(errno));
+		close(sd);
+		return -1;
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return sd;
+}
+
+/* TCP Fast Openで接続とリクエストの送信をまとめてする */
+static int
+rpcload_connect_fast_open(struct addrinfo *ai, const char *request, size_t len)
+{
+#ifdef MSG_FASTOPEN
+	ssize_t n;
+	int sd;
+	int one = 1;
+
+	sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sd < 0) {
+		fprintf(stderr, "failed in create socket.\n");
+		return -1;
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	n = sendto(sd, request, len, MSG_FASTOPEN, ai->ai_addr, ai->ai_addrlen);
+	if (n < 0 || (size_t)n != len) {
+		fprintf(stderr, "failed in send with fast open (%s).\n", n < 0 ? strerror(errno) : "short");
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+#else
+	fprintf(stderr, "fast open is not supported.\n");
+	return -1;
+#endif
+}
+
+/* 全部書く */
+static int
+rpcload_write_all(int sd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(sd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* ちょうどlenバイト読む */
+static int
+rpcload_read_all(int sd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(sd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* textの1往復 */
+static int
+rpcload_text(struct addrinfo *ai, int values, int fast_open)
+{
+	char line[RPCLOAD_LINE_SIZE];
+	char buffer[RPC_RESULT_SIZE];
+	ssize_t n;
+	int sd, len, i;
+
+	for (i = 0; i < values; i++) {
+		len = snprintf(line, sizeof(line), "%s\r\n",
+		    rpcload_commands[i % RPCLOAD_COMMAND_COUNT]);
+		if (fast_open) {
+			sd = rpcload_connect_fast_open(ai, line, len);
+			if (sd < 0) {
+				return 1;
+			}
+		} else {
+			sd = rpcload_connect(ai);
+			if (sd < 0) {
+				return 1;
+			}
+		}
+		if (!fast_open && rpcload_write_all(sd, line, len)) {
+			fprintf(stderr, "failed in send request.\n");
+			close(sd);
+			return 1;
+		}
+		/* 1回で終わる接続なのでEOFまで読む */
+		do {
+			n = read(sd, buffer, sizeof(buffer));
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		close(sd);
+		if (n < 0) {
+			fprintf(stderr, "failed in read response.\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * binaryのリクエストのフレームを作って長さを返す
+ * floodなら全エントリをRPCLOAD_FLOOD_COMMANDにする
+ */
+static size_t
+rpcload_frame(unsigned char *frame, int values, int flood)
+{
+	const char *command;
+	size_t len = RPC_BINARY_FRAME_HEADER;
+	size_t command_len;
+	uint32_t frame_len;
+	uint16_t count;
+	int i;
+
+	for (i = 0; i < values; i++) {
+		if (flood) {
+			command = RPCLOAD_FLOOD_COMMAND;
+		} else if (i % 3 == 2) {
+			frame[len++] = RPC_BINARY_OP_STATUS;
+			frame[len++] = 0;
+			frame[len++] = 0;
+			continue;
+		} else {
+			command = rpcload_commands[i % 3];
+		}
+		command_len = strlen(command);
+		frame[len++] = RPC_BINARY_OP_TEXT;
+		frame[len++] = (command_len >> 8) & 0xff;
+		frame[len++] = command_len & 0xff;
+		memcpy(&frame[len], command, command_len);
+		len += command_len;
+	}
+	frame_len = htonl(len - 4);
+	count = htons(values);
+	memcpy(frame, &frame_len, 4);
+	memcpy(&frame[4], &count, 2);
+
+	return len;
+}
+
+/* binaryの1往復 */
+static int
+rpcload_binary(int sd, const unsigned char *frame, size_t frame_len, unsigned char *response, int values)
+{
+	uint32_t len;
+	uint16_t count;
+
+	if (rpcload_write_all(sd, frame, frame_len)) {
+		fprintf(stderr, "failed in send frame.\n");
+		return 1;
+	}
+	if (rpcload_read_all(sd, &len, 4)) {
+		fprintf(stderr, "failed in read frame.\n");
+		return 1;
+	}
+	len = ntohl(len);
+	if (len < 2 || len > RPCLOAD_RESPONSE_SIZE - 4 ||
+	    rpcload_read_all(sd, response, len)) {
+		fprintf(stderr, "failed in read frame.\n");
+		return 1;
+	}
+	memcpy(&count, response, 2);
+	if (ntohs(count) != values) {
+		fprintf(stderr, "unexpected entry count (%d).\n", ntohs(count));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * floodの1プロセス分
+ * 終わるまでに実行したコマンド数をfdに書く
+ */
+static int
+rpcload_flood_client(struct addrinfo *ai, int values, int seconds, int fd)
+{
+	unsigned char frame[RPC_BINARY_FRAME_MAX + 4];
+	unsigned char *response;
+	unsigned char magic = RPC_BINARY_MAGIC;
+	unsigned long commands = 0;
+	size_t frame_len;
+	double end;
+	int sd;
+	int error = 1;
+
+	response = malloc(RPCLOAD_RESPONSE_SIZE);
+	if (response == NULL) {
+		fprintf(stderr, "failed in allocate response buffer.\n");
+		return 1;
+	}
+	frame_len = rpcload_frame(frame, values, 1);
+	sd = rpcload_connect(ai);
+	if (sd < 0 || rpcload_write_all(sd, &magic, 1)) {
+		goto finish;
+	}
+	end = rpcload_now() + seconds;
+	while (rpcload_now() < end) {
+		if (rpcload_binary(sd, frame, frame_len, response, values)) {
+			goto finish;
+		}
+		commands += values;
+	}
+	error = 0;
+finish:
+	if (write(fd, &commands, sizeof(commands)) != sizeof(commands)) {
+		error = 1;
+	}
+	if (sd >= 0) {
+		close(sd);
+	}
+	free(response);
+
+	return error;
+}
+
+/* GET_STATSのpoll_jitterの項目を表示する */
+static int
+rpcload_print_jitter(struct addrinfo *ai)
+{
+	static const char request[] = "GET_STATS\r\n";
+	char buffer[RPC_RESULT_SIZE];
+	char *item, *last;
+	size_t len = 0;
+	ssize_t n;
+	int sd;
+
+	sd = rpcload_connect(ai);
+	if (sd < 0) {
+		return 1;
+	}
+	if (rpcload_write_all(sd, request, sizeof(request) - 1)) {
+		close(sd);
+		return 1;
+	}
+	while (len < sizeof(buffer) - 1) {
+		n = read(sd, &buffer[len], sizeof(buffer) - 1 - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+	}
+	close(sd);
+	buffer[len] = '\0';
+	for (item = strtok_r(buffer, " \r\n", &last); item != NULL;
+	    item = strtok_r(NULL, " \r\n", &last)) {
+		if (strncmp(item, RPCLOAD_JITTER_PREFIX, sizeof(RPCLOAD_JITTER_PREFIX) - 1) == 0) {
+			printf("%s\n", item);
+		}
+	}
+
+	return 0;
+}
+
+/* floodを-cのプロセスで-tの秒数の間流す */
+static int
+rpcload_flood(struct addrinfo *ai, int clients, int values, int seconds)
+{
+	unsigned long commands, total = 0;
+	pid_t pid;
+	int fds[2];
+	int i, started = 0, status;
+	int error = 0;
+
+	if (pipe(fds)) {
+		fprintf(stderr, "failed in create pipe.\n");
+		return 1;
+	}
+	for (i = 0; i < clients; i++) {
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "failed in fork.\n");
+			error = 1;
+			break;
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			_exit(rpcload_flood_client(ai, values, seconds, fds[1]));
+		}
+		started++;
+	}
+	close(fds[1]);
+	for (i = 0; i < started; i++) {
+		if (read(fds[0], &commands, sizeof(commands)) != sizeof(commands)) {
+			error = 1;
+			break;
+		}
+		total += commands;
+	}
+	close(fds[0]);
+	for (i = 0; i < started; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			error = 1;
+		}
+	}
+	printf("mode = flood\n");
+	printf("clients = %d\n", clients);
+	printf("values per frame = %d\n", values);
+	printf("commands = %lu in %d sec, %.0f commands/s\n",
+	    total, seconds, (double)total / seconds);
+	if (rpcload_print_jitter(ai)) {
+		fprintf(stderr, "failed in get stats.\n");
+		error = 1;
+	}
+
+	return error;
+}
+
+static void
+usage(char *cmd)
+{
+	printf("%s [-H <host>] [-p <port>] [-n <count>] [-k <values>] [-f] text|binary\n", cmd);
+	printf("%s [-H <host>] [-p <port>] [-c <clients>] [-t <seconds>] [-k <values>] flood\n", cmd);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *host = RPCLOAD_DEFAULT_HOST;
+	const char *port = DEFAULT_RPC_PORT;
+	const char *mode;
+	struct addrinfo hints, *ai = NULL;
+	unsigned char frame[RPC_BINARY_FRAME_MAX + 4];
+	unsigned char *response = NULL;
+	unsigned char magic = RPC_BINARY_MAGIC;
+	unsigned long count = RPCLOAD_DEFAULT_COUNT, i;
+	size_t frame_len = 0;
+	double *latency = NULL;
+	double start, round_start, elapsed;
+	int values = RPCLOAD_DEFAULT_VALUES;
+	int clients = RPCLOAD_DEFAULT_CLIENTS;
+	int seconds = RPCLOAD_DEFAULT_SECONDS;
+	int binary, flood = 0;
+	int fast_open = 0;
+	int sd = -1;
+	int opt;
+	int error = 1;
+
+	while ((opt = getopt(argc, argv, "H:p:n:k:c:t:f")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			if (count == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'k':
+			values = atoi(optarg);
+			if (values <= 0 || values > RPC_BINARY_ENTRY_LIMIT) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			fast_open = 1;
+			break;
+		case 'c':
+			clients = atoi(optarg);
+			if (clients <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			if (seconds <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	mode = argv[optind];
+	if (strcmp(mode, "text") == 0) {
+		binary = 0;
+	} else if (strcmp(mode, "binary") == 0) {
+		binary = 1;
+	} else if (strcmp(mode, "flood") == 0) {
+		binary = 1;
+		flood = 1;
+	} else {
+		usage(argv[0]);
+		return 1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0) {
+		fprintf(stderr, "failed in resolve %s:%s.\n", host, port);
+		return 1;
+	}
+	/* 切られた接続への書き込みで落ちないようにする */
+	signal(SIGPIPE, SIG_IGN);
+	if (flood) {
+		error = rpcload_flood(ai, clients, values, seconds);
+		goto finish;
+	}
+	/* 1往復ごとの時間 */
+	latency = malloc(sizeof(double) * count);
+	if (latency == NULL) {
+		fprintf(stderr, "failed in allocate latency buffer.\n");
+		goto finish;
+	}
+	if (binary) {
+		response = malloc(RPCLOAD_RESPONSE_SIZE);
+		if (response == NULL) {
+			fprintf(stderr, "failed in allocate response buffer.\n");
+			goto finish;
+		}
+		frame_len = rpcload_frame(frame, values, 0);
+		sd = rpcload_connect(ai);
+		if (sd < 0 || rpcload_write_all(sd, &magic, 1)) {
+			goto finish;
+		}
+	}
+	start = rpcload_now();
+	for (i = 0; i < count; i++) {
+		round_start = rpcload_now();
+		if (binary) {
+			if (rpcload_binary(sd, frame, frame_len, response, values)) {
+				goto finish;
+			}
+		} else {
+			if (rpcload_text(ai, values, fast_open)) {
+				goto finish;
+			}
+		}
+		latency[i] = rpcload_now() - round_start;
+	}
+	elapsed = rpcload_now() - start;
+	qsort(latency, count, sizeof(double), rpcload_compare);
+	printf("mode = %s\n", mode);
+	printf("rounds = %lu\n", count);
+	printf("values per round = %d\n", values);
+	printf("elapsed = %.3f sec, %.0f rounds/s\n", elapsed, count / elapsed);
+	printf("latency p50 = %.0f usec, p99 = %.0f usec, max = %.0f usec\n",
+	    latency[count / 2] * 1e6, latency[count * 99 / 100] * 1e6, latency[count - 1] * 1e6);
+	error = 0;
+finish:
+	if (sd >= 0) {
+		close(sd);
+	}
+	free(response);
+	free(latency);
+	freeaddrinfo(ai);
+
+	return error;
+}
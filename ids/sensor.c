@@ -20,16 +20,29 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <usb.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <event.h>
 
 #include "macro.h"
 #include "alert.h"
 #include "sensor.h"
+#include "history.h"
+#include "archive.h"
+#include "detector.h"
+#include "logger.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "priority.h"
 
 /* USBデバイスの初期化処理 */
 static struct usb_bus *
@@ -41,16 +54,54 @@ usb_initialize(void)
 	return usb_get_busses();
 }
 
-/* USBデバイスを探す */
+/* sysfsのファイルから数値を1つ読む */
+static int
+usb_sysfs_read(const char *port_path, const char *name, unsigned long *value) {
+	char path[PATH_MAX];
+	FILE *fp;
+	int n;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", USB_SYSFS_DEVICES, port_path, name);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return 1;
+	}
+	n = fscanf(fp, "%lu", value);
+	fclose(fp);
+
+	return n != 1;
+}
+
+/*
+ * USBデバイスを探す
+ * pathが空でなければ、そのポートに今つながっているデバイスだけを見る
+ * (デバイス番号は挿し直すたびに変わるので、探すたびにsysfsから引く)
+ */
 static struct usb_device *
 usb_search(
     struct usb_bus *busses,
-    struct usb_device *dev)
+    const char *path)
 {
 	struct usb_bus *bus;
-
+	struct usb_device *dev;
+	unsigned long busnum = 0, devnum = 0;
+	int port = 0;
+
+	if (path && path[0] != '\0') {
+		if (usb_sysfs_read(path, "busnum", &busnum) ||
+		    usb_sysfs_read(path, "devnum", &devnum)) {
+			return NULL;
+		}
+		port = 1;
+	}
 	for (bus=busses; bus; bus=bus->next) {
+		if (port && strtoul(bus->dirname, NULL, 10) != busnum) {
+			continue;
+		}
 		for (dev=bus->devices; dev; dev=dev->next) {
+			if (port && strtoul(dev->filename, NULL, 10) != devnum) {
+				continue;
+			}
 			if ((dev->descriptor.idVendor==USB_VENDOR) &&
 			    (dev->descriptor.idProduct==USB_PRODUCT)) {
 				return dev;
@@ -69,26 +120,68 @@ usb_configure(
 {
 	if (usb_set_configuration(dh, dev->config->bConfigurationValue) < 0) {
 		if (usb_detach_kernel_driver_np(dh, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
-			fprintf(stderr, "failed to device configuration.\n");
-			fprintf(stderr, "failed to device detach. (%s)\n", usb_strerror());
+			logger_write(LOGGER_WARN, "usb_configure", "error=\"failed to device detach\" usb_error=\"%s\"",
+			    usb_strerror());
  		}
 	}
 
 	if (usb_claim_interface(dh, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
 		if (usb_detach_kernel_driver_np(dh, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
-			fprintf(stderr,"failed to claim interface.\n");
-			fprintf(stderr, "failed to device detach. (%s)\n", usb_strerror());
+			logger_write(LOGGER_WARN, "usb_claim", "error=\"failed to device detach\" usb_error=\"%s\"",
+			    usb_strerror());
 		}
 	}
 
 	if (usb_claim_interface(dh, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
-		fprintf(stderr, "failed to device detach. (%s)\n", usb_strerror());
+		logger_write(LOGGER_WARN, "usb_claim", "error=\"failed to claim interface\" usb_error=\"%s\"",
+		    usb_strerror());
 	}
 
 	return 0;
 
 }
 
+/*
+ * 標準入出力以外の全てのfdにclose-on-execを付ける
+ * libusb-0.1はデバイスのfdを返さず、close-on-execも付けずに開くので、
+ * usb_openの後に呼んでupgradeでexecするプロセスや警報スクリプトに渡らないようにする
+ * (自分で開くfdには元々付けている)
+ */
+static void
+usb_set_cloexec(void)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int fd, flags;
+
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		logger_write(LOGGER_WARN, "device", "errno=%d error=\"failed in open /proc/self/fd\"", errno);
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		fd = atoi(entry->d_name);
+		if (fd <= STDERR_FILENO || fd == dirfd(dir)) {
+			continue;
+		}
+		flags = fcntl(fd, F_GETFD);
+		if (flags >= 0 && !(flags & FD_CLOEXEC)) {
+			fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+		}
+	}
+	closedir(dir);
+}
+
+/* 登録された通知先にイベントを通知する */
+static void
+sensor_notify(struct sensor *sensor, int event) {
+	int i;
+
+	for (i = 0; i < sensor->listener_count; i++) {
+		sensor->listeners[i].event_cb(event, sensor->listeners[i].args);
+	}
+}
+
 /* USBデバイスのintteruptポーリング */
 static void
 sensor_polling(int fd, short event, void *args) {
@@ -97,16 +190,24 @@ sensor_polling(int fd, short event, void *args) {
 	unsigned char wdata[0];
 	unsigned char rdata[8];
 	struct usb_endpoint_descriptor *endpoint;
+	uint64_t start;
+	unsigned long first;
 	
         if (event != EV_TIMEOUT) {
 		ABORT();
 		/* NOT REACHED */
         }
 
+	watchdog_enter("sensor_polling");
+	/* 予定した時刻からの遅れ */
+	start = stats_now();
+	stats_record(STATS_POLL_JITTER,
+	    (start > sensor->poll_expected) ? start - sensor->poll_expected : 0);
 	/* エンドポイントは１つだけと仮定 */
 	endpoint = &sensor->dev->config->interface->altsetting->endpoint[0];
 
 	/* intterrupt bulk通信 */
+	start = stats_now();
 rewrite:
 	if (usb_interrupt_write(
 	    sensor->dh,
@@ -117,7 +218,9 @@ rewrite:
 		if (errno == EAGAIN) {
 			goto rewrite;
 		}
-		fprintf(stderr, "failed in intterupt write. (%d: %s)\n", errno, usb_strerror());
+		logger_write(LOGGER_WARN, "usb_write", "errno=%d usb_error=\"%s\"", errno, usb_strerror());
+		sensor->error_count++;
+		stats_add(STATS_USB_ERRORS, 1);
 		goto next;
 	}
 
@@ -131,47 +234,70 @@ reread:
 		if (errno == EAGAIN) {
 			goto reread;
 		}
-		fprintf(stderr, "failed in intterupt read. (%d: %s)\n", errno, usb_strerror());
+		logger_write(LOGGER_WARN, "usb_read", "errno=%d usb_error=\"%s\"", errno, usb_strerror());
+		sensor->error_count++;
+		stats_add(STATS_USB_ERRORS, 1);
 		goto next;
 	}
+	stats_record(STATS_USB_RTT, stats_now() - start);
+	stats_add(STATS_SAMPLES, 1);
+	sensor->sample_count++;
+	gettimeofday(&sensor->last_sample, NULL);
+	if (sensor->history) {
+		history_add(sensor->history, sensor->last_sample.tv_sec, (rdata[4] == 0xff));
+	}
+	if (sensor->archive) {
+		if (archive_add(sensor->archive,
+		    (uint64_t)sensor->last_sample.tv_sec * 1000000 + (uint64_t)sensor->last_sample.tv_usec,
+		    rdata[4],
+		    sensor->poll_interval)) {
+			logger_write(LOGGER_WARN, "archive", "errno=%d path=%s", errno, sensor->archive->path);
+		}
+	}
 
-        /* 取得した情報をチェック */
+        /* 人の有無が変わったら通知する */
+	if ((rdata[4] == 0xff) != sensor->presence) {
+		sensor->presence = (rdata[4] == 0xff);
+		sensor_notify(sensor, SENSOR_EVENT_PRESENCE);
+	}
+        /* 取得した情報をチェック (idssweepと同じ判定) */
 	if (rdata[4] == 0xff) {
-		/* 人がいる */
-		sensor->detect_count++;
-		if (sensor->detect_count > sensor->alert_threshold) {
-			printf("alert!!\n");
-			if (sensor->execute_alert) {
-				alert_start_first(sensor->alert);
-			}
-			sensor->detect_count = 0;
+		stats_add(STATS_DETECTIONS, 1);
+	}
+	if (detector_feed(&sensor->detect_count,
+	    (unsigned long)sensor->alert_threshold, (rdata[4] == 0xff), 1, &first)) {
+		logger_write(LOGGER_INFO, "alert", "detect_count=%lu threshold=%d execute=%d",
+		    (unsigned long)sensor->alert_threshold + 1, sensor->alert_threshold, sensor->execute_alert);
+		if (sensor->execute_alert) {
+			alert_start_first(sensor->alert);
 		}
-	} else {
-		/* 人がいない */
-		sensor->detect_count = 0;
 	}
 	/* 次のポーリングイベントを登録 */
 next:
+	sensor_notify(sensor, SENSOR_EVENT_SAMPLE);
 	timer.tv_sec = 0;
 	timer.tv_usec = sensor->poll_interval;
+	sensor->poll_expected = stats_now() + sensor->poll_interval;
         evtimer_set(&sensor->poll_event, sensor_polling, sensor);
         event_base_set(sensor->event_base, &sensor->poll_event);
+	event_priority_set(&sensor->poll_event, EVENT_PRIORITY_HIGH);
         evtimer_add(&sensor->poll_event, &timer);
+	watchdog_leave();
 }
 
 static void
 sensor_close(struct sensor *sensor) {
 	if (sensor->dh) {
 		/* device release */
-		printf("device release.\n");
 		if (usb_release_interface(sensor->dh, 0)) {
-			fprintf(stderr, "failed in release device. (%s)\n", usb_strerror());
+			logger_write(LOGGER_WARN, "usb_release", "usb_error=\"%s\"", usb_strerror());
 		}
 		/* device close */
-		printf("device close.\n");
 		if (usb_close(sensor->dh) < 0) {
-			fprintf(stderr, "failed in close device.(%s)\n", usb_strerror());
+			logger_write(LOGGER_WARN, "usb_close", "usb_error=\"%s\"", usb_strerror());
 		}
+		logger_write(LOGGER_INFO, "device", "state=closed");
+		sensor->dh = NULL;
 	}
 }
 
@@ -207,38 +333,41 @@ sensor_start(struct sensor *sensor)
 	int error = 0;
 	unsigned char wdata[0];
 	struct timeval timer;
+	uint64_t now;
 
 	if (sensor == NULL) {
 		fprintf(stderr, "invalid argument\n");
 		return  1;
 	}
 	/* USBデバイスの初期化処理 */
-	printf("device Initializing\n");
+	logger_write(LOGGER_INFO, "device", "state=initializing");
 	sensor->bus = usb_initialize();
-	sensor->dev = usb_search(sensor->bus, sensor->dev);
+	sensor->dev = usb_search(sensor->bus, sensor->usb_path);
 	if (sensor->dev == NULL) {
-		fprintf(stderr, "Device not found\n");
+		logger_write(LOGGER_ERROR, "device", "error=\"not found\" usb_path=%s",
+		    sensor->usb_path ? sensor->usb_path : "-");
 		error = 1;
 		goto finish;
 	}
         /* USBデバイスを開く */
-	printf("device opening\n");
+	logger_write(LOGGER_INFO, "device", "state=opening");
 	sensor->dh = usb_open(sensor->dev);
 	if (sensor->dh == NULL) {
-		fprintf(stderr, "failed in open device. (%s)\n", usb_strerror());
+		logger_write(LOGGER_ERROR, "device", "error=\"failed in open\" usb_error=\"%s\"", usb_strerror());
 		error = 1;
 		goto finish;
 	}
+	usb_set_cloexec();
         /* USBデバイスの設定処理 */
         if (usb_configure(sensor->dev, sensor->dh)) {
-		fprintf(stderr, "failed in configuration device.\n");
+		logger_write(LOGGER_ERROR, "device", "error=\"failed in configuration\"");
 		error = 1;
 		goto finish;
 	}
 
 	/* エンドポイントのチェック */
 	if (sensor->dev->config->interface->altsetting->bNumEndpoints <= 0) {
-		fprintf(stderr, "not found endpoints.\n");
+		logger_write(LOGGER_ERROR, "device", "error=\"not found endpoints\"");
 		error = 1;
 		goto finish;
 	}
@@ -253,21 +382,31 @@ sensor_start(struct sensor *sensor)
 	    (char *)wdata,
 	    sizeof(wdata),
 	    DEVICE_TIMEOUT) < 0) {
-		fprintf(stderr, "failed in control message.\n");
+		logger_write(LOGGER_ERROR, "device", "error=\"failed in control message\"");
 		error = 1;
 		goto finish;
 	}
 
 	/*
          * センサーのポーリングイベントの登録
-         * 初回は、イベントループに入るまでに、
-         * RPC開始などの処理があるため2秒ほど待つ
-         * 2秒は適当。
+         * 初回はイベントループに入ったらすぐにポーリングする
+         * (RPCなどの開始はイベントループに入る前に終わっている)
          */ 
-	timer.tv_sec = 2;
-	timer.tv_usec = 0;
+	now = stats_now();
+	if (sensor->resume) {
+		/* 前のプロセスが予定していた時刻から続ける */
+		if (sensor->poll_expected < now) {
+			sensor->poll_expected = now;
+		}
+		sensor->resume = 0;
+	} else {
+		sensor->poll_expected = now;
+	}
+	timer.tv_sec = (sensor->poll_expected - now) / 1000000;
+	timer.tv_usec = (sensor->poll_expected - now) % 1000000;
         evtimer_set(&sensor->poll_event, sensor_polling, sensor);
         event_base_set(sensor->event_base, &sensor->poll_event);
+	event_priority_set(&sensor->poll_event, EVENT_PRIORITY_HIGH);
         evtimer_add(&sensor->poll_event, &timer);
 
 	return 0;
@@ -283,24 +422,192 @@ sensor_finish(struct sensor *sensor) {
         /* ポーリングイベントを削除 */
 	evtimer_del(&sensor->poll_event);
 	sensor_close(sensor);
+	/* 引き継ぐプロセスが続きから書けるようにアーカイブを閉じる */
+	if (sensor->archive && archive_close(sensor->archive)) {
+		logger_write(LOGGER_WARN, "archive", "errno=%d path=%s", errno, sensor->archive->path);
+	}
 }
 
 void 
 sensor_destroy(struct sensor *sensor) {
-	free(sensor);
+	if (sensor) {
+		free(sensor->usb_path);
+		free(sensor);
+	}
+}
+
+int
+sensor_set_usb_path(struct sensor *sensor, const char *usb_path) {
+	char *path = NULL;
+
+	if (usb_path[0] != '\0') {
+		/* "<バス>-<ポート>[.<ポート>...]" */
+		if (strspn(usb_path, "0123456789-.") != strlen(usb_path) ||
+		    strchr(usb_path, '-') == NULL) {
+			return 1;
+		}
+		path = strdup(usb_path);
+		if (path == NULL) {
+			return 1;
+		}
+	}
+	free(sensor->usb_path);
+	sensor->usb_path = path;
+
+	return 0;
+}
+
+void
+sensor_set_history(struct sensor *sensor, struct history *history) {
+	sensor->history = history;
+}
+
+void
+sensor_set_archive(struct sensor *sensor, struct archive *archive) {
+	sensor->archive = archive;
 }
 
 void
 sensor_monitor_start(struct sensor *sensor) {
+	if (sensor->execute_alert) {
+		return;
+	}
 	sensor->execute_alert = 1;
+	sensor_notify(sensor, SENSOR_EVENT_MONITOR);
 }
 
 void
 sensor_monitor_stop(struct sensor *sensor) {
+	if (!sensor->execute_alert) {
+		return;
+	}
 	sensor->execute_alert = 0;
+	sensor_notify(sensor, SENSOR_EVENT_MONITOR);
 }
 
 int
 sensor_get_monitor_status(struct sensor *sensor) {
 	return sensor->execute_alert;
 }
+
+int
+sensor_get_presence(struct sensor *sensor) {
+	return sensor->presence;
+}
+
+unsigned long
+sensor_get_detect_count(struct sensor *sensor) {
+	return sensor->detect_count;
+}
+
+int
+sensor_get_alert_threshold(struct sensor *sensor) {
+	return sensor->alert_threshold;
+}
+
+unsigned long
+sensor_get_sample_count(struct sensor *sensor) {
+	return sensor->sample_count;
+}
+
+unsigned long
+sensor_get_error_count(struct sensor *sensor) {
+	return sensor->error_count;
+}
+
+void
+sensor_get_last_sample(struct sensor *sensor, struct timeval *last_sample) {
+	*last_sample = sensor->last_sample;
+}
+
+void
+sensor_get_state(struct sensor *sensor, struct sensor_state *state) {
+	memset(state, 0, sizeof(*state));
+	state->execute_alert = sensor->execute_alert;
+	state->presence = sensor->presence;
+	state->detect_count = sensor->detect_count;
+	state->sample_count = sensor->sample_count;
+	state->error_count = sensor->error_count;
+	state->last_sample = sensor->last_sample;
+	state->poll_expected = sensor->poll_expected;
+}
+
+void
+sensor_set_state(struct sensor *sensor, const struct sensor_state *state) {
+	sensor->detect_count = state->detect_count;
+	sensor->sample_count = state->sample_count;
+	sensor->error_count = state->error_count;
+	sensor->last_sample = state->last_sample;
+	sensor->poll_expected = state->poll_expected;
+	sensor->resume = 1;
+	if (sensor->presence != state->presence) {
+		sensor->presence = state->presence;
+		sensor_notify(sensor, SENSOR_EVENT_PRESENCE);
+	}
+	if (state->execute_alert) {
+		sensor_monitor_start(sensor);
+	} else {
+		sensor_monitor_stop(sensor);
+	}
+}
+
+void
+sensor_set_poll_interval(struct sensor *sensor, int poll_interval) {
+	struct timeval timer;
+	uint64_t now, expected;
+
+	if (evtimer_pending(&sensor->poll_event, NULL)) {
+		now = stats_now();
+		expected = sensor->poll_expected - sensor->poll_interval + poll_interval;
+		if (expected < now) {
+			expected = now;
+		}
+		evtimer_del(&sensor->poll_event);
+		timer.tv_sec = (expected - now) / 1000000;
+		timer.tv_usec = (expected - now) % 1000000;
+		sensor->poll_expected = expected;
+		evtimer_add(&sensor->poll_event, &timer);
+	}
+	sensor->poll_interval = poll_interval;
+}
+
+void
+sensor_set_alert_threshold(struct sensor *sensor, int alert_threshold) {
+	sensor->alert_threshold = alert_threshold;
+}
+
+int
+sensor_add_listener(
+    struct sensor *sensor,
+    void (*event_cb)(int event, void *args),
+    void *args)
+{
+	if (sensor->listener_count >= SENSOR_LISTENER_LIMIT) {
+		return 1;
+	}
+	sensor->listeners[sensor->listener_count].event_cb = event_cb;
+	sensor->listeners[sensor->listener_count].args = args;
+	sensor->listener_count++;
+
+	return 0;
+}
+
+void
+sensor_remove_listener(
+    struct sensor *sensor,
+    void (*event_cb)(int event, void *args),
+    void *args)
+{
+	int i;
+
+	for (i = 0; i < sensor->listener_count; i++) {
+		if (sensor->listeners[i].event_cb == event_cb &&
+		    sensor->listeners[i].args == args) {
+			/* 通知の順番を変えないように詰める */
+			memmove(&sensor->listeners[i], &sensor->listeners[i + 1],
+			    sizeof(sensor->listeners[0]) * (sensor->listener_count - i - 1));
+			sensor->listener_count--;
+			return;
+		}
+	}
+}
@@ -24,22 +24,58 @@
 #define USB_VENDOR      0x04bb /* IODATA */
 #define USB_PRODUCT     0x0f04 /* SENSOR-HM/ECO */
 #define DEVICE_TIMEOUT  (10 * 1000)
+#define USB_SYSFS_DEVICES "/sys/bus/usb/devices" /* usb_pathのポートを引くsysfsのディレクトリ */
 #define DEFAULT_POLL_INTERVAL	5000
 #define DEFAULT_ALERT_THRESHOLD 12
 
+#define SENSOR_LISTENER_LIMIT   8       /* rpc, http, status_publisher, 起動時の待ち合わせの4つと予備 */
+
+/* 通知するイベントの種類 */
+#define SENSOR_EVENT_MONITOR    0   /* 監視状態が変化した */
+#define SENSOR_EVENT_PRESENCE   1   /* 人の有無が変化した */
+#define SENSOR_EVENT_SAMPLE     2   /* ポーリングを1回終えた (失敗も含む) */
+
+/* sensorの状態変化を通知する先 */
+struct sensor_listener {
+	void (*event_cb)(int event, void *args);
+	void *args;
+};
+
+/* 別のプロセスに引き継ぐsensorの状態 */
+struct sensor_state {
+	int execute_alert;              /* alertの処理を行うかどうかのフラグ */
+	int presence;                   /* 最後のサンプルで人がいたかどうか */
+	unsigned long detect_count;     /* 連続検出回数 */
+	unsigned long sample_count;     /* 読めたサンプルの数 */
+	unsigned long error_count;      /* USBの読み書きに失敗した数 */
+	struct timeval last_sample;     /* 最後にサンプルを読めた時刻 */
+	uint64_t poll_expected;         /* 次のポーリングの予定時刻 (stats_now()の値) */
+};
+
 struct sensor {
 	struct event poll_event;
 	struct event_base *event_base;
         struct usb_bus *bus;
         struct usb_device *dev;
         struct usb_dev_handle *dh;
+	char *usb_path;                 /* 探すデバイスのポート "<バス>-<ポート>[.<ポート>...]"、NULLなら全て探す */
 	unsigned long detect_count;     /* 連続検出回数 */
+	int presence;                   /* 最後のサンプルで人がいたかどうか */
+	unsigned long sample_count;     /* 読めたサンプルの数 */
+	unsigned long error_count;      /* USBの読み書きに失敗した数 */
+	struct timeval last_sample;     /* 最後にサンプルを読めた時刻 */
+	uint64_t poll_expected;         /* 次のポーリングの予定時刻 (stats_now()の値) */
+	int resume;                     /* 引き継いだpoll_expectedから最初のポーリングを始める */
 	int execute_alert;              /* alertの処理を行うかどうかのフラグ */
 	struct alert *alert;            /* alertのインスタンス */
+	struct history *history;        /* 在室率の履歴、NULLなら記録しない */
+	struct archive *archive;        /* サンプルのアーカイブ、NULLなら記録しない */
         int poll_interval;              /* ポーリング間隔 */
         int alert_threshold;            /* 警報処理を開始する検出回数の境界値
                                          * 小さすぎると誤検知、大きすぎると検知しない
                                          */
+	struct sensor_listener listeners[SENSOR_LISTENER_LIMIT]; /* 状態変化の通知先 */
+	int listener_count;
 };
 
 /* sensorのインスタンスを生成 */
@@ -61,6 +97,29 @@ int sensor_start(
  */
 void sensor_finish(
     struct sensor *sensor);
+/*
+ * 探すデバイスをつながっているポート "<バス>-<ポート>[.<ポート>...]"
+ * (/sys/bus/usb/devices以下の名前、lsusb -tの並び) で決める
+ * 同じポートに挿し直せば同じデバイスとして見つかる
+ * sensor_startの前に呼ぶ。空ならベンダーIDとプロダクトIDが合う最初のデバイスを使う
+ */
+int sensor_set_usb_path(
+    struct sensor *sensor,
+    const char *usb_path);
+/*
+ * サンプルを在室率の履歴に記録する
+ * NULLなら記録しない
+ */
+void sensor_set_history(
+    struct sensor *sensor,
+    struct history *history);
+/*
+ * 読んだ値をアーカイブに記録する
+ * NULLなら記録しない、sensor_finishでアーカイブのファイルを閉じる
+ */
+void sensor_set_archive(
+    struct sensor *sensor,
+    struct archive *archive);
 /* インスタンス削除 */
 void sensor_destroy(
     struct sensor *sensor);
@@ -73,5 +132,58 @@ void sensor_monitor_stop(
 /* alert処理をしているかしていないかの状態を返す */
 int sensor_get_monitor_status(
     struct sensor *sensor);
+/* 最後のサンプルで人がいたかどうかを返す */
+int sensor_get_presence(
+    struct sensor *sensor);
+/* 連続検出回数を返す */
+unsigned long sensor_get_detect_count(
+    struct sensor *sensor);
+/* 警報処理を開始する検出回数の境界値を返す */
+int sensor_get_alert_threshold(
+    struct sensor *sensor);
+/* 読めたサンプルの数を返す */
+unsigned long sensor_get_sample_count(
+    struct sensor *sensor);
+/* USBの読み書きに失敗した数を返す */
+unsigned long sensor_get_error_count(
+    struct sensor *sensor);
+/* 最後にサンプルを読めた時刻を返す */
+void sensor_get_last_sample(
+    struct sensor *sensor,
+    struct timeval *last_sample);
+/* 別のプロセスに引き継ぐ状態を取得する */
+void sensor_get_state(
+    struct sensor *sensor,
+    struct sensor_state *state);
+/*
+ * 引き継いだ状態に戻す
+ * sensor_startの前に呼ぶ。最初のポーリングは引き継いだ予定時刻に行う
+ * (過ぎていればすぐにポーリングする)
+ */
+void sensor_set_state(
+    struct sensor *sensor,
+    const struct sensor_state *state);
+/*
+ * ポーリング間隔を変える
+ * 次のポーリングは前回のポーリングから新しい間隔で予定し直す
+ * (もう過ぎていればすぐにポーリングする)
+ */
+void sensor_set_poll_interval(
+    struct sensor *sensor,
+    int poll_interval);
+/* 警報処理を開始する検出回数の境界値を変える */
+void sensor_set_alert_threshold(
+    struct sensor *sensor,
+    int alert_threshold);
+/* 状態が変化した時の通知先を登録する */
+int sensor_add_listener(
+    struct sensor *sensor,
+    void (*event_cb)(int event, void *args),
+    void *args);
+/* sensor_add_listenerで登録した通知先を外す (登録されていなければ何もしない) */
+void sensor_remove_listener(
+    struct sensor *sensor,
+    void (*event_cb)(int event, void *args),
+    void *args);
 
 #endif
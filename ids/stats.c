@@ -0,0 +1,243 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct stats ids_stats;
+
+/* 出力用の名前 */
+struct stats_name {
+	const char *key;       /* GET_STATSのキー */
+	const char *metric;    /* Prometheusのメトリクス名 (ラベル付き) */
+	const char *help;      /* Prometheusの説明 */
+};
+
+static const struct stats_name stats_counter_names[] = {
+#define STATS_COUNTER(id, key, metric, help) { #key, metric, help },
+#define STATS_HISTOGRAM(id, key, metric, help)
+#include "stats.def"
+#undef STATS_COUNTER
+#undef STATS_HISTOGRAM
+};
+
+static const struct stats_name stats_histogram_names[] = {
+#define STATS_COUNTER(id, key, metric, help)
+#define STATS_HISTOGRAM(id, key, metric, help) { #key, metric, help },
+#include "stats.def"
+#undef STATS_COUNTER
+#undef STATS_HISTOGRAM
+};
+
+/*
+ * bufferのlenの位置に追記する
+ * 収まらなければ1を返す
+ */
+static int stats_append(char *buffer, size_t size, size_t *len, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static int
+stats_append(char *buffer, size_t size, size_t *len, const char *format, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(&buffer[*len], size - *len, format, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= size - *len) {
+		return 1;
+	}
+	*len += n;
+
+	return 0;
+}
+
+uint64_t
+stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t
+stats_bucket_upper(int bucket) {
+	int exponent, sub;
+
+	if (bucket < STATS_HISTOGRAM_SUB - 1) {
+		return bucket;
+	}
+	/* 次のbucketの下限 - 1 */
+	bucket++;
+	exponent = bucket / STATS_HISTOGRAM_SUB + STATS_HISTOGRAM_SUB_BITS - 1;
+	sub = bucket % STATS_HISTOGRAM_SUB;
+	return ((uint64_t)(STATS_HISTOGRAM_SUB + sub) << (exponent - STATS_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+uint64_t
+stats_histogram_percentile(const struct stats_histogram *histogram, int percent) {
+	uint64_t count, rank, max, seen = 0;
+	int i;
+
+	count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	if (count == 0) {
+		return 0;
+	}
+	/* bucketの上限がmaxを超える場合はmaxを返す */
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	rank = (count * percent + 99) / 100;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= rank) {
+			return (stats_bucket_upper(i) < max) ? stats_bucket_upper(i) : max;
+		}
+	}
+
+	return max;
+}
+
+int
+stats_format(char *buffer, size_t size) {
+	const struct stats_histogram *histogram;
+	const char *key;
+	size_t len = 0;
+	int i;
+
+	buffer[0] = '\0';
+	for (i = 0; i < STATS_COUNTER_MAX; i++) {
+		if (stats_append(buffer, size, &len, "%s%s=%" PRIu64,
+		    (len == 0) ? "" : " ", stats_counter_names[i].key,
+		    __atomic_load_n(&ids_stats.counters[i], __ATOMIC_RELAXED))) {
+			return -1;
+		}
+	}
+	for (i = 0; i < STATS_HISTOGRAM_MAX; i++) {
+		histogram = &ids_stats.histograms[i];
+		key = stats_histogram_names[i].key;
+		if (stats_append(buffer, size, &len,
+		    " %s_count=%" PRIu64 " %s_sum_us=%" PRIu64
+		    " %s_p50_us=%" PRIu64 " %s_p90_us=%" PRIu64
+		    " %s_p99_us=%" PRIu64 " %s_max_us=%" PRIu64,
+		    key, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+		    key, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED),
+		    key, stats_histogram_percentile(histogram, 50),
+		    key, stats_histogram_percentile(histogram, 90),
+		    key, stats_histogram_percentile(histogram, 99),
+		    key, __atomic_load_n(&histogram->max, __ATOMIC_RELAXED))) {
+			return -1;
+		}
+	}
+
+	return (int)len;
+}
+
+/* ラベルを除いたメトリクス名の長さ */
+static int
+stats_metric_family_len(const char *metric) {
+	const char *brace = strchr(metric, '{');
+
+	return brace ? (int)(brace - metric) : (int)strlen(metric);
+}
+
+/* 前と違うメトリクス名ならHELPとTYPEを書く */
+static int
+stats_append_family(
+    char *buffer,
+    size_t size,
+    size_t *len,
+    const struct stats_name *name,
+    const struct stats_name *prev,
+    const char *type)
+{
+	int family_len = stats_metric_family_len(name->metric);
+
+	if (prev != NULL &&
+	    stats_metric_family_len(prev->metric) == family_len &&
+	    strncmp(prev->metric, name->metric, family_len) == 0) {
+		return 0;
+	}
+
+	return stats_append(buffer, size, len, "# HELP %.*s %s\n# TYPE %.*s %s\n",
+	    family_len, name->metric, name->help, family_len, name->metric, type);
+}
+
+int
+stats_format_prometheus(char *buffer, size_t size) {
+	const struct stats_histogram *histogram;
+	const struct stats_name *name;
+	uint64_t cumulative, upper, sum;
+	size_t len = 0;
+	int i, bucket;
+
+	buffer[0] = '\0';
+	for (i = 0; i < STATS_COUNTER_MAX; i++) {
+		name = &stats_counter_names[i];
+		if (stats_append_family(buffer, size, &len, name,
+		    (i > 0) ? &stats_counter_names[i - 1] : NULL, "counter") ||
+		    stats_append(buffer, size, &len, "%s %" PRIu64 "\n", name->metric,
+		    __atomic_load_n(&ids_stats.counters[i], __ATOMIC_RELAXED))) {
+			return -1;
+		}
+	}
+	/*
+	 * bucketは2のべき乗の区切りだけ出す
+	 * countは途中で増えても食い違わないようにbucketの合計を使う
+	 */
+	for (i = 0; i < STATS_HISTOGRAM_MAX; i++) {
+		histogram = &ids_stats.histograms[i];
+		name = &stats_histogram_names[i];
+		if (stats_append_family(buffer, size, &len, name, NULL, "histogram")) {
+			return -1;
+		}
+		cumulative = 0;
+		for (bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS - 1; bucket++) {
+			cumulative += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+			if ((bucket + 1) % STATS_HISTOGRAM_SUB != 0) {
+				continue;
+			}
+			upper = stats_bucket_upper(bucket);
+			if (stats_append(buffer, size, &len,
+			    "%s_bucket{le=\"%" PRIu64 ".%06" PRIu64 "\"} %" PRIu64 "\n",
+			    name->metric, upper / 1000000, upper % 1000000, cumulative)) {
+				return -1;
+			}
+		}
+		cumulative += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+		sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+		if (stats_append(buffer, size, &len,
+		    "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+		    "%s_sum %" PRIu64 ".%06" PRIu64 "\n"
+		    "%s_count %" PRIu64 "\n",
+		    name->metric, cumulative,
+		    name->metric, sum / 1000000, sum % 1000000,
+		    name->metric, cumulative)) {
+			return -1;
+		}
+	}
+
+	return (int)len;
+}
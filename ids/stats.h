@@ -0,0 +1,137 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * デーモン全体の統計
+ * どのモジュールからも更新するのでインスタンスは1つだけ (ids_stats)
+ * 更新はrelaxedのatomicで行い、ロックはとらない
+ * 使う側は stdint.h をincludeしてからこのファイルをincludeする
+ */
+
+/*
+ * ヒストグラムはlog-linear
+ * 2のべき乗の区間ごとにSTATS_HISTOGRAM_SUB個の等間隔のbucketに分ける
+ * 最後のbucketはそれ以上の値をすべて含む
+ */
+#define STATS_HISTOGRAM_SUB_BITS  2
+#define STATS_HISTOGRAM_SUB       (1 << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_BUCKETS   128   /* 2^32マイクロ秒くらいまで */
+
+enum stats_counter_id {
+#define STATS_COUNTER(id, key, metric, help) STATS_##id,
+#define STATS_HISTOGRAM(id, key, metric, help)
+#include "stats.def"
+#undef STATS_COUNTER
+#undef STATS_HISTOGRAM
+	STATS_COUNTER_MAX
+};
+
+enum stats_histogram_id {
+#define STATS_COUNTER(id, key, metric, help)
+#define STATS_HISTOGRAM(id, key, metric, help) STATS_##id,
+#include "stats.def"
+#undef STATS_COUNTER
+#undef STATS_HISTOGRAM
+	STATS_HISTOGRAM_MAX
+};
+
+struct stats_histogram {
+	uint64_t count;                              /* 記録した数 */
+	uint64_t sum;                                /* 合計 (マイクロ秒) */
+	uint64_t max;                                /* 最大 (マイクロ秒) */
+	uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+struct stats {
+	uint64_t counters[STATS_COUNTER_MAX];
+	struct stats_histogram histograms[STATS_HISTOGRAM_MAX];
+};
+
+extern struct stats ids_stats;
+
+/* 値が入るbucketの番号 */
+static inline int
+stats_bucket(uint64_t value) {
+	int exponent, index;
+
+	if (value < STATS_HISTOGRAM_SUB) {
+		return (int)value;
+	}
+	exponent = 63 - __builtin_clzll(value);
+	index = (exponent - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB +
+	    (int)((value >> (exponent - STATS_HISTOGRAM_SUB_BITS)) & (STATS_HISTOGRAM_SUB - 1));
+	if (index >= STATS_HISTOGRAM_BUCKETS) {
+		return STATS_HISTOGRAM_BUCKETS - 1;
+	}
+
+	return index;
+}
+
+/* カウンターを増やす */
+static inline void
+stats_add(enum stats_counter_id id, uint64_t value) {
+	__atomic_fetch_add(&ids_stats.counters[id], value, __ATOMIC_RELAXED);
+}
+
+/* ヒストグラムに記録する */
+static inline void
+stats_record(enum stats_histogram_id id, uint64_t value) {
+	struct stats_histogram *histogram = &ids_stats.histograms[id];
+	uint64_t max;
+
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->buckets[stats_bucket(value)], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	while (value > max &&
+	    !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* maxは更新されている */
+	}
+}
+
+/* 経過時間を測るための単調増加する時刻 (マイクロ秒) */
+uint64_t stats_now(void);
+/* bucketに入る値の上限 */
+uint64_t stats_bucket_upper(
+    int bucket);
+/* ヒストグラムのパーセンタイル (bucketの上限で返す) */
+uint64_t stats_histogram_percentile(
+    const struct stats_histogram *histogram,
+    int percent);
+/*
+ * 全ての統計を key=value の1行にする
+ * 書いた長さを返す、収まらなければ-1を返す
+ */
+int stats_format(
+    char *buffer,
+    size_t size);
+/*
+ * 全ての統計をPrometheusのtext exposition formatで書く
+ * 書いた長さを返す、収まらなければ-1を返す
+ */
+int stats_format_prometheus(
+    char *buffer,
+    size_t size);
+
+#endif
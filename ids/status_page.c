@@ -0,0 +1,219 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "status_page.h"
+
+#define STATUS_PAGE_WORDS (sizeof(struct status_page_snapshot) / sizeof(uint64_t))
+
+/*
+ * スナップショットを1語ずつコピーする
+ * 書き手と読み手が同時に触るのでrelaxedのatomicで読み書きする
+ */
+static void
+status_page_copy(uint64_t *dst, const uint64_t *src) {
+	size_t i;
+
+	for (i = 0; i < STATUS_PAGE_WORDS; i++) {
+		__atomic_store_n(&dst[i], __atomic_load_n(&src[i], __ATOMIC_RELAXED),
+		    __ATOMIC_RELAXED);
+	}
+}
+
+static struct status_page *
+status_page_alloc(const char *name) {
+	struct status_page *inst;
+
+	inst = malloc(sizeof(struct status_page));
+	if (inst == NULL) {
+		return NULL;
+	}
+	memset(inst, 0, sizeof(struct status_page));
+	inst->name = strdup(name);
+	if (inst->name == NULL) {
+		free(inst);
+		return NULL;
+	}
+
+	return inst;
+}
+
+int
+status_page_create(struct status_page **page, const char *name) {
+	struct status_page *inst;
+	int fd = -1;
+	void *addr;
+
+	*page = NULL;
+	inst = status_page_alloc(name);
+	if (inst == NULL) {
+		return 1;
+	}
+	/* 前回のページが残っていたら作り直す (古いページを開いている読み手はそのまま) */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed in open shared memory (%s).\n", name);
+		goto fail;
+	}
+	inst->owner = 1;
+	if (ftruncate(fd, sizeof(struct status_page_shm)) < 0) {
+		fprintf(stderr, "failed in truncate shared memory (%s).\n", name);
+		goto fail;
+	}
+	addr = mmap(NULL, sizeof(struct status_page_shm),
+	    PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "failed in map shared memory (%s).\n", name);
+		goto fail;
+	}
+	close(fd);
+	inst->shm = addr;
+	inst->shm->version = STATUS_PAGE_VERSION;
+	inst->shm->snapshot_size = sizeof(struct status_page_snapshot);
+	/* 初期化が終わってからmagicを書く */
+	__atomic_store_n(&inst->shm->magic, STATUS_PAGE_MAGIC, __ATOMIC_RELEASE);
+	*page = inst;
+
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (inst->owner) {
+		shm_unlink(name);
+	}
+	free(inst->name);
+	free(inst);
+
+	return 1;
+}
+
+void
+status_page_write(
+    struct status_page *page,
+    const struct status_page_snapshot *snapshot)
+{
+	struct status_page_shm *shm = page->shm;
+	uint64_t sequence;
+
+	/* 書き手は1つだけなのでsequenceはそのまま読める */
+	sequence = shm->sequence;
+	__atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	status_page_copy((uint64_t *)&shm->snapshot, (const uint64_t *)snapshot);
+	__atomic_store_n(&shm->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int
+status_page_open(struct status_page **page, const char *name) {
+	struct status_page *inst;
+	struct stat st;
+	int fd;
+	void *addr;
+
+	*page = NULL;
+	inst = status_page_alloc(name);
+	if (inst == NULL) {
+		return 1;
+	}
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		goto fail;
+	}
+	if (fstat(fd, &st) < 0 ||
+	    st.st_size < (off_t)sizeof(struct status_page_shm)) {
+		close(fd);
+		goto fail;
+	}
+	addr = mmap(NULL, sizeof(struct status_page_shm),
+	    PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		goto fail;
+	}
+	inst->shm = addr;
+	if (__atomic_load_n(&inst->shm->magic, __ATOMIC_ACQUIRE) != STATUS_PAGE_MAGIC ||
+	    inst->shm->version != STATUS_PAGE_VERSION ||
+	    inst->shm->snapshot_size != sizeof(struct status_page_snapshot)) {
+		munmap(inst->shm, sizeof(struct status_page_shm));
+		goto fail;
+	}
+	*page = inst;
+
+	return 0;
+
+fail:
+	free(inst->name);
+	free(inst);
+
+	return 1;
+}
+
+int
+status_page_read(
+    struct status_page *page,
+    struct status_page_snapshot *snapshot)
+{
+	const struct status_page_shm *shm = page->shm;
+	uint64_t sequence;
+	int retry;
+
+	for (retry = 0; retry < STATUS_PAGE_READ_RETRY; retry++) {
+		sequence = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			continue;
+		}
+		status_page_copy((uint64_t *)snapshot, (const uint64_t *)&shm->snapshot);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->sequence, __ATOMIC_RELAXED) == sequence) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void
+status_page_disown(struct status_page *page) {
+	page->owner = 0;
+}
+
+void
+status_page_destroy(struct status_page *page) {
+	if (page) {
+		munmap(page->shm, sizeof(struct status_page_shm));
+		if (page->owner) {
+			shm_unlink(page->name);
+		}
+		free(page->name);
+		free(page);
+	}
+}
@@ -0,0 +1,100 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+/*
+ * idsの状態を置く共有メモリのページ
+ *
+ * idsデーモンがPOSIX共有メモリに書き、同じホストの読み手(CGIや監視エージェント)は
+ * mmapして読むだけでよい。ソケットもシステムコールも使わず、デーモンも起こさない。
+ * 書き込み中かどうかはseqlockで判定する。sequenceが奇数の間は書き込み中で、
+ * 読む前と後でsequenceが同じなら一貫したスナップショットが読めている。
+ *
+ * 使う側は stdint.h をincludeしてからこのファイルをincludeする。
+ */
+
+#define STATUS_PAGE_DEFAULT_NAME  "/ids"
+#define STATUS_PAGE_MAGIC         0x49445331   /* "IDS1" */
+#define STATUS_PAGE_VERSION       1
+#define STATUS_PAGE_READ_RETRY    1000         /* 書き込み中だった場合に読み直す回数 */
+
+/* ページに置く状態 (すべてuint64_t) */
+struct status_page_snapshot {
+	uint64_t pid;                  /* idsデーモンのpid */
+	uint64_t alert_status;         /* 0: GOOD, 1: FIRST ALERT, 2: SECOND ALERT */
+	uint64_t execute_alert;        /* 0: STOPPING, 1: RUNNING */
+	uint64_t presence;             /* 最後のサンプルで人がいたか */
+	uint64_t detect_count;         /* 連続検出回数 */
+	uint64_t last_sample_sec;      /* 最後にサンプルを読めた時刻 */
+	uint64_t last_sample_usec;
+	uint64_t sample_count;         /* 読めたサンプルの数 */
+	uint64_t error_count;          /* USBの読み書きに失敗した数 */
+	uint64_t first_alert_count;    /* 1次警報になった回数 */
+	uint64_t second_alert_count;   /* 2次警報になった回数 */
+};
+
+/* 共有メモリの中身 */
+struct status_page_shm {
+	uint32_t magic;                /* 初期化が終わったらSTATUS_PAGE_MAGIC */
+	uint32_t version;              /* STATUS_PAGE_VERSION */
+	uint32_t snapshot_size;        /* sizeof(struct status_page_snapshot) */
+	uint32_t reserved;
+	uint64_t sequence;             /* seqlock、奇数なら書き込み中 */
+	struct status_page_snapshot snapshot;
+};
+
+struct status_page {
+	char *name;                    /* shm_openの名前 */
+	struct status_page_shm *shm;   /* mmapしたページ */
+	int owner;                     /* 作成した側か (削除時にshm_unlinkする) */
+};
+
+/* ページを作成する (デーモン側) */
+int status_page_create(
+    struct status_page **page,
+    const char *name);
+/* スナップショットを書く (デーモン側) */
+void status_page_write(
+    struct status_page *page,
+    const struct status_page_snapshot *snapshot);
+/* 既存のページを読み込み専用で開く (読み手側) */
+int status_page_open(
+    struct status_page **page,
+    const char *name);
+/*
+ * 一貫したスナップショットを読む (読み手側)
+ * 書き込み中のままSTATUS_PAGE_READ_RETRY回読み直しても読めなければ1を返す
+ */
+int status_page_read(
+    struct status_page *page,
+    struct status_page_snapshot *snapshot);
+/*
+ * 閉じてもページを削除しないようにする (デーモン側)
+ * 同じ名前のページを別のプロセスが作り直す場合に呼ぶ
+ */
+void status_page_disown(
+    struct status_page *page);
+/* ページを閉じる、作成した側ならページを削除する */
+void status_page_destroy(
+    struct status_page *page);
+
+#endif
@@ -0,0 +1,150 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "macro.h"
+#include "alert.h"
+#include "sensor.h"
+#include "status_page.h"
+#include "status_publisher.h"
+
+/* 現在の状態をページに書く */
+static void
+status_publisher_update(struct status_publisher *publisher) {
+	struct status_page_snapshot *snapshot = &publisher->snapshot;
+	struct timeval last_sample;
+
+	if (publisher->page == NULL) {
+		return;
+	}
+	sensor_get_last_sample(publisher->sensor, &last_sample);
+	snapshot->alert_status = alert_get_status(publisher->alert);
+	snapshot->execute_alert = sensor_get_monitor_status(publisher->sensor);
+	snapshot->presence = sensor_get_presence(publisher->sensor);
+	snapshot->detect_count = sensor_get_detect_count(publisher->sensor);
+	snapshot->last_sample_sec = last_sample.tv_sec;
+	snapshot->last_sample_usec = last_sample.tv_usec;
+	snapshot->sample_count = sensor_get_sample_count(publisher->sensor);
+	snapshot->error_count = sensor_get_error_count(publisher->sensor);
+	status_page_write(publisher->page, snapshot);
+}
+
+/* alertステータスの変化通知 */
+static void
+status_publisher_alert_status_changed(int status, void *args) {
+	struct status_publisher *publisher = args;
+
+	if (status == ALERT_STATUS_FIRST_ALERT) {
+		publisher->snapshot.first_alert_count++;
+	} else if (status == ALERT_STATUS_SECOND_ALERT) {
+		publisher->snapshot.second_alert_count++;
+	}
+	status_publisher_update(publisher);
+}
+
+/* sensorの状態変化通知 (サンプルごとにも来る) */
+static void
+status_publisher_sensor_event(int event, void *args) {
+	status_publisher_update(args);
+}
+
+int
+status_publisher_create(
+    struct status_publisher **publisher,
+    const char *name,
+    struct alert *alert,
+    struct sensor *sensor)
+{
+	struct status_publisher *inst;
+
+	*publisher = NULL;
+	inst = malloc(sizeof(struct status_publisher));
+	if (inst == NULL) {
+		return 1;
+	}
+	memset(inst, 0, sizeof(struct status_publisher));
+	inst->name = strdup(name);
+	if (inst->name == NULL) {
+		goto fail;
+	}
+	inst->alert = alert;
+	inst->sensor = sensor;
+	if (alert_add_listener(alert, status_publisher_alert_status_changed, inst) ||
+	    sensor_add_listener(sensor, status_publisher_sensor_event, inst)) {
+		goto fail;
+	}
+	*publisher = inst;
+
+	return 0;
+
+fail:
+	alert_remove_listener(alert, status_publisher_alert_status_changed, inst);
+	sensor_remove_listener(sensor, status_publisher_sensor_event, inst);
+	free(inst->name);
+	free(inst);
+
+	return 1;
+}
+
+int
+status_publisher_start(struct status_publisher *publisher) {
+	if (status_page_create(&publisher->page, publisher->name)) {
+		fprintf(stderr, "failed in create status page.\n");
+		return 1;
+	}
+	publisher->snapshot.pid = getpid();
+	status_publisher_update(publisher);
+
+	return 0;
+}
+
+void
+status_publisher_finish(struct status_publisher *publisher) {
+	status_page_destroy(publisher->page);
+	publisher->page = NULL;
+}
+
+void
+status_publisher_release(struct status_publisher *publisher) {
+	if (publisher->page == NULL) {
+		return;
+	}
+	status_page_disown(publisher->page);
+	status_page_destroy(publisher->page);
+	publisher->page = NULL;
+}
+
+void
+status_publisher_destroy(struct status_publisher *publisher) {
+	if (publisher) {
+		status_page_destroy(publisher->page);
+		alert_remove_listener(publisher->alert, status_publisher_alert_status_changed, publisher);
+		sensor_remove_listener(publisher->sensor, status_publisher_sensor_event, publisher);
+		free(publisher->name);
+		free(publisher);
+	}
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef STATUS_PUBLISHER_H
+#define STATUS_PUBLISHER_H
+
+/* alertとsensorの状態を共有メモリのページに書き続ける */
+struct status_publisher {
+	char *name;                            /* 共有メモリの名前 */
+	struct status_page *page;              /* 書き込むページ */
+	struct alert *alert;                   /* alertのインスタンス */
+	struct sensor *sensor;                 /* sensorのインスタンス */
+	struct status_page_snapshot snapshot;  /* 最後に書いた状態 */
+};
+
+/* status_publisherのインスタンス生成 */
+int status_publisher_create(
+    struct status_publisher **publisher,
+    const char *name,
+    struct alert *alert,
+    struct sensor *sensor);
+/* ページを作成して書き始める */
+int status_publisher_start(
+    struct status_publisher *publisher);
+/* ページを削除する */
+void status_publisher_finish(
+    struct status_publisher *publisher);
+/*
+ * ページを削除せずに書くのをやめる
+ * 新しいプロセスが同じ名前でページを作り直す場合に呼ぶ
+ */
+void status_publisher_release(
+    struct status_publisher *publisher);
+/* status_publisherのインスタンス削除 */
+void status_publisher_destroy(
+    struct status_publisher *publisher);
+
+#endif
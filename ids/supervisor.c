@@ -0,0 +1,123 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "supervisor.h"
+
+int
+supervisor_notify(const char *state) {
+	const char *path;
+	struct sockaddr_un sun;
+	socklen_t sun_len;
+	size_t len;
+	int sd;
+
+	path = getenv(SUPERVISOR_NOTIFY_ENV);
+	if (path == NULL || (path[0] != '/' && path[0] != '@')) {
+		return 0;
+	}
+	len = strlen(path);
+	if (len >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "too long %s (%s).\n", SUPERVISOR_NOTIFY_ENV, path);
+		return 1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len);
+	/* abstractの名前は先頭を\0にして、長さで終わりを示す */
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0';
+	}
+	sun_len = offsetof(struct sockaddr_un, sun_path) + len;
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		fprintf(stderr, "failed in create notify socket (%s).\n", strerror(errno));
+		return 1;
+	}
+	if (sendto(sd, state, strlen(state), MSG_NOSIGNAL,
+	    (struct sockaddr *)&sun, sun_len) < 0) {
+		fprintf(stderr, "failed in notify %s (%s).\n", path, strerror(errno));
+		close(sd);
+		return 1;
+	}
+	close(sd);
+
+	return 0;
+}
+
+/* 環境変数の数値を読む、読めなければ-1 */
+static long
+supervisor_env_number(const char *name) {
+	const char *env;
+	char *end;
+	long value;
+
+	env = getenv(name);
+	if (env == NULL || *env == '\0') {
+		return -1;
+	}
+	errno = 0;
+	value = strtol(env, &end, 10);
+	if (errno || *end != '\0' || value < 0) {
+		return -1;
+	}
+
+	return value;
+}
+
+int
+supervisor_listen_fds(int *sd, int sd_max) {
+	long pid;
+	long count;
+	int i;
+
+	pid = supervisor_env_number(SUPERVISOR_LISTEN_PID_ENV);
+	count = supervisor_env_number(SUPERVISOR_LISTEN_FDS_ENV);
+	unsetenv(SUPERVISOR_LISTEN_PID_ENV);
+	unsetenv(SUPERVISOR_LISTEN_FDS_ENV);
+	unsetenv(SUPERVISOR_LISTEN_NAMES_ENV);
+	/* 自分宛てでなければ他のプロセスに渡されたもの */
+	if (pid < 0 || count < 0 || pid != (long)getpid()) {
+		return 0;
+	}
+	if (count > sd_max) {
+		fprintf(stderr, "too many %s (%ld).\n", SUPERVISOR_LISTEN_FDS_ENV, count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		sd[i] = SUPERVISOR_LISTEN_FDS_START + i;
+		if (fcntl(sd[i], F_SETFD, FD_CLOEXEC) < 0) {
+			fprintf(stderr, "invalid listen socket %d (%s).\n", sd[i], strerror(errno));
+			return -1;
+		}
+	}
+
+	return (int)count;
+}
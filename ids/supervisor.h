@@ -0,0 +1,60 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+/*
+ * サービスマネージャー (systemdなど) とのやり取り
+ *
+ * 環境変数NOTIFY_SOCKETにunix domain socketのパス (@で始まればabstract) があれば、
+ * そこに "READY=1" などの状態をdatagramで送る (sd_notifyと同じ形式)。
+ * 無ければ何もしない。
+ *
+ * 環境変数LISTEN_PIDが自分のpidなら、fd 3からLISTEN_FDS個のsdを
+ * サービスマネージャーがlistenしたものとして受け取る (sd_listen_fdsと同じ形式)。
+ * サービスマネージャーがsdを持ち続けるので、再起動の間の接続はbacklogで待たされる。
+ */
+
+#define SUPERVISOR_NOTIFY_ENV   "NOTIFY_SOCKET"
+#define SUPERVISOR_STATE_SIZE   256     /* 1回で送る状態の大きさ */
+#define SUPERVISOR_LISTEN_PID_ENV   "LISTEN_PID"
+#define SUPERVISOR_LISTEN_FDS_ENV   "LISTEN_FDS"
+#define SUPERVISOR_LISTEN_NAMES_ENV "LISTEN_FDNAMES"
+#define SUPERVISOR_LISTEN_FDS_START 3   /* 渡されるsdの最初の番号 */
+
+/*
+ * 状態を送る
+ * stateは "KEY=VALUE" を改行で区切ったもの
+ * 送り先が無ければ0、送れなければ1を返す
+ */
+int supervisor_notify(
+    const char *state);
+
+/*
+ * サービスマネージャーから渡されたsdをsdに書いてその数を返す
+ * fork (daemon) する前に呼ぶ。渡されていなければ0、おかしければ-1を返す
+ * 受け取ったsdはclose-on-execにし、子プロセスに渡さないように環境変数は消す
+ */
+int supervisor_listen_fds(
+    int *sd,
+    int sd_max);
+
+#endif
@@ -19,8 +19,11 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE     /* struct ucred, accept4, pipe2 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/queue.h>
 #include <sys/time.h>
 #include <netinet/in.h>
@@ -31,78 +34,389 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include <event.h>
 #include <semaphore.h>
 #include <stdint.h>
 #include <time.h>
 
 #include "macro.h"
+#include "token_bucket.h"
 #include "tcpsock.h"
+#include "logger.h"
+#include "tcpsock_uring.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "priority.h"
 
+/*
+ * タイマーホイール
+ */
+/* 接続をタイマーホイールから外す */
 static void
-tcp_server_accept(int listen_sd, short event, void *args){
-	tcp_accept_t *tcpaccept;
+tcp_timer_wheel_remove(tcp_accept_info_t *tcpacceptinfo) {
+	if (!tcpacceptinfo->timeout_armed) {
+		return;
+	}
+	LIST_REMOVE(tcpacceptinfo, timeout_entry);
+	tcpacceptinfo->timeout_armed = 0;
+	tcpacceptinfo->tcpaccept->tcpserver->timer_wheel.count--;
+}
+
+/* 接続をタイマーホイールに載せる (載っていれば延長する) */
+static void
+tcp_timer_wheel_insert(struct tcp_timer_wheel *timer_wheel, tcp_accept_info_t *tcpacceptinfo) {
+	struct timeval tick;
+	unsigned int slot;
+
+	tcp_timer_wheel_remove(tcpacceptinfo);
+	slot = (timer_wheel->current + timer_wheel->ticks) & (TIMER_WHEEL_SLOTS - 1);
+	tcpacceptinfo->timeout_rounds = (timer_wheel->ticks - 1) / TIMER_WHEEL_SLOTS;
+	LIST_INSERT_HEAD(&timer_wheel->slots[slot], tcpacceptinfo, timeout_entry);
+	tcpacceptinfo->timeout_armed = 1;
+	timer_wheel->count++;
+	/* 空の間は止めているtickを動かす */
+	if (!timer_wheel->armed) {
+		tick.tv_sec = TIMER_WHEEL_TICK;
+		tick.tv_usec = 0;
+		if (evtimer_add(&timer_wheel->tick_event, &tick) == 0) {
+			timer_wheel->armed = 1;
+		}
+	}
+}
+
+/*
+ * スロットを1つ進めてタイムアウトした接続のコールバックを呼ぶ
+ * コールバックの中で他の接続が閉じられてもいいように、先に別のリストに移してから呼ぶ
+ * 載っている接続が無くなったらtickを止める (アイドル時に起きないように)
+ */
+static void
+tcp_timer_wheel_tick_handle(int fd, short event, void *args) {
+	struct tcp_timer_wheel *timer_wheel = args;
+	LIST_HEAD(, tcp_accept_info) expired;
+	tcp_accept_info_t *tcpacceptinfo, *next;
+
+	if (event != EV_TIMEOUT) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	LIST_INIT(&expired);
+	timer_wheel->current = (timer_wheel->current + 1) & (TIMER_WHEEL_SLOTS - 1);
+	for (tcpacceptinfo = LIST_FIRST(&timer_wheel->slots[timer_wheel->current]);
+	     tcpacceptinfo != NULL;
+	     tcpacceptinfo = next) {
+		next = LIST_NEXT(tcpacceptinfo, timeout_entry);
+		if (tcpacceptinfo->timeout_rounds > 0) {
+			tcpacceptinfo->timeout_rounds--;
+			continue;
+		}
+		LIST_REMOVE(tcpacceptinfo, timeout_entry);
+		LIST_INSERT_HEAD(&expired, tcpacceptinfo, timeout_entry);
+	}
+	while ((tcpacceptinfo = LIST_FIRST(&expired)) != NULL) {
+		tcp_timer_wheel_remove(tcpacceptinfo);
+		if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+			tcp_uring_accept_dispatch(tcpacceptinfo, EV_TIMEOUT);
+			continue;
+		}
+		event_del(&tcpacceptinfo->accept_event);
+		tcpacceptinfo->tcpaccept->main_accept_cb(
+		    tcpacceptinfo->accept_sd, EV_TIMEOUT, tcpacceptinfo);
+	}
+	if (timer_wheel->count == 0 && timer_wheel->armed) {
+		evtimer_del(&timer_wheel->tick_event);
+		timer_wheel->armed = 0;
+	}
+}
+
+static void
+tcp_timer_wheel_tick(int fd, short event, void *args) {
+	watchdog_enter("tcp_timer_wheel_tick");
+	tcp_timer_wheel_tick_handle(fd, event, args);
+	watchdog_leave();
+}
+
+/* タイムアウトまでのスロット数 */
+static unsigned int
+tcp_timer_wheel_ticks(struct timeval *timeout) {
+	/* 早くタイムアウトしないように端数と今のスロットの残り分を切り上げる */
+	return (timeout->tv_sec + (timeout->tv_usec > 0)
+	    + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK + 1;
+}
+
+/* tickは最初の接続を載せた時に登録する */
+static int
+tcp_timer_wheel_start(struct tcp_timer_wheel *timer_wheel,
+    struct timeval *timeout, struct event_base *event_base) {
+	int i;
+
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		LIST_INIT(&timer_wheel->slots[i]);
+	}
+	timer_wheel->current = 0;
+	timer_wheel->count = 0;
+	timer_wheel->armed = 0;
+	timer_wheel->ticks = tcp_timer_wheel_ticks(timeout);
+	event_set(&timer_wheel->tick_event, -1, EV_PERSIST, tcp_timer_wheel_tick, timer_wheel);
+	if (event_base_set(event_base, &timer_wheel->tick_event)) {
+		fprintf(stderr, "failed in set event of timer wheel.\n");
+		return 1;
+	}
+	event_priority_set(&timer_wheel->tick_event, EVENT_PRIORITY_LOW);
+	timer_wheel->running = 1;
+
+	return 0;
+}
+
+static void
+tcp_timer_wheel_stop(struct tcp_timer_wheel *timer_wheel) {
+	if (!timer_wheel->running) {
+		return;
+	}
+	if (timer_wheel->armed) {
+		evtimer_del(&timer_wheel->tick_event);
+		timer_wheel->armed = 0;
+	}
+	timer_wheel->running = 0;
+}
+
+/*
+ * 接続元ごとのaccept数の制限
+ */
+/* 接続元のキーを作る */
+static void
+tcp_rate_limit_key(
+    tcp_server_t *tcpserver,
+    struct sockaddr_storage *sa_st,
+    struct ucred *cred,
+    int *family,
+    unsigned char *addr)
+{
+	memset(addr, 0, 16);
+	if (tcpserver->unix_domain) {
+		*family = AF_UNIX;
+		if (cred) {
+			memcpy(addr, &cred->uid, sizeof(cred->uid));
+		}
+	} else if (sa_st->ss_family == AF_INET6) {
+		*family = AF_INET6;
+		memcpy(addr, &((struct sockaddr_in6 *)sa_st)->sin6_addr, 16);
+	} else {
+		*family = AF_INET;
+		memcpy(addr, &((struct sockaddr_in *)sa_st)->sin_addr, 4);
+	}
+}
+
+/* 接続元のバケットからトークンを1つ使う、制限を超えていれば1を返す */
+static int
+tcp_rate_limit_take(
+    tcp_server_t *tcpserver,
+    struct sockaddr_storage *sa_st,
+    struct ucred *cred)
+{
+	struct tcp_rate_limit *rate_limit = &tcpserver->rate_limit;
+	struct tcp_rate_limit_entry *entry;
+	unsigned char addr[16];
+	unsigned int h = 2166136261u;
+	uint64_t now;
+	int family;
+	int i;
+
+	if (rate_limit->rate == 0) {
+		return 0;
+	}
+	tcp_rate_limit_key(tcpserver, sa_st, cred, &family, addr);
+	/* FNV-1a */
+	for (i = 0; i < 16; i++) {
+		h ^= addr[i];
+		h *= 16777619u;
+	}
+	entry = &rate_limit->entries[h & (RATE_LIMIT_SLOTS - 1)];
+	now = stats_now();
+	if (entry->family == 0) {
+		token_bucket_init(&entry->bucket, rate_limit->burst, now);
+	}
+	/*
+	 * 衝突した時はトークンをそのまま引き継ぐ
+	 * (満タンに戻すと、衝突する接続元を交互に使って制限をすり抜けられるため)
+	 */
+	if (entry->family != family || memcmp(entry->addr, addr, sizeof(addr)) != 0) {
+		entry->family = family;
+		memcpy(entry->addr, addr, sizeof(addr));
+	}
+
+	return token_bucket_take(&entry->bucket, rate_limit->rate, rate_limit->burst, 1, now);
+}
+
+/* 接続のイベントが来たらタイムアウトを延長してからコールバックを呼ぶ */
+void
+tcp_server_accept_event(int sd, short event, void *args) {
+	tcp_accept_info_t *tcpacceptinfo = args;
+
+	if (tcpacceptinfo->timeout_armed) {
+		tcp_timer_wheel_insert(
+		    &tcpacceptinfo->tcpaccept->tcpserver->timer_wheel, tcpacceptinfo);
+	}
+	tcpacceptinfo->tcpaccept->main_accept_cb(sd, event, tcpacceptinfo);
+}
+
+/* 受け付けなかったsdを閉じる */
+static void
+tcp_server_accept_reject(tcp_server_t *tcpserver, int sd) {
+	if (tcpserver->uring) {
+		tcp_uring_close(tcpserver, sd);
+	} else {
+		close(sd);
+	}
+}
+
+/*
+ * acceptしたsdを空いているスロットに入れてコールバックを登録する
+ * io_uringではsa_st_lenが0で渡ってくるので、必要な時だけgetpeernameする
+ */
+void
+tcp_server_accept_socket(
+    tcp_accept_t *tcpaccept,
+    int sd,
+    struct sockaddr_storage *sa_st,
+    socklen_t sa_st_len)
+{
 	tcp_server_t *tcpserver;
+	struct ucred cred;
+	socklen_t credlen;
+	int cred_valid = 0;
 	int i;
 
-	tcpaccept = args;
 	tcpserver = tcpaccept->tcpserver;
 
-	if (event != EV_READ) {
-		fprintf(stderr, "not event read (accept).\n");
+	/*
+	 * 断る場合も待たせるとlistenのイベントが出続けるので、acceptしてすぐ閉じる
+	 * 断るまではfdopenもコールバックも呼ばない
+	 */
+	if (tcpserver->unix_domain) {
+		/* 接続元プロセスの資格情報 */
+		credlen = sizeof(cred);
+		if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0) {
+			cred_valid = 1;
+		}
+	} else if (sa_st_len == 0 && tcpserver->rate_limit.rate > 0) {
+		sa_st_len = sizeof(*sa_st);
+		if (getpeername(sd, (struct sockaddr *)sa_st, &sa_st_len) < 0) {
+			sa_st_len = 0;
+		}
+	}
+	if (tcp_rate_limit_take(tcpserver, sa_st, cred_valid ? &cred : NULL)) {
+		stats_add(STATS_CONNECTION_DROPS, 1);
+		tcp_server_accept_reject(tcpserver, sd);
 		return;
 	}
-
 	for (i = 0; i < ACCEPT_LIMIT; i++) {
-		if (tcpaccept->tcpacceptinfo[i].accept_sd == -1)
+		if (tcpaccept->tcpacceptinfo[i].accept_sd == -1 &&
+		    !tcpaccept->tcpacceptinfo[i].closing)
 			break;
 	}
 	if (i == ACCEPT_LIMIT) {
-		fprintf(stderr, "server connection is full.\n");
+		logger_write(LOGGER_WARN, "accept", "error=\"server connection is full\"");
+		stats_add(STATS_CONNECTION_REJECTS, 1);
+		tcp_server_accept_reject(tcpserver, sd);
 		return;
 	}
-	tcpaccept->tcpacceptinfo[i].sa_st_len = sizeof(struct sockaddr_storage);
-	tcpaccept->tcpacceptinfo[i].accept_sd = accept(listen_sd,
-	    (struct sockaddr *)&(tcpaccept->tcpacceptinfo[i].sa_st), &(tcpaccept->tcpacceptinfo[i].sa_st_len));
-	if (tcpaccept->tcpacceptinfo[i].accept_sd < 0) {
-		fprintf(stderr, "failed in accept.\n");
-		return;
+	tcpaccept->tcpacceptinfo[i].accept_sd = sd;
+	tcpaccept->tcpacceptinfo[i].sa_st = *sa_st;
+	tcpaccept->tcpacceptinfo[i].sa_st_len = sa_st_len;
+	if (tcpserver->uring) {
+		tcpaccept->tcpacceptinfo[i].accept_sp = tcp_uring_accept_open(&tcpaccept->tcpacceptinfo[i]);
+	} else {
+		tcpaccept->tcpacceptinfo[i].accept_sp = fdopen(tcpaccept->tcpacceptinfo[i].accept_sd, "r+");
 	}
-	tcpaccept->tcpacceptinfo[i].accept_sp = fdopen(tcpaccept->tcpacceptinfo[i].accept_sd, "r+");
 	if (tcpaccept->tcpacceptinfo[i].accept_sp == NULL) {
-		close(tcpaccept->tcpacceptinfo[i].accept_sd);
+		tcp_server_accept_reject(tcpserver, tcpaccept->tcpacceptinfo[i].accept_sd);
 		tcpaccept->tcpacceptinfo[i].accept_sd = -1;
-		fprintf(stderr, "failed in fdopen.\n");
+		logger_write(LOGGER_ERROR, "accept", "error=\"failed in fdopen\"");
 		return;
 	}
+	stats_add(STATS_CONNECTIONS, 1);
+	tcpaccept->tcpacceptinfo[i].ctx = NULL;
+	tcpaccept->tcpacceptinfo[i].peer_cred_valid = cred_valid;
+	if (cred_valid) {
+		tcpaccept->tcpacceptinfo[i].peer_uid = cred.uid;
+		tcpaccept->tcpacceptinfo[i].peer_pid = cred.pid;
+	}
+	tcpaccept->tcpacceptinfo[i].timeout_armed = 0;
 	if (tcpaccept->init_accept_cb) {
 		if (tcpaccept->init_accept_cb(
 		    tcpaccept->tcpacceptinfo[i].accept_sd,
 		    &tcpaccept->tcpacceptinfo[i])) {
-			fprintf(stderr, "failed in initialize of accept.\n");
+			logger_write(LOGGER_ERROR, "accept", "error=\"failed in initialize of accept\"");
 			goto fail;
 		}
 	}
 	event_set(&tcpaccept->tcpacceptinfo[i].accept_event, tcpaccept->tcpacceptinfo[i].accept_sd,
-	    tcpserver->event, tcpaccept->main_accept_cb, &tcpaccept->tcpacceptinfo[i]);
+	    tcpserver->event, tcp_server_accept_event, &tcpaccept->tcpacceptinfo[i]);
 	if (event_base_set(tcpserver->event_base, &tcpaccept->tcpacceptinfo[i].accept_event)) {
-		fprintf(stderr, "failed in set event of accept.\n");
-		goto fail;
+		logger_write(LOGGER_ERROR, "accept", "error=\"failed in set event of accept\"");
+		goto fail_finish;
 	}
-	if (event_add(&tcpaccept->tcpacceptinfo[i].accept_event, tcpserver->timeout) < 0 ) {
-		fprintf(stderr, "failed in add evet of accept.\n");
-		goto fail;
+	event_priority_set(&tcpaccept->tcpacceptinfo[i].accept_event, EVENT_PRIORITY_LOW);
+	if (tcp_server_accept_wait(&tcpaccept->tcpacceptinfo[i]) < 0) {
+		logger_write(LOGGER_ERROR, "accept", "error=\"failed in add event of accept\"");
+		goto fail_finish;
+	}
+	if (tcpserver->timer_wheel.running) {
+		tcp_timer_wheel_insert(&tcpserver->timer_wheel, &tcpaccept->tcpacceptinfo[i]);
 	}
 
 	return;
 
+fail_finish:
+	if (tcpaccept->finish_accept_cb) {
+		tcpaccept->finish_accept_cb(
+		    tcpaccept->tcpacceptinfo[i].accept_sd,
+		    &tcpaccept->tcpacceptinfo[i]);
+	}
 fail:
 	fclose(tcpaccept->tcpacceptinfo[i].accept_sp);
+	if (tcpserver->uring) {
+		tcp_uring_close(tcpserver, tcpaccept->tcpacceptinfo[i].accept_sd);
+	}
+	tcpaccept->tcpacceptinfo[i].accept_sp = NULL;
 	tcpaccept->tcpacceptinfo[i].accept_sd = -1;
 	return;
 }
 
+static void
+tcp_server_accept_handle(int listen_sd, short event, void *args){
+	tcp_accept_t *tcpaccept;
+	struct sockaddr_storage sa_st;
+	socklen_t sa_st_len;
+	int sd;
+
+	tcpaccept = args;
+
+	if (event != EV_READ) {
+		logger_write(LOGGER_ERROR, "accept", "error=\"not event read\"");
+		return;
+	}
+	sa_st_len = sizeof(sa_st);
+	/* upgradeでexecするプロセスや警報スクリプトには渡さない */
+	sd = accept4(listen_sd, (struct sockaddr *)&sa_st, &sa_st_len, SOCK_CLOEXEC);
+	if (sd < 0) {
+		logger_write(LOGGER_WARN, "accept", "errno=%d error=\"failed in accept\"", errno);
+		return;
+	}
+	tcp_server_accept_socket(tcpaccept, sd, &sa_st, sa_st_len);
+}
+
+/* listenしたsdにacceptできる接続が来た */
+static void
+tcp_server_accept(int listen_sd, short event, void *args) {
+	watchdog_enter("tcp_server_accept");
+	tcp_server_accept_handle(listen_sd, event, args);
+	watchdog_leave();
+}
+
 static int
 tcp_server_accept_stop(tcp_accept_t *tcpaccept) {
 	int i;
@@ -121,9 +435,14 @@ tcp_server_accept_stop(tcp_accept_t *tcpaccept) {
 			continue;
 		}
 		if (event_del(&tcpaccept->tcpacceptinfo[i].accept_event)) {
-			fprintf(stderr, "failed in delete evet of accept.\n");
+			logger_write(LOGGER_ERROR, "accept", "error=\"failed in delete event of accept\"");
 		}
+		tcp_timer_wheel_remove(&tcpaccept->tcpacceptinfo[i]);
 		fclose(tcpaccept->tcpacceptinfo[i].accept_sp);
+		if (tcpaccept->tcpserver->uring) {
+			/* リングはこの後閉じるので直接閉じる */
+			close(tcpaccept->tcpacceptinfo[i].accept_sd);
+		}
 		tcpaccept->tcpacceptinfo[i].accept_sd = -1;
 	}
 
@@ -140,13 +459,222 @@ tcp_server_listen_clear(struct addrinfo *addr_info_res0)
 void
 tcp_server_accept_clear(tcp_accept_info_t *tcpacceptinfo) {
 
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		tcp_timer_wheel_remove(tcpacceptinfo);
+		tcp_uring_accept_clear(tcpacceptinfo);
+		tcpacceptinfo->accept_sp = NULL;
+		tcpacceptinfo->accept_sd = -1;
+		return;
+	}
 	if (event_del(&tcpacceptinfo->accept_event)) {
-		fprintf(stderr, "failed in delete of accept event.\n");
+		logger_write(LOGGER_ERROR, "accept", "error=\"failed in delete event of accept\"");
 	}
-	close(tcpacceptinfo->accept_sd);
+	tcp_timer_wheel_remove(tcpacceptinfo);
+	/* fdopenしたストリームごと閉じる */
+	fclose(tcpacceptinfo->accept_sp);
+	tcpacceptinfo->accept_sp = NULL;
 	tcpacceptinfo->accept_sd = -1;
 }
 
+void
+tcp_server_set_rate_limit(tcp_server_t *tcpserver, unsigned int rate, unsigned int burst) {
+	memset(&tcpserver->rate_limit, 0, sizeof(tcpserver->rate_limit));
+	tcpserver->rate_limit.rate = rate;
+	tcpserver->rate_limit.burst = burst;
+}
+
+void
+tcp_server_accept_timeout_stop(tcp_accept_info_t *tcpacceptinfo) {
+	tcp_timer_wheel_remove(tcpacceptinfo);
+}
+
+/* acceptしたsdのeventを待つ (待つものを変えるので毎回設定し直す) */
+static int
+tcp_server_accept_event_add(tcp_accept_info_t *tcpacceptinfo, short event) {
+	tcp_server_t *tcpserver = tcpacceptinfo->tcpaccept->tcpserver;
+
+	if (event_pending(&tcpacceptinfo->accept_event, EV_READ | EV_WRITE, NULL) &&
+	    event_del(&tcpacceptinfo->accept_event)) {
+		return -1;
+	}
+	event_set(&tcpacceptinfo->accept_event, tcpacceptinfo->accept_sd,
+	    event, tcp_server_accept_event, tcpacceptinfo);
+	if (event_base_set(tcpserver->event_base, &tcpacceptinfo->accept_event)) {
+		return -1;
+	}
+	event_priority_set(&tcpacceptinfo->accept_event, EVENT_PRIORITY_LOW);
+
+	return event_add(&tcpacceptinfo->accept_event, NULL);
+}
+
+int
+tcp_server_accept_loopback(tcp_accept_info_t *tcpacceptinfo) {
+	struct sockaddr_in6 *sin6;
+
+	if (tcpacceptinfo->tcpaccept->tcpserver->unix_domain) {
+		return 0;
+	}
+	/* io_uringで受けた接続はまだ接続元を取っていない */
+	if (tcpacceptinfo->sa_st_len == 0) {
+		tcpacceptinfo->sa_st_len = sizeof(tcpacceptinfo->sa_st);
+		if (getpeername(tcpacceptinfo->accept_sd,
+		    (struct sockaddr *)&tcpacceptinfo->sa_st, &tcpacceptinfo->sa_st_len) < 0) {
+			tcpacceptinfo->sa_st_len = 0;
+			return 0;
+		}
+	}
+	if (tcpacceptinfo->sa_st.ss_family == AF_INET) {
+		return (ntohl(((struct sockaddr_in *)&tcpacceptinfo->sa_st)->sin_addr.s_addr) >> 24) == 127;
+	}
+	if (tcpacceptinfo->sa_st.ss_family == AF_INET6) {
+		sin6 = (struct sockaddr_in6 *)&tcpacceptinfo->sa_st;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			return sin6->sin6_addr.s6_addr[12] == 127;
+		}
+		return IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr);
+	}
+
+	return 0;
+}
+
+int
+tcp_server_accept_wait(tcp_accept_info_t *tcpacceptinfo) {
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		return tcp_uring_accept_wait(tcpacceptinfo) ? -1 : 0;
+	}
+	return tcp_server_accept_event_add(tcpacceptinfo, tcpacceptinfo->tcpaccept->tcpserver->event);
+}
+
+int
+tcp_server_accept_wait_write(tcp_accept_info_t *tcpacceptinfo) {
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		return tcp_uring_accept_wait_write(tcpacceptinfo);
+	}
+	return tcp_server_accept_event_add(tcpacceptinfo, EV_WRITE);
+}
+
+ssize_t
+tcp_server_accept_read(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len) {
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		return tcp_uring_accept_read(tcpacceptinfo, buf, len, 0);
+	}
+	return recv(tcpacceptinfo->accept_sd, buf, len, MSG_DONTWAIT);
+}
+
+ssize_t
+tcp_server_accept_peek(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len) {
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		return tcp_uring_accept_read(tcpacceptinfo, buf, len, 1);
+	}
+	return recv(tcpacceptinfo->accept_sd, buf, len, MSG_PEEK);
+}
+
+ssize_t
+tcp_server_accept_write(tcp_accept_info_t *tcpacceptinfo, const void *buf, size_t len) {
+	if (tcpacceptinfo->tcpaccept->tcpserver->uring) {
+		return tcp_uring_accept_write(tcpacceptinfo, buf, len);
+	}
+	return send(tcpacceptinfo->accept_sd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void
+tcp_server_set_io_uring(tcp_server_t *tcpserver, int use_uring) {
+	tcpserver->use_uring = use_uring;
+}
+
+void
+tcp_server_set_accept_options(tcp_server_t *tcpserver, int defer_accept, int fast_open) {
+	tcpserver->defer_accept = defer_accept;
+	tcpserver->fast_open = fast_open;
+}
+
+void
+tcp_server_timeout_update(tcp_server_t *tcpserver) {
+	if (tcpserver->timeout == NULL || !tcpserver->timer_wheel.running) {
+		return;
+	}
+	tcpserver->timer_wheel.ticks = tcp_timer_wheel_ticks(tcpserver->timeout);
+}
+
+int
+tcp_server_set_listen_fds(tcp_server_t *tcpserver, const int *sd, int count) {
+	int i;
+
+	if (count > LISTEN_LIMIT) {
+		fprintf(stderr, "too many listen sockets (%d).\n", count);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		/* 渡し方によらず、execするプロセスには渡さない */
+		if (fcntl(sd[i], F_SETFD, FD_CLOEXEC) < 0) {
+			fprintf(stderr, "invalid listen socket %d (%s).\n", sd[i], strerror(errno));
+			return 1;
+		}
+		tcpserver->inherit_sd[i] = sd[i];
+	}
+	tcpserver->inherit_count = count;
+
+	return 0;
+}
+
+int
+tcp_server_listen_fds(tcp_server_t *tcpserver, int *sd, int sd_max) {
+	int i;
+
+	if (tcpserver->listen_sd_array_max > sd_max) {
+		return -1;
+	}
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		sd[i] = tcpserver->listen_sd[i];
+	}
+
+	return tcpserver->listen_sd_array_max;
+}
+
+void
+tcp_server_listen_detach(tcp_server_t *tcpserver) {
+	int i;
+
+	if (tcpserver->detached) {
+		return;
+	}
+	/* 止めた後に終わったacceptの完了でacceptを投げ直さないように先に落とす */
+	tcpserver->tcp_listen_run = 0;
+	if (tcpserver->uring) {
+		tcp_uring_accept_cancel(tcpserver);
+	} else {
+		for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+			if (event_del(&tcpserver->listen_events[i])) {
+				fprintf(stderr, "failed in delete event of listen.\n");
+			}
+		}
+	}
+	tcpserver->detached = 1;
+}
+
+/*
+ * 短い接続用のオプション
+ * 使えなくても普通にacceptできるので、失敗してもメッセージだけ出す
+ */
+static void
+tcp_server_listen_options(tcp_server_t *tcpserver, int sd)
+{
+#ifdef TCP_DEFER_ACCEPT
+	if (tcpserver->defer_accept > 0 &&
+	    setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+	    &tcpserver->defer_accept, sizeof(tcpserver->defer_accept)) < 0) {
+		fprintf(stderr, "failed in setsockopt (TCP_DEFER_ACCEPT).\n");
+	}
+#endif
+#ifdef TCP_FASTOPEN
+	if (tcpserver->fast_open > 0 &&
+	    setsockopt(sd, IPPROTO_TCP, TCP_FASTOPEN,
+	    &tcpserver->fast_open, sizeof(tcpserver->fast_open)) < 0) {
+		fprintf(stderr, "failed in setsockopt (TCP_FASTOPEN).\n");
+	}
+#endif
+}
+
 int
 tcp_server_create(
     tcp_server_t **tcpserver,
@@ -170,14 +698,16 @@ tcp_server_create(
 	int pfd[2] = { -1, -1 };
 
 	ASSERT(tcpserver != NULL);
-	ASSERT(port != NULL);
+	ASSERT(port != NULL || (address != NULL && address[0] == '/'));
 	ASSERT(main_accept_cb != NULL);
 
 	*tcpserver = NULL;
-	dup_port = strdup(port);
-	if (dup_port == NULL) {
-		fprintf(stderr, "failed in copy port.\n");
-		goto fail;
+	if (port) {
+		dup_port = strdup(port);
+		if (dup_port == NULL) {
+			fprintf(stderr, "failed in copy port.\n");
+			goto fail;
+		}
 	}
 	if (address && address[0] != '\0') {
 		dup_addr = strdup(address);
@@ -186,7 +716,7 @@ tcp_server_create(
 			goto fail;
 		}
 	}
-	if (pipe(pfd) == -1) {
+	if (pipe2(pfd, O_CLOEXEC) == -1) {
 		fprintf(stderr, "failed in make pipe.\n");
 		goto fail;
 	}
@@ -213,6 +743,7 @@ tcp_server_create(
 	inst->listen_sd_array_max = 0;
         inst->address = dup_addr;
         inst->port = dup_port;
+	inst->unix_domain = (port == NULL);
         inst->recvbuf = recvbuf;
         inst->args = args;
         inst->event = event;
@@ -244,6 +775,126 @@ tcp_server_destroy(tcp_server_t *tcpserver)
 	free(tcpserver);
 }
 
+static int
+tcp_server_listen_event_add(tcp_server_t *tcpserver, int idx)
+{
+	event_set(&tcpserver->listen_events[idx], tcpserver->listen_sd[idx],
+	    EV_READ | EV_PERSIST, tcp_server_accept, &tcpserver->tcpaccept[idx]);
+	if (event_base_set(tcpserver->event_base, &tcpserver->listen_events[idx])) {
+		fprintf(stderr, "failed in set event of listen.\n");
+		return 1;
+	}
+	event_priority_set(&tcpserver->listen_events[idx], EVENT_PRIORITY_LOW);
+	if (event_add(&tcpserver->listen_events[idx], NULL) < 0) {
+		fprintf(stderr, "failed in add event of listen.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* listenしたsdに来たコネクションをacceptするためのイベント登録 */
+static int
+tcp_server_listen_events(tcp_server_t *tcpserver, int *sd, int sarray_max)
+{
+	int i, j;
+
+	tcpserver->listen_sd_array_max = sarray_max;
+	if (tcpserver->timeout) {
+		if (tcp_timer_wheel_start(&tcpserver->timer_wheel,
+		    tcpserver->timeout, tcpserver->event_base)) {
+			i = 0;
+			goto fail;
+		}
+	}
+	for (i = 0; i < sarray_max; i++) {
+		tcpserver->listen_sd[i] = sd[i];
+		if (tcpserver->init_listen_cb) {
+			if (tcpserver->init_listen_cb(sd[i], &tcpserver->args)) {
+				fprintf(stderr, "failed in initialized of listen.\n");
+				goto fail;
+			}
+		}
+		/* io_uringではacceptはリングで受ける */
+		if (!tcpserver->use_uring && tcp_server_listen_event_add(tcpserver, i)) {
+			goto fail;
+		}
+	}
+	tcpserver->tcp_listen_run = 1;
+	if (tcpserver->use_uring && tcp_uring_start(tcpserver)) {
+		/* io_uringが使えないカーネルではlibeventで受ける */
+		fprintf(stderr, "io_uring is not available, fall back to libevent.\n");
+		tcpserver->use_uring = 0;
+		for (i = 0; i < sarray_max; i++) {
+			if (tcp_server_listen_event_add(tcpserver, i)) {
+				goto fail;
+			}
+		}
+	}
+
+	return 0;
+
+fail:
+	tcpserver->tcp_listen_run = 0;
+	tcp_timer_wheel_stop(&tcpserver->timer_wheel);
+	for (j = 0; j < i && !tcpserver->use_uring; j++) {
+		if (event_del(&tcpserver->listen_events[j])) {
+			fprintf(stderr, "failed in delete event of listen.\n");
+		}
+	}
+	for (j = 0; j < sarray_max; j++) {
+		close(sd[j]);
+		tcpserver->listen_sd[j] = -1;
+	}
+	tcpserver->listen_sd_array_max = 0;
+
+	return 1;
+}
+
+/*
+ * unix domain socketでlistenする
+ * 接続元の確認はaccept時のSO_PEERCREDで行うので、パーミッションは誰でも繋げるようにしておく
+ */
+static int
+tcp_server_start_unix(tcp_server_t *tcpserver)
+{
+	struct sockaddr_un sun;
+	int sd;
+
+	if (strlen(tcpserver->address) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "too long unix domain socket path (%s).\n", tcpserver->address);
+		return 1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, tcpserver->address);
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		fprintf(stderr, "failed in create socket.\n");
+		return 1;
+	}
+	/* 前回の残骸を消す */
+	unlink(tcpserver->address);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "failed in bind unix domain socket (%s).\n", tcpserver->address);
+		close(sd);
+		return 1;
+	}
+	if (chmod(tcpserver->address, 0666) < 0) {
+		fprintf(stderr, "failed in chmod unix domain socket (%s).\n", tcpserver->address);
+	}
+	/* backlogはACCEPT_LIMITと同じ値 */
+	if (listen(sd, ACCEPT_LIMIT) < 0) {
+		fprintf(stderr, "failed in listen.\n");
+		close(sd);
+		unlink(tcpserver->address);
+		return 1;
+	}
+	printf("unix listen: path = %s.\n", tcpserver->address);
+
+	return tcp_server_listen_events(tcpserver, &sd, 1);
+}
+
 int
 tcp_server_start(tcp_server_t *tcpserver)
 {
@@ -251,7 +902,6 @@ tcp_server_start(tcp_server_t *tcpserver)
 	int sd[LISTEN_LIMIT];
         int sock_max;
         int sarray_max;
-	int i = 0, j;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
 	int error;
 
@@ -267,6 +917,15 @@ tcp_server_start(tcp_server_t *tcpserver)
 #endif
 	ASSERT(tcpserver != NULL);
 
+	if (tcpserver->inherit_count > 0) {
+		printf("%s listen: inherited %d socket(s).\n",
+		    tcpserver->unix_domain ? "unix" : "tcp", tcpserver->inherit_count);
+		return tcp_server_listen_events(tcpserver,
+		    tcpserver->inherit_sd, tcpserver->inherit_count);
+	}
+	if (tcpserver->unix_domain) {
+		return tcp_server_start_unix(tcpserver);
+	}
 	if (tcpserver->port == NULL ||  *(tcpserver->port) == '\0') {
 		fprintf(stderr, "invalid port.\n");
 		return 1;
@@ -287,7 +946,7 @@ tcp_server_start(tcp_server_t *tcpserver)
 	     addr_info_res && sarray_max < LISTEN_LIMIT;
 	     addr_info_res = addr_info_res->ai_next) {
 		sd[sarray_max] = socket(addr_info_res->ai_family,
-		    addr_info_res->ai_socktype, addr_info_res->ai_protocol);
+		    addr_info_res->ai_socktype | SOCK_CLOEXEC, addr_info_res->ai_protocol);
 
 		if (sd[sarray_max] < 0) {
 			fprintf(stderr, "failed in create socket.\n");
@@ -325,6 +984,8 @@ tcp_server_start(tcp_server_t *tcpserver)
 			sd[sarray_max] = -1;
 			continue;
 		}
+		/* TCP_FASTOPENはlistenの前に設定する */
+		tcp_server_listen_options(tcpserver, sd[sarray_max]);
 
 		/* backlogはACCEPT_LIMITと同じ値 */
 		if (listen(sd[sarray_max], ACCEPT_LIMIT) < 0) {
@@ -350,52 +1011,14 @@ tcp_server_start(tcp_server_t *tcpserver)
 		sarray_max++;
 	}
 
-	tcpserver->listen_sd_array_max = sarray_max;
-
 	if (sock_max == -1) {
 		fprintf(stderr, "not there avilable socket of listen.\n");
 		freeaddrinfo(addr_info_res0);
 		return 1;
 	}
-
-	/* 来たコネクションをacceptするためのイベント登録 */
-	for (i = 0; i < sarray_max; i++) {
-		tcpserver->listen_sd[i] = sd[i];
-		if (tcpserver->init_listen_cb) {
-			if (tcpserver->init_listen_cb(sd[i], &tcpserver->args)) {
-				fprintf(stderr, "failed in initialized of listen.\n");
-				goto fail;
-			}
-		}
-		event_set(&tcpserver->listen_events[i], sd[i],
-		    EV_READ | EV_PERSIST, tcp_server_accept, &tcpserver->tcpaccept[i]);
-		if (event_base_set(tcpserver->event_base, &tcpserver->listen_events[i])) {
-			fprintf(stderr, "failed in set event of listen.\n");
-			goto fail;
-		}
-		if (event_add(&tcpserver->listen_events[i], NULL) < 0) {
-			fprintf(stderr, "failed in add event of listen.\n");
-			goto fail;
-		}
-	}
-	tcpserver->tcp_listen_run = 1;
-	/* dispatch */
-	if (event_base_dispatch(tcpserver->event_base) < 0) {
-		fprintf(stderr, "failed in dispatch event.\n");
-		goto fail;
-	}
         tcp_server_listen_clear(addr_info_res0);
-	return 0;
 
-fail:
-	for (j = 0; j < i; j++) {
-		if (event_del(&tcpserver->listen_events[j])) {
-			fprintf(stderr, "failed in delete event of listen.\n");
-		}
-		close(tcpserver->listen_sd[j]);
-	}
-        tcp_server_listen_clear(addr_info_res0);
-	return 1;
+	return tcp_server_listen_events(tcpserver, sd, sarray_max);
 }
 
 int
@@ -410,13 +1033,24 @@ tcp_server_stop(tcp_server_t *tcpserver) {
 		tcpserver->finish_listen_cb(tcpserver->listen_sd[i], tcpserver->args);
 	}
 	tcpserver->tcp_listen_run = 0;
+	tcp_timer_wheel_stop(&tcpserver->timer_wheel);
+	tcp_uring_stop(tcpserver);
 	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
-		if (event_del(&tcpserver->listen_events[i])) {
+		if (!tcpserver->use_uring && event_del(&tcpserver->listen_events[i])) {
 			fprintf(stderr, "failed in delete event of listen.\n");
 		}
 		close(tcpserver->listen_sd[i]);
 		tcpserver->listen_sd[i] = -1;
 	}
+	/*
+	 * 自分でbindしたパスだけ消す
+	 * (渡した先のプロセスやサービスマネージャーがまだ使っている)
+	 */
+	if (tcpserver->unix_domain && tcpserver->listen_sd_array_max > 0 &&
+	    !tcpserver->detached && tcpserver->inherit_count == 0) {
+		unlink(tcpserver->address);
+	}
+	tcpserver->listen_sd_array_max = 0;
 
 	return 0;
 }
@@ -27,6 +27,9 @@
 #define ACCEPT_LIMIT	10	/* liten,bind毎のacceptするセッション数 */
 #define TCP_LIMIT	LISTEN_LIMIT
 #define RECV_BUFF       (256 * 4)
+#define TIMER_WHEEL_SLOTS	64	/* タイマーホイールのスロット数 (2のべき乗) */
+#define TIMER_WHEEL_TICK	1	/* タイマーホイールの1スロットの秒数 */
+#define RATE_LIMIT_SLOTS	256	/* 接続元ごとのトークンバケットの数 (2のべき乗) */
 
 typedef struct tcp_accept_info tcp_accept_info_t;
 typedef struct tcp_accept tcp_accept_t;
@@ -40,6 +43,31 @@ struct tcp_accept_info {
 	socklen_t sa_st_len;					/* sockaddrの長さ */
 	struct sockaddr_storage sa_st;				/* 接続を受け付けた相手のアドレス情報 */
 	tcp_accept_t *tcpaccept;				/* tcpaccept へのポインタ */
+	void *ctx;						/* コールバック側が接続ごとに使うコンテキスト */
+	int peer_cred_valid;					/* peer_uid, peer_pidが有効かどうか (unix domainのみ) */
+	uid_t peer_uid;						/* 接続元プロセスのuid */
+	pid_t peer_pid;						/* 接続元プロセスのpid */
+	LIST_ENTRY(tcp_accept_info) timeout_entry;		/* タイマーホイールのスロットのリスト */
+	int timeout_armed;					/* タイマーホイールに載っているかどうか */
+	unsigned int timeout_rounds;				/* タイムアウトまでにスロットが何周するか */
+	int closing;						/* io_uringでcloseの完了を待っている */
+	struct tcp_uring_connection *uring_conn;		/* io_uringで使う接続ごとのバッファ */
+};
+
+/*
+ * 接続のタイムアウト用のタイマーホイール
+ * 接続ごとにlibeventのタイムアウトを使うとヒープへの追加と削除がO(log n)になるので、
+ * TIMER_WHEEL_TICK秒毎のタイマー1つでまとめて管理する。
+ * 登録、解除、延長はO(1)。タイムアウトは最大1tick遅れる。
+ */
+struct tcp_timer_wheel {
+	LIST_HEAD(, tcp_accept_info) slots[TIMER_WHEEL_SLOTS];	/* スロット毎の接続のリスト */
+	unsigned int current;					/* 今のスロット */
+	unsigned int ticks;					/* タイムアウトのtick数 */
+	unsigned int count;					/* 載っている接続の数 */
+	int running;						/* タイムアウトを管理しているかどうか */
+	int armed;						/* tickのイベントを登録しているかどうか (空なら止める) */
+	struct event tick_event;				/* tick毎のイベント */
 };
 
 struct tcp_accept{
@@ -54,10 +82,29 @@ struct tcp_accept{
         int (*finish_accept_cb)(int sd, void *);        	/* accept処理の停止を行いたい場合に呼ぶ関数 */
 };
 
+/*
+ * 接続元ごとのaccept数の制限
+ * 接続元のアドレス (unix domainはuid) のハッシュで直接引くだけの表で、
+ * 衝突したら新しい接続元がスロットを使うが、トークンは古い方の残りを引き継ぐ
+ * (しばらく使われていないスロットなら時間が経った分だけ貯まっている)
+ */
+struct tcp_rate_limit_entry {
+	int family;						/* 0なら空き */
+	unsigned char addr[16];					/* IPv4, IPv6のアドレスまたはuid */
+	struct token_bucket bucket;
+};
+
+struct tcp_rate_limit {
+	unsigned int rate;					/* 1秒あたりのaccept数、0なら制限しない */
+	unsigned int burst;					/* まとめてacceptできる数 */
+	struct tcp_rate_limit_entry entries[RATE_LIMIT_SLOTS];
+};
+
 struct tcp_server{
 	int tcp_listen_run;				/* tcpのlistenがうごいているかどうか */
 	char *address;					/* bindするアドレス */
 	char *port;					/* bindするポート番号 */
+	int unix_domain;				/* addressをunix domain socketのパスとして扱う */
 	int recvbuf;					/* 受信バッファ */
 	int listen_sd[LISTEN_LIMIT];			/* listen sd の配列 */
 	int listen_sd_array_max;			/* listen sd 配列の最大個数 */
@@ -66,7 +113,16 @@ struct tcp_server{
         tcp_accept_t tcpaccept[LISTEN_LIMIT];	/* tcp accept の構造体 */
 	void *args;					/* コールバックに渡す引数 */
         short event; 			                /* 監視するイベントのフラグ (libevent由来) */
-        struct timeval *timeout;			/* タイムアウト */
+        struct timeval *timeout;			/* タイムアウト (接続のタイムアウトはtimer_wheelで管理する) */
+	struct tcp_timer_wheel timer_wheel;		/* 接続のタイムアウト用のタイマーホイール */
+	struct tcp_rate_limit rate_limit;		/* 接続元ごとのaccept数の制限 */
+	int use_uring;					/* io_uringを使うかどうか */
+	int defer_accept;				/* TCP_DEFER_ACCEPTの秒数、0なら使わない */
+	int fast_open;					/* TCP_FASTOPENのキューの長さ、0なら使わない */
+	struct tcp_uring *uring;			/* 使っているio_uring (使えなければNULL) */
+	int inherit_sd[LISTEN_LIMIT];			/* 引き継いだlisten sd (startでlistenせずにこれを使う) */
+	int inherit_count;				/* 引き継いだlisten sdの数 */
+	int detached;					/* listen sdを他のプロセスに渡してacceptを止めた */
         int (*init_listen_cb)(int sd, void *);          /* accept直後の初期化用のコールバック */
         int (*finish_listen_cb)(int sd, void *);        /* listen処理の停止を行いたい場合に呼ぶ関数 */
         struct event stop_event;			/* 終了するときにeventを抜けさせる */
@@ -87,8 +143,18 @@ struct tcp_server{
  */
 void tcp_server_accept_clear(tcp_accept_info_t *tcpacceptinfo);
 
+/*
+ * 接続のタイムアウトを止める
+ * SUBSCRIBEのように接続を開いたまま待ち続ける場合に呼ぶ
+ * 止めたタイムアウトは接続を閉じるまで再び登録されない
+ * (タイムアウトはaccept時に登録され、イベントが来るたびに延長される。
+ *  タイムアウトした場合はmain_accept_cbがEV_TIMEOUTで呼ばれる)
+ */
+void tcp_server_accept_timeout_stop(tcp_accept_info_t *tcpacceptinfo);
+
 /*
  * tcp serverのコンテキストを作成する
+ * portがNULLの場合はaddressを(/から始まる)unix domain socketのパスとしてlistenする
  */
 int tcp_server_create(
     tcp_server_t **tcpserver,
@@ -105,6 +171,104 @@ int tcp_server_create(
     void *args,
     struct event_base *event_base);
 
+/*
+ * 接続元ごとにaccept数を制限する
+ * tcp_server_startの前に呼ぶ。rateが0なら制限しない
+ * 超えた接続はacceptしてすぐ閉じる
+ */
+void tcp_server_set_rate_limit(
+    tcp_server_t *tcpserver,
+    unsigned int rate,
+    unsigned int burst);
+
+/*
+ * acceptしたsdの読み込みを待つ
+ * main_accept_cbを呼ぶたびに1回だけ待つので、続けて読む場合はまた呼ぶ
+ * (init_accept_cbで呼ぶこと)
+ */
+int tcp_server_accept_wait(tcp_accept_info_t *tcpacceptinfo);
+/*
+ * 接続元がループバックアドレス (127.0.0.0/8, ::1) なら1を返す
+ * unix domain socketや接続元が分からない場合は0
+ */
+int tcp_server_accept_loopback(tcp_accept_info_t *tcpacceptinfo);
+
+/*
+ * acceptしたsdから読む
+ * read(2), recv(2)のMSG_PEEKと同じように使うが、ブロックしない
+ * (読めるものが無ければ-1でerrnoはEAGAIN、io_uringでは受信済みのデータしか返さない)
+ */
+ssize_t tcp_server_accept_read(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len);
+ssize_t tcp_server_accept_peek(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len);
+
+/*
+ * acceptしたsdに書く
+ * accept_spを使わずにブロックせずに送り、送れた長さを返す
+ * (1バイトも送れなければ-1でerrnoはEAGAIN、残りはtcp_server_accept_wait_writeで待つ)
+ * io_uringでは接続ごとのバッファに入れ、main_accept_cbの中ならtcp_server_accept_clearか
+ * main_accept_cbから戻った時に送る
+ * accept_spに書いたものがあれば先にfflushしておくこと
+ */
+ssize_t tcp_server_accept_write(tcp_accept_info_t *tcpacceptinfo, const void *buf, size_t len);
+/*
+ * acceptしたsdに書けるようになるのを待つ
+ * 書けるようになったらEV_WRITEでmain_accept_cbを呼ぶ (io_uringでは溜まっている分を送り切った時)
+ * 読み込みの待ちと同時には使えない
+ */
+int tcp_server_accept_wait_write(tcp_accept_info_t *tcpacceptinfo);
+
+/*
+ * io_uringで接続を扱う
+ * tcp_server_startの前に呼ぶ。使えなければlibeventで扱う
+ * acceptと読み込みをリングで受け、応答の送信とcloseはまとめて投げる
+ */
+void tcp_server_set_io_uring(tcp_server_t *tcpserver, int use_uring);
+
+/*
+ * 1回で終わる短い接続を速くするlistenのオプション
+ * tcp_server_startの前に呼ぶ。unix domain socketでは使わない
+ * defer_acceptはTCP_DEFER_ACCEPTの秒数で、データが届くまでacceptで起こされない
+ * fast_openはTCP_FASTOPENのキューの長さで、SYNに載ったデータを受け付ける
+ * 0ならそれぞれ使わない
+ */
+void tcp_server_set_accept_options(
+    tcp_server_t *tcpserver,
+    int defer_accept,
+    int fast_open);
+
+/*
+ * 他のプロセスから引き継いだlisten済みのsdを使う
+ * tcp_server_startの前に呼ぶ。startではlisten, bindせずにこのsdでacceptする
+ * unix domain socketのパスはtcp_server_stopで消さない
+ * countがLISTEN_LIMITを超えた場合は1を返す
+ */
+int tcp_server_set_listen_fds(
+    tcp_server_t *tcpserver,
+    const int *sd,
+    int count);
+
+/*
+ * listenしているsdをsdに書いてその数を返す
+ * sd_maxより多い場合は-1を返す
+ */
+int tcp_server_listen_fds(
+    tcp_server_t *tcpserver,
+    int *sd,
+    int sd_max);
+
+/*
+ * acceptを止める
+ * listen sdを他のプロセスに渡した後に呼ぶ。acceptしている接続はそのまま扱う
+ * tcp_server_stopではunix domain socketのパスを消さない
+ */
+void tcp_server_listen_detach(tcp_server_t *tcpserver);
+
+/*
+ * tcp_server_createで渡したタイムアウトの値を変えた後に呼ぶ
+ * 次にタイムアウトを登録するところから新しい値を使う
+ */
+void tcp_server_timeout_update(tcp_server_t *tcpserver);
+
 /*
  * tcp serverのコンテキストを作成する
  * tcp serverを終了しておく必要がある
@@ -113,6 +277,8 @@ void tcp_server_destroy(tcp_server_t *tcpserver);
 
 /*
  * tcp serverを開始する
+ * listenしてacceptのイベントを登録するだけで、
+ * イベントループは呼び出し側で回す
  */
 int tcp_server_start(tcp_server_t *tcpserver);
 
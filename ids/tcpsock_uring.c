@@ -0,0 +1,999 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE     /* fopencookie */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <event.h>
+#include <stdint.h>
+
+#include "macro.h"
+#include "token_bucket.h"
+#include "tcpsock.h"
+#include "tcpsock_uring.h"
+#include "logger.h"
+#include "priority.h"
+#include "stats.h"
+
+/* user_dataの下位ビットに入れる処理の種類 (ポインタは8バイト境界) */
+#define URING_OP_ACCEPT		1	/* ポインタはtcp_accept_t */
+#define URING_OP_RECV		2	/* ポインタはtcp_accept_info_t */
+#define URING_OP_CLOSE		3	/* ポインタはtcp_accept_info_t */
+#define URING_OP_IGNORE		4	/* 結果を見ないもの */
+#define URING_OP_CLOSE_SD	5	/* ポインタの位置にsdを入れる */
+#define URING_OP_SEND		6	/* ポインタはtcp_accept_info_t */
+#define URING_OP_MASK		7
+#define URING_OP_SHIFT		3
+
+#define URING_STOP_TIMEOUT	1000	/* 止める時に取り消した処理の完了を待つ時間 (msec) */
+
+/* 接続の状態 */
+#define URING_CONN_FREE		0
+#define URING_CONN_ACTIVE	1
+#define URING_CONN_CLOSING	2	/* sendとcloseの完了待ち (sendを投げたままならその完了後にcloseを投げる) */
+
+struct tcp_uring_connection {
+	int state;				/* URING_CONN_* */
+	int recv_pending;			/* recvを投げて完了を待っている */
+	int eof;				/* 0: 読める, 1: EOF, -1: エラー (errorにerrno) */
+	int error;
+	int dispatching;			/* main_accept_cbの実行中 */
+	int send_pending;			/* outのsendを投げて完了を待っている */
+	int want_write;				/* outが空いたらEV_WRITEでmain_accept_cbを呼ぶ */
+	int write_error;			/* 送信に失敗したerrno、0なら失敗していない */
+	int sd;					/* 閉じている途中のsd (closeが取り消されたら直接閉じる) */
+	size_t in_pos;				/* inの読んだ位置 */
+	size_t in_len;				/* inに溜まっている長さ */
+	unsigned char in[URING_INPUT_SIZE];
+	size_t out_len;				/* outに溜まっている長さ */
+	unsigned char out[URING_OUTPUT_SIZE];
+};
+
+struct tcp_uring {
+	int fd;					/* io_uringのfd */
+	tcp_server_t *tcpserver;
+	struct event ring_event;		/* 完了が来たらfdが読めるようになる */
+	int reaping;				/* 完了を処理中なら最後にまとめてsubmitする */
+	int stopping;				/* tcp_uring_stopで残った完了を捨てている */
+	unsigned int to_submit;			/* まだsubmitしていないSQEの数 */
+	unsigned int inflight;			/* 完了を待っている処理の数 */
+	/* SQ */
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* CQ */
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* provided buffer ring */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned char *buffers;
+	unsigned short buf_tail;
+	/* 接続ごとのバッファ */
+	struct tcp_uring_connection *conns;
+};
+
+static int
+tcp_uring_setup(unsigned int entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+tcp_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* 完了を1つ以上、timeout_msだけ待つ */
+static int
+tcp_uring_wait(int fd, unsigned int to_submit, int timeout_ms) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, 1,
+	    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static int
+tcp_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* 溜まっているSQEをカーネルに渡す */
+static int
+tcp_uring_submit(struct tcp_uring *uring) {
+	int n;
+
+	while (uring->to_submit > 0) {
+		n = tcp_uring_enter(uring->fd, uring->to_submit, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			logger_write(LOGGER_ERROR, "io_uring", "error=\"failed in submit\" errno=%d", errno);
+			return 1;
+		}
+		uring->to_submit -= n;
+	}
+
+	return 0;
+}
+
+/* 完了を処理していなければすぐにsubmitする */
+static void
+tcp_uring_flush(struct tcp_uring *uring) {
+	if (!uring->reaping) {
+		tcp_uring_submit(uring);
+	}
+}
+
+/*
+ * 空きSQEをcount個確保する
+ * リンクしたSQEが別々にsubmitされないように、足りなければ先にsubmitする
+ */
+static int
+tcp_uring_reserve(struct tcp_uring *uring, unsigned int count) {
+	unsigned int head;
+
+	head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (*uring->sq_tail - head + count <= uring->sq_entries) {
+		return 0;
+	}
+	if (tcp_uring_submit(uring)) {
+		return 1;
+	}
+	head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (*uring->sq_tail - head + count > uring->sq_entries) {
+		logger_write(LOGGER_WARN, "io_uring", "error=\"submission queue is full\"");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* SQEを1つ取る (tcp_uring_reserveで確保しておくこと) */
+static struct io_uring_sqe *
+tcp_uring_sqe(struct tcp_uring *uring, int op, void *ptr) {
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	tail = *uring->sq_tail;
+	index = tail & *uring->sq_mask;
+	sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->to_submit++;
+	uring->inflight++;
+
+	return sqe;
+}
+
+/* 受信バッファをリングに戻す */
+static void
+tcp_uring_buffer_put(struct tcp_uring *uring, unsigned short bid) {
+	struct io_uring_buf *buf;
+
+	buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUFFER_COUNT - 1)];
+	buf->addr = (uint64_t)(uintptr_t)&uring->buffers[(size_t)bid * URING_BUFFER_SIZE];
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	uring->buf_tail++;
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static struct tcp_uring_connection *
+tcp_uring_conn(tcp_accept_info_t *tcpacceptinfo) {
+	return tcpacceptinfo->uring_conn;
+}
+
+/* listenしたsdのmultishot acceptを投げる */
+static int
+tcp_uring_accept_submit(struct tcp_uring *uring, tcp_accept_t *tcpaccept) {
+	struct io_uring_sqe *sqe;
+
+	if (tcp_uring_reserve(uring, 1)) {
+		return 1;
+	}
+	sqe = tcp_uring_sqe(uring, URING_OP_ACCEPT, tcpaccept);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = uring->tcpserver->listen_sd[tcpaccept->accept_idx];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	tcp_uring_flush(uring);
+
+	return 0;
+}
+
+/* 接続からのrecvを投げる */
+static int
+tcp_uring_recv_submit(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	struct io_uring_sqe *sqe;
+
+	if (conn->recv_pending || conn->eof) {
+		return 0;
+	}
+	if (tcp_uring_reserve(uring, 1)) {
+		return 1;
+	}
+	sqe = tcp_uring_sqe(uring, URING_OP_RECV, tcpacceptinfo);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = tcpacceptinfo->accept_sd;
+	sqe->len = URING_BUFFER_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	conn->recv_pending = 1;
+	tcp_uring_flush(uring);
+
+	return 0;
+}
+
+/* outの先頭からsendを投げる */
+static int
+tcp_uring_send_submit(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	struct io_uring_sqe *sqe;
+
+	if (tcp_uring_reserve(uring, 1)) {
+		return 1;
+	}
+	sqe = tcp_uring_sqe(uring, URING_OP_SEND, tcpacceptinfo);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = tcpacceptinfo->accept_sd;
+	sqe->addr = (uint64_t)(uintptr_t)conn->out;
+	sqe->len = conn->out_len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	conn->send_pending = 1;
+	tcp_uring_flush(uring);
+
+	return 0;
+}
+
+/* ブロックしないsendで送れるだけ送り、送った長さを返す */
+static size_t
+tcp_uring_send_now(tcp_accept_info_t *tcpacceptinfo, const unsigned char *data, size_t len) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	ssize_t n;
+
+	do {
+		n = send(tcpacceptinfo->accept_sd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			conn->write_error = errno;
+		}
+		return 0;
+	}
+
+	return (size_t)n;
+}
+
+/*
+ * outに溜まっている分を送る
+ * すぐに送り切れなければ残りのsendを投げる (sendを投げたままなら完了後に投げる)
+ * 書けるようになるのを待っている場合は、sendの完了で知らせるために全部リングで送る
+ */
+static void
+tcp_uring_output(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	size_t n = 0;
+
+	if (conn->send_pending || conn->out_len == 0) {
+		return;
+	}
+	if (!conn->want_write) {
+		n = tcp_uring_send_now(tcpacceptinfo, conn->out, conn->out_len);
+	}
+	if (conn->write_error) {
+		conn->out_len = 0;
+		return;
+	}
+	memmove(conn->out, &conn->out[n], conn->out_len - n);
+	conn->out_len -= n;
+	if (conn->out_len > 0 && tcp_uring_send_submit(uring, tcpacceptinfo)) {
+		logger_write(LOGGER_WARN, "io_uring", "error=\"failed in submit send\"");
+	}
+}
+
+/*
+ * fopencookieのストリーム
+ * 読み込みは受信済みのデータだけを返し、無ければEAGAINにする
+ * 書き込みはoutに溜め、main_accept_cbの実行中でなければすぐに送る
+ * outに入らない分は送り切れなければ書き込みに失敗する (受け取らない相手は切る)
+ */
+static ssize_t
+tcp_uring_cookie_read(void *cookie, char *buf, size_t size) {
+	tcp_accept_info_t *tcpacceptinfo = cookie;
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	if (conn->in_pos < conn->in_len) {
+		return tcp_uring_accept_read(tcpacceptinfo, buf, size, 0);
+	}
+	if (conn->eof > 0) {
+		return 0;
+	}
+	if (conn->eof < 0) {
+		errno = conn->error;
+		return -1;
+	}
+	errno = EAGAIN;
+
+	return -1;
+}
+
+static ssize_t
+tcp_uring_cookie_write(void *cookie, const char *buf, size_t size) {
+	return tcp_uring_accept_write(cookie, buf, size);
+}
+
+/* sdはtcp_uring_accept_clearで閉じるのでここでは閉じない */
+static int
+tcp_uring_cookie_close(void *cookie) {
+	return 0;
+}
+
+FILE *
+tcp_uring_accept_open(tcp_accept_info_t *tcpacceptinfo) {
+	static const cookie_io_functions_t functions = {
+		.read = tcp_uring_cookie_read,
+		.write = tcp_uring_cookie_write,
+		.seek = NULL,
+		.close = tcp_uring_cookie_close,
+	};
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	conn->state = URING_CONN_ACTIVE;
+	conn->recv_pending = 0;
+	conn->eof = 0;
+	conn->error = 0;
+	conn->dispatching = 0;
+	conn->send_pending = 0;
+	conn->want_write = 0;
+	conn->write_error = 0;
+	conn->sd = -1;
+	conn->in_pos = 0;
+	conn->in_len = 0;
+	conn->out_len = 0;
+
+	return fopencookie(tcpacceptinfo, "r+", functions);
+}
+
+int
+tcp_uring_accept_wait(tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	if (conn->in_pos < conn->in_len || conn->eof) {
+		/* 読み残しがあるのでリングを通さずにすぐ呼ぶ */
+		tcp_uring_accept_dispatch(tcpacceptinfo, EV_READ);
+		return 0;
+	}
+	return tcp_uring_recv_submit(tcpacceptinfo->tcpaccept->tcpserver->uring, tcpacceptinfo);
+}
+
+ssize_t
+tcp_uring_accept_write(tcp_accept_info_t *tcpacceptinfo, const void *buf, size_t len) {
+	struct tcp_uring *uring = tcpacceptinfo->tcpaccept->tcpserver->uring;
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	const unsigned char *data = buf;
+	size_t n = 0, space;
+
+	if (conn->write_error) {
+		errno = conn->write_error;
+		return -1;
+	}
+	if (conn->out_len + len > sizeof(conn->out)) {
+		/* 溜まっている分を先に送って空け、それでも入らなければ直接送る */
+		tcp_uring_output(uring, tcpacceptinfo);
+		if (conn->out_len == 0 && !conn->send_pending && !conn->write_error) {
+			n = tcp_uring_send_now(tcpacceptinfo, data, len);
+		}
+		if (conn->write_error) {
+			errno = conn->write_error;
+			return -1;
+		}
+	}
+	space = sizeof(conn->out) - conn->out_len;
+	if (len - n > space) {
+		len = n + space;
+	}
+	memcpy(&conn->out[conn->out_len], &data[n], len - n);
+	conn->out_len += len - n;
+	if (len == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (!conn->dispatching) {
+		tcp_uring_output(uring, tcpacceptinfo);
+	}
+
+	return (ssize_t)len;
+}
+
+int
+tcp_uring_accept_wait_write(tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	conn->want_write = 1;
+	if (!conn->dispatching) {
+		tcp_uring_output(tcpacceptinfo->tcpaccept->tcpserver->uring, tcpacceptinfo);
+	}
+
+	return 0;
+}
+
+ssize_t
+tcp_uring_accept_read(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len, int peek) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	size_t n;
+
+	n = conn->in_len - conn->in_pos;
+	if (n == 0) {
+		if (conn->eof < 0) {
+			errno = conn->error;
+			return -1;
+		}
+		if (conn->eof > 0) {
+			return 0;
+		}
+		errno = EAGAIN;
+		return -1;
+	}
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, &conn->in[conn->in_pos], n);
+	if (!peek) {
+		conn->in_pos += n;
+		if (conn->in_pos == conn->in_len) {
+			conn->in_pos = 0;
+			conn->in_len = 0;
+		}
+	}
+
+	return (ssize_t)n;
+}
+
+void
+tcp_uring_accept_dispatch(tcp_accept_info_t *tcpacceptinfo, short event) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	conn->dispatching = 1;
+	tcp_server_accept_event(tcpacceptinfo->accept_sd, event, tcpacceptinfo);
+	conn->dispatching = 0;
+	/* 閉じずに残った接続に溜まっている分は今送る */
+	if (conn->state == URING_CONN_ACTIVE) {
+		tcp_uring_output(tcpacceptinfo->tcpaccept->tcpserver->uring, tcpacceptinfo);
+	}
+}
+
+/*
+ * 溜まっているデータのsendとcloseをリンクして投げる
+ * recvを投げたままならcancelを先頭にする
+ */
+static void
+tcp_uring_close_submit(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	struct io_uring_sqe *sqe;
+
+	if (conn->write_error) {
+		conn->out_len = 0;
+	}
+	if (tcp_uring_reserve(uring, 3)) {
+		/* リングが使えないので直接閉じる (すぐに送れない分は捨てる) */
+		tcp_uring_send_now(tcpacceptinfo, conn->out, conn->out_len);
+		close(conn->sd);
+		conn->state = URING_CONN_FREE;
+		conn->sd = -1;
+		tcpacceptinfo->closing = 0;
+		return;
+	}
+	if (conn->recv_pending) {
+		sqe = tcp_uring_sqe(uring, URING_OP_IGNORE, NULL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)(uintptr_t)tcpacceptinfo | URING_OP_RECV;
+		sqe->flags = IOSQE_IO_HARDLINK;
+	}
+	if (conn->out_len > 0) {
+		sqe = tcp_uring_sqe(uring, URING_OP_IGNORE, NULL);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->sd;
+		sqe->addr = (uint64_t)(uintptr_t)conn->out;
+		sqe->len = conn->out_len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->flags = IOSQE_IO_HARDLINK;
+	}
+	sqe = tcp_uring_sqe(uring, URING_OP_CLOSE, tcpacceptinfo);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = conn->sd;
+	tcp_uring_flush(uring);
+}
+
+/*
+ * ストリームを閉じて、溜まっているデータを送ってから閉じる
+ * バッファはcloseの完了まで使うので、それまでスロットは空かない
+ */
+void
+tcp_uring_accept_clear(tcp_accept_info_t *tcpacceptinfo) {
+	struct tcp_uring *uring = tcpacceptinfo->tcpaccept->tcpserver->uring;
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+
+	/* ストリームに残っている分をoutに出す */
+	conn->dispatching = 1;
+	fclose(tcpacceptinfo->accept_sp);
+	conn->dispatching = 0;
+	conn->state = URING_CONN_CLOSING;
+	conn->sd = tcpacceptinfo->accept_sd;
+	tcpacceptinfo->closing = 1;
+	if (conn->send_pending) {
+		/* 投げてあるsendの完了後にcloseを投げる */
+		return;
+	}
+	tcp_uring_close_submit(uring, tcpacceptinfo);
+}
+
+void
+tcp_uring_close(tcp_server_t *tcpserver, int sd) {
+	struct tcp_uring *uring = tcpserver->uring;
+	struct io_uring_sqe *sqe;
+
+	if (tcp_uring_reserve(uring, 1)) {
+		close(sd);
+		return;
+	}
+	sqe = tcp_uring_sqe(uring, URING_OP_CLOSE_SD, (void *)((uintptr_t)sd << URING_OP_SHIFT));
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = sd;
+	tcp_uring_flush(uring);
+}
+
+/* recvの完了 */
+static void
+tcp_uring_recv_complete(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo, struct io_uring_cqe *cqe) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	unsigned short bid;
+	unsigned char *data;
+	size_t len;
+
+	conn->recv_pending = 0;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		data = &uring->buffers[(size_t)bid * URING_BUFFER_SIZE];
+		if (conn->state == URING_CONN_ACTIVE && cqe->res > 0) {
+			len = (size_t)cqe->res;
+			if (conn->in_pos > 0) {
+				memmove(conn->in, &conn->in[conn->in_pos], conn->in_len - conn->in_pos);
+				conn->in_len -= conn->in_pos;
+				conn->in_pos = 0;
+			}
+			if (len > sizeof(conn->in) - conn->in_len) {
+				conn->eof = -1;
+				conn->error = ENOBUFS;
+			} else {
+				memcpy(&conn->in[conn->in_len], data, len);
+				conn->in_len += len;
+			}
+		}
+		tcp_uring_buffer_put(uring, bid);
+	}
+	if (conn->state != URING_CONN_ACTIVE) {
+		/* 閉じている途中 (cancelされた) */
+		return;
+	}
+	if (cqe->res == -ENOBUFS) {
+		/* 受信バッファが空くのを待ってやり直す */
+		tcp_uring_recv_submit(uring, tcpacceptinfo);
+		return;
+	}
+	if (cqe->res == 0) {
+		conn->eof = 1;
+	} else if (cqe->res < 0) {
+		conn->eof = -1;
+		conn->error = -cqe->res;
+	}
+	tcp_uring_accept_dispatch(tcpacceptinfo, EV_READ);
+}
+
+/* outのsendの完了 */
+static void
+tcp_uring_send_complete(struct tcp_uring *uring, tcp_accept_info_t *tcpacceptinfo, struct io_uring_cqe *cqe) {
+	struct tcp_uring_connection *conn = tcp_uring_conn(tcpacceptinfo);
+	size_t n;
+
+	conn->send_pending = 0;
+	if (uring->stopping) {
+		/* 使っている接続はtcp_server_accept_stopで閉じている */
+		if (conn->state == URING_CONN_CLOSING) {
+			close(conn->sd);
+			conn->state = URING_CONN_FREE;
+			conn->sd = -1;
+			tcpacceptinfo->closing = 0;
+		}
+		return;
+	}
+	if (cqe->res < 0) {
+		conn->write_error = -cqe->res;
+		conn->out_len = 0;
+	} else {
+		n = (size_t)cqe->res;
+		memmove(conn->out, &conn->out[n], conn->out_len - n);
+		conn->out_len -= n;
+	}
+	if (conn->state == URING_CONN_CLOSING) {
+		tcp_uring_close_submit(uring, tcpacceptinfo);
+	} else if (conn->state == URING_CONN_ACTIVE) {
+		if (conn->out_len > 0 && !conn->write_error) {
+			tcp_uring_output(uring, tcpacceptinfo);
+		} else if (conn->want_write) {
+			conn->want_write = 0;
+			tcp_uring_accept_dispatch(tcpacceptinfo, EV_WRITE);
+		}
+	}
+}
+
+/*
+ * 完了を1つ処理する
+ * stoppingの間は接続のコールバックを呼ばず、取り消されたcloseは直接閉じる
+ */
+static void
+tcp_uring_complete(struct tcp_uring *uring, struct io_uring_cqe *cqe) {
+	tcp_accept_info_t *tcpacceptinfo;
+	struct tcp_uring_connection *conn;
+	tcp_accept_t *tcpaccept;
+	struct sockaddr_storage sa_st;
+	void *ptr;
+	int op;
+
+	op = (int)(cqe->user_data & URING_OP_MASK);
+	ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+	/* multishot acceptは最後の完了まで続く */
+	if (op != URING_OP_ACCEPT || !(cqe->flags & IORING_CQE_F_MORE)) {
+		uring->inflight--;
+	}
+	switch (op) {
+	case URING_OP_ACCEPT:
+		tcpaccept = ptr;
+		if (cqe->res >= 0) {
+			if (uring->stopping) {
+				close(cqe->res);
+				break;
+			}
+			memset(&sa_st, 0, sizeof(sa_st));
+			tcp_server_accept_socket(tcpaccept, cqe->res, &sa_st, 0);
+		} else if (cqe->res != -ECANCELED) {
+			logger_write(LOGGER_WARN, "accept", "errno=%d error=\"failed in accept\"", -cqe->res);
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE) &&
+		    uring->tcpserver->tcp_listen_run && !uring->stopping) {
+			tcp_uring_accept_submit(uring, tcpaccept);
+		}
+		break;
+	case URING_OP_RECV:
+		if (uring->stopping) {
+			break;
+		}
+		tcp_uring_recv_complete(uring, ptr, cqe);
+		break;
+	case URING_OP_CLOSE:
+		tcpacceptinfo = ptr;
+		conn = tcp_uring_conn(tcpacceptinfo);
+		if (cqe->res == -ECANCELED) {
+			close(conn->sd);
+		}
+		conn->state = URING_CONN_FREE;
+		conn->sd = -1;
+		tcpacceptinfo->closing = 0;
+		break;
+	case URING_OP_SEND:
+		tcp_uring_send_complete(uring, ptr, cqe);
+		break;
+	case URING_OP_CLOSE_SD:
+		if (cqe->res == -ECANCELED) {
+			close((int)((uintptr_t)ptr >> URING_OP_SHIFT));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* 届いている完了をまとめて処理する */
+static void
+tcp_uring_complete_all(struct tcp_uring *uring) {
+	unsigned int head, tail;
+
+	head = *uring->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			break;
+		}
+		tcp_uring_complete(uring, &uring->cqes[head & *uring->cq_mask]);
+		head++;
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/* リングの完了をまとめて処理する */
+static void
+tcp_uring_reap(int fd, short event, void *args) {
+	struct tcp_uring *uring = args;
+
+	uring->reaping = 1;
+	tcp_uring_complete_all(uring);
+	uring->reaping = 0;
+	tcp_uring_submit(uring);
+}
+
+static void
+tcp_uring_free(struct tcp_uring *uring) {
+	if (uring->buf_ring) {
+		munmap(uring->buf_ring, uring->buf_ring_size);
+	}
+	free(uring->buffers);
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->cq_ptr && uring->cq_ptr != uring->sq_ptr) {
+		munmap(uring->cq_ptr, uring->cq_size);
+	}
+	if (uring->sq_ptr) {
+		munmap(uring->sq_ptr, uring->sq_size);
+	}
+	if (uring->fd >= 0) {
+		close(uring->fd);
+	}
+	free(uring->conns);
+	free(uring);
+}
+
+int
+tcp_uring_start(tcp_server_t *tcpserver) {
+	struct tcp_uring *uring;
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	unsigned char *sq, *cq;
+	int i, j;
+
+	uring = malloc(sizeof(struct tcp_uring));
+	if (uring == NULL) {
+		return 1;
+	}
+	memset(uring, 0, sizeof(struct tcp_uring));
+	uring->fd = -1;
+	uring->tcpserver = tcpserver;
+	memset(&params, 0, sizeof(params));
+	uring->fd = tcp_uring_setup(URING_ENTRIES, &params);
+	if (uring->fd < 0) {
+		fprintf(stderr, "failed in setup io_uring (%s).\n", strerror(errno));
+		goto fail;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		fprintf(stderr, "io_uring is too old.\n");
+		goto fail;
+	}
+	/* SQとCQは1つのmmap */
+	uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (uring->cq_size > uring->sq_size) {
+		uring->sq_size = uring->cq_size;
+	}
+	uring->cq_size = uring->sq_size;
+	uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ptr == MAP_FAILED) {
+		uring->sq_ptr = NULL;
+		goto fail;
+	}
+	uring->cq_ptr = uring->sq_ptr;
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto fail;
+	}
+	sq = uring->sq_ptr;
+	cq = uring->cq_ptr;
+	uring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	uring->sq_entries = params.sq_entries;
+	uring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	uring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	/* provided buffer ring (ページ境界に置く必要がある) */
+	uring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->buf_ring == MAP_FAILED) {
+		uring->buf_ring = NULL;
+		goto fail;
+	}
+	uring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	if (uring->buffers == NULL) {
+		goto fail;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (tcp_uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fprintf(stderr, "failed in register io_uring buffer ring (%s).\n", strerror(errno));
+		goto fail;
+	}
+	for (i = 0; i < URING_BUFFER_COUNT; i++) {
+		tcp_uring_buffer_put(uring, i);
+	}
+	/* 接続ごとのバッファ */
+	uring->conns = calloc((size_t)tcpserver->listen_sd_array_max * ACCEPT_LIMIT,
+	    sizeof(struct tcp_uring_connection));
+	if (uring->conns == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		for (j = 0; j < ACCEPT_LIMIT; j++) {
+			tcpserver->tcpaccept[i].tcpacceptinfo[j].uring_conn
+			    = &uring->conns[i * ACCEPT_LIMIT + j];
+		}
+	}
+	event_set(&uring->ring_event, uring->fd, EV_READ | EV_PERSIST, tcp_uring_reap, uring);
+	if (event_base_set(tcpserver->event_base, &uring->ring_event)) {
+		goto fail;
+	}
+	event_priority_set(&uring->ring_event, EVENT_PRIORITY_LOW);
+	if (event_add(&uring->ring_event, NULL) < 0) {
+		goto fail;
+	}
+	tcpserver->uring = uring;
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		if (tcp_uring_accept_submit(uring, &tcpserver->tcpaccept[i])) {
+			event_del(&uring->ring_event);
+			tcpserver->uring = NULL;
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	tcp_uring_free(uring);
+	return 1;
+}
+
+/*
+ * multishot acceptを取り消す
+ * tcp_listen_runを落としてから呼ぶので、取り消しの完了で投げ直されない
+ */
+void
+tcp_uring_accept_cancel(tcp_server_t *tcpserver) {
+	struct tcp_uring *uring = tcpserver->uring;
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if (uring == NULL) {
+		return;
+	}
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		if (tcp_uring_reserve(uring, 1)) {
+			return;
+		}
+		sqe = tcp_uring_sqe(uring, URING_OP_IGNORE, NULL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)(uintptr_t)&tcpserver->tcpaccept[i] | URING_OP_ACCEPT;
+	}
+	tcp_uring_flush(uring);
+}
+
+/*
+ * 投げたままの処理を全て取り消して完了を待つ
+ * カーネルがバッファ (buffer ringとconnsのout) を使い終わるまで開放できず、
+ * 取り消されたcloseのsdは自分で閉じる必要がある
+ * URING_STOP_TIMEOUTの間に終わらなければ1を返す
+ */
+static int
+tcp_uring_drain(struct tcp_uring *uring) {
+	struct io_uring_sqe *sqe;
+	uint64_t deadline;
+	int n;
+
+	uring->stopping = 1;
+	tcp_uring_complete_all(uring);
+	if (uring->inflight == 0) {
+		return 0;
+	}
+	if (tcp_uring_reserve(uring, 1) == 0) {
+		sqe = tcp_uring_sqe(uring, URING_OP_IGNORE, NULL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+	}
+	deadline = stats_now() + (uint64_t)URING_STOP_TIMEOUT * 1000;
+	while (uring->inflight > 0) {
+		if (stats_now() >= deadline) {
+			return 1;
+		}
+		n = tcp_uring_wait(uring->fd, uring->to_submit, URING_STOP_TIMEOUT);
+		if (n < 0 && errno != EINTR && errno != ETIME) {
+			logger_write(LOGGER_ERROR, "io_uring", "error=\"failed in wait\" errno=%d", errno);
+			return 1;
+		}
+		if (n > 0) {
+			uring->to_submit -= n;
+		}
+		tcp_uring_complete_all(uring);
+	}
+
+	return 0;
+}
+
+void
+tcp_uring_stop(tcp_server_t *tcpserver) {
+	struct tcp_uring *uring = tcpserver->uring;
+	int i, j;
+
+	if (uring == NULL) {
+		return;
+	}
+	event_del(&uring->ring_event);
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		for (j = 0; j < ACCEPT_LIMIT; j++) {
+			tcpserver->tcpaccept[i].tcpacceptinfo[j].closing = 0;
+		}
+	}
+	if (tcp_uring_drain(uring)) {
+		/* カーネルがまだ使っているかもしれないので開放せずに残す */
+		logger_write(LOGGER_ERROR, "io_uring", "error=\"operations did not finish\" inflight=%u",
+		    uring->inflight);
+	} else {
+		tcp_uring_free(uring);
+	}
+	for (i = 0; i < tcpserver->listen_sd_array_max; i++) {
+		for (j = 0; j < ACCEPT_LIMIT; j++) {
+			tcpserver->tcpaccept[i].tcpacceptinfo[j].uring_conn = NULL;
+		}
+	}
+	tcpserver->uring = NULL;
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef TCPSOCK_URING_H
+#define TCPSOCK_URING_H
+
+/*
+ * tcp serverのio_uringバックエンド
+ * tcpsock.cからだけ使う
+ *
+ * listenしたsdはmultishot acceptで、接続からの読み込みはprovided buffer ringを
+ * 使ったrecvで受ける。accept_spはfopencookieのストリームで、コールバックが
+ * 書いたものはtcp_server_accept_clearのときにsendとcloseをリンクして投げる。
+ * コールバックの外で書いたもの (通知など) はブロックしないsendで送り、
+ * 送り切れなかった分はoutに溜めてsendを投げる。イベントループではブロックしない。
+ * リングのfdをlibeventで監視して、完了したものをまとめて処理する。
+ */
+#define URING_ENTRIES		256	/* SQの大きさ */
+#define URING_BUFFER_GROUP	0	/* provided buffer ringのグループ番号 */
+#define URING_BUFFER_COUNT	64	/* 受信に使うバッファの数 (2のべき乗) */
+#define URING_BUFFER_SIZE	2048	/* 受信に使うバッファ1つの大きさ */
+#define URING_INPUT_SIZE	8192	/* 接続ごとに受信したデータを溜めておく大きさ */
+#define URING_OUTPUT_SIZE	4096	/* 接続ごとに送信するデータを溜めておく大きさ */
+
+/* io_uringを使えればリングを作ってacceptを始める */
+int tcp_uring_start(tcp_server_t *tcpserver);
+/* acceptを止める (接続はそのまま扱う) */
+void tcp_uring_accept_cancel(tcp_server_t *tcpserver);
+/* リングを閉じる */
+void tcp_uring_stop(tcp_server_t *tcpserver);
+/* 受け付けなかったsdを閉じる */
+void tcp_uring_close(tcp_server_t *tcpserver, int sd);
+/* 接続のストリームを作る */
+FILE *tcp_uring_accept_open(tcp_accept_info_t *tcpacceptinfo);
+/* 次の読み込みを待つ */
+int tcp_uring_accept_wait(tcp_accept_info_t *tcpacceptinfo);
+/* outに入るだけ書く */
+ssize_t tcp_uring_accept_write(tcp_accept_info_t *tcpacceptinfo, const void *buf, size_t len);
+/* outが空いたらEV_WRITEでmain_accept_cbを呼ぶ */
+int tcp_uring_accept_wait_write(tcp_accept_info_t *tcpacceptinfo);
+/* 受信済みのデータを読む */
+ssize_t tcp_uring_accept_read(tcp_accept_info_t *tcpacceptinfo, void *buf, size_t len, int peek);
+/* main_accept_cbを呼ぶ */
+void tcp_uring_accept_dispatch(tcp_accept_info_t *tcpacceptinfo, short event);
+/* 溜まっているデータを送ってから閉じる */
+void tcp_uring_accept_clear(tcp_accept_info_t *tcpacceptinfo);
+
+/* tcpsock.cにある、libeventとio_uringで共通の処理 */
+void tcp_server_accept_socket(
+    tcp_accept_t *tcpaccept,
+    int sd,
+    struct sockaddr_storage *sa_st,
+    socklen_t sa_st_len);
+void tcp_server_accept_event(int sd, short event, void *args);
+
+#endif
@@ -0,0 +1,75 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+/*
+ * トークンバケット
+ * rate個/秒でburst個まで貯まり、1回の処理でn個使う
+ * 時刻はstats_now()のマイクロ秒を渡す
+ * 使う側は stdint.h をincludeしてからこのファイルをincludeする
+ */
+#define TOKEN_BUCKET_UNIT ((uint64_t)1000000) /* トークン1個 (rate * マイクロ秒で足していくため) */
+
+struct token_bucket {
+	uint64_t tokens;        /* 残りのトークン (TOKEN_BUCKET_UNIT単位) */
+	uint64_t last;          /* 最後に補充した時刻 (マイクロ秒) */
+};
+
+static inline void
+token_bucket_init(struct token_bucket *bucket, unsigned int burst, uint64_t now) {
+	bucket->tokens = (uint64_t)burst * TOKEN_BUCKET_UNIT;
+	bucket->last = now;
+}
+
+/* n個使えれば使って0、足りなければ何もせずに1を返す */
+static inline int
+token_bucket_take(
+    struct token_bucket *bucket,
+    unsigned int rate,
+    unsigned int burst,
+    unsigned int n,
+    uint64_t now)
+{
+	uint64_t limit = (uint64_t)burst * TOKEN_BUCKET_UNIT;
+	uint64_t elapsed;
+
+	if (now > bucket->last && rate > 0) {
+		/* 長く空いた時に掛け算が溢れないように、満タンになるまでの時間で切る */
+		elapsed = now - bucket->last;
+		if (elapsed > limit / rate) {
+			elapsed = limit / rate;
+		}
+		bucket->tokens += elapsed * rate;
+		bucket->last = now;
+	}
+	if (bucket->tokens > limit) {
+		bucket->tokens = limit;
+	}
+	if (bucket->tokens < (uint64_t)n * TOKEN_BUCKET_UNIT) {
+		return 1;
+	}
+	bucket->tokens -= (uint64_t)n * TOKEN_BUCKET_UNIT;
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "macro.h"
+#include "alert.h"
+#include "sensor.h"
+#include "upgrade.h"
+
+int
+upgrade_spawn(char **argv, int *channel, pid_t *pid) {
+	int sv[2];
+	char fd_str[16];
+	pid_t child;
+
+	/* 警報スクリプトなど、この後forkするプロセスには渡さない */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		fprintf(stderr, "failed in create socket pair (%s).\n", strerror(errno));
+		return 1;
+	}
+	child = fork();
+	switch (child) {
+	case -1:
+		fprintf(stderr, "failed in fork (%s).\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	case 0:
+		/* 子側 (sv[1]だけexec後も残す) */
+		close(sv[0]);
+		if (fcntl(sv[1], F_SETFD, 0) < 0) {
+			_exit(1);
+		}
+		snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+		if (setenv(UPGRADE_ENV, fd_str, 1)) {
+			_exit(1);
+		}
+		execvp(argv[0], argv);
+		fprintf(stderr, "failed in exec %s (%s).\n", argv[0], strerror(errno));
+		_exit(1);
+		/* NOT REACHED */
+	default:
+		break;
+	}
+	close(sv[1]);
+	*channel = sv[0];
+	*pid = child;
+
+	return 0;
+}
+
+int
+upgrade_channel(void) {
+	const char *env;
+	char *end;
+	long fd;
+
+	env = getenv(UPGRADE_ENV);
+	if (env == NULL) {
+		return -1;
+	}
+	fd = strtol(env, &end, 10);
+	/* 新しいプロセスがさらにexecするものには渡さない */
+	unsetenv(UPGRADE_ENV);
+	if (*env == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+		fprintf(stderr, "invalid %s.\n", UPGRADE_ENV);
+		return -1;
+	}
+	if (fcntl((int)fd, F_SETFD, FD_CLOEXEC) < 0) {
+		fprintf(stderr, "invalid %s (%s).\n", UPGRADE_ENV, strerror(errno));
+		return -1;
+	}
+
+	return (int)fd;
+}
+
+/* UPGRADE_TIMEOUTの間channelが読めるようになるのを待つ */
+static int
+upgrade_wait(int channel) {
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = channel;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do {
+		ret = poll(&pfd, 1, UPGRADE_TIMEOUT);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		fprintf(stderr, "timeout in wait upgrade message.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* 受け取ったメッセージの先頭を確かめる */
+static int
+upgrade_check(const struct upgrade_header *header, int type, ssize_t len, size_t size) {
+	if (len == 0) {
+		fprintf(stderr, "upgrade peer closed.\n");
+		return 1;
+	}
+	if (len < 0) {
+		fprintf(stderr, "failed in receive upgrade message (%s).\n", strerror(errno));
+		return 1;
+	}
+	if ((size_t)len != size ||
+	    header->version != UPGRADE_VERSION ||
+	    header->type != (uint32_t)type) {
+		fprintf(stderr, "unexpected upgrade message.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+upgrade_send_listen(int channel, const int *count, const int *sd) {
+	struct upgrade_listen listen;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT)];
+	} control;
+	int total = 0;
+	int i;
+
+	memset(&listen, 0, sizeof(listen));
+	listen.header.type = UPGRADE_MESSAGE_LISTEN;
+	listen.header.version = UPGRADE_VERSION;
+	for (i = 0; i < UPGRADE_LISTEN_COUNT; i++) {
+		if (count[i] > UPGRADE_LISTEN_FD_LIMIT) {
+			fprintf(stderr, "too many listen sockets (%d).\n", count[i]);
+			return 1;
+		}
+		listen.count[i] = count[i];
+		total += count[i];
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &listen;
+	iov.iov_len = sizeof(listen);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (total > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * total);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * total);
+		memcpy(CMSG_DATA(cmsg), sd, sizeof(int) * total);
+	}
+	if (sendmsg(channel, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(listen)) {
+		fprintf(stderr, "failed in send listen sockets (%s).\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+upgrade_recv_listen(int channel, int *count, int *sd, int sd_max) {
+	struct upgrade_listen listen;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_LISTEN_FD_LIMIT * UPGRADE_LISTEN_COUNT)];
+	} control;
+	ssize_t len;
+	int received = 0;
+	int total = 0;
+	int i;
+
+	if (upgrade_wait(channel)) {
+		return 1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &listen;
+	iov.iov_len = sizeof(listen);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	len = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+	/* 受け取ったsdは確かめる前に数えておいて、おかしければ閉じる */
+	for (cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (received > sd_max) {
+				received = sd_max;
+			}
+			memcpy(sd, CMSG_DATA(cmsg), sizeof(int) * received);
+			break;
+		}
+	}
+	if (upgrade_check(&listen.header, UPGRADE_MESSAGE_LISTEN, len, sizeof(listen))) {
+		goto fail;
+	}
+	if (msg.msg_flags & MSG_CTRUNC) {
+		fprintf(stderr, "too many listen sockets.\n");
+		goto fail;
+	}
+	for (i = 0; i < UPGRADE_LISTEN_COUNT; i++) {
+		if (listen.count[i] > UPGRADE_LISTEN_FD_LIMIT) {
+			fprintf(stderr, "too many listen sockets (%u).\n", listen.count[i]);
+			goto fail;
+		}
+		count[i] = listen.count[i];
+		total += count[i];
+	}
+	if (total != received) {
+		fprintf(stderr, "unexpected number of listen sockets (%d).\n", received);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	for (i = 0; i < received; i++) {
+		close(sd[i]);
+	}
+
+	return 1;
+}
+
+int
+upgrade_send(int channel, int type, void *message, size_t size) {
+	struct upgrade_header *header = message;
+
+	header->type = type;
+	header->version = UPGRADE_VERSION;
+	if (send(channel, message, size, MSG_NOSIGNAL) != (ssize_t)size) {
+		fprintf(stderr, "failed in send upgrade message (%s).\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+upgrade_recv(int channel, int type, void *message, size_t size) {
+	ssize_t len;
+
+	if (upgrade_wait(channel)) {
+		return 1;
+	}
+	len = recv(channel, message, size, MSG_TRUNC);
+
+	return upgrade_check(message, type, len, size);
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ * 動いたままのバイナリの入れ替え
+ *
+ * SIGUSR2を受けたプロセス (前のプロセス) が自分と同じコマンドラインで
+ * 新しいバイナリをexecし、SOCK_SEQPACKETのsocketpairで次の順にやり取りする。
+ *
+ *   前 -> 新  UPGRADE_MESSAGE_LISTEN  listenしているsd (SCM_RIGHTS)
+ *   新 -> 前  UPGRADE_MESSAGE_READY   インスタンスを作り終えた
+ *   前 -> 新  UPGRADE_MESSAGE_STATE   ポーリングを止めた後のalert, sensorの状態
+ *   新 -> 前  UPGRADE_MESSAGE_STARTED センサーのポーリングなどを開始できた
+ *
+ * listenしているsdは閉じずに渡すので、入れ替えの間の接続はbacklogで待たされるだけで
+ * 拒否されない。前のプロセスはSTARTEDを受けてからacceptを止め、
+ * 処理中の接続をUPGRADE_DRAIN_TIMEだけ待ってから終了する。
+ * STATEを送った後UPGRADE_TIMEOUTの間にSTARTEDが来なければ (新しいプロセスが
+ * センサーを開けずに終わった場合など)、新しいプロセスを止めて自分でポーリングを再開する。
+ * 新しいプロセスは前のプロセスが予定していた時刻から最初のポーリングを始め、
+ * STARTEDを送ってからpidファイルを書き換える。
+ *
+ * 新しいプロセスにはsocketpairのsdを環境変数UPGRADE_ENVで渡す。
+ * 使う側は stdint.h, sys/time.h, alert.h, sensor.h をincludeしてからこのファイルをincludeする
+ */
+
+#define UPGRADE_ENV              "IDS_UPGRADE_FD"
+#define UPGRADE_VERSION          1
+#define UPGRADE_TIMEOUT          5000   /* 相手からのメッセージを待つ時間 (msec) */
+#define UPGRADE_DRAIN_TIME       1      /* 渡した後に処理中の接続を待つ時間 (sec) */
+
+/* 渡すlisten sdの種類 */
+#define UPGRADE_LISTEN_RPC       0      /* rpcのTCP */
+#define UPGRADE_LISTEN_RPC_UNIX  1      /* rpcのunix domain socket */
+#define UPGRADE_LISTEN_HTTP      2      /* http */
+#define UPGRADE_LISTEN_COUNT     3
+#define UPGRADE_LISTEN_FD_LIMIT  10     /* 種類ごとのsdの数の限界値 (tcpsock.hのLISTEN_LIMIT) */
+
+/* メッセージの種類 */
+#define UPGRADE_MESSAGE_LISTEN   1
+#define UPGRADE_MESSAGE_READY    2
+#define UPGRADE_MESSAGE_STATE    3
+#define UPGRADE_MESSAGE_STARTED  4
+
+/* メッセージの先頭 */
+struct upgrade_header {
+	uint32_t type;                  /* UPGRADE_MESSAGE_* */
+	uint32_t version;               /* UPGRADE_VERSION */
+};
+
+/* listenしているsdの数 (sdは種類の順に並べてSCM_RIGHTSで送る) */
+struct upgrade_listen {
+	struct upgrade_header header;
+	uint32_t count[UPGRADE_LISTEN_COUNT];
+};
+
+/* 引き継ぐ状態 */
+struct upgrade_state {
+	struct upgrade_header header;
+	struct alert_state alert;
+	struct sensor_state sensor;
+};
+
+/*
+ * 新しいバイナリをexecする (前のプロセス側)
+ * argvはmainのargvで、argv[0]をexecvpで探す
+ * 成功したらやり取りに使うsdをchannel、子プロセスのpidをpidに入れる
+ */
+int upgrade_spawn(
+    char **argv,
+    int *channel,
+    pid_t *pid);
+/*
+ * 環境変数で渡されたsdを返す (新しいプロセス側)
+ * 入れ替えで起動されたのでなければ-1を返す
+ */
+int upgrade_channel(void);
+/*
+ * listenしているsdを送る (前のプロセス側)
+ * sdはcountの種類の順に並べておく
+ */
+int upgrade_send_listen(
+    int channel,
+    const int *count,
+    const int *sd);
+/*
+ * listenしているsdを受け取る (新しいプロセス側)
+ * sdにはcountの種類の順に並ぶ
+ */
+int upgrade_recv_listen(
+    int channel,
+    int *count,
+    int *sd,
+    int sd_max);
+/* メッセージを送る、headerはここで埋める */
+int upgrade_send(
+    int channel,
+    int type,
+    void *message,
+    size_t size);
+/*
+ * メッセージを受け取る
+ * UPGRADE_TIMEOUTの間に来ないか、種類や大きさが違えば1を返す
+ */
+int upgrade_recv(
+    int channel,
+    int type,
+    void *message,
+    size_t size);
+
+#endif
@@ -0,0 +1,198 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "macro.h"
+#include "stats.h"
+#include "logger.h"
+#include "watchdog.h"
+#include "priority.h"
+
+struct watchdog ids_watchdog;
+
+/*
+ * 監視スレッド
+ * 予算の半分毎 (最大でWATCHDOG_PROBE_INTERVAL毎) に実行中のコールバックを調べ、
+ * 予算を超えても同じheartbeatのままなら1回だけログに出す
+ */
+static void *
+watchdog_main(void *args) {
+	struct watchdog *watchdog = args;
+	struct timespec interval;
+	uint64_t wait, heartbeat, start, now;
+	uint64_t reported = 0;
+	const char *current;
+
+	wait = watchdog->budget / 2;
+	if (wait > WATCHDOG_PROBE_INTERVAL * 1000) {
+		wait = WATCHDOG_PROBE_INTERVAL * 1000;
+	}
+	if (wait == 0) {
+		wait = 1;
+	}
+	interval.tv_sec = wait / 1000000;
+	interval.tv_nsec = (wait % 1000000) * 1000;
+	while (!__atomic_load_n(&watchdog->stop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		current = __atomic_load_n(&watchdog->current, __ATOMIC_ACQUIRE);
+		if (current == NULL) {
+			continue;
+		}
+		heartbeat = __atomic_load_n(&watchdog->heartbeat, __ATOMIC_ACQUIRE);
+		start = __atomic_load_n(&watchdog->start, __ATOMIC_RELAXED);
+		now = stats_now();
+		if (heartbeat == reported || now < start || now - start <= watchdog->budget) {
+			continue;
+		}
+		reported = heartbeat;
+		logger_write(LOGGER_WARN, "callback_stuck", "callback=%s elapsed_ms=%lu",
+		    current, (unsigned long)((now - start) / 1000));
+	}
+
+	return NULL;
+}
+
+/* 遅延プローブ */
+static void
+watchdog_probe(int fd, short event, void *args) {
+	struct watchdog *watchdog = args;
+	struct timeval interval;
+	uint64_t now, lag;
+
+	if (event != EV_TIMEOUT) {
+		ABORT();
+		/* NOT REACHED */
+	}
+	now = stats_now();
+	lag = (now > watchdog->probe_expected) ? now - watchdog->probe_expected : 0;
+	stats_record(STATS_LOOP_LAG, lag);
+	if (lag > watchdog->stall_threshold) {
+		stats_add(STATS_LOOP_STALLS, 1);
+		logger_write(LOGGER_WARN, "loop_stall", "lag_ms=%lu", (unsigned long)(lag / 1000));
+	}
+	interval.tv_sec = WATCHDOG_PROBE_INTERVAL / 1000;
+	interval.tv_usec = (WATCHDOG_PROBE_INTERVAL % 1000) * 1000;
+	watchdog->probe_expected = now + WATCHDOG_PROBE_INTERVAL * 1000;
+	evtimer_add(&watchdog->probe_event, &interval);
+}
+
+/* 監視スレッドを止める */
+static void
+watchdog_stop_thread(struct watchdog *watchdog) {
+	if (!watchdog->thread_running) {
+		return;
+	}
+	__atomic_store_n(&watchdog->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(watchdog->thread, NULL);
+	watchdog->thread_running = 0;
+}
+
+int
+watchdog_start(int callback_budget, struct event_base *event_base) {
+	struct watchdog *watchdog = &ids_watchdog;
+	struct timeval interval;
+	sigset_t mask, old_mask;
+	int error;
+
+	memset(watchdog, 0, sizeof(struct watchdog));
+	watchdog->event_base = event_base;
+	watchdog->budget = (uint64_t)callback_budget * 1000;
+	watchdog->stall_threshold = (uint64_t)(callback_budget ? callback_budget : WATCHDOG_STALL_DEFAULT) * 1000;
+	if (watchdog->budget) {
+		/* シグナルは全てメインスレッドで受ける */
+		sigfillset(&mask);
+		pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+		error = pthread_create(&watchdog->thread, NULL, watchdog_main, watchdog);
+		pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+		if (error) {
+			fprintf(stderr, "failed in create watchdog thread (%s).\n", strerror(error));
+			return 1;
+		}
+		watchdog->thread_running = 1;
+	}
+	interval.tv_sec = WATCHDOG_PROBE_INTERVAL / 1000;
+	interval.tv_usec = (WATCHDOG_PROBE_INTERVAL % 1000) * 1000;
+	watchdog->probe_expected = stats_now() + WATCHDOG_PROBE_INTERVAL * 1000;
+	evtimer_set(&watchdog->probe_event, watchdog_probe, watchdog);
+	event_base_set(event_base, &watchdog->probe_event);
+	event_priority_set(&watchdog->probe_event, EVENT_PRIORITY_HIGH);
+	if (evtimer_add(&watchdog->probe_event, &interval) < 0) {
+		fprintf(stderr, "failed in add lag probe event.\n");
+		watchdog_stop_thread(watchdog);
+		return 1;
+	}
+	watchdog->running = 1;
+
+	return 0;
+}
+
+void
+watchdog_finish(void) {
+	struct watchdog *watchdog = &ids_watchdog;
+
+	if (!watchdog->running) {
+		return;
+	}
+	evtimer_del(&watchdog->probe_event);
+	watchdog_stop_thread(watchdog);
+	watchdog->running = 0;
+}
+
+void
+watchdog_enter(const char *name) {
+	struct watchdog *watchdog = &ids_watchdog;
+
+	__atomic_store_n(&watchdog->start, stats_now(), __ATOMIC_RELAXED);
+	if (!watchdog->budget) {
+		return;
+	}
+	__atomic_add_fetch(&watchdog->heartbeat, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&watchdog->current, name, __ATOMIC_RELEASE);
+}
+
+void
+watchdog_leave(void) {
+	struct watchdog *watchdog = &ids_watchdog;
+	uint64_t elapsed;
+	const char *name;
+
+	elapsed = stats_now() - watchdog->start;
+	stats_record(STATS_CALLBACK, elapsed);
+	if (!watchdog->budget) {
+		return;
+	}
+	name = watchdog->current;
+	__atomic_store_n(&watchdog->current, NULL, __ATOMIC_RELEASE);
+	if (elapsed > watchdog->budget) {
+		stats_add(STATS_SLOW_CALLBACKS, 1);
+		logger_write(LOGGER_WARN, "watchdog", "error=\"slow callback\" callback=%s elapsed_ms=%lu",
+		    name ? name : "unknown", (unsigned long)(elapsed / 1000));
+	}
+}
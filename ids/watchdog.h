@@ -0,0 +1,76 @@
+/* Copyright (c) 2010 Hiroyuki Kakine
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+/*
+ * イベントループの監視
+ *
+ * - 遅延プローブ
+ *   WATCHDOG_PROBE_INTERVAL毎のタイマーが予定よりどれだけ遅れて呼ばれたかを測る。
+ *   callback_budgetより遅れたらストールとして数える。
+ * - コールバックの予算
+ *   コールバックの前後でwatchdog_enter, watchdog_leaveを呼ぶ。
+ *   入るたびに番号 (heartbeat) を進めるだけでシステムコールは呼ばない。
+ *   監視スレッドがcallback_budgetを超えても同じ番号のまま戻らないコールバックを
+ *   見つけたら、その名前と経過時間をログに出す (1回のコールバックにつき1回)。
+ *   シグナルを使わないので、実行中のシステムコールを中断することはない。
+ *
+ * 監視スレッドと共有するのでインスタンスは1つだけ (ids_watchdog)
+ * 使う側は stdint.h, event.h, pthread.h をincludeしてからこのファイルをincludeする
+ */
+
+#define WATCHDOG_PROBE_INTERVAL   100    /* 遅延プローブの間隔 (msec) */
+#define WATCHDOG_STALL_DEFAULT    100    /* callback_budgetが0の時のストールの閾値 (msec) */
+
+struct watchdog {
+	struct event_base *event_base;
+	uint64_t budget;                 /* コールバックの予算 (usec)、0なら監視しない */
+	uint64_t stall_threshold;        /* ストールとみなす遅延 (usec) */
+	const char *current;             /* 実行中のコールバックの名前 (監視スレッドも読む) */
+	uint64_t start;                  /* 実行中のコールバックの開始時刻 (usec、監視スレッドも読む) */
+	uint64_t heartbeat;              /* watchdog_enterのたびに進める番号 (監視スレッドも読む) */
+	struct event probe_event;        /* 遅延プローブのタイマー */
+	uint64_t probe_expected;         /* 遅延プローブが呼ばれるはずの時刻 (usec) */
+	pthread_t thread;                /* 監視スレッド */
+	int thread_running;
+	int stop;                        /* 監視スレッドへの終了の指示 */
+	int running;
+};
+
+extern struct watchdog ids_watchdog;
+
+/*
+ * 監視の開始
+ * callback_budgetはmsec、0ならコールバックの予算は監視しない
+ */
+int watchdog_start(
+    int callback_budget,
+    struct event_base *event_base);
+/* 監視の終了 */
+void watchdog_finish(void);
+/* コールバックに入る、nameは静的な文字列 */
+void watchdog_enter(
+    const char *name);
+/* コールバックから出る */
+void watchdog_leave(void);
+
+#endif